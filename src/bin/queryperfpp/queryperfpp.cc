@@ -13,15 +13,24 @@
 // PERFORMANCE OF THIS SOFTWARE.
 
 #include <dispatcher.h>
+#include <cpu_affinity.h>
+#include <latency_histogram.h>
+#include <live_statistics.h>
+#include <resource_usage.h>
+#include <transfer_statistics.h>
+#include <sustained_rate.h>
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <sstream>
 #include <iostream>
+#include <map>
 #include <vector>
 #include <stdexcept>
 
@@ -39,24 +48,169 @@ using boost::shared_ptr;
 
 namespace {
 struct QueryStatistics {
-    QueryStatistics() : queries_sent(0), queries_completed(0)
+    QueryStatistics() : queries_scheduled(0), queries_sent(0),
+                        queries_completed(0)
     {}
 
+    size_t queries_scheduled;
     size_t queries_sent;
     size_t queries_completed;
+    SustainedRates sustained_rates; // merged per interval (adaptive window)
+    LatencyHistogram latencies; // merged latencies of all worker threads
+    LatencyHistogram corrected_latencies; // ditto, for coordinated omission
+    TransferStatistics transfers; // merged zone transfers of all threads
     std::vector<double> qps_results; // a list of QPS per worker thread
 };
 
 double
 accumulateResult(const Dispatcher& disp, QueryStatistics& result) {
+    result.queries_scheduled += disp.getQueriesScheduled();
     result.queries_sent += disp.getQueriesSent();
     result.queries_completed += disp.getQueriesCompleted();
+    result.sustained_rates.merge(disp.getSustainedRates());
+    result.latencies.merge(disp.getLatencyHistogram());
+    result.corrected_latencies.merge(disp.getCorrectedLatencyHistogram());
+    result.transfers.merge(disp.getTransferStatistics());
 
     const time_duration duration = disp.getEndTime() - disp.getStartTime();
     return (disp.getQueriesCompleted() / (
                 static_cast<double>(duration.total_microseconds()) / 1000000));
 }
 
+// Print a latency value given in microseconds in milliseconds.
+void
+printLatency(const char* label, double usec) {
+    std::cout << "  " << label << std::setprecision(3) << std::fixed
+              << usec / 1000 << " ms\n";
+}
+
+void
+printLatencies(const LatencyHistogram& latencies) {
+    if (latencies.getCount() == 0) {
+        std::cout << "  Latency:              N/A\n";
+        return;
+    }
+    printLatency("Latency min:          ", latencies.getMin());
+    printLatency("Latency mean:         ", latencies.getMean());
+    printLatency("Latency 50th pct:     ",
+                 latencies.getValueAtPercentile(50));
+    printLatency("Latency 90th pct:     ",
+                 latencies.getValueAtPercentile(90));
+    printLatency("Latency 99th pct:     ",
+                 latencies.getValueAtPercentile(99));
+    printLatency("Latency 99.9th pct:   ",
+                 latencies.getValueAtPercentile(99.9));
+    printLatency("Latency max:          ", latencies.getMax());
+}
+
+// Print the percentiles of latencies corrected for coordinated omission.
+// They are higher than the raw ones if the server (or this program) stalled.
+void
+printCorrectedLatencies(const LatencyHistogram& latencies) {
+    if (latencies.getCount() == 0) {
+        return;
+    }
+    printLatency("Corrected 50th pct:   ",
+                 latencies.getValueAtPercentile(50));
+    printLatency("Corrected 90th pct:   ",
+                 latencies.getValueAtPercentile(90));
+    printLatency("Corrected 99th pct:   ",
+                 latencies.getValueAtPercentile(99));
+    printLatency("Corrected 99.9th pct: ",
+                 latencies.getValueAtPercentile(99.9));
+    printLatency("Corrected max:        ", latencies.getMax());
+}
+
+// Print the percentage of a part of the wall time of a thread.
+void
+printUsageRatio(const char* label, uint64_t usec, uint64_t wall_usec) {
+    std::cout << label << std::setprecision(1) << std::fixed
+              << (wall_usec > 0 ? static_cast<double>(usec) / wall_usec * 100 :
+                  0) << "%";
+}
+
+// Print the resource usage of each I/O thread of all dispatchers, and warn
+// about threads that were saturated, in which case the result may show the
+// limit of the client rather than the server.  Return true if any thread
+// was saturated.
+bool
+printResourceUsage(const std::vector<shared_ptr<Dispatcher> >& dispatchers) {
+    std::cout << "  Client resource usage:\n";
+    std::vector<std::string> saturated;
+    for (size_t i = 0; i < dispatchers.size(); ++i) {
+        for (size_t j = 0; j < dispatchers[i]->getIOThreads(); ++j) {
+            const std::string name = lexical_cast<std::string>(i) + "." +
+                lexical_cast<std::string>(j);
+            std::cout << "    Thread #" << name << ": ";
+            // It's not available if the thread failed.
+            ResourceUsage usage;
+            try {
+                usage = dispatchers[i]->getResourceUsage(j);
+            } catch (const DispatcherError&) {
+                std::cout << "not available\n";
+                continue;
+            }
+            printUsageRatio("CPU ", usage.user_usec + usage.system_usec,
+                            usage.wall_usec);
+            printUsageRatio(" (user ", usage.user_usec, usage.wall_usec);
+            printUsageRatio(", system ", usage.system_usec, usage.wall_usec);
+            std::cout << ")";
+            if (usage.has_loop_stats) {
+                printUsageRatio(", idle ", usage.idle_usec, usage.wall_usec);
+                // Some backends can't tell the time spent for I/O.
+                if (usage.io_usec > 0) {
+                    printUsageRatio(", I/O ", usage.io_usec, usage.wall_usec);
+                }
+            }
+            std::cout << "\n      context switches "
+                      << usage.voluntary_switches
+                      << " voluntary, " << usage.involuntary_switches
+                      << " involuntary\n";
+            if (usage.isSaturated()) {
+                saturated.push_back(name);
+            }
+        }
+    }
+    if (!saturated.empty()) {
+        std::cout << "  [WARN] Client thread(s) saturated:";
+        for (size_t i = 0; i < saturated.size(); ++i) {
+            std::cout << " #" << saturated[i];
+        }
+        std::cout << "\n         The results may show the limit of this "
+                  << "client rather than the server.\n";
+    }
+    return (!saturated.empty());
+}
+
+// Print the summary of zone transfers, if any.  The total throughput is
+// the total bytes of the transfers over the whole test duration.
+void
+printTransfers(const TransferStatistics& transfers, double duration) {
+    if (transfers.getCount() == 0) {
+        return;
+    }
+    std::cout << "  Transfers completed:  " << transfers.getCount() << "\n";
+    std::cout << "  Transfer messages:    " << transfers.getMessages()
+              << "\n";
+    std::cout << "  Transfer RRs:         " << transfers.getRRs() << "\n";
+    std::cout << "  Transfer bytes:       " << transfers.getBytes() << "\n";
+    const LatencyHistogram& first_byte = transfers.getFirstByteTimes();
+    if (first_byte.getCount() > 0) {
+        printLatency("First byte mean:      ", first_byte.getMean());
+        printLatency("First byte max:       ", first_byte.getMax());
+    }
+    const LatencyHistogram& durations = transfers.getDurations();
+    printLatency("Transfer time mean:   ", durations.getMean());
+    printLatency("Transfer time 99th:   ",
+                 durations.getValueAtPercentile(99));
+    printLatency("Transfer time max:    ", durations.getMax());
+    std::cout << "  Transfer throughput:  " << std::setprecision(3)
+              << transfers.getThroughput() << " MB/s (per transfer), "
+              << transfers.getBytes() / duration / 1000000
+              << " MB/s (total)\n";
+    std::cout << "\n";
+}
+
 // Default Parameters
 uint16_t getDefaultPort() { return (Dispatcher::DEFAULT_PORT); }
 long getDefaultDuration() { return (Dispatcher::DEFAULT_DURATION); }
@@ -66,17 +220,42 @@ const bool DEFAULT_DNSSEC = true; // set EDNS DO bit by default
 const bool DEFAULT_EDNS = true; // set EDNS0 OPT RR by default
 const char* const DEFAULT_DATA_FILE = "-"; // stdin
 const char* const DEFAULT_PROTOCOL = "udp";
+const bool DEFAULT_TCP_KEEPALIVE = false;
+// Default cool-down period in seconds in the sweep mode, so that the last
+// queries of each step complete under the same load.
+const char* const DEFAULT_SWEEP_COOLDOWN = "1";
+size_t getDefaultWindow() { return (Dispatcher::DEFAULT_WINDOW); }
 
 void
 usage() {
     const std::string usage_head = "Usage: queryperf++ ";
     const std::string indent(usage_head.size(), ' ');
     std::cerr << usage_head
-         << "[-C qclass] [-d datafile] [-D on|off] [-e on|off] [-l limit]\n";
+         << "[-a cpu_list] [-A msec] [-b backend] [-c #connections]\n";
     std::cerr << indent
-         << "[-L] [-n #threads] [-p port] [-P udp|tcp] [-Q query_sequence]\n";
+         << "[-C qclass] [-d datafile] [-D on|off] [-e on|off]\n";
     std::cerr << indent
-         << "[-s server_addr]\n";
+         << "[-H library] [-i msec] [-I interface] [-k on|off]\n";
+    std::cerr << indent
+         << "[-K cooldown] [-l limit] [-L] [-n #threads] [-p port]\n";
+    std::cerr << indent
+         << "[-P udp|tcp] [-Q query_sequence] [-r qps] [-s server_addr]\n";
+    std::cerr << indent
+         << "[-S from:to:step] [-t #io_threads] [-T max_threads]\n";
+    std::cerr << indent
+         << "[-w window] [-W warmup]\n";
+    std::cerr << "  -a pins the I/O threads to the CPUs in the given list, "
+              << "e.g., 0-3,8\n"
+              << "     (default: unspecified)\n";
+    std::cerr << "  -A adapts the window to find the highest rate within the "
+              << "given\n"
+              << "     average latency in milliseconds (default: disabled)\n";
+    std::cerr << "  -b sets the I/O backend, asio, epoll or io_uring (default: "
+              << Dispatcher::DEFAULT_IO_BACKEND << ")\n";
+    std::cerr << "  -c sets the number of persistent TCP connections per "
+              << "thread\n"
+              << "     (default: " << Dispatcher::DEFAULT_TCP_CONNECTIONS
+              << ", use a new connection for each query)\n";
     std::cerr << "  -C sets default query class (default: "
          << DEFAULT_CLASS << ")\n";
     std::cerr << "  -d sets the input data file (default: stdin)\n";
@@ -84,6 +263,23 @@ usage() {
          << (DEFAULT_EDNS ? "on" : "off") << ")\n";
     std::cerr << "  -e sets whether to include EDNS (default: "
          << (DEFAULT_DNSSEC ? "on" : "off") << ")\n";
+    std::cerr << "  -H handles queries in process with the query handler of "
+              << "the given\n"
+              << "     shared object instead of sending them (default: "
+              << "disabled)\n";
+    std::cerr << "  -i prints live statistics every given milliseconds "
+              << "(default: disabled)\n";
+    std::cerr << "  -I pins the I/O threads to the CPUs local to the given "
+              << "network\n"
+              << "     interface (default: unspecified)\n";
+    std::cerr << "  -k sets whether to include the EDNS TCP keepalive option "
+              << "(default: " << (DEFAULT_TCP_KEEPALIVE ? "on" : "off")
+              << ")\n";
+    std::cerr << "  -K keeps sending queries for the given seconds after the "
+              << "test\n"
+              << "     without counting them (default: 0, count responses "
+              << "until all\n"
+              << "     outstanding queries complete)\n";
     std::cerr << "  -l sets how long to run tests in seconds (default: "
          << getDefaultDuration() << ")\n";
     std::cerr << "  -L enables query preloading (default: disabled)\n";
@@ -95,8 +291,29 @@ usage() {
          << DEFAULT_PROTOCOL << ")\n";
     std::cerr
         << "  -Q sets newline-separated query data (default: unspecified)\n";
+    std::cerr << "  -r sends queries at the given total rate in qps "
+              << "(open-loop mode)\n"
+              << "     (default: unspecified, send a new query on completion "
+              << "of a previous one)\n";
     std::cerr << "  -s sets the server to query (default: "
-              << Dispatcher::DEFAULT_SERVER << ")";
+              << Dispatcher::DEFAULT_SERVER << ")\n";
+    std::cerr << "  -S repeats the test in the open-loop mode for each total "
+              << "rate in\n"
+              << "     the given range in qps, and prints the "
+              << "latency-throughput curve\n"
+              << "     (default: unspecified; -K defaults to "
+              << DEFAULT_SWEEP_COOLDOWN << " with this option)\n";
+    std::cerr << "  -t sets the number of I/O threads per querying thread "
+              << "(default: " << Dispatcher::DEFAULT_IO_THREADS << ")\n";
+    std::cerr << "  -T repeats the test with 1, 2, 4, ... up to the given "
+              << "number of\n"
+              << "     querying threads and prints the scaling efficiency "
+              << "(default: unspecified)\n";
+    std::cerr << "  -w sets the maximum number of outstanding queries per "
+              << "thread (default: " << getDefaultWindow() << ")\n";
+    std::cerr << "  -W sends queries for the given seconds before the test "
+              << "without\n"
+              << "     counting them (default: 0)";
     std::cerr << std::endl;
     exit(1);
 }
@@ -113,6 +330,146 @@ runQueryperf(void* arg) {
     return (NULL);
 }
 
+// A minimum ratio of the completion rate to the target rate at each step
+// of the sweep mode; if the completion rate is lower, the server is
+// considered to be saturated.
+const double SWEEP_SATURATION_RATIO = 0.95;
+
+// Results of a single step of the sweep mode.
+struct SweepPoint {
+    SweepPoint(size_t target, double offered, double achieved,
+               const QueryStatistics& result) :
+        target_rate(target), offered_rate(offered), achieved_rate(achieved),
+        loss(result.queries_sent == 0 ? 0 :
+             static_cast<double>(result.queries_sent -
+                                 result.queries_completed) /
+             result.queries_sent * 100),
+        latencies(result.latencies),
+        corrected_latencies(result.corrected_latencies),
+        client_saturated(false)
+    {}
+
+    size_t target_rate;         // qps
+    double offered_rate;        // qps
+    double achieved_rate;       // qps of completed queries
+    double loss;                // percentage of lost queries
+    LatencyHistogram latencies;
+    LatencyHistogram corrected_latencies;
+    bool client_saturated;      // the result may not be of the server
+};
+
+// Parse the range of the sweep mode in the form of "from:to:step" into
+// a list of query rates.
+bool
+parseSweepRange(const std::string& range, std::vector<size_t>& rates) {
+    const size_t pos1 = range.find(':');
+    const size_t pos2 = pos1 == std::string::npos ? pos1 :
+        range.find(':', pos1 + 1);
+    if (pos2 == std::string::npos) {
+        return (false);
+    }
+    size_t from, to, step;
+    try {
+        from = lexical_cast<size_t>(range.substr(0, pos1));
+        to = lexical_cast<size_t>(range.substr(pos1 + 1, pos2 - pos1 - 1));
+        step = lexical_cast<size_t>(range.substr(pos2 + 1));
+    } catch (const boost::bad_lexical_cast&) {
+        return (false);
+    }
+    if (from == 0 || to < from || step == 0) {
+        return (false);
+    }
+    for (size_t rate = from; rate <= to; rate += step) {
+        rates.push_back(rate);
+    }
+    return (true);
+}
+
+// Print the latency-throughput curve of the sweep mode in the CSV format,
+// followed by the saturation point: the highest target rate achieved
+// before the first step where the server fails to keep up.
+void
+printSweep(const std::vector<SweepPoint>& points) {
+    std::cout << "Sweep results:\n\n";
+    std::cout << "target_qps,offered_qps,achieved_qps,loss_pct,"
+              << "p50_ms,p90_ms,p99_ms,p99.9_ms,corrected_p99_ms,"
+              << "client_saturated\n";
+    size_t saturation = 0;      // index of the first saturated step + 1
+    for (size_t i = 0; i < points.size(); ++i) {
+        const SweepPoint& point = points[i];
+        std::cout << std::setprecision(3) << std::fixed
+                  << point.target_rate << ',' << point.offered_rate << ','
+                  << point.achieved_rate << ',' << point.loss << ','
+                  << point.latencies.getValueAtPercentile(50) / 1000.0 << ','
+                  << point.latencies.getValueAtPercentile(90) / 1000.0 << ','
+                  << point.latencies.getValueAtPercentile(99) / 1000.0 << ','
+                  << point.latencies.getValueAtPercentile(99.9) / 1000.0 << ','
+                  << point.corrected_latencies.getValueAtPercentile(99) / 1000.0
+                  << ',' << (point.client_saturated ? "yes" : "no") << '\n';
+        if (saturation == 0 && point.achieved_rate <
+            point.target_rate * SWEEP_SATURATION_RATIO) {
+            saturation = i + 1;
+        }
+    }
+    std::cout << "\n  Saturation point:     ";
+    if (saturation == 0) {
+        std::cout << "not reached\n";
+    } else if (saturation == 1) {
+        std::cout << "below " << points[0].target_rate << " qps\n";
+    } else {
+        const SweepPoint& point = points[saturation - 2];
+        std::cout << point.target_rate << " qps (achieved "
+                  << point.achieved_rate << " qps)\n";
+    }
+    std::cout << std::endl;
+}
+
+// Results of a single step of the thread-scaling mode.
+struct ScalingPoint {
+    ScalingPoint(size_t threads, const QueryStatistics& result) :
+        num_threads(threads), total_qps(0),
+        min_qps(*std::min_element(result.qps_results.begin(),
+                                  result.qps_results.end())),
+        max_qps(*std::max_element(result.qps_results.begin(),
+                                  result.qps_results.end())),
+        client_saturated(false)
+    {
+        for (size_t i = 0; i < result.qps_results.size(); ++i) {
+            total_qps += result.qps_results[i];
+        }
+    }
+
+    size_t num_threads;
+    double total_qps;           // sum of all threads
+    double min_qps;             // of the slowest thread
+    double max_qps;             // of the fastest thread
+    bool client_saturated;      // the result may not be of the server
+};
+
+// Print the results of the thread-scaling mode in the CSV format.  The
+// scaling efficiency is the total QPS relative to that of the first step
+// (with 1 thread) multiplied by the number of threads, and the balance is
+// the QPS of the slowest thread relative to the fastest one.
+void
+printScaling(const std::vector<ScalingPoint>& points) {
+    std::cout << "Thread scaling results:\n\n";
+    std::cout << "threads,total_qps,min_thread_qps,max_thread_qps,"
+              << "efficiency_pct,balance_pct,client_saturated\n";
+    const double base_qps = points[0].total_qps / points[0].num_threads;
+    for (size_t i = 0; i < points.size(); ++i) {
+        const ScalingPoint& point = points[i];
+        std::cout << std::setprecision(3) << std::fixed
+                  << point.num_threads << ',' << point.total_qps << ','
+                  << point.min_qps << ',' << point.max_qps << ','
+                  << (base_qps > 0 ? point.total_qps /
+                      (base_qps * point.num_threads) * 100 : 0) << ','
+                  << (point.max_qps > 0 ?
+                      point.min_qps / point.max_qps * 100 : 0) << ','
+                  << (point.client_saturated ? "yes" : "no") << '\n';
+    }
+    std::cout << std::endl;
+}
+
 typedef shared_ptr<Dispatcher> DispatcherPtr;
 typedef shared_ptr<std::stringstream> SStreamPtr;
 
@@ -133,6 +490,59 @@ parseOnOffFlag(const char* optname, const char* const optarg,
     }
     return (default_val);
 }
+
+// Preloaded queries to be loaded into a dispatcher, or copied from another
+// one, by a thread pinned to a CPU, so that they'll be in the memory local
+// to the CPU.
+struct PinnedLoad {
+    unsigned int cpu;
+    DispatcherPtr disp;         // loads the queries if source is NULL
+    const Dispatcher* source;   // otherwise copied from this
+    size_t start_index;         // of the copy
+    std::string error;          // set if loading fails
+};
+
+void*
+runPinnedLoad(void* arg) {
+    PinnedLoad* load = static_cast<PinnedLoad*>(arg);
+    try {
+        setThreadAffinity(load->cpu);
+        if (load->source == NULL) {
+            load->disp->loadQueries();
+        } else {
+            load->disp.reset(new Dispatcher(*load->source, load->start_index,
+                                            true));
+        }
+    } catch (const std::exception& ex) {
+        load->error = ex.what();
+    }
+    return (NULL);
+}
+
+// Load the queries into a dispatcher (or copy them from \c source if it's
+// not NULL) in a thread pinned to the given CPU, and return the dispatcher.
+DispatcherPtr
+loadPinned(unsigned int cpu, DispatcherPtr disp, const Dispatcher* source,
+           size_t start_index)
+{
+    PinnedLoad load;
+    load.cpu = cpu;
+    load.disp = disp;
+    load.source = source;
+    load.start_index = start_index;
+    pthread_t th;
+    const int error = pthread_create(&th, NULL, runPinnedLoad, &load);
+    if (error != 0) {
+        throw std::runtime_error(
+            std::string("Failed to create a thread to load queries: ") +
+            strerror(error));
+    }
+    pthread_join(th, NULL);
+    if (!load.error.empty()) {
+        throw std::runtime_error(load.error);
+    }
+    return (load.disp);
+}
 }
 
 int
@@ -148,12 +558,41 @@ main(int argc, char* argv[]) {
         lexical_cast<std::string>(getDefaultDuration());
     const char* num_threads_txt = NULL;
     const char* query_txt = NULL;
+    const char* query_rate_txt = NULL;
+    const char* window_txt = NULL;
+    const char* interval_txt = NULL;
+    const char* tcp_connections_txt = NULL;
+    const char* tcp_keepalive_txt = NULL;
+    const char* io_threads_txt = NULL;
+    const char* latency_bound_txt = NULL;
+    const char* sweep_txt = NULL;
+    const char* scaling_txt = NULL;
+    const char* warmup_txt = NULL;
+    const char* cooldown_txt = NULL;
+    const char* io_backend = NULL;
+    const char* standalone_library = NULL;
+    const char* cpus_txt = NULL;
+    const char* interface_txt = NULL;
     size_t num_threads = DEFAULT_THREAD_COUNT;
     bool preload = false;
 
     int ch;
-    while ((ch = getopt(argc, argv, "C:d:D:e:hl:Ln:p:P:Q:s:")) != -1) {
+    while ((ch = getopt(argc, argv,
+                        "a:A:b:c:C:d:D:e:hH:i:I:k:K:l:Ln:p:P:Q:r:s:S:t:"
+                        "T:w:W:")) != -1) {
         switch (ch) {
+        case 'a':
+            cpus_txt = optarg;
+            break;
+        case 'A':
+            latency_bound_txt = optarg;
+            break;
+        case 'b':
+            io_backend = optarg;
+            break;
+        case 'c':
+            tcp_connections_txt = optarg;
+            break;
         case 'C':
             qclass_txt = optarg;
             break;
@@ -166,6 +605,21 @@ main(int argc, char* argv[]) {
         case 'e':
             edns_flag_txt = optarg;
             break;
+        case 'H':
+            standalone_library = optarg;
+            break;
+        case 'i':
+            interval_txt = optarg;
+            break;
+        case 'I':
+            interface_txt = optarg;
+            break;
+        case 'k':
+            tcp_keepalive_txt = optarg;
+            break;
+        case 'K':
+            cooldown_txt = optarg;
+            break;
         case 'n':
             num_threads_txt = optarg;
             break;
@@ -181,6 +635,24 @@ main(int argc, char* argv[]) {
         case 'Q':
             query_txt = optarg;
             break;
+        case 'r':
+            query_rate_txt = optarg;
+            break;
+        case 'S':
+            sweep_txt = optarg;
+            break;
+        case 't':
+            io_threads_txt = optarg;
+            break;
+        case 'T':
+            scaling_txt = optarg;
+            break;
+        case 'w':
+            window_txt = optarg;
+            break;
+        case 'W':
+            warmup_txt = optarg;
+            break;
         case 'l':
             time_limit_str = std::string(optarg);
             break;
@@ -203,6 +675,16 @@ main(int argc, char* argv[]) {
                   << std::endl;
         return (1);
     }
+    if (io_backend != NULL && standalone_library != NULL) {
+        std::cerr << "-b and -H cannot be specified at the same time"
+                  << std::endl;
+        return (1);
+    }
+    if (cpus_txt != NULL && interface_txt != NULL) {
+        std::cerr << "-a and -I cannot be specified at the same time"
+                  << std::endl;
+        return (1);
+    }
     const bool dnssec_flag = parseOnOffFlag("-D", dnssec_flag_txt,
                                             DEFAULT_DNSSEC);
     const bool edns_flag = parseOnOffFlag("-e", edns_flag_txt, DEFAULT_EDNS);
@@ -210,6 +692,8 @@ main(int argc, char* argv[]) {
         std::cerr << "[WARN] EDNS is disabled but DNSSEC is enabled; "
                   << "EDNS will still be included." << std::endl;
     }
+    const bool tcp_keepalive = parseOnOffFlag("-k", tcp_keepalive_txt,
+                                              DEFAULT_TCP_KEEPALIVE);
     const std::string proto_str(proto_txt);
     if (proto_str != "udp" && proto_str != "tcp") {
         std::cerr << "Invalid protocol: " << proto_str << std::endl;
@@ -218,132 +702,412 @@ main(int argc, char* argv[]) {
     const int proto = proto_str == "udp" ? IPPROTO_UDP : IPPROTO_TCP;
 
     try {
-        std::vector<DispatcherPtr> dispatchers;
         std::vector<SStreamPtr> input_streams;
         if (num_threads_txt != NULL) {
             num_threads = lexical_cast<size_t>(num_threads_txt);
         }
-        if (num_threads > 1 && data_file != NULL &&
-            std::string(data_file) == "-") {
-            std::cerr << "stdin can be used as input only with 1 thread"
+
+        // In the sweep mode the test is repeated in the open-loop mode for
+        // each of the query rates in the range; in the thread-scaling mode
+        // it's repeated for each number of threads; otherwise it runs once.
+        std::vector<size_t> step_rates;
+        std::vector<size_t> step_threads;
+        if (sweep_txt != NULL && scaling_txt != NULL) {
+            std::cerr << "-S and -T cannot be specified at the same time"
                       << std::endl;
             return (1);
         }
-
-        // Prepare
-        std::cout << "[Status] Processing input data" << std::endl;
-        for (size_t i = 0; i < num_threads; ++i) {
-            DispatcherPtr disp;
-            if (data_file != NULL) {
-                disp.reset(new Dispatcher(data_file));
-            } else {
-                assert(query_txt != NULL);
-                SStreamPtr ss(new std::stringstream(query_txt));
-                disp.reset(new Dispatcher(*ss));
-                input_streams.push_back(ss);
+        if (sweep_txt != NULL) {
+            if (query_rate_txt != NULL || latency_bound_txt != NULL) {
+                std::cerr << "-S cannot be specified with -r or -A"
+                          << std::endl;
+                return (1);
+            }
+            if (!parseSweepRange(sweep_txt, step_rates)) {
+                std::cerr << "Invalid sweep range: " << sweep_txt
+                          << std::endl;
+                return (1);
             }
-            disp->setServerAddress(server_address);
-            disp->setServerPort(lexical_cast<uint16_t>(server_port_str));
-            disp->setTestDuration(lexical_cast<size_t>(time_limit_str));
-            disp->setDefaultQueryClass(qclass_txt);
-            disp->setDNSSEC(dnssec_flag);
-            disp->setEDNS(edns_flag);
-            disp->setProtocol(proto);
-            // Preload must be the final step of configuration before running.
-            if (preload) {
-                disp->loadQueries();
+            // Queries are preloaded and shared by all steps.
+            preload = true;
+            if (cooldown_txt == NULL) {
+                cooldown_txt = DEFAULT_SWEEP_COOLDOWN;
             }
-            dispatchers.push_back(disp);
+        } else {
+            step_rates.push_back(query_rate_txt == NULL ? 0 :
+                                 lexical_cast<size_t>(query_rate_txt));
         }
-
-        // Run
-        std::cout << "[Status] Sending queries to " << server_address
-             << " over " << proto_str << ", port " << server_port_str << std::endl;
-        std::vector<pthread_t> threads;
-        const ptime start_time = microsec_clock::local_time();
-        for (size_t i = 0; i < num_threads; ++i) {
-            pthread_t th;
-            const int error = pthread_create(&th, NULL, runQueryperf,
-                                             dispatchers[i].get());
-            if (error != 0) {
-                throw std::runtime_error(
-                    std::string("Failed to create a worker thread: ") +
-                    strerror(error));
+        if (scaling_txt != NULL) {
+            if (num_threads_txt != NULL) {
+                std::cerr << "-n and -T cannot be specified at the same time"
+                          << std::endl;
+                return (1);
             }
-            threads.push_back(th);
+            const size_t max_threads = lexical_cast<size_t>(scaling_txt);
+            if (max_threads == 0) {
+                std::cerr << "Invalid number of threads: " << scaling_txt
+                          << std::endl;
+                return (1);
+            }
+            for (size_t n = 1; n < max_threads; n *= 2) {
+                step_threads.push_back(n);
+            }
+            step_threads.push_back(max_threads);
+            step_rates.resize(step_threads.size(), step_rates[0]);
+            num_threads = max_threads;
+            // Queries are preloaded and shared by all steps, so the added
+            // threads of each step only share (or, on a new NUMA node,
+            // copy) them.
+            preload = true;
+        } else {
+            step_threads.resize(step_rates.size(), num_threads);
+        }
+        if ((query_rate_txt != NULL || sweep_txt != NULL) &&
+            step_rates[0] < num_threads) {
+            std::cerr << "query rate must be at least the number of threads"
+                      << std::endl;
+            return (1);
         }
 
-        for (size_t i = 0; i < num_threads; ++i) {
-            const int error = pthread_join(threads[i], NULL);
-            if (error != 0) {
-                // if join failed, we warn about it and just continue anyway
-                std::cerr
-                    << "pthread_join failed: " << strerror(error) << std::endl;
+        // Each I/O thread of each querying thread is pinned to the next CPU
+        // of the list in turn.
+        std::vector<unsigned int> cpus;
+        if (cpus_txt != NULL) {
+            cpus = parseCPUList(cpus_txt);
+        } else if (interface_txt != NULL) {
+            cpus = getInterfaceCPUs(interface_txt);
+        }
+        if (!cpus.empty()) {
+            std::cout << "[Status] Pinning threads to CPUs";
+            for (size_t i = 0; i < cpus.size(); ++i) {
+                std::cout << (i == 0 ? " " : ",") << cpus[i];
             }
+            std::cout << std::endl;
         }
-        const ptime end_time = microsec_clock::local_time();
-        std::cout << "[Status] Testing complete" << std::endl;
-
-        // Accumulate per-thread statistics.  Print the summary QPS for each,
-        // and if more than one thread was used, print the sum of them.
-        std::cout << "\nStatistics:\n\n";
-
-        QueryStatistics result;
-        double total_qps = 0;
-        std::cout.precision(6);
-        for (size_t i = 0; i < num_threads; ++i) {
-            const double qps = accumulateResult(*dispatchers[i], result);
-            total_qps += qps;
-            std::cout << "  Queries per second #" << i <<
-                ":  " << std::fixed << qps << " qps\n";
+        const size_t io_threads = io_threads_txt == NULL ?
+            Dispatcher::DEFAULT_IO_THREADS :
+            lexical_cast<size_t>(io_threads_txt);
+
+        if ((num_threads > 1 || step_rates.size() > 1) && !preload &&
+            data_file != NULL && std::string(data_file) == "-") {
+            std::cerr << "stdin can be used as input only with 1 thread "
+                      << "unless preloaded" << std::endl;
+            return (1);
         }
-        if (num_threads > 1) {
-            std::cout << "         Summarized QPS:  " << std::fixed << total_qps
-                 << " qps\n";
+
+        // Preloaded queries are loaded only once, and shared by the
+        // dispatchers of all steps.  If the threads are pinned, each NUMA
+        // node has its own copy, loaded (or copied from the first one) by
+        // a thread pinned to a CPU of the node, so that it's in the local
+        // memory of the node.
+        DispatcherPtr first_source;
+        std::map<unsigned int, DispatcherPtr> node_sources;
+        std::vector<SweepPoint> sweep_points;
+        std::vector<ScalingPoint> scaling_points;
+        for (size_t step = 0; step < step_rates.size(); ++step) {
+            const size_t query_rate = step_rates[step];
+            num_threads = step_threads[step];
+            std::vector<DispatcherPtr> dispatchers;
+            if (sweep_txt != NULL) {
+                std::cout << "[Status] Sweep step " << step + 1 << "/"
+                          << step_rates.size() << ": " << query_rate
+                          << " qps" << std::endl;
+            }
+            if (scaling_txt != NULL) {
+                std::cout << "[Status] Scaling step " << step + 1 << "/"
+                          << step_threads.size() << ": " << num_threads
+                          << " threads" << std::endl;
+            }
+
+            // Prepare
+            std::cout << "[Status] Processing input data" << std::endl;
+            for (size_t i = 0; i < num_threads; ++i) {
+                // Each dispatcher sharing preloaded queries starts at a
+                // different position so that threads won't send the same
+                // queries in lockstep.
+                const unsigned int cpu = cpus.empty() ? 0 :
+                    cpus[(i * io_threads) % cpus.size()];
+                DispatcherPtr* node_source = !preload ? NULL :
+                    &node_sources[cpus.empty() ? 0 : getCPUNode(cpu)];
+                const bool share_queries = node_source != NULL &&
+                    (*node_source || first_source);
+                DispatcherPtr disp;
+                if (share_queries && *node_source) {
+                    const Dispatcher& source = **node_source;
+                    disp.reset(new Dispatcher(source,
+                                              source.getQueryCount() * i /
+                                              num_threads));
+                } else if (share_queries) {
+                    // The first dispatcher on this node makes the copy.
+                    disp = loadPinned(cpu, disp, first_source.get(),
+                                      first_source->getQueryCount() * i /
+                                      num_threads);
+                    *node_source = disp;
+                } else if (data_file != NULL) {
+                    disp.reset(new Dispatcher(data_file));
+                } else {
+                    assert(query_txt != NULL);
+                    SStreamPtr ss(new std::stringstream(query_txt));
+                    disp.reset(new Dispatcher(*ss));
+                    input_streams.push_back(ss);
+                }
+                if (standalone_library != NULL) {
+                    disp->setStandaloneLibrary(standalone_library);
+                } else {
+                    disp->setIOBackend(io_backend != NULL ? io_backend :
+                                       Dispatcher::DEFAULT_IO_BACKEND);
+                }
+                disp->setServerAddress(server_address);
+                disp->setServerPort(lexical_cast<uint16_t>(server_port_str));
+                disp->setTestDuration(lexical_cast<size_t>(time_limit_str));
+                if (warmup_txt != NULL) {
+                    disp->setWarmupDuration(lexical_cast<size_t>(warmup_txt));
+                }
+                if (cooldown_txt != NULL) {
+                    disp->setCooldownDuration(
+                        lexical_cast<size_t>(cooldown_txt));
+                }
+                if (!share_queries) {
+                    disp->setDefaultQueryClass(qclass_txt);
+                    disp->setDNSSEC(dnssec_flag);
+                    disp->setEDNS(edns_flag);
+                    disp->setProtocol(proto);
+                }
+                if (tcp_connections_txt != NULL) {
+                    disp->setTCPConnections(
+                        lexical_cast<size_t>(tcp_connections_txt));
+                }
+                disp->setTCPKeepalive(tcp_keepalive);
+                if (io_threads_txt != NULL) {
+                    disp->setIOThreads(lexical_cast<size_t>(io_threads_txt));
+                }
+                if (window_txt != NULL) {
+                    disp->setWindow(lexical_cast<size_t>(window_txt));
+                }
+                if (latency_bound_txt != NULL) {
+                    // Given in milliseconds, possibly with a fraction.
+                    disp->setLatencyBound(static_cast<uint64_t>(
+                        lexical_cast<double>(latency_bound_txt) * 1000));
+                }
+                // The total rate is divided among the threads as evenly as
+                // possible.
+                if (query_rate > 0) {
+                    disp->setQueryRate(query_rate / num_threads +
+                                       (i < query_rate % num_threads ? 1 : 0));
+                }
+                // Preload must be the final step of configuration before
+                // running, except for the CPU affinity: if pinned, the
+                // queries are loaded in a thread pinned to the first CPU
+                // instead of deferring it to run().
+                if (preload && !share_queries) {
+                    if (cpus.empty()) {
+                        disp->loadQueries();
+                    } else {
+                        loadPinned(cpu, disp, NULL, 0);
+                    }
+                    first_source = disp;
+                    *node_source = disp;
+                }
+                if (!cpus.empty()) {
+                    std::vector<unsigned int> disp_cpus;
+                    for (size_t j = 0; j < io_threads; ++j) {
+                        disp_cpus.push_back(
+                            cpus[(i * io_threads + j) % cpus.size()]);
+                    }
+                    disp->setCPUAffinity(disp_cpus);
+                }
+                dispatchers.push_back(disp);
+            }
+
+            // Live statistics are sampled by a separate reporter thread from
+            // the counters of all dispatchers.
+            boost::scoped_ptr<LiveStatisticsReporter> reporter;
+            if (interval_txt != NULL) {
+                std::vector<const LiveCounters*> counters;
+                for (size_t i = 0; i < num_threads; ++i) {
+                    const Dispatcher& disp = *dispatchers[i];
+                    for (size_t j = 0; j < disp.getIOThreads(); ++j) {
+                        counters.push_back(&disp.getLiveCounters(j));
+                    }
+                }
+                reporter.reset(new LiveStatisticsReporter(
+                                   counters,
+                                   milliseconds(
+                                       lexical_cast<long>(interval_txt)),
+                                   std::cout));
+            }
+
+            // Run
+            std::cout << "[Status] Sending queries to " << server_address
+                 << " over " << proto_str << ", port " << server_port_str
+                 << std::endl;
+            std::vector<pthread_t> threads;
+            ptime start_time = microsec_clock::local_time();
+            if (reporter) {
+                reporter->start();
+            }
+            for (size_t i = 0; i < num_threads; ++i) {
+                pthread_t th;
+                const int error = pthread_create(&th, NULL, runQueryperf,
+                                                 dispatchers[i].get());
+                if (error != 0) {
+                    throw std::runtime_error(
+                        std::string("Failed to create a worker thread: ") +
+                        strerror(error));
+                }
+                threads.push_back(th);
+            }
+
+            for (size_t i = 0; i < num_threads; ++i) {
+                const int error = pthread_join(threads[i], NULL);
+                if (error != 0) {
+                    // if join failed, we warn about it and just continue anyway
+                    std::cerr
+                        << "pthread_join failed: " << strerror(error)
+                        << std::endl;
+                }
+            }
+            if (reporter) {
+                reporter->stop();
+            }
+            ptime end_time = microsec_clock::local_time();
+            std::cout << "[Status] Testing complete" << std::endl;
+
+            // Accumulate per-thread statistics.  Print the summary QPS for
+            // each, and if more than one thread was used, print the sum of
+            // them.
+            std::cout << "\nStatistics:\n\n";
+
+            // The total result covers the measurement windows of all
+            // threads, unless none of them got to start (e.g., due to a
+            // bad parameter).
+            ptime window_start, window_end;
+            for (size_t i = 0; i < num_threads; ++i) {
+                const ptime& start = dispatchers[i]->getStartTime();
+                const ptime& end = dispatchers[i]->getEndTime();
+                if (start.is_special() || end.is_special()) {
+                    continue;
+                }
+                if (window_start.is_special() || start < window_start) {
+                    window_start = start;
+                }
+                if (window_end.is_special() || end > window_end) {
+                    window_end = end;
+                }
+            }
+            if (!window_start.is_special()) {
+                start_time = window_start;
+                end_time = window_end;
+            }
+
+            QueryStatistics result;
+            double total_qps = 0;
+            std::cout.precision(6);
+            for (size_t i = 0; i < num_threads; ++i) {
+                const double qps = accumulateResult(*dispatchers[i], result);
+                total_qps += qps;
+                result.qps_results.push_back(qps);
+                std::cout << "  Queries per second #" << i <<
+                    ":  " << std::fixed << qps << " qps\n";
+            }
+            if (num_threads > 1) {
+                std::cout << "         Summarized QPS:  " << std::fixed
+                          << total_qps << " qps\n";
+            }
+            std::cout << std::endl;
+
+            // Print the total result.
+            std::cout << "  Queries sent:         " << result.queries_sent
+                 << " queries\n";
+            std::cout << "  Queries completed:    " << result.queries_completed
+                 << " queries\n";
+            std::cout << "\n";
+
+            std::cout << "  Percentage completed: " << std::setprecision(2);
+            if (result.queries_sent > 0) {
+                std::cout << std::setw(6)
+                          << (static_cast<double>(result.queries_completed) /
+                              result.queries_sent) * 100 << "%\n";
+            } else {
+                std::cout << "N/A\n";
+            }
+            std::cout << "  Percentage lost:      ";
+            if (result.queries_sent > 0) {
+                const size_t lost_count = result.queries_sent -
+                    result.queries_completed;
+                std::cout << std::setw(6)
+                          << (static_cast<double>(lost_count) /
+                              result.queries_sent) * 100 << "%\n";
+            } else {
+                std::cout << "N/A\n";
+            }
+            std::cout << "\n";
+
+            std::cout << "  Started at:           " << start_time << std::endl;
+            std::cout << "  Finished at:          " << end_time << std::endl;
+            const time_duration duration = end_time - start_time;
+            std::cout
+                << "  Run for:              " << std::setprecision(6)
+                << (static_cast<double>(duration.total_microseconds()) /
+                    1000000)
+                << " seconds\n";
+            std::cout << "\n";
+
+            const double qps = result.queries_completed / (
+                static_cast<double>(duration.total_microseconds()) / 1000000);
+            std::cout.precision(6);
+            std::cout << "  Queries per second:   " << std::fixed << qps
+                      << " qps\n";
+            if (query_rate > 0) {
+                // In the open-loop mode, also show the offered load (the rate
+                // at which queries were scheduled) and the rate at which they
+                // were actually sent, both over the configured test duration.
+                const double test_duration =
+                    lexical_cast<double>(time_limit_str);
+                std::cout << "  Target query rate:    " << query_rate
+                          << " qps\n";
+                std::cout << "  Offered query rate:   "
+                          << result.queries_scheduled / test_duration
+                          << " qps\n";
+                std::cout << "  Achieved send rate:   "
+                          << result.queries_sent / test_duration << " qps\n";
+            }
+            if (latency_bound_txt != NULL) {
+                const SustainedRates& rates = result.sustained_rates;
+                std::cout << "  Max sustained rate:   "
+                          << rates.getMaxRate() << " qps (window "
+                          << rates.getMaxWindow() << ")\n";
+            }
+            std::cout << "\n";
+
+            printTransfers(result.transfers,
+                           static_cast<double>(duration.total_microseconds()) /
+                           1000000);
+            printLatencies(result.latencies);
+            printCorrectedLatencies(result.corrected_latencies);
+            std::cout << "\n";
+            const bool client_saturated = printResourceUsage(dispatchers);
+            std::cout << std::endl;
+
+            if (sweep_txt != NULL) {
+                sweep_points.push_back(
+                    SweepPoint(query_rate,
+                               result.queries_scheduled /
+                               lexical_cast<double>(time_limit_str),
+                               qps, result));
+                sweep_points.back().client_saturated = client_saturated;
+            }
+            if (scaling_txt != NULL) {
+                scaling_points.push_back(ScalingPoint(num_threads, result));
+                scaling_points.back().client_saturated = client_saturated;
+            }
         }
-        std::cout << std::endl;
-
-        // Print the total result.
-        std::cout << "  Queries sent:         " << result.queries_sent
-             << " queries\n";
-        std::cout << "  Queries completed:    " << result.queries_completed
-             << " queries\n";
-        std::cout << "\n";
-
-        std::cout << "  Percentage completed: " << std::setprecision(2);
-        if (result.queries_sent > 0) {
-            std::cout << std::setw(6)
-                      << (static_cast<double>(result.queries_completed) /
-                          result.queries_sent) * 100 << "%\n";
-        } else {
-            std::cout << "N/A\n";
+        if (sweep_txt != NULL) {
+            printSweep(sweep_points);
         }
-        std::cout << "  Percentage lost:      ";
-        if (result.queries_sent > 0) {
-            const size_t lost_count = result.queries_sent -
-                result.queries_completed;
-            std::cout << std::setw(6) << (static_cast<double>(lost_count) /
-                                          result.queries_sent) * 100 << "%\n";
-        } else {
-            std::cout << "N/A\n";
+        if (scaling_txt != NULL) {
+            printScaling(scaling_points);
         }
-        std::cout << "\n";
-
-        std::cout << "  Started at:           " << start_time << std::endl;
-        std::cout << "  Finished at:          " << end_time << std::endl;
-        const time_duration duration = end_time - start_time;
-        std::cout
-            << "  Run for:              " << std::setprecision(6)
-            << (static_cast<double>(duration.total_microseconds()) / 1000000)
-            << " seconds\n";
-        std::cout << "\n";
-
-        const double qps = result.queries_completed / (
-            static_cast<double>(duration.total_microseconds()) / 1000000);
-        std::cout.precision(6);
-        std::cout << "  Queries per second:   " << std::fixed << qps
-                  << " qps\n";
-        std::cout << std::endl;
     } catch (const std::exception& ex) {
         std::cerr << "Unexpected failure: " << ex.what() << std::endl;
         return (1);
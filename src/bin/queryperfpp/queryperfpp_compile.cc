@@ -0,0 +1,159 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <query_repository.h>
+
+#include <dns/rrclass.h>
+
+#include <boost/scoped_ptr.hpp>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+
+#include <netinet/in.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace Queryperf;
+
+// This program converts a text query data file to a compiled query set,
+// which queryperf++ can use without parsing (see the -d option).
+
+namespace {
+const char* const DEFAULT_CLASS = "IN";
+const bool DEFAULT_DNSSEC = true;
+const bool DEFAULT_EDNS = true;
+const char* const DEFAULT_PROTOCOL = "udp";
+
+void
+usage() {
+    std::cerr << "Usage: queryperf++-compile [-C qclass] [-D on|off] "
+              << "[-e on|off] [-P udp|tcp]\n"
+              << "                           input_file output_file\n";
+    std::cerr << "  -C sets default query class (default: "
+              << DEFAULT_CLASS << ")\n";
+    std::cerr << "  -D sets whether to set EDNS DO bit (default: "
+              << (DEFAULT_DNSSEC ? "on" : "off") << ")\n";
+    std::cerr << "  -e sets whether to include EDNS (default: "
+              << (DEFAULT_EDNS ? "on" : "off") << ")\n";
+    std::cerr << "  -P sets transport protocol for queries (default: "
+              << DEFAULT_PROTOCOL << ")\n";
+    std::cerr << "  input_file can be '-' for stdin";
+    std::cerr << std::endl;
+    exit(1);
+}
+
+bool
+parseOnOffFlag(const char* optname, const char* const optarg,
+               bool default_val)
+{
+    if (optarg != NULL) {
+        if (std::string(optarg) == "on") {
+            return (true);
+        } else if (std::string(optarg) == "off") {
+            return (false);
+        } else {
+            std::cerr << "Option argument of "<< optname
+                      << " must be 'on' or 'off'" << std::endl;
+            exit(1);
+        }
+    }
+    return (default_val);
+}
+}
+
+int
+main(int argc, char* argv[]) {
+    const char* qclass_txt = DEFAULT_CLASS;
+    const char* dnssec_flag_txt = NULL;
+    const char* edns_flag_txt = NULL;
+    const char* proto_txt = DEFAULT_PROTOCOL;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "C:D:e:hP:")) != -1) {
+        switch (ch) {
+        case 'C':
+            qclass_txt = optarg;
+            break;
+        case 'D':
+            dnssec_flag_txt = optarg;
+            break;
+        case 'e':
+            edns_flag_txt = optarg;
+            break;
+        case 'P':
+            proto_txt = optarg;
+            break;
+        case 'h':
+        case '?':
+        default :
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 2) {
+        usage();
+    }
+    const std::string input_file(argv[0]);
+    const std::string output_file(argv[1]);
+
+    const bool dnssec_flag = parseOnOffFlag("-D", dnssec_flag_txt,
+                                            DEFAULT_DNSSEC);
+    const bool edns_flag = parseOnOffFlag("-e", edns_flag_txt, DEFAULT_EDNS);
+    const std::string proto_str(proto_txt);
+    if (proto_str != "udp" && proto_str != "tcp") {
+        std::cerr << "Invalid protocol: " << proto_str << std::endl;
+        return (1);
+    }
+
+    try {
+        boost::scoped_ptr<QueryRepository> repository_ptr(
+            input_file == "-" ? new QueryRepository(std::cin) :
+            new QueryRepository(input_file));
+        QueryRepository& repository = *repository_ptr;
+        repository.setQueryClass(bundy::dns::RRClass(qclass_txt));
+        repository.setDNSSEC(dnssec_flag);
+        repository.setEDNS(edns_flag);
+        repository.setProtocol(proto_str == "udp" ? IPPROTO_UDP :
+                               IPPROTO_TCP);
+        repository.load();
+
+        std::ofstream output(output_file.c_str(),
+                             std::ios::out | std::ios::binary |
+                             std::ios::trunc);
+        if (!output) {
+            std::cerr << "Failed to open output file: " << output_file
+                      << std::endl;
+            return (1);
+        }
+        repository.writeCompiled(output);
+        output.close();
+        if (!output) {
+            std::cerr << "Failed to write output file: " << output_file
+                      << std::endl;
+            return (1);
+        }
+        std::cout << "Compiled " << repository.getQueryCount()
+                  << " queries into " << output_file << std::endl;
+    } catch (const std::exception& ex) {
+        std::cerr << "Unexpected failure: " << ex.what() << std::endl;
+        return (1);
+    }
+
+    return (0);
+}
@@ -0,0 +1,555 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+// queryperf-responder: a minimal, fast DNS responder for benchmarking
+// queryperf++ itself.  It answers any query with a pre-baked response
+// without looking into the query beyond the question, so that the client
+// side is the bottleneck of a test run on the same host.
+
+#include <config.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using boost::lexical_cast;
+
+namespace {
+const char* const DEFAULT_ADDRESS = "::1";
+const uint16_t DEFAULT_PORT = 53;
+const size_t DEFAULT_THREAD_COUNT = 1;
+
+const size_t HEADER_LEN = 12;
+const size_t MAX_UDP_MESSAGE = 4096; // large enough for EDNS queries
+const size_t MAX_TCP_MESSAGE = 65535;
+
+// Number of UDP messages received or sent at once with recvmmsg/sendmmsg.
+const size_t UDP_BATCH_SIZE = 64;
+
+// The answer RR appended to the response to a query for IN/A: the owner
+// name is a compression pointer to the question name, and the RDATA is
+// 192.0.2.1 with a TTL of 3600.
+const uint8_t A_ANSWER[] = {
+    0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10,
+    0x00, 0x04, 192, 0, 2, 1
+};
+
+// Render the response to the given query in the buffer, and return its
+// length.  It returns 0 if the query should be ignored (e.g., a response
+// or a broken query).
+//
+// The response consists of the header and the question section of the
+// query, followed by the pre-baked answer for IN/A queries (all others
+// get an empty answer).  Other sections of the query, including EDNS,
+// are ignored.
+size_t
+makeResponse(const uint8_t* query, size_t query_len, uint8_t* response,
+             size_t response_len)
+{
+    if (query_len < HEADER_LEN || (query[2] & 0x80) != 0 ||
+        query[4] != 0 || query[5] != 1) { // QDCOUNT must be 1
+        return (0);
+    }
+
+    // Skip the question name.  It shouldn't be compressed.
+    size_t pos = HEADER_LEN;
+    while (pos < query_len && query[pos] != 0) {
+        if ((query[pos] & 0xc0) != 0) {
+            return (0);
+        }
+        pos += query[pos] + 1;
+    }
+    pos += 5;                   // the root label, type and class
+    if (pos > query_len) {
+        return (0);
+    }
+    const bool answer = query[pos - 4] == 0 && query[pos - 3] == 1 &&
+        query[pos - 2] == 0 && query[pos - 1] == 1;
+    const size_t len = pos + (answer ? sizeof(A_ANSWER) : 0);
+    if (len > response_len) {
+        return (0);
+    }
+
+    std::memcpy(response, query, pos);
+    // Set QR and AA, preserving the opcode and RD; RCODE is NOERROR.
+    response[2] = (query[2] & 0x79) | 0x84;
+    response[3] = 0;
+    response[6] = 0;            // ANCOUNT
+    response[7] = answer ? 1 : 0;
+    std::memset(&response[8], 0, 4); // NSCOUNT and ARCOUNT
+    if (answer) {
+        std::memcpy(&response[pos], A_ANSWER, sizeof(A_ANSWER));
+    }
+    return (len);
+}
+
+// Create a socket bound to the given address and port.  Sockets of all
+// threads are bound to the same address and port with SO_REUSEPORT, so
+// the kernel distributes queries (or connections) among the threads.
+int
+createSocket(const struct addrinfo& ai, int type, bool reuse_port) {
+    const int fd = socket(ai.ai_family, type, 0);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("socket(2) failed: ") +
+                                 std::strerror(errno));
+    }
+    const int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    if (reuse_port &&
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        const int error = errno;
+        close(fd);
+        throw std::runtime_error(std::string("failed to set SO_REUSEPORT: ") +
+                                 std::strerror(error));
+    }
+#else
+    if (reuse_port) {
+        close(fd);
+        throw std::runtime_error("SO_REUSEPORT is not supported; "
+                                 "use a single thread");
+    }
+#endif
+    if (bind(fd, ai.ai_addr, ai.ai_addrlen) < 0 ||
+        (type == SOCK_STREAM && listen(fd, SOMAXCONN) < 0)) {
+        const int error = errno;
+        close(fd);
+        throw std::runtime_error(std::string("bind/listen failed: ") +
+                                 std::strerror(error));
+    }
+    return (fd);
+}
+
+// Receive queries on a UDP socket and send responses, in batches if
+// possible.
+class UDPResponder {
+public:
+    explicit UDPResponder(int fd) : fd_(fd) {}
+    ~UDPResponder() { close(fd_); }
+    void run();
+
+private:
+    const int fd_;
+};
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+void
+UDPResponder::run() {
+    std::vector<uint8_t> qbuf(UDP_BATCH_SIZE * MAX_UDP_MESSAGE);
+    std::vector<uint8_t> rbuf(UDP_BATCH_SIZE * MAX_UDP_MESSAGE);
+    std::vector<struct sockaddr_storage> addrs(UDP_BATCH_SIZE);
+    std::vector<struct iovec> qiov(UDP_BATCH_SIZE), riov(UDP_BATCH_SIZE);
+    std::vector<struct mmsghdr> qmsgs(UDP_BATCH_SIZE), rmsgs(UDP_BATCH_SIZE);
+
+    for (;;) {
+        for (size_t i = 0; i < UDP_BATCH_SIZE; ++i) {
+            qiov[i].iov_base = &qbuf[i * MAX_UDP_MESSAGE];
+            qiov[i].iov_len = MAX_UDP_MESSAGE;
+            std::memset(&qmsgs[i], 0, sizeof(qmsgs[i]));
+            qmsgs[i].msg_hdr.msg_name = &addrs[i];
+            qmsgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            qmsgs[i].msg_hdr.msg_iov = &qiov[i];
+            qmsgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        // Block for the first message, then take whatever is queued.
+        const int n = recvmmsg(fd_, &qmsgs[0], UDP_BATCH_SIZE,
+                               MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("recvmmsg failed: ") +
+                                     std::strerror(errno));
+        }
+
+        size_t count = 0;
+        for (int i = 0; i < n; ++i) {
+            uint8_t* const response = &rbuf[count * MAX_UDP_MESSAGE];
+            const size_t len = makeResponse(&qbuf[i * MAX_UDP_MESSAGE],
+                                            qmsgs[i].msg_len, response,
+                                            MAX_UDP_MESSAGE);
+            if (len == 0) {
+                continue;
+            }
+            riov[count].iov_base = response;
+            riov[count].iov_len = len;
+            std::memset(&rmsgs[count], 0, sizeof(rmsgs[count]));
+            rmsgs[count].msg_hdr.msg_name = &addrs[i];
+            rmsgs[count].msg_hdr.msg_namelen = qmsgs[i].msg_hdr.msg_namelen;
+            rmsgs[count].msg_hdr.msg_iov = &riov[count];
+            rmsgs[count].msg_hdr.msg_iovlen = 1;
+            ++count;
+        }
+
+        // sendmmsg may send only some of them; if it fails for a message,
+        // the message is dropped, just like a lost response.
+        size_t sent = 0;
+        while (sent < count) {
+            const int m = sendmmsg(fd_, &rmsgs[sent], count - sent, 0);
+            if (m < 0 && errno == EINTR) {
+                continue;
+            }
+            sent += m > 0 ? m : 1;
+        }
+    }
+}
+#else
+void
+UDPResponder::run() {
+    std::vector<uint8_t> qbuf(MAX_UDP_MESSAGE), rbuf(MAX_UDP_MESSAGE);
+    for (;;) {
+        struct sockaddr_storage ss;
+        socklen_t sslen = sizeof(ss);
+        void* p = &ss;
+        const ssize_t n = recvfrom(fd_, &qbuf[0], qbuf.size(), 0,
+                                   static_cast<struct sockaddr*>(p), &sslen);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("recvfrom failed: ") +
+                                     std::strerror(errno));
+        }
+        const size_t len = makeResponse(&qbuf[0], n, &rbuf[0], rbuf.size());
+        if (len > 0) {
+            sendto(fd_, &rbuf[0], len, 0, static_cast<struct sockaddr*>(p),
+                   sslen);
+        }
+    }
+}
+#endif
+
+// Accept TCP connections on a listening socket and serve them in a poll
+// loop.  Each connection can carry any number of queries, which may be
+// pipelined; all complete queries read at once are answered with a single
+// write.  The connection is closed when the client closes it (or shuts
+// down its sending side) and all responses have been written.
+class TCPResponder {
+public:
+    explicit TCPResponder(int fd) : listen_fd_(fd) {}
+    ~TCPResponder();
+    void run();
+
+private:
+    struct Connection {
+        Connection(int fd_param) : fd(fd_param), outpos(0), eof(false) {}
+        int fd;
+        std::vector<uint8_t> inbuf;  // received, not yet complete data
+        std::vector<uint8_t> outbuf; // responses with the length fields
+        size_t outpos;               // beginning of unwritten data
+        bool eof;                    // the client has closed its side
+    };
+
+    void accept();
+
+    // Read and answer queries on the connection.  Return false if the
+    // connection should be closed.
+    bool handleRead(Connection& conn);
+
+    // Write pending responses.  Return false on a write error.
+    bool handleWrite(Connection& conn);
+
+    const int listen_fd_;
+    std::vector<Connection> conns_;
+    std::vector<uint8_t> readbuf_;
+};
+
+TCPResponder::~TCPResponder() {
+    for (size_t i = 0; i < conns_.size(); ++i) {
+        close(conns_[i].fd);
+    }
+    close(listen_fd_);
+}
+
+void
+TCPResponder::accept() {
+    const int fd = ::accept(listen_fd_, NULL, NULL);
+    if (fd >= 0) {
+        // Make it non blocking so a client not reading responses can't
+        // block other connections.
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        conns_.push_back(Connection(fd));
+    } else if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
+        std::cerr << "[Warn] accept failed: " << std::strerror(errno)
+                  << std::endl;
+    }
+}
+
+bool
+TCPResponder::handleRead(Connection& conn) {
+    const ssize_t n = read(conn.fd, &readbuf_[0], readbuf_.size());
+    if (n < 0) {
+        return (errno == EINTR || errno == EAGAIN);
+    }
+    if (n == 0) {
+        conn.eof = true;
+        return (conn.outpos < conn.outbuf.size());
+    }
+    conn.inbuf.insert(conn.inbuf.end(), readbuf_.begin(),
+                      readbuf_.begin() + n);
+
+    // Answer all complete queries.  Queries that get no response are
+    // silently ignored.
+    size_t pos = 0;
+    while (conn.inbuf.size() - pos >= 2) {
+        const size_t qlen = conn.inbuf[pos] * 256 + conn.inbuf[pos + 1];
+        if (conn.inbuf.size() - pos - 2 < qlen) {
+            break;
+        }
+        const size_t outlen = conn.outbuf.size();
+        conn.outbuf.resize(outlen + 2 + MAX_TCP_MESSAGE);
+        const size_t len = makeResponse(&conn.inbuf[pos + 2], qlen,
+                                        &conn.outbuf[outlen + 2],
+                                        MAX_TCP_MESSAGE);
+        conn.outbuf[outlen] = len >> 8;
+        conn.outbuf[outlen + 1] = len & 0xff;
+        conn.outbuf.resize(len > 0 ? outlen + 2 + len : outlen);
+        pos += 2 + qlen;
+    }
+    conn.inbuf.erase(conn.inbuf.begin(), conn.inbuf.begin() + pos);
+    return (handleWrite(conn));
+}
+
+bool
+TCPResponder::handleWrite(Connection& conn) {
+    if (conn.outpos < conn.outbuf.size()) {
+        const ssize_t n = write(conn.fd, &conn.outbuf[conn.outpos],
+                                conn.outbuf.size() - conn.outpos);
+        if (n < 0) {
+            return (errno == EINTR || errno == EAGAIN);
+        }
+        conn.outpos += n;
+    }
+    if (conn.outpos == conn.outbuf.size()) {
+        conn.outbuf.clear();
+        conn.outpos = 0;
+        return (!conn.eof);
+    }
+    return (true);
+}
+
+void
+TCPResponder::run() {
+    readbuf_.resize(MAX_TCP_MESSAGE);
+    std::vector<struct pollfd> pfds;
+    for (;;) {
+        // The first entry is the listening socket, followed by the
+        // connections in the same order as conns_.  We wait for
+        // writability only while some responses couldn't be written.
+        pfds.resize(conns_.size() + 1);
+        pfds[0].fd = listen_fd_;
+        pfds[0].events = POLLIN;
+        for (size_t i = 0; i < conns_.size(); ++i) {
+            pfds[i + 1].fd = conns_[i].fd;
+            pfds[i + 1].events =
+                conns_[i].outpos < conns_[i].outbuf.size() ? POLLOUT : POLLIN;
+        }
+        if (poll(&pfds[0], pfds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("poll failed: ") +
+                                     std::strerror(errno));
+        }
+
+        // Handle the connections first, closing those completed, and then
+        // accept new ones, so the indices of pfds and conns_ match.
+        size_t j = 0;
+        for (size_t i = 0; i < conns_.size(); ++i) {
+            const short revents = pfds[i + 1].revents;
+            bool keep = true;
+            if ((revents & POLLOUT) != 0) {
+                keep = handleWrite(conns_[i]);
+            } else if ((revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+                keep = handleRead(conns_[i]);
+            }
+            if (keep) {
+                if (j != i) {
+                    conns_[j] = conns_[i];
+                }
+                ++j;
+            } else {
+                close(conns_[i].fd);
+            }
+        }
+        conns_.resize(j, Connection(-1));
+        if ((pfds[0].revents & POLLIN) != 0) {
+            accept();
+        }
+    }
+}
+
+void*
+runUDP(void* arg) {
+    UDPResponder* responder = static_cast<UDPResponder*>(arg);
+    try {
+        responder->run();
+    } catch (const std::exception& ex) {
+        std::cerr << "UDP responder thread died unexpectedly: " << ex.what()
+                  << std::endl;
+    }
+    return (NULL);
+}
+
+void*
+runTCP(void* arg) {
+    TCPResponder* responder = static_cast<TCPResponder*>(arg);
+    try {
+        responder->run();
+    } catch (const std::exception& ex) {
+        std::cerr << "TCP responder thread died unexpectedly: " << ex.what()
+                  << std::endl;
+    }
+    return (NULL);
+}
+
+// Start a responder thread, throwing an exception on failure.
+pthread_t
+startThread(void* (*func)(void*), void* arg) {
+    pthread_t th;
+    const int error = pthread_create(&th, NULL, func, arg);
+    if (error != 0) {
+        throw std::runtime_error(
+            std::string("Failed to create a responder thread: ") +
+            std::strerror(error));
+    }
+    return (th);
+}
+
+void
+usage() {
+    std::cerr << "Usage: queryperf-responder [-n #threads] [-p port] "
+              << "[-s address]\n";
+    std::cerr << "  -n sets the number of threads for each of UDP and TCP "
+              << "(default: " << DEFAULT_THREAD_COUNT << ")\n";
+    std::cerr << "  -p sets the port to listen on (default: "
+              << DEFAULT_PORT << ")\n";
+    std::cerr << "  -s sets the address to listen on (default: "
+              << DEFAULT_ADDRESS << ")";
+    std::cerr << std::endl;
+    exit(1);
+}
+}
+
+int
+main(int argc, char* argv[]) {
+    const char* address = DEFAULT_ADDRESS;
+    const char* port_txt = NULL;
+    const char* num_threads_txt = NULL;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "hn:p:s:")) != -1) {
+        switch (ch) {
+        case 'n':
+            num_threads_txt = optarg;
+            break;
+        case 'p':
+            port_txt = optarg;
+            break;
+        case 's':
+            address = optarg;
+            break;
+        case 'h':
+        case '?':
+        default:
+            usage();
+        }
+    }
+
+    // A client closing a connection before reading all responses shouldn't
+    // kill us.
+    signal(SIGPIPE, SIG_IGN);
+
+    try {
+        const size_t num_threads = num_threads_txt == NULL ?
+            DEFAULT_THREAD_COUNT : lexical_cast<size_t>(num_threads_txt);
+        if (num_threads == 0) {
+            std::cerr << "the number of threads must be positive"
+                      << std::endl;
+            return (1);
+        }
+        const std::string port = port_txt == NULL ?
+            lexical_cast<std::string>(DEFAULT_PORT) :
+            lexical_cast<std::string>(lexical_cast<uint16_t>(port_txt));
+
+        struct addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE;
+        struct addrinfo* res;
+        const int error = getaddrinfo(address, port.c_str(), &hints, &res);
+        if (error != 0) {
+            std::cerr << "Invalid address: " << address << ": "
+                      << gai_strerror(error) << std::endl;
+            return (1);
+        }
+
+        // Open all sockets first, so any setup error is detected before
+        // starting the service.
+        std::vector<UDPResponder*> udp_responders;
+        std::vector<TCPResponder*> tcp_responders;
+        const bool reuse_port = num_threads > 1;
+        for (size_t i = 0; i < num_threads; ++i) {
+            udp_responders.push_back(
+                new UDPResponder(createSocket(*res, SOCK_DGRAM, reuse_port)));
+            tcp_responders.push_back(
+                new TCPResponder(createSocket(*res, SOCK_STREAM,
+                                              reuse_port)));
+        }
+        freeaddrinfo(res);
+
+        // If a thread can't be created, the process exits with an error;
+        // those already started terminate with it.
+        std::vector<pthread_t> threads;
+        for (size_t i = 0; i < num_threads; ++i) {
+            threads.push_back(startThread(runUDP, udp_responders[i]));
+            threads.push_back(startThread(runTCP, tcp_responders[i]));
+        }
+        std::cout << "[Status] Responding on " << address << "#" << port
+                  << " with " << num_threads << " thread(s) for each of UDP "
+                  << "and TCP" << std::endl;
+
+        // The threads normally run until the process is terminated.
+        for (size_t i = 0; i < threads.size(); ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        for (size_t i = 0; i < num_threads; ++i) {
+            delete udp_responders[i];
+            delete tcp_responders[i];
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Unexpected failure: " << ex.what() << std::endl;
+        return (1);
+    }
+
+    return (0);
+}
@@ -16,6 +16,7 @@
 
 #include <message_manager.h>
 #include <asio_message_manager.h>
+#include <timer_wheel.h>
 
 #ifdef HAVE_NONBOOST_ASIO
 #include <asio.hpp>
@@ -27,13 +28,23 @@
 #include <boost/bind.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include <memory>
 #include <limits>
 #include <string>
 #include <iostream>
 
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <poll.h>
 
 #ifdef HAVE_NONBOOST_ASIO
 using namespace asio;
@@ -61,32 +72,81 @@ class UDPMessageSocket : public ASIOMessageSocket::ASIOMessageSocketImpl {
 public:
     UDPMessageSocket(io_service& io_service, const std::string& address,
                      uint16_t port, void* recvbuf, size_t recvbuf_len,
-                     MessageSocket::Callback callback);
+                     MessageSocket::Callback callback, bool batched);
     virtual void send(const void* data, size_t datalen);
     virtual void cancel() {     // in our simplified usage, this is enough
+        // Send the queued messages now, and detach the handlers still
+        // pending in the io_service, which may run after we are killed (or
+        // never).
+        flush();
+        *self_ = NULL;
         delete this;
     }
 
     virtual int native() { return (asio_sock_.native()); }
 
 private:
+    // The maximum number of messages sent or received in a single batch.
+    static const size_t BATCH_SIZE = 64;
+    // The size of each send buffer for batching.  Larger messages are sent
+    // immediately (after flushing the queue).
+    static const size_t BATCH_SENDBUF_LEN = 512;
+
     // The handler for ASIO receive operations on this socket.
     void handleRead(const error_code& ec, size_t length);
 
+    // The handlers passed to the io_service may run after we are killed
+    // (e.g., with operation_aborted); they are called via self_, and
+    // ignored once it's reset.
+    typedef boost::shared_ptr<UDPMessageSocket*> SelfPtr;
+    static void readHandler(SelfPtr self, const error_code& ec,
+                            size_t length);
+    static void readableHandler(SelfPtr self, const error_code& ec);
+
+    // Batched versions of send and receive.  Queued messages are flushed
+    // in a handler posted to the io_service, i.e., at the end of the
+    // current event loop iteration.
+    void queue(const void* data, size_t datalen);
+    static void handleFlush(SelfPtr self);
+    void flush();
+    void handleReadable(const error_code& ec);
+    size_t receiveBatch();
+    void startReceive();
+
+    // Wait until the socket becomes writable.
+    void waitWritable();
+
 private:
+    io_service& io_service_;
     ip::udp::socket asio_sock_;
     MessageSocket::Callback callback_;
     bool receiving_;
     void* recvbuf_;
     size_t recvbuf_len_;
+    const bool batched_;
+    bool flush_pending_;
+    // Referred to by the posted flush handler; reset to NULL on cancel.
+    SelfPtr self_;
+    size_t send_count_;
+    std::vector<uint8_t> sendbufs_; // BATCH_SIZE * BATCH_SENDBUF_LEN
+    size_t sendlens_[BATCH_SIZE];
+    std::vector<uint8_t> recvbufs_; // BATCH_SIZE * recvbuf_len_
+    size_t recvlens_[BATCH_SIZE];
 };
 
+const size_t UDPMessageSocket::BATCH_SIZE;
+const size_t UDPMessageSocket::BATCH_SENDBUF_LEN;
+
 UDPMessageSocket::UDPMessageSocket(io_service& io_service,
                                    const std::string& address, uint16_t port,
                                    void* recvbuf, size_t recvbuf_len,
-                                   MessageSocket::Callback callback) :
-    asio_sock_(io_service), callback_(callback), receiving_(false),
-    recvbuf_(recvbuf), recvbuf_len_(recvbuf_len)
+                                   MessageSocket::Callback callback,
+                                   bool batched) :
+    io_service_(io_service), asio_sock_(io_service), callback_(callback),
+    receiving_(false),
+    recvbuf_(recvbuf), recvbuf_len_(recvbuf_len), batched_(batched),
+    flush_pending_(false), self_(new UDPMessageSocket*(this)),
+    send_count_(0)
 {
     try {
         // connect the socket, which implicitly opens a new one.
@@ -100,24 +160,60 @@ UDPMessageSocket::UDPMessageSocket(io_service& io_service,
         throw MessageSocketError(std::string("Failed to create a socket: ") +
                                  e.what());
     }
+    if (batched_) {
+        sendbufs_.resize(BATCH_SIZE * BATCH_SENDBUF_LEN);
+        recvbufs_.resize(BATCH_SIZE * recvbuf_len_);
+    }
 }
 
 void
 UDPMessageSocket::send(const void* data, size_t datalen) {
-    error_code ec;
-    asio_sock_.send(buffer(data, datalen), 0, ec);
-    if (ec) {
-        throw MessageSocketError(
-            std::string("Unexpected failure on socket send: ") + ec.message());
+    if (batched_) {
+        queue(data, datalen);
+    } else {
+        error_code ec;
+        asio_sock_.send(buffer(data, datalen), 0, ec);
+        if (ec) {
+            throw MessageSocketError(
+                std::string("Unexpected failure on socket send: ") +
+                ec.message());
+        }
     }
     if (!receiving_) {
-        asio_sock_.async_receive(buffer(recvbuf_, recvbuf_len_),
-                                 boost::bind(&UDPMessageSocket::handleRead,
-                                             this, _1, _2));
+        startReceive();
         receiving_ = true;
     }
 }
 
+void
+UDPMessageSocket::startReceive() {
+    if (batched_) {
+        asio_sock_.async_receive(null_buffers(),
+                                 boost::bind(&UDPMessageSocket::readableHandler,
+                                             self_, _1));
+    } else {
+        asio_sock_.async_receive(buffer(recvbuf_, recvbuf_len_),
+                                 boost::bind(&UDPMessageSocket::readHandler,
+                                             self_, _1, _2));
+    }
+}
+
+void
+UDPMessageSocket::readHandler(SelfPtr self, const error_code& ec,
+                              size_t length)
+{
+    if (*self != NULL) {
+        (*self)->handleRead(ec, length);
+    }
+}
+
+void
+UDPMessageSocket::readableHandler(SelfPtr self, const error_code& ec) {
+    if (*self != NULL) {
+        (*self)->handleReadable(ec);
+    }
+}
+
 void
 UDPMessageSocket::handleRead(const error_code& ec, size_t length) {
     if (ec) {
@@ -125,9 +221,166 @@ UDPMessageSocket::handleRead(const error_code& ec, size_t length) {
                                  ec.message());
     }
     callback_(MessageSocket::Event(recvbuf_, length));
-    asio_sock_.async_receive(buffer(recvbuf_, recvbuf_len_),
-                             boost::bind(&UDPMessageSocket::handleRead,
-                                         this, _1, _2));
+    startReceive();
+}
+
+void
+UDPMessageSocket::queue(const void* data, size_t datalen) {
+    if (datalen > BATCH_SENDBUF_LEN || send_count_ == BATCH_SIZE) {
+        flush();
+    }
+    if (datalen > BATCH_SENDBUF_LEN) {
+        // Too large for the batch buffer.  This shouldn't happen for normal
+        // queries; simply send it immediately.
+        waitWritable();
+        if (::send(asio_sock_.native(), data, datalen, 0) < 0) {
+            throw MessageSocketError(
+                std::string("Unexpected failure on socket send: ") +
+                std::strerror(errno));
+        }
+        return;
+    }
+
+    // Copy the data, as the caller may reuse its buffer before the flush.
+    std::memcpy(&sendbufs_[send_count_ * BATCH_SENDBUF_LEN], data, datalen);
+    sendlens_[send_count_++] = datalen;
+    if (!flush_pending_) {
+        io_service_.post(
+            boost::bind(&UDPMessageSocket::handleFlush, self_));
+        flush_pending_ = true;
+    }
+}
+
+void
+UDPMessageSocket::handleFlush(SelfPtr self) {
+    UDPMessageSocket* const sock = *self;
+    if (sock != NULL) {
+        sock->flush_pending_ = false;
+        sock->flush();
+    }
+}
+
+void
+UDPMessageSocket::waitWritable() {
+    // ASIO internally makes the socket non blocking once any asynchronous
+    // operation is started on it, so we need to emulate the blocking
+    // behavior of the non batched mode here.
+    struct pollfd pfd;
+    pfd.fd = asio_sock_.native();
+    pfd.events = POLLOUT;
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            throw MessageSocketError(
+                std::string("Unexpected failure on socket poll: ") +
+                std::strerror(errno));
+        }
+    }
+}
+
+void
+UDPMessageSocket::flush() {
+    const int fd = asio_sock_.native();
+    size_t sent = 0;
+    while (sent < send_count_) {
+#ifdef HAVE_SENDMMSG
+        struct mmsghdr msgs[BATCH_SIZE];
+        struct iovec iovs[BATCH_SIZE];
+        const size_t count = send_count_ - sent;
+        std::memset(msgs, 0, sizeof(msgs[0]) * count);
+        for (size_t i = 0; i < count; ++i) {
+            iovs[i].iov_base = &sendbufs_[(sent + i) * BATCH_SENDBUF_LEN];
+            iovs[i].iov_len = sendlens_[sent + i];
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        const int n = sendmmsg(fd, msgs, count, 0);
+#else
+        const int n = ::send(fd, &sendbufs_[sent * BATCH_SENDBUF_LEN],
+                             sendlens_[sent], 0) < 0 ? -1 : 1;
+#endif
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                waitWritable();
+                continue;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            throw MessageSocketError(
+                std::string("Unexpected failure on socket send: ") +
+                std::strerror(errno));
+        }
+        sent += n;
+    }
+    send_count_ = 0;
+}
+
+size_t
+UDPMessageSocket::receiveBatch() {
+    const int fd = asio_sock_.native();
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    std::memset(msgs, 0, sizeof(msgs));
+    for (size_t i = 0; i < BATCH_SIZE; ++i) {
+        iovs[i].iov_base = &recvbufs_[i * recvbuf_len_];
+        iovs[i].iov_len = recvbuf_len_;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n;
+    do {
+        n = recvmmsg(fd, msgs, BATCH_SIZE, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+    for (int i = 0; i < n; ++i) {
+        recvlens_[i] = msgs[i].msg_len;
+    }
+#else
+    int n = 0;
+    while (n < static_cast<int>(BATCH_SIZE)) {
+        const ssize_t cc = recv(fd, &recvbufs_[n * recvbuf_len_],
+                                recvbuf_len_, MSG_DONTWAIT);
+        if (cc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (n == 0) {
+                n = -1;
+            }
+            break;
+        }
+        recvlens_[n++] = cc;
+    }
+#endif
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return (0);
+        }
+        throw MessageSocketError(
+            std::string("unexpected failure on socket read: ") +
+            std::strerror(errno));
+    }
+    return (n);
+}
+
+void
+UDPMessageSocket::handleReadable(const error_code& ec) {
+    if (ec) {
+        throw MessageSocketError("unexpected failure on socket read: " +
+                                 ec.message());
+    }
+
+    // Drain the socket, delivering each batch of received messages in
+    // order.  Responses to the callback may queue new queries; they'll be
+    // flushed together once we return to the event loop.
+    size_t count;
+    do {
+        count = receiveBatch();
+        for (size_t i = 0; i < count; ++i) {
+            callback_(MessageSocket::Event(&recvbufs_[i * recvbuf_len_],
+                                           recvlens_[i]));
+        }
+    } while (count == BATCH_SIZE);
+    startReceive();
 }
 
 class TCPMessageSocket : public ASIOMessageSocket::ASIOMessageSocketImpl {
@@ -135,7 +388,7 @@ public:
     TCPMessageSocket(io_service& io_service, const std::string& address,
                      uint16_t port, void* recvbuf,
                      MessageSocket::Callback callback);
-    ~TCPMessageSocket() { delete aux_recvbuf_; }
+    ~TCPMessageSocket() { delete[] aux_recvbuf_; }
     virtual void send(const void* data, size_t datalen);
     virtual void cancel();
     virtual int native() { return (asio_sock_.native()); }
@@ -158,7 +411,12 @@ private:
 
     void sendCallback(const void* callback_data, size_t data_len) {
         completed_ = true;
-        callback_(MessageSocket::Event(callback_data, data_len));
+        callback_(MessageSocket::Event(callback_data, data_len, &transfer_));
+    }
+
+    // The buffer for the message being read.
+    void* getReadBuffer() {
+        return (recvdata_len_ == 0 ? recvbuf_ : aux_recvbuf_);
     }
 
 private:
@@ -170,6 +428,7 @@ private:
     void* recvbuf_;       // for the first message (must be of > 64KB)
     size_t recvdata_len_; // actual message length of the first message
     uint8_t* aux_recvbuf_; // placeholder for subsequent messages
+    MessageSocket::TransferInfo transfer_; // summary of all messages
     uint8_t msglen_placeholder_[2];
     boost::array<const_buffer, 2> sendbufs_;
     bool cancelled_;
@@ -249,10 +508,9 @@ TCPMessageSocket::handleWrite(const error_code& ec, size_t) {
     }
 
     // Then wait for the response.
-    asio_sock_.async_receive(buffer(msglen_placeholder_,
-                                    sizeof(msglen_placeholder_)),
-                             boost::bind(&TCPMessageSocket::handleReadLength,
-                                         this, _1, _2));
+    async_read(asio_sock_, buffer(msglen_placeholder_,
+                                  sizeof(msglen_placeholder_)),
+               boost::bind(&TCPMessageSocket::handleReadLength, this, _1, _2));
 }
 
 void
@@ -260,6 +518,7 @@ TCPMessageSocket::handleReadLength(const error_code& ec, size_t length) {
     if (cancelCheck(ec)) {
         return;
     }
+    transfer_.addBytes(length);
     if (ec == error::eof) {
         // We've received all messages.  Note that this includes the case
         // where the server closes the connection without sending any message
@@ -273,24 +532,16 @@ TCPMessageSocket::handleReadLength(const error_code& ec, size_t length) {
         sendCallback(NULL, 0);
         return;
     }
-    if (length != sizeof(msglen_placeholder_)) {
-        throw MessageSocketError("received unexpected size of data for "
-                                 "msglen: " +
-                                 lexical_cast<std::string>(length));
-    }
     const uint16_t msglen = msglen_placeholder_[0] * 256 +
         msglen_placeholder_[1];
     // Now we are going to receive the main message.  We keep the first
-    // message in recvbuf_ for callback, and hold others in the aux
-    // buffer only temporarily.
-    if (recvdata_len_ > 0) {
+    // message in recvbuf_ for callback, and read others into the aux
+    // buffer, which is allocated only once and reused for all of them.
+    if (recvdata_len_ > 0 && aux_recvbuf_ == NULL) {
         aux_recvbuf_ = new uint8_t[std::numeric_limits<uint16_t>::max()];
     }
-    asio_sock_.async_receive(buffer(
-                                 recvdata_len_ == 0 ? recvbuf_ : aux_recvbuf_,
-                                 msglen),
-                             boost::bind(&TCPMessageSocket::handleReadData,
-                                         this, _1, _2));
+    async_read(asio_sock_, buffer(getReadBuffer(), msglen),
+               boost::bind(&TCPMessageSocket::handleReadData, this, _1, _2));
 }
 
 void
@@ -298,6 +549,8 @@ TCPMessageSocket::handleReadData(const error_code& ec, size_t length) {
     if (cancelCheck(ec)) {
         return;
     }
+    transfer_.addBytes(length);
+    transfer_.addData(0, getReadBuffer(), length);
     if (ec == error::eof) {
         // We've received all messages.  This is an unexpected connection
         // termination by the server.  Do the callback with what we've had
@@ -311,19 +564,283 @@ TCPMessageSocket::handleReadData(const error_code& ec, size_t length) {
         sendCallback(NULL, recvdata_len_);
         return;
     }
+    transfer_.addMessage();
     // If this is the first message, remember its length.
     if (recvdata_len_ == 0) {
         recvdata_len_ = length;
     }
 
-    // There may be more messages, like in the case for AXFR or large IX FR
-    // For now, we'll simply read and discard any subsequent message until
-    // the server closes the connection, at which point we return the control
-    // to the original caller with a callback.
-    asio_sock_.async_receive(buffer(msglen_placeholder_,
-                                    sizeof(msglen_placeholder_)),
-                             boost::bind(&TCPMessageSocket::handleReadLength,
-                                         this, _1, _2));
+    // There may be more messages, like in the case for AXFR or large IXFR.
+    // We'll read and count any subsequent message until the server closes
+    // the connection, at which point we return the control to the original
+    // caller with a callback.
+    async_read(asio_sock_, buffer(msglen_placeholder_,
+                                  sizeof(msglen_placeholder_)),
+               boost::bind(&TCPMessageSocket::handleReadLength, this, _1, _2));
+}
+
+// A persistent TCP connection that can carry any number of messages in
+// both directions (see MessageManager::createStreamMessageSocket()).
+//
+// Since the connection can be closed and reopened while some handlers of
+// the previous connection are still pending, each connection is identified
+// by a generation number, which is passed to the handlers; the handlers of
+// an older generation are simply ignored.  Likewise, on cancel() the object
+// isn't deleted until all pending handlers are called.
+class StreamMessageSocket : public ASIOMessageSocket::ASIOMessageSocketImpl {
+public:
+    StreamMessageSocket(io_service& io_service, const std::string& address,
+                        uint16_t port, MessageSocket::Callback callback);
+    virtual void send(const void* data, size_t datalen);
+    virtual void cancel();
+    virtual int native() { return (asio_sock_.native()); }
+
+private:
+    // The size of the receive buffer.  It must be larger than the maximum
+    // size of a DNS message with the length field, so a partial message
+    // at the beginning of the buffer can always be completed.
+    static const size_t RECVBUF_LEN = 131072;
+
+    void connect();
+    void startWrite();
+    void startRead();
+    void handleConnect(const error_code& ec, uint32_t generation);
+    void handleFlush();
+    void handleWrite(const error_code& ec, uint32_t generation);
+    void handleRead(const error_code& ec, size_t length, uint32_t generation);
+
+    // Common preprocessing of handlers.  It returns true if the handler
+    // shouldn't do anything further, i.e., the socket has been cancelled
+    // (in which case it may have been deleted) or the event is for an
+    // older connection.
+    bool handlerCheck(uint32_t generation) {
+        --pending_handlers_;
+        if (cancelled_) {
+            if (pending_handlers_ == 0) {
+                delete this;
+            }
+            return (true);
+        }
+        return (generation != generation_);
+    }
+
+    // Call the callback, and return true if the socket has been cancelled
+    // in it; it may have been deleted in that case.
+    bool doCallback(const void* data, size_t datalen) {
+        in_callback_ = true;
+        callback_(MessageSocket::Event(data, datalen));
+        in_callback_ = false;
+        if (cancelled_) {
+            if (pending_handlers_ == 0) {
+                delete this;
+            }
+            return (true);
+        }
+        return (false);
+    }
+
+    // Close the current connection and tell the caller about it.  If
+    // \c what isn't NULL, it's an unexpected error and is logged.
+    // It returns the result of doCallback().
+    bool terminate(const char* what, const error_code& ec);
+
+private:
+    io_service& io_service_;
+    ip::tcp::socket asio_sock_;
+    const ip::tcp::endpoint dest_;
+    MessageSocket::Callback callback_;
+    enum { CLOSED, CONNECTING, CONNECTED } state_;
+    uint32_t generation_;       // incremented on each close
+    size_t pending_handlers_;
+    bool cancelled_;
+    bool in_callback_;
+    bool writing_;
+    bool flush_pending_;
+    std::vector<uint8_t> sendbuf_;  // queued messages not yet being written
+    std::vector<uint8_t> writebuf_; // messages being written
+    std::vector<uint8_t> recvbuf_;  // RECVBUF_LEN bytes
+    size_t recvdata_len_;           // received data not yet processed
+};
+
+const size_t StreamMessageSocket::RECVBUF_LEN;
+
+StreamMessageSocket::StreamMessageSocket(io_service& io_service,
+                                         const std::string& address,
+                                         uint16_t port,
+                                         MessageSocket::Callback callback) :
+    io_service_(io_service), asio_sock_(io_service),
+    dest_(ip::address::from_string(address), port),
+    callback_(callback), state_(CLOSED), generation_(0),
+    pending_handlers_(0), cancelled_(false), in_callback_(false),
+    writing_(false), flush_pending_(false),
+    recvbuf_(RECVBUF_LEN), recvdata_len_(0)
+{
+    // Note: we don't even open the socket yet.
+}
+
+void
+StreamMessageSocket::send(const void* data, size_t datalen) {
+    if (state_ == CLOSED) {
+        connect();
+    }
+    sendbuf_.push_back(datalen >> 8);
+    sendbuf_.push_back(datalen & 0x00ff);
+    const uint8_t* const cp = static_cast<const uint8_t*>(data);
+    sendbuf_.insert(sendbuf_.end(), cp, cp + datalen);
+
+    // Messages queued in the current iteration of the event loop will be
+    // written at once.
+    if (state_ == CONNECTED && !writing_ && !flush_pending_) {
+        ++pending_handlers_;
+        flush_pending_ = true;
+        io_service_.post(boost::bind(&StreamMessageSocket::handleFlush,
+                                     this));
+    }
+}
+
+void
+StreamMessageSocket::cancel() {
+    cancelled_ = true;
+    if (asio_sock_.is_open()) {
+        error_code ec;
+        asio_sock_.close(ec);
+    }
+    if (pending_handlers_ == 0 && !in_callback_) {
+        delete this;
+    }
+}
+
+void
+StreamMessageSocket::connect() {
+    state_ = CONNECTING;
+    ++pending_handlers_;
+    asio_sock_.async_connect(dest_,
+                             boost::bind(&StreamMessageSocket::handleConnect,
+                                         this, _1, generation_));
+}
+
+void
+StreamMessageSocket::startWrite() {
+    writebuf_.swap(sendbuf_);
+    sendbuf_.clear();
+    writing_ = true;
+    ++pending_handlers_;
+    async_write(asio_sock_, buffer(writebuf_),
+                boost::bind(&StreamMessageSocket::handleWrite, this, _1,
+                            generation_));
+}
+
+void
+StreamMessageSocket::startRead() {
+    ++pending_handlers_;
+    asio_sock_.async_receive(buffer(&recvbuf_[recvdata_len_],
+                                    RECVBUF_LEN - recvdata_len_),
+                             boost::bind(&StreamMessageSocket::handleRead,
+                                         this, _1, _2, generation_));
+}
+
+void
+StreamMessageSocket::handleConnect(const error_code& ec,
+                                   uint32_t generation)
+{
+    if (handlerCheck(generation)) {
+        return;
+    }
+    if (ec) {
+        terminate("TCP connect failed", ec);
+        return;
+    }
+    state_ = CONNECTED;
+
+    // Queries are generally small and sent without waiting for responses
+    // to previous ones, so we don't want them to be delayed.
+    error_code ignored;
+    asio_sock_.set_option(ip::tcp::no_delay(true), ignored);
+
+    startRead();
+    if (!sendbuf_.empty()) {
+        startWrite();
+    }
+}
+
+void
+StreamMessageSocket::handleFlush() {
+    flush_pending_ = false;
+    if (handlerCheck(generation_)) {
+        return;
+    }
+    if (state_ == CONNECTED && !writing_ && !sendbuf_.empty()) {
+        startWrite();
+    }
+}
+
+void
+StreamMessageSocket::handleWrite(const error_code& ec, uint32_t generation) {
+    if (handlerCheck(generation)) {
+        return;
+    }
+    writing_ = false;
+    if (ec) {
+        terminate("TCP send failed", ec);
+        return;
+    }
+    if (!sendbuf_.empty()) {
+        startWrite();
+    }
+}
+
+void
+StreamMessageSocket::handleRead(const error_code& ec, size_t length,
+                                uint32_t generation)
+{
+    if (handlerCheck(generation)) {
+        return;
+    }
+    if (ec == error::eof) {
+        // The server closed the connection.  This is a normal event (e.g.,
+        // due to idle timeout), so we don't log it.
+        terminate(NULL, ec);
+        return;
+    }
+    if (ec) {
+        terminate("failed to read TCP message", ec);
+        return;
+    }
+
+    // Deliver all complete messages, then move the remaining partial
+    // message, if any, to the beginning of the buffer.
+    recvdata_len_ += length;
+    size_t offset = 0;
+    while (recvdata_len_ - offset >= 2) {
+        const size_t msglen = recvbuf_[offset] * 256 + recvbuf_[offset + 1];
+        if (recvdata_len_ - offset < msglen + 2) {
+            break;
+        }
+        if (doCallback(&recvbuf_[offset + 2], msglen)) {
+            return;
+        }
+        offset += msglen + 2;
+    }
+    if (offset > 0) {
+        std::memmove(&recvbuf_[0], &recvbuf_[offset], recvdata_len_ - offset);
+        recvdata_len_ -= offset;
+    }
+    startRead();
+}
+
+bool
+StreamMessageSocket::terminate(const char* what, const error_code& ec) {
+    if (what != NULL) {
+        std::cerr << "[Warn] " << what << ": " << ec.message() << std::endl;
+    }
+    error_code ignored;
+    asio_sock_.close(ignored);
+    state_ = CLOSED;
+    ++generation_;
+    writing_ = false;
+    sendbuf_.clear();
+    recvdata_len_ = 0;
+    return (doCallback(NULL, 0));
 }
 } // end of unnamed namespace
 
@@ -345,11 +862,17 @@ ASIOMessageSocket::native() {
 }
 
 struct ASIOMessageManager::ASIOMessageManagerImpl {
+    ASIOMessageManagerImpl(bool batch_udp) : batch_udp_(batch_udp) {}
+
     io_service io_service_;
+    const bool batch_udp_;
+    // Placed after io_service_ so it'll be destroyed first.  Created on the
+    // first use.
+    boost::scoped_ptr<TimerWheel> timer_wheel_;
 };
 
-ASIOMessageManager::ASIOMessageManager() :
-    impl_(new ASIOMessageManagerImpl)
+ASIOMessageManager::ASIOMessageManager(bool batch_udp) :
+    impl_(new ASIOMessageManagerImpl(batch_udp))
 {}
 
 ASIOMessageManager::~ASIOMessageManager() {
@@ -370,7 +893,8 @@ ASIOMessageManager::createMessageSocket(int proto, const std::string& address,
     if (proto == IPPROTO_UDP) {
         std::auto_ptr<UDPMessageSocket> impl_p(
             new UDPMessageSocket(impl_->io_service_, address, port,
-                                 recvbuf, recvbuf_len, callback));
+                                 recvbuf, recvbuf_len, callback,
+                                 impl_->batch_udp_));
         ret = new ASIOMessageSocket(impl_p.get());
         impl_p.release();
         return (ret);
@@ -389,6 +913,21 @@ ASIOMessageManager::createMessageSocket(int proto, const std::string& address,
                              lexical_cast<std::string>(proto));
 }
 
+MessageSocket*
+ASIOMessageManager::createStreamMessageSocket(const std::string& address,
+                                              uint16_t port,
+                                              MessageSocket::Callback callback)
+{
+    if (!callback) {
+        throw MessageSocketError("null socket callback specified");
+    }
+    std::auto_ptr<StreamMessageSocket> impl_p(
+        new StreamMessageSocket(impl_->io_service_, address, port, callback));
+    MessageSocket* ret = new ASIOMessageSocket(impl_p.get());
+    impl_p.release();
+    return (ret);
+}
+
 class ASIOMessageTimer : public MessageTimer {
 public:
     ASIOMessageTimer(io_service& io_service, Callback callback) :
@@ -433,6 +972,14 @@ ASIOMessageManager::createMessageTimer(MessageTimer::Callback callback) {
     return (new ASIOMessageTimer(impl_->io_service_, callback));
 }
 
+MessageTimer*
+ASIOMessageManager::createCoarseMessageTimer(MessageTimer::Callback callback) {
+    if (!impl_->timer_wheel_) {
+        impl_->timer_wheel_.reset(new TimerWheel(*this));
+    }
+    return (impl_->timer_wheel_->createTimer(callback));
+}
+
 void
 ASIOMessageManager::run() {
     impl_->io_service_.run();
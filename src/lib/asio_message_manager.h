@@ -46,7 +46,17 @@ public:
 
 class ASIOMessageManager : public MessageManager {
 public:
-    ASIOMessageManager();
+    /// \brief Constructor.
+    ///
+    /// If \c batch_udp is true, UDP sockets created by this manager work in
+    /// the batched mode: \c send() only queues the message, and all messages
+    /// queued in one iteration of the event loop are sent together (with
+    /// \c sendmmsg() if available) when the control returns to the loop.
+    /// Likewise, available responses are received together (with
+    /// \c recvmmsg() if available) and passed to the callback one by one.
+    /// This reduces the number of system calls per message, but the
+    /// message isn't sent until \c run() is called.
+    explicit ASIOMessageManager(bool batch_udp = false);
 
     virtual ~ASIOMessageManager();
 
@@ -55,8 +65,27 @@ public:
         void* recvbuf, size_t recvbuf_len,
         MessageSocket::Callback callback);
 
+    /// \brief Create a socket for a persistent TCP connection.
+    ///
+    /// Messages queued by \c send() in one iteration of the event loop are
+    /// written together with a single asynchronous write.  Responses are
+    /// read in chunks of up to 128KB, so the callback may be called for
+    /// multiple messages for a single read.
+    virtual MessageSocket* createStreamMessageSocket(
+        const std::string& address, uint16_t port,
+        MessageSocket::Callback callback);
+
     virtual MessageTimer* createMessageTimer(MessageTimer::Callback callback);
 
+    /// \brief Create a coarse timer.
+    ///
+    /// This implementation manages coarse timers in a \c TimerWheel with
+    /// the default tick interval, so a coarse timer may expire up to 10ms
+    /// later than specified.  All coarse timers created by this manager
+    /// must be destroyed before the manager.
+    virtual MessageTimer* createCoarseMessageTimer(
+        MessageTimer::Callback callback);
+
     virtual void run();
 
     virtual void stop();
@@ -0,0 +1,129 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <compiled_query_set.h>
+#include <query_repository.h>
+
+#include <cstring>
+#include <string>
+
+#include <netinet/in.h>
+
+namespace Queryperf {
+
+namespace {
+const char MAGIC[8] = { 'Q', 'P', 'P', 'Q', 'S', 'E', 'T', '\0' };
+
+// The minimum length of a DNS message (header only).
+const size_t MIN_QUERY_LEN = 12;
+
+uint64_t
+readUint64(const uint8_t* cp) {
+    uint64_t val = 0;
+    for (int i = 0; i < 8; ++i) {
+        val = (val << 8) | cp[i];
+    }
+    return (val);
+}
+
+uint32_t
+readUint32(const uint8_t* cp) {
+    return ((static_cast<uint32_t>(cp[0]) << 24) | (cp[1] << 16) |
+            (cp[2] << 8) | cp[3]);
+}
+
+void
+writeUint(std::ostream& os, uint64_t val, int len) {
+    char buf[8];
+    for (int i = len - 1; i >= 0; --i) {
+        buf[i] = val & 0xff;
+        val >>= 8;
+    }
+    os.write(buf, len);
+}
+}
+
+const size_t CompiledQuerySet::HEADER_SIZE;
+const size_t CompiledQuerySet::INDEX_ENTRY_SIZE;
+const uint32_t CompiledQuerySet::VERSION;
+const uint8_t CompiledQuerySet::FLAG_EDNS;
+const uint8_t CompiledQuerySet::FLAG_DNSSEC;
+
+bool
+CompiledQuerySet::isCompiled(const void* data, size_t len) {
+    return (len >= sizeof(MAGIC) &&
+            std::memcmp(data, MAGIC, sizeof(MAGIC)) == 0);
+}
+
+CompiledQuerySet::CompiledQuerySet(const void* data, size_t len) {
+    if (!isCompiled(data, len) || len < HEADER_SIZE) {
+        throw QueryRepositoryError("not a compiled query set");
+    }
+    const uint8_t* const cp = static_cast<const uint8_t*>(data);
+    const uint32_t version = readUint32(cp + 8);
+    if (version != VERSION) {
+        throw QueryRepositoryError("unsupported compiled query set version");
+    }
+    const uint64_t count = readUint64(cp + 16);
+    data_size_ = readUint64(cp + 24);
+
+    // Check the overall size (carefully, to avoid overflow).
+    const uint64_t body_len = len - HEADER_SIZE;
+    if (count > body_len / INDEX_ENTRY_SIZE ||
+        data_size_ > body_len - count * INDEX_ENTRY_SIZE) {
+        throw QueryRepositoryError("truncated compiled query set");
+    }
+    count_ = count;
+    index_ = cp + HEADER_SIZE;
+    data_ = index_ + count * INDEX_ENTRY_SIZE;
+}
+
+const uint8_t*
+CompiledQuerySet::getQuery(size_t index, size_t& len, int& protocol) const {
+    const uint8_t* const entry = index_ + index * INDEX_ENTRY_SIZE;
+    const uint64_t offset = readUint64(entry);
+    len = (entry[8] << 8) | entry[9];
+    protocol = entry[10];
+    if (len < MIN_QUERY_LEN || offset > data_size_ ||
+        len > data_size_ - offset ||
+        (protocol != IPPROTO_UDP && protocol != IPPROTO_TCP)) {
+        throw QueryRepositoryError("broken index entry in compiled query set");
+    }
+    return (data_ + offset);
+}
+
+void
+CompiledQuerySet::writeHeader(std::ostream& os, uint64_t count,
+                              uint64_t data_size)
+{
+    os.write(MAGIC, sizeof(MAGIC));
+    writeUint(os, VERSION, 4);
+    writeUint(os, 0, 4);        // reserved
+    writeUint(os, count, 8);
+    writeUint(os, data_size, 8);
+}
+
+void
+CompiledQuerySet::writeIndexEntry(std::ostream& os, uint64_t offset,
+                                  uint16_t len, int protocol, uint8_t flags)
+{
+    writeUint(os, offset, 8);
+    writeUint(os, len, 2);
+    writeUint(os, protocol, 1);
+    writeUint(os, flags, 1);
+    writeUint(os, 0, 4);        // reserved
+}
+
+} // end of QueryPerf
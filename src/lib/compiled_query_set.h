@@ -0,0 +1,109 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#ifndef __QUERYPERF_COMPILED_QUERY_SET_H
+#define __QUERYPERF_COMPILED_QUERY_SET_H 1
+
+#include <boost/noncopyable.hpp>
+
+#include <ostream>
+
+#include <sys/types.h>
+#include <stdint.h>
+
+namespace Queryperf {
+
+/// \brief Read-only access to a compiled query set.
+///
+/// A compiled query set is a binary file containing queries that have
+/// been validated and rendered in wire format, so they can be used
+/// directly from a memory mapped image without parsing.  It consists of
+/// the following three parts; all integers are in network byte order.
+///
+/// - Header (32 bytes): magic string "QPPQSET\0" (8 bytes), version (32
+///   bits, currently 1), reserved (32 bits), number of queries (64 bits),
+///   and the size of the data part (64 bits).
+/// - Index: an entry of 16 bytes for each query: the offset of the query
+///   in the data part (64 bits), its length (16 bits), the transport
+///   protocol (8 bits, IPPROTO_UDP or IPPROTO_TCP), flags (8 bits, see
+///   \c FLAG_xxx), and reserved (32 bits).
+/// - Data: rendered queries, with the QID of 0.
+///
+/// This class doesn't own the data; the caller must keep the data valid
+/// while it's used.
+class CompiledQuerySet : private boost::noncopyable {
+public:
+    static const size_t HEADER_SIZE = 32;
+    static const size_t INDEX_ENTRY_SIZE = 16;
+    static const uint32_t VERSION = 1;
+
+    /// \brief Flag indicating the query has EDNS.
+    static const uint8_t FLAG_EDNS = 0x01;
+    /// \brief Flag indicating the query has the EDNS DO bit set.
+    static const uint8_t FLAG_DNSSEC = 0x02;
+
+    /// \brief Return whether the data begins with the magic string.
+    static bool isCompiled(const void* data, size_t len);
+
+    /// \brief Constructor.
+    ///
+    /// It only validates the header; each index entry is validated when
+    /// it's used.
+    ///
+    /// \throw QueryRepositoryError The data is not a valid compiled query
+    /// set.
+    CompiledQuerySet(const void* data, size_t len);
+
+    /// \brief Return the number of queries.
+    size_t getCount() const { return (count_); }
+
+    /// \brief Return the query of the given index.
+    ///
+    /// \throw QueryRepositoryError The index entry is broken.
+    ///
+    /// \param index The index of the query; must be less than the count.
+    /// \param len Set to the length of the query.
+    /// \param protocol Set to the transport protocol of the query.
+    /// \return A pointer to the query data.
+    const uint8_t* getQuery(size_t index, size_t& len, int& protocol) const;
+
+    /// \brief Return the flags (\c FLAG_xxx) of the query of the given
+    /// index.
+    uint8_t getFlags(size_t index) const {
+        return (index_[index * INDEX_ENTRY_SIZE + 11]);
+    }
+
+    /// \brief Write the header of a compiled query set.
+    static void writeHeader(std::ostream& os, uint64_t count,
+                            uint64_t data_size);
+
+    /// \brief Write an index entry of a compiled query set.
+    static void writeIndexEntry(std::ostream& os, uint64_t offset,
+                                uint16_t len, int protocol, uint8_t flags);
+
+private:
+    const uint8_t* index_;
+    const uint8_t* data_;
+    size_t count_;
+    uint64_t data_size_;
+};
+
+} // end of QueryPerf
+
+#endif // __QUERYPERF_COMPILED_QUERY_SET_H
+
+// Local Variables:
+// mode: c++
+// End:
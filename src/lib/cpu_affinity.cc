@@ -0,0 +1,135 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <config.h>
+
+#include <cpu_affinity.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include <cstring>
+#include <fstream>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+using namespace std;
+using boost::lexical_cast;
+
+namespace Queryperf {
+
+namespace {
+unsigned int
+parseCPU(const string& cpu, const string& list) {
+    if (cpu.empty() ||
+        cpu.find_first_not_of("0123456789") != string::npos) {
+        throw CPUAffinityError("invalid CPU list: " + list);
+    }
+    try {
+        return (lexical_cast<unsigned int>(cpu));
+    } catch (const boost::bad_lexical_cast&) {
+        throw CPUAffinityError("invalid CPU list: " + list);
+    }
+}
+}
+
+vector<unsigned int>
+parseCPUList(const string& list) {
+    vector<unsigned int> cpus;
+    string::size_type pos = 0;
+    while (true) {
+        const string::size_type end = list.find(',', pos);
+        const string item = list.substr(pos, end == string::npos ?
+                                        string::npos : end - pos);
+        const string::size_type dash = item.find('-');
+        if (dash == string::npos) {
+            cpus.push_back(parseCPU(item, list));
+        } else {
+            const unsigned int from = parseCPU(item.substr(0, dash), list);
+            const unsigned int to = parseCPU(item.substr(dash + 1), list);
+            if (from > to) {
+                throw CPUAffinityError("invalid CPU range: " + item);
+            }
+            for (unsigned int cpu = from; cpu <= to; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        if (end == string::npos) {
+            break;
+        }
+        pos = end + 1;
+    }
+    return (cpus);
+}
+
+vector<unsigned int>
+getInterfaceCPUs(const string& ifname) {
+    const string path = "/sys/class/net/" + ifname + "/device/local_cpulist";
+    ifstream ifs(path.c_str());
+    string list;
+    if (!ifs || !getline(ifs, list)) {
+        throw CPUAffinityError("failed to get CPUs of interface " + ifname +
+                               " from " + path);
+    }
+    return (parseCPUList(list));
+}
+
+unsigned int
+getCPUNode(unsigned int cpu) {
+    const string path = "/sys/devices/system/cpu/cpu" +
+        lexical_cast<string>(cpu);
+    DIR* dir = opendir(path.c_str());
+    if (dir == NULL) {
+        return (0);
+    }
+    unsigned int node = 0;
+    const struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const string name = entry->d_name;
+        if (name.size() > 4 && name.compare(0, 4, "node") == 0 &&
+            name.find_first_not_of("0123456789", 4) == string::npos) {
+            node = lexical_cast<unsigned int>(name.substr(4));
+            break;
+        }
+    }
+    closedir(dir);
+    return (node);
+}
+
+void
+setThreadAffinity(unsigned int cpu) {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    if (cpu >= CPU_SETSIZE) {
+        throw CPUAffinityError("CPU number too large: " +
+                               lexical_cast<string>(cpu));
+    }
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    const int error = pthread_setaffinity_np(pthread_self(), sizeof(cpuset),
+                                             &cpuset);
+    if (error != 0) {
+        throw CPUAffinityError("failed to pin thread to CPU " +
+                               lexical_cast<string>(cpu) + ": " +
+                               strerror(error));
+    }
+#else
+    throw CPUAffinityError("CPU affinity is not supported on this system "
+                           "(CPU " + lexical_cast<string>(cpu) + ")");
+#endif
+}
+
+} // end of QueryPerf
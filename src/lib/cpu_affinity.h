@@ -0,0 +1,76 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#ifndef __QUERYPERF_CPU_AFFINITY_H
+#define __QUERYPERF_CPU_AFFINITY_H 1
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Queryperf {
+
+/// \brief Exception class thrown on an error of CPU affinity.
+class CPUAffinityError : public std::runtime_error {
+public:
+    explicit CPUAffinityError(const std::string& what_arg) :
+        std::runtime_error(what_arg)
+    {}
+};
+
+/// \brief Parse a list of CPUs.
+///
+/// The list is in the form used by Linux (e.g., in sysfs and by
+/// \c taskset), i.e., comma-separated CPU numbers or ranges of them,
+/// such as "0-3,8,10-11".  The CPUs are returned in the order they
+/// appear; duplicates are kept.
+///
+/// \throw CPUAffinityError \c list is empty or malformed.
+std::vector<unsigned int> parseCPUList(const std::string& list);
+
+/// \brief Return the CPUs local to a network interface.
+///
+/// These are the CPUs on the NUMA node the interface device is attached
+/// to, which normally also handle its interrupts.  They're taken from
+/// sysfs (/sys/class/net/<ifname>/device/local_cpulist).
+///
+/// \throw CPUAffinityError The list cannot be read, e.g., the interface
+/// doesn't exist or is a virtual one.
+std::vector<unsigned int> getInterfaceCPUs(const std::string& ifname);
+
+/// \brief Return the NUMA node of the given CPU.
+///
+/// It's taken from sysfs (the node<N> entry of
+/// /sys/devices/system/cpu/cpu<cpu>).  It returns 0 if it's unknown,
+/// e.g., on a system without NUMA support, so all such CPUs are considered
+/// to be on the same node.
+unsigned int getCPUNode(unsigned int cpu);
+
+/// \brief Pin the calling thread to the given CPU.
+///
+/// Memory the thread allocates and touches first afterwards will then be
+/// placed on the NUMA node of the CPU under the default memory policy.
+///
+/// \throw CPUAffinityError The CPU is invalid, or pinning is not
+/// supported on this system.
+void setThreadAffinity(unsigned int cpu);
+
+} // end of QueryPerf
+
+#endif // __QUERYPERF_CPU_AFFINITY_H
+
+// Local Variables:
+// mode: c++
+// End:
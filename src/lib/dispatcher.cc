@@ -15,8 +15,17 @@
 #include <query_context.h>
 #include <query_repository.h>
 #include <dispatcher.h>
+#include <cpu_affinity.h>
 #include <message_manager.h>
 #include <asio_message_manager.h>
+#include <epoll_message_manager.h>
+#include <io_uring_message_manager.h>
+#include <standalone_message_manager.h>
+#include <latency_histogram.h>
+#include <live_statistics.h>
+#include <resource_usage.h>
+#include <transfer_statistics.h>
+#include <sustained_rate.h>
 
 #include <util/buffer.h>
 
@@ -30,13 +39,19 @@
 #include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include <algorithm>
 #include <istream>
 #include <cassert>
-#include <list>
+#include <cctype>
+#include <cstring>
+#include <map>
+#include <utility>
+#include <vector>
 
 #include <netinet/in.h>
+#include <pthread.h>
 
 using namespace std;
 using namespace bundy::util;
@@ -48,14 +63,18 @@ using boost::posix_time::seconds;
 
 namespace {
 class QueryEvent {
-    typedef boost::function<void(qid_t, const Message*)> RestartCallback;
+    typedef boost::function<void(qid_t, uint32_t, const Message*)>
+    RestartCallback;
 public:
     QueryEvent(MessageManager& mgr, qid_t qid, QueryContext* ctx,
                RestartCallback restart_callback) :
-        ctx_(ctx), qid_(qid), restart_callback_(restart_callback),
-        timer_(mgr.createMessageTimer(
+        ctx_(ctx), qid_(qid), generation_(0),
+        restart_callback_(restart_callback),
+        timer_(mgr.createCoarseMessageTimer(
                    boost::bind(&QueryEvent::queryTimerCallback, this))),
-        tcp_sock_(NULL), tcp_rcvbuf_(NULL)
+        tcp_sock_(NULL), tcp_rcvbuf_(NULL), stream_(NO_STREAM),
+        transfer_(false), measured_(false), query_data_(NULL),
+        query_len_(0)
     {}
 
     ~QueryEvent() {
@@ -64,13 +83,22 @@ public:
         delete[] tcp_rcvbuf_;
     }
 
-    QueryContext::QuerySpec start(qid_t qid, const time_duration& timeout) {
+    QueryContext::QuerySpec start(qid_t qid, uint32_t generation,
+                                  const time_duration& timeout)
+    {
         assert(ctx_ != NULL);
         qid_ = qid;
+        generation_ = generation;
         timer_->start(timeout);
         return (ctx_->start(qid_));
     }
 
+    // Stop the query timer; used when the query completes and won't be
+    // restarted.
+    void stop() {
+        timer_->cancel();
+    }
+
     void* getTCPBuf() {
         if (tcp_rcvbuf_ == NULL) {
             tcp_rcvbuf_ = new uint8_t[TCP_RCVBUF_LEN];
@@ -83,7 +111,15 @@ public:
 
     qid_t getQid() const { return (qid_); }
 
-    bool matchResponse(qid_t qid) const { return (qid_ == qid); }
+    uint32_t getGeneration() const { return (generation_); }
+
+    void setSentTime(const ptime& now) { sent_time_ = now; }
+    const ptime& getSentTime() const { return (sent_time_); }
+
+    // The time the query should have been sent at according to the
+    // sending schedule; only meaningful in the open-loop mode.
+    void setIntendedTime(const ptime& t) { intended_time_ = t; }
+    const ptime& getIntendedTime() const { return (intended_time_); }
 
     void setTCPSocket(MessageSocket* tcp_sock) {
         assert(tcp_sock_ == NULL);
@@ -96,25 +132,188 @@ public:
         tcp_sock_ = NULL;
     }
 
+    // The index of the persistent TCP connection used for the query, or
+    // NO_STREAM if it's not sent over a persistent connection.
+    static const size_t NO_STREAM = static_cast<size_t>(-1);
+    void setStream(size_t index) { stream_ = index; }
+    size_t getStream() const { return (stream_); }
+
+    // Whether the query is a zone transfer (AXFR or IXFR).
+    void setTransfer(bool transfer) { transfer_ = transfer; }
+    bool isTransfer() const { return (transfer_); }
+
+    // Whether the query was sent within the measurement window.  Only
+    // the responses to such queries are counted in the statistics, even
+    // if they arrive after the window closes.
+    void setMeasured(bool measured) { measured_ = measured; }
+    bool isMeasured() const { return (measured_); }
+
+    // The wire data of the query currently sent.  It's kept valid by the
+    // query context or the repository until the query is restarted.
+    void setQueryData(const void* data, size_t len) {
+        query_data_ = data;
+        query_len_ = len;
+    }
+    const void* getQueryData() const { return (query_data_); }
+    size_t getQueryLength() const { return (query_len_); }
+
 private:
     void queryTimerCallback() {
         cout << "[Timeout] Query timed out: msg id: " << qid_ << endl;
         if (tcp_sock_ != NULL) {
             clearTCPSocket();
         }
-        restart_callback_(qid_, NULL);
+        restart_callback_(qid_, generation_, NULL);
     }
 
     QueryContext* ctx_;
     qid_t qid_;
+    uint32_t generation_;
+    ptime sent_time_;
+    ptime intended_time_;
     RestartCallback restart_callback_;
     boost::shared_ptr<MessageTimer> timer_;
     MessageSocket* tcp_sock_;
     static const size_t TCP_RCVBUF_LEN = 65535;
     uint8_t* tcp_rcvbuf_;      // lazily allocated
+    size_t stream_;
+    bool transfer_;
+    bool measured_;
+    const void* query_data_;
+    size_t query_len_;
 };
 
 typedef boost::shared_ptr<QueryEvent> QueryEventPtr;
+
+// An entry of the table of outstanding queries, indexed by QID.
+// The generation is incremented every time the QID is assigned to a new
+// query, so a late event for a previous user of the QID (which would carry
+// an older generation) can be identified as stale and rejected.
+struct OutstandingEntry {
+    OutstandingEntry() : qev(NULL), generation(0) {}
+    QueryEvent* qev;            // NULL if the QID isn't in use
+    uint32_t generation;
+};
+
+// Minimum interval of the pacing timer in the open-loop mode, in
+// microseconds.
+const uint64_t MIN_PACING_INTERVAL = 1000;
+
+// Parameters of the adaptive window control (see setLatencyBound()): the
+// interval of adjusting the window in milliseconds, and the fraction of
+// lost queries in an interval above which the server is considered to be
+// overloaded (1 / ADAPTIVE_LOSS_DIVISOR).
+const long ADAPTIVE_INTERVAL = 100;
+const size_t ADAPTIVE_LOSS_DIVISOR = 100;
+
+// Append an EDNS TCP keepalive option (RFC 7828) to the query of the given
+// length stored in the buffer, and return the new length.  The option has
+// no timeout value as it's sent from a client.  This assumes the only
+// additional RR is an OPT RR without any option, which is the case for
+// queries built by the repository; otherwise the query is kept intact.
+// The buffer must have room for the option (4 bytes).
+size_t
+addTCPKeepalive(uint8_t* buf, size_t len) {
+    const size_t HEADER_LEN = 12;
+    const size_t OPT_LEN = 11;  // root name, type, class, TTL and RDLENGTH
+    if (len < HEADER_LEN + OPT_LEN || buf[10] != 0 || buf[11] != 1) {
+        return (len);           // ARCOUNT isn't 1
+    }
+    uint8_t* const opt = buf + len - OPT_LEN;
+    if (opt[0] != 0 || opt[1] != 0 || opt[2] != 41 || // type OPT
+        opt[9] != 0 || opt[10] != 0) {
+        return (len);
+    }
+    opt[10] = 4;                // RDLENGTH
+    buf[len] = 0;               // OPTION-CODE (11)
+    buf[len + 1] = 11;
+    buf[len + 2] = 0;           // OPTION-LENGTH (0)
+    buf[len + 3] = 0;
+    return (len + 4);
+}
+
+// Return true if the given query is of type AXFR or IXFR.  The query is
+// assumed to consist of the header and a question whose name isn't
+// compressed, which is the case for queries built by the repository.
+bool
+isZoneTransfer(const void* data, size_t len) {
+    const uint8_t* const cp = static_cast<const uint8_t*>(data);
+    size_t offset = 12;         // skip the header
+    while (offset < len && cp[offset] != 0) {
+        offset += cp[offset] + 1;
+    }
+    if (offset + 3 > len) {
+        return (false);
+    }
+    const uint16_t qtype = cp[offset + 1] * 256 + cp[offset + 2];
+    return (qtype == 251 || qtype == 252); // IXFR or AXFR
+}
+
+// Check whether a response has the same question as the query, so that a
+// late response to a previous user of the QID isn't taken for the response
+// to the current one.  The query is assumed to be built by the repository
+// as in isZoneTransfer(); the name is compared case-insensitively.  A
+// response without a question (e.g., some FORMERR) can't be checked and
+// is accepted.
+bool
+matchQuestion(const void* query, size_t query_len, const void* response,
+              size_t response_len)
+{
+    const uint8_t* const qp = static_cast<const uint8_t*>(query);
+    const uint8_t* const rp = static_cast<const uint8_t*>(response);
+    if (response_len >= 12 && rp[4] == 0 && rp[5] == 0) {
+        return (true);          // QDCOUNT is 0
+    }
+    size_t offset = 12;         // skip the header
+    while (offset < query_len && qp[offset] != 0) {
+        offset += qp[offset] + 1;
+    }
+    const size_t end = offset + 5; // the root label, type and class
+    if (end > query_len || end > response_len) {
+        return (false);
+    }
+    for (size_t i = 12; i <= offset; ++i) {
+        if (tolower(qp[i]) != tolower(rp[i])) {
+            return (false);
+        }
+    }
+    return (memcmp(qp + offset + 1, rp + offset + 1, 4) == 0);
+}
+
+// The size of the outstanding query table.  It covers the entire 16-bit
+// QID space, so matching a response is a single lookup regardless of the
+// window size.
+const size_t QID_SPACE = 65536;
+
+// Return the i-th of n shares of the total, divided as evenly as possible.
+size_t
+getShare(size_t total, size_t i, size_t n) {
+    return (total / n + (i < total % n ? 1 : 0));
+}
+
+// Create a builtin message manager: the stand alone one if a query handler
+// library is given, or one of the given I/O backend otherwise.
+MessageManager*
+createMessageManager(const string& backend, const string& library) {
+    try {
+        if (!library.empty()) {
+            return (new StandaloneMessageManager(library));
+        }
+        if (backend == "asio") {
+            return (new ASIOMessageManager(true));
+        } else if (backend == "epoll") {
+            return (new EpollMessageManager);
+        } else if (backend == "io_uring") {
+            return (new IOUringMessageManager);
+        }
+    } catch (const MessageSocketError& ex) {
+        throw DispatcherError(string(library.empty() ?
+                                     "I/O backend unavailable: " :
+                                     "stand alone mode unavailable: ") +
+                              ex.what());
+    }
+    throw DispatcherError("unknown I/O backend: " + backend);
+}
 } // unnamed namespace
 
 namespace Queryperf {
@@ -129,7 +328,7 @@ struct Dispatcher::DispatcherImpl {
 
     DispatcherImpl(const string& data_file) :
         qry_repo_local_(new QueryRepository(data_file)),
-        msg_mgr_local_(new ASIOMessageManager),
+        msg_mgr_local_(new ASIOMessageManager(true)),
         qryctx_creator_local_(new QueryContextCreator(*qry_repo_local_)),
         msg_mgr_(msg_mgr_local_.get()),
         qryctx_creator_(qryctx_creator_local_.get()),
@@ -140,7 +339,33 @@ struct Dispatcher::DispatcherImpl {
 
     DispatcherImpl(istream& input_stream) :
         qry_repo_local_(new QueryRepository(input_stream)),
-        msg_mgr_local_(new ASIOMessageManager),
+        msg_mgr_local_(new ASIOMessageManager(true)),
+        qryctx_creator_local_(new QueryContextCreator(*qry_repo_local_)),
+        msg_mgr_(msg_mgr_local_.get()),
+        qryctx_creator_(qryctx_creator_local_.get()),
+        response_(Message::PARSE)
+    {
+        initParams();
+    }
+
+    DispatcherImpl(const QueryRepository& source_repo, size_t start_index,
+                   bool copy) :
+        qry_repo_local_(new QueryRepository(source_repo, start_index, copy)),
+        msg_mgr_local_(new ASIOMessageManager(true)),
+        qryctx_creator_local_(new QueryContextCreator(*qry_repo_local_)),
+        msg_mgr_(msg_mgr_local_.get()),
+        qryctx_creator_(qryctx_creator_local_.get()),
+        response_(Message::PARSE)
+    {
+        initParams();
+    }
+
+    // Used for the shards, with the builtin message manager of the given
+    // backend (see createMessageManager()).
+    DispatcherImpl(const QueryRepository& source_repo, size_t start_index,
+                   const string& backend, const string& library) :
+        qry_repo_local_(new QueryRepository(source_repo, start_index)),
+        msg_mgr_local_(createMessageManager(backend, library)),
         qryctx_creator_local_(new QueryContextCreator(*qry_repo_local_)),
         msg_mgr_(msg_mgr_local_.get()),
         qryctx_creator_(qryctx_creator_local_.get()),
@@ -151,18 +376,114 @@ struct Dispatcher::DispatcherImpl {
 
     void initParams() {
         keep_sending_ = true;
+        phase_ = MEASURING;
+        measuring_ = true;
+        warmup_duration_ = 0;
+        cooldown_duration_ = 0;
+        tcp_connections_ = DEFAULT_TCP_CONNECTIONS;
+        tcp_keepalive_ = false;
+        next_stream_ = 0;
         window_ = DEFAULT_WINDOW;
+        query_rate_ = 0;
+        latency_bound_ = 0;
+        active_window_ = 0;
+        slow_start_ = true;
+        interval_completed_ = 0;
+        interval_lost_ = 0;
+        interval_latency_sum_ = 0;
+        sustained_rates_ = SustainedRates(milliseconds(ADAPTIVE_INTERVAL));
+        queries_scheduled_ = 0;
+        queries_pending_ = 0;
+        queries_offered_ = 0;
         qid_ = 0;
+        outstanding_count_ = 0;
         queries_sent_ = 0;
         queries_completed_ = 0;
         server_address_ = DEFAULT_SERVER;
         server_port_ = DEFAULT_PORT;
         test_duration_ = DEFAULT_DURATION;
         query_timeout_ = seconds(DEFAULT_QUERY_TIMEOUT);
+        io_backend_ = DEFAULT_IO_BACKEND;
+        io_threads_ = DEFAULT_IO_THREADS;
+        load_on_run_ = false;
+        qid_begin_ = 0;
+        qid_count_ = QID_SPACE;
+        live_counters_ = &live_counters_local_;
     }
 
     void run();
 
+    // Run the test with multiple I/O threads (see setIOThreads()).  The
+    // dispatcher is split into shards, each of which is a dispatcher
+    // running in its own thread with a part of the window, the query rate
+    // and the QID space, and their statistics are merged into this one.
+    void runShards();
+
+    struct ShardGroup;
+
+    // A shard run in a separate thread.  The shard is built in the thread
+    // after pinning it, so its message manager, sockets and buffers will
+    // be local to the CPU's node.  If it fails, it stops all the others,
+    // so the test won't go on with only some of them.
+    struct Shard {
+        ShardGroup* group;
+        size_t index;
+        const QueryRepository* repo; // queries to share, local to the node
+        qid_t qid_begin;
+        boost::shared_ptr<DispatcherImpl> impl; // set once built
+        string error;           // set if the shard fails
+        static void* run(void* arg);
+    };
+
+    // All shards of the dispatcher.  As the shards are built and stopped
+    // in different threads, the impl of each shard is set and the shards
+    // are stopped under the lock.
+    struct ShardGroup {
+        ShardGroup(const DispatcherImpl& parent_impl, size_t count) :
+            parent(parent_impl), shards(count), stopped(false)
+        {
+            pthread_mutex_init(&lock, NULL);
+        }
+        ~ShardGroup() {
+            pthread_mutex_destroy(&lock);
+        }
+        void stopAll();
+
+        const DispatcherImpl& parent;
+        vector<Shard> shards;
+        pthread_mutex_t lock;
+        bool stopped;
+    };
+
+    // Build the dispatcher of a shard from the parameters of this one.
+    DispatcherImpl* createShard(const Shard& shard) const;
+
+    // A copy of the preloaded queries made by a thread pinned to the given
+    // CPU, so that the shards on the CPU's node can read them locally.
+    struct NodeQueries {
+        unsigned int cpu;
+        const QueryRepository* source;
+        boost::shared_ptr<QueryRepository> repo;
+        string error;           // set if copying fails
+        static void* run(void* arg);
+    };
+
+    // Return the entry of the outstanding table for the given QID, or NULL
+    // if the QID is out of the range used by the dispatcher (which is
+    // possible for a bogus response in the multi-threaded mode).
+    OutstandingEntry* findOutstanding(qid_t qid) {
+        const size_t index = static_cast<qid_t>(qid - qid_begin_);
+        return (index < qid_count_ ? &outstanding_[index] : NULL);
+    }
+
+    // Advance the next QID, wrapping around within the range.
+    void advanceQid() {
+        ++qid_;
+        if (static_cast<qid_t>(qid_ - qid_begin_) >= qid_count_) {
+            qid_ = qid_begin_;
+        }
+    }
+
     // Callback from the message manager called when a response to a query is
     // delivered.
     void responseCallback(const MessageSocket::Event& sockev);
@@ -170,14 +491,86 @@ struct Dispatcher::DispatcherImpl {
     void responseTCPCallback(const MessageSocket::Event& sockev,
                              QueryEvent* qev);
 
-    // Generate next query either due to completion or timeout.
-    void restartQuery(qid_t qid, const Message* response);
+    // Record the statistics of a completed zone transfer and report it.
+    void recordTransfer(const QueryEvent& qev,
+                        const MessageSocket::TransferInfo& info);
+
+    // Callback from the message manager on a response or termination of
+    // a persistent TCP connection.
+    void streamCallback(const MessageSocket::Event& sockev, size_t index);
+
+    // Restart the outstanding query of the QID of the response just parsed
+    // into response_, if it's really the response to that query.
+    void matchResponse(const MessageSocket::Event& sockev);
+
+    // Generate next query either due to completion or timeout.  The
+    // generation identifies the specific use of the QID (see
+    // OutstandingEntry).
+    void restartQuery(qid_t qid, uint32_t generation,
+                      const Message* response);
+
+    // Count a completed query and record its latency in the statistics.
+    void recordLatency(const QueryEvent& qev, const ptime& now,
+                       uint64_t latency);
+
+    // Assign the next available QID to the given query event, register it
+    // in the outstanding table, and send the query.  QIDs are basically
+    // assigned sequentially, but those still in use (which can happen if
+    // some query stays outstanding long enough for the QID to wrap around)
+    // are skipped.
+    void startQuery(QueryEvent& qev) {
+        assert(outstanding_count_ < qid_count_);
+        while (findOutstanding(qid_)->qev != NULL) {
+            advanceQid();
+        }
+        OutstandingEntry& entry = *findOutstanding(qid_);
+        entry.qev = &qev;
+        ++entry.generation;
+        ++outstanding_count_;
+        sendQuery(qev, qev.start(qid_, entry.generation, query_timeout_));
+    }
+
+    // Send the oldest query scheduled but not sent yet in the open-loop
+    // mode using the given query event.  The query's intended time is
+    // calculated from its position in the schedule, so the latency can be
+    // measured from that point even if sending it is delayed.
+    void startScheduledQuery(QueryEvent& qev) {
+        assert(queries_pending_ > 0);
+        const uint64_t index = queries_scheduled_ - queries_pending_;
+        --queries_pending_;
+        qev.setIntendedTime(pacing_start_ +
+                            microseconds(index * 1000000 / query_rate_));
+        startQuery(qev);
+    }
 
     // A subroutine commonly used to send a single query.
     void sendQuery(QueryEvent& qev, const QueryContext::QuerySpec& qry_spec) {
+        qev.setSentTime(microsec_clock::universal_time());
+        qev.setStream(QueryEvent::NO_STREAM);
+        qev.setTransfer(false);
+        qev.setQueryData(qry_spec.data, qry_spec.len);
         if (qry_spec.proto == IPPROTO_UDP) {
             udp_socket_->send(qry_spec.data, qry_spec.len);
+        } else if (!tcp_streams_.empty()) {
+            // Pipeline the query over the persistent connections in the
+            // round-robin manner.
+            const size_t index = next_stream_;
+            if (++next_stream_ == tcp_streams_.size()) {
+                next_stream_ = 0;
+            }
+            qev.setStream(index);
+            if (tcp_keepalive_) {
+                std::memcpy(&tcp_query_buf_[0], qry_spec.data, qry_spec.len);
+                tcp_streams_[index]->send(
+                    &tcp_query_buf_[0],
+                    addTCPKeepalive(&tcp_query_buf_[0], qry_spec.len));
+            } else {
+                tcp_streams_[index]->send(qry_spec.data, qry_spec.len);
+            }
         } else {
+            // Zone transfers are measured only in this mode, where all
+            // messages of the response are counted by the socket.
+            qev.setTransfer(isZoneTransfer(qry_spec.data, qry_spec.len));
             MessageSocket* tcp_sock =
                 msg_mgr_->createMessageSocket(
                     IPPROTO_TCP, server_address_, server_port_,
@@ -188,20 +581,76 @@ struct Dispatcher::DispatcherImpl {
                 tcp_sock->send(qry_spec.data, qry_spec.len);
         }
 
-        ++queries_sent_;
-        ++qid_;
+        qev.setMeasured(measuring_);
+        if (measuring_) {
+            ++queries_sent_;
+        }
+        live_counters_->addSent();
+        advanceQid();
     }
 
     // Callback from the message manager on expiration of the session timer.
-    // Stop sending more queries; only wait for outstanding ones.
+    // The timer is reused for each phase of the test: at the end of the
+    // warm-up period the measurement starts; at the end of the test
+    // duration the measurement ends, followed by the cool-down period, if
+    // any.  At the end of the last phase, stop sending more queries; only
+    // wait for outstanding ones.  The responses to the queries sent within
+    // the measurement window are still counted when they arrive later.
     void sessionTimerCallback() {
+        if (phase_ == WARMING_UP) {
+            phase_ = MEASURING;
+            measuring_ = true;
+            measure_start_ = microsec_clock::local_time();
+            session_timer_->start(seconds(test_duration_));
+            return;
+        }
+        if (phase_ == MEASURING) {
+            measuring_ = false;
+            measure_end_ = microsec_clock::local_time();
+            if (cooldown_duration_ > 0) {
+                phase_ = COOLING_DOWN;
+                session_timer_->start(seconds(cooldown_duration_));
+                return;
+            }
+        }
         keep_sending_ = false;
+        if (pacing_timer_) {
+            pacing_timer_->cancel();
+        }
+        if (adaptive_timer_) {
+            adaptive_timer_->cancel();
+        }
+        // In the open-loop mode there may be no outstanding query at this
+        // point, in which case nothing would stop the manager otherwise.
+        if (outstanding_count_ == 0) {
+            msg_mgr_->stop();
+        }
+    }
+
+    // Callback from the message manager for the pacing timer in the
+    // open-loop mode.  Send all queries whose scheduled time has come,
+    // and reschedule the timer for the next one.
+    void pacingTimerCallback();
+
+    // Callback from the message manager for the timer of the adaptive
+    // window control.  Adjust the window based on the latencies and losses
+    // in the last interval, in the AIMD manner.
+    void adaptiveTimerCallback();
+
+    // Send queries that are scheduled but not sent yet as long as there
+    // are idle query events (i.e., within the window).
+    void sendPendingQueries() {
+        while (queries_pending_ > 0 && !idle_qevents_.empty()) {
+            QueryEvent* qev = idle_qevents_.back();
+            idle_qevents_.pop_back();
+            startScheduledQuery(*qev);
+        }
     }
 
     // These are placeholders for the support class objects when they are
     // built within the context.
     scoped_ptr<QueryRepository> qry_repo_local_;
-    scoped_ptr<ASIOMessageManager> msg_mgr_local_;
+    scoped_ptr<MessageManager> msg_mgr_local_;
     scoped_ptr<QueryContextCreator> qryctx_creator_local_;
 
     // These are pointers to the objects actually used in the object
@@ -212,29 +661,100 @@ struct Dispatcher::DispatcherImpl {
     // these should be released first.
     scoped_ptr<MessageSocket> udp_socket_;
     scoped_ptr<MessageTimer> session_timer_;
+    scoped_ptr<MessageTimer> pacing_timer_; // only used in open-loop mode
+    scoped_ptr<MessageTimer> adaptive_timer_; // only for adaptive window
+    vector<boost::shared_ptr<MessageSocket> > tcp_streams_;
     uint8_t udp_recvbuf_[4096];
 
     // Configurable parameters
     string server_address_;
     uint16_t server_port_;
     size_t test_duration_;
+    size_t warmup_duration_;    // seconds before the measurement starts
+    size_t cooldown_duration_;  // seconds of sending after it ends
     time_duration query_timeout_;
+    size_t tcp_connections_;    // number of persistent TCP connections
+    bool tcp_keepalive_;        // whether to use EDNS TCP keepalive
+    string io_backend_;         // I/O backend of the builtin message manager
+    string standalone_library_; // query handler library if used
+    size_t io_threads_;         // number of I/O threads (shards)
+    vector<unsigned int> cpus_; // CPU of each I/O thread, if pinned
+    bool load_on_run_;          // whether to preload queries in run()
 
     bool keep_sending_; // whether to send next query on getting a response
+    enum { WARMING_UP, MEASURING, COOLING_DOWN } phase_;
+    bool measuring_;    // whether to count statistics at this point
     size_t window_;
+    size_t query_rate_; // target qps in the open-loop mode; 0 if closed-loop
+    uint64_t latency_bound_;    // usec, enables adaptive window if non-0
+    size_t active_window_;      // current window, <= window_
+    bool slow_start_;           // whether to double the window on success
     qid_t qid_;
+    qid_t qid_begin_;           // QIDs in [qid_begin_, qid_begin_ +
+    size_t qid_count_;          // qid_count_) are used (wrapping around)
     Message response_;          // placeholder for response messages
-    list<boost::shared_ptr<QueryEvent> > outstanding_;
+    vector<QueryEventPtr> qevents_; // pool of query events, size = window_
+    vector<QueryEvent*> idle_qevents_; // not outstanding (open-loop or
+                                       // adaptive window only)
+    // Outstanding queries indexed by QID - qid_begin_
+    vector<OutstandingEntry> outstanding_;
+    size_t outstanding_count_;
+    size_t next_stream_;        // next persistent connection to be used
+    vector<uint8_t> tcp_query_buf_; // for queries with TCP keepalive
 
     // statistics
     size_t queries_sent_;
     size_t queries_completed_;
-    ptime start_time_;
-    ptime end_time_;
+    size_t queries_scheduled_;  // queries due to be sent (open-loop only)
+    size_t queries_pending_;    // scheduled but not yet sent (ditto)
+    size_t queries_offered_;    // scheduled while measuring (ditto)
+    ptime pacing_start_;        // base time of the sending schedule
+    LatencyHistogram latencies_; // RTT of completed queries in microseconds
+    LatencyHistogram corrected_latencies_; // same, corrected for
+                                           // coordinated omission
+    TransferStatistics transfers_; // completed zone transfers
+    // Statistics of the current interval of the adaptive window control
+    size_t interval_completed_;
+    size_t interval_lost_;
+    uint64_t interval_latency_sum_;
+    ptime interval_start_;
+    SustainedRates sustained_rates_; // qps within the latency bound
+    // Live counters can be read by other threads while running.  In the
+    // multi-threaded mode, the first shard uses those of this dispatcher
+    // and the others use shard_counters_.
+    LiveCounters live_counters_local_;
+    LiveCounters* live_counters_;
+    vector<boost::shared_ptr<LiveCounters> > shard_counters_;
+    vector<ResourceUsage> resource_usages_; // per I/O thread, after run()
+    ptime start_time_;          // when run() starts
+    ptime measure_start_;       // the measurement window
+    ptime measure_end_;
 };
 
 void
 Dispatcher::DispatcherImpl::run() {
+    // Pin the thread first, so that everything allocated below (and the
+    // preloaded queries if deferred) will be local to the CPU's node.
+    if (!cpus_.empty()) {
+        setThreadAffinity(cpus_[0]);
+    }
+    if (load_on_run_) {
+        qry_repo_local_->load();
+    }
+    if (io_threads_ > 1) {
+        runShards();
+        return;
+    }
+
+    // Rebuild the builtin message manager in the pinned thread, so its
+    // buffers will also be local to the CPU's node.
+    if (!cpus_.empty() && msg_mgr_local_) {
+        msg_mgr_local_.reset();
+        msg_mgr_local_.reset(createMessageManager(io_backend_,
+                                                  standalone_library_));
+        msg_mgr_ = msg_mgr_local_.get();
+    }
+
     // Allocate resources used throughout the test session:
     // common UDP socket and the whole session timer.
     udp_socket_.reset(msg_mgr_->createMessageSocket(
@@ -242,30 +762,115 @@ Dispatcher::DispatcherImpl::run() {
                           udp_recvbuf_, sizeof(udp_recvbuf_),
                           boost::bind(&DispatcherImpl::responseCallback,
                                       this, _1)));
+    for (size_t i = 0; i < tcp_connections_; ++i) {
+        tcp_streams_.push_back(
+            boost::shared_ptr<MessageSocket>(
+                msg_mgr_->createStreamMessageSocket(
+                    server_address_, server_port_,
+                    boost::bind(&DispatcherImpl::streamCallback, this, _1,
+                                i))));
+    }
+    if (tcp_keepalive_) {
+        tcp_query_buf_.resize(65535 + 4);
+    }
     session_timer_.reset(msg_mgr_->createMessageTimer(
                              boost::bind(&DispatcherImpl::sessionTimerCallback,
                                          this)));
 
-    // Start the session timer.
-    session_timer_->start(seconds(test_duration_));
+    // Start the session timer, first for the warm-up period if any.
+    // Statistics are not counted until it ends.
+    if (warmup_duration_ > 0) {
+        phase_ = WARMING_UP;
+        measuring_ = false;
+        session_timer_->start(seconds(warmup_duration_));
+    } else {
+        session_timer_->start(seconds(test_duration_));
+    }
+    if (query_rate_ > 0) {
+        pacing_timer_.reset(msg_mgr_->createMessageTimer(
+                                boost::bind(
+                                    &DispatcherImpl::pacingTimerCallback,
+                                    this)));
+    }
+
+    if (latency_bound_ > 0) {
+        if (query_rate_ > 0) {
+            throw DispatcherError("adaptive window cannot be used in the "
+                                  "open-loop mode");
+        }
+        adaptive_timer_.reset(msg_mgr_->createMessageTimer(
+                                  boost::bind(
+                                      &DispatcherImpl::adaptiveTimerCallback,
+                                      this)));
+    }
 
     // Create a pool of query contexts.  Setting QID to 0 for now.
+    if (window_ > qid_count_) {
+        throw DispatcherError("window size exceeds the QID space");
+    }
+    outstanding_.resize(qid_count_);
+    qid_ = qid_begin_;
     for (size_t i = 0; i < window_; ++i) {
         QueryEventPtr qev(new QueryEvent(
                               *msg_mgr_, 0, qryctx_creator_->create(),
                               boost::bind(&DispatcherImpl::restartQuery,
-                                          this, _1, _2)));
-        outstanding_.push_back(qev);
+                                          this, _1, _2, _3)));
+        qevents_.push_back(qev);
     }
 
-    // Record the start time and dispatch initial queries at once.
+    // Record the start time and dispatch initial queries.  In the
+    // closed-loop mode all queries of the window are sent at once, unless
+    // the window is adaptive, in which case it starts with one query;
+    // in the open-loop mode the first query is sent now, and the rest will
+    // be sent on schedule.
     start_time_ = microsec_clock::local_time();
-    BOOST_FOREACH(boost::shared_ptr<QueryEvent>& qev, outstanding_) {
-        sendQuery(*qev, qev->start(qid_, query_timeout_));
+    if (measuring_) {
+        measure_start_ = start_time_;
+    }
+    ThreadUsageMeter meter;
+    meter.start();
+    const LoopStatistics* const loop_stats = msg_mgr_->getLoopStatistics();
+    const LoopStatistics loop_start = loop_stats != NULL ? *loop_stats :
+        LoopStatistics();
+    if (query_rate_ == 0) {
+        active_window_ = adaptive_timer_ ? 1 : window_;
+        BOOST_FOREACH(QueryEventPtr& qev, qevents_) {
+            if (outstanding_count_ < active_window_) {
+                startQuery(*qev);
+            } else {
+                idle_qevents_.push_back(qev.get());
+            }
+        }
+        if (adaptive_timer_) {
+            interval_start_ = microsec_clock::universal_time();
+            adaptive_timer_->start(milliseconds(ADAPTIVE_INTERVAL));
+        }
+    } else {
+        BOOST_FOREACH(QueryEventPtr& qev, qevents_) {
+            idle_qevents_.push_back(qev.get());
+        }
+        pacing_start_ = microsec_clock::universal_time();
+        pacingTimerCallback();
     }
 
-    // Enter the event loop.
+    // Enter the event loop.  The measurement normally ends on expiration
+    // of the session timer; if the loop is stopped before that, it ends
+    // here.
     msg_mgr_->run();
+    if (measure_end_.is_special()) {
+        measure_end_ = microsec_clock::local_time();
+    }
+
+    // Record the resource usage of this thread; the loop statistics may be
+    // accumulated over multiple runs of an external manager.
+    ResourceUsage usage;
+    meter.stop(usage);
+    if (loop_stats != NULL) {
+        usage.has_loop_stats = true;
+        usage.idle_usec = loop_stats->idle_usec - loop_start.idle_usec;
+        usage.io_usec = loop_stats->io_usec - loop_start.io_usec;
+    }
+    resource_usages_.assign(1, usage);
 }
 
 void
@@ -278,7 +883,24 @@ Dispatcher::DispatcherImpl::responseCallback(
     response_.parseHeader(buffer);
     // TODO: catch exception due to bogus response
 
-    restartQuery(response_.getQid(), &response_);
+    matchResponse(sockev);
+}
+
+void
+Dispatcher::DispatcherImpl::matchResponse(const MessageSocket::Event& sockev)
+{
+    // The generation isn't known from the response itself, and the QID
+    // may have been reused since the query the response is for was sent.
+    // So it's also checked against the question of the query currently
+    // using the QID.
+    const qid_t qid = response_.getQid();
+    const OutstandingEntry* entry = findOutstanding(qid);
+    if (entry != NULL && entry->qev != NULL &&
+        matchQuestion(entry->qev->getQueryData(),
+                      entry->qev->getQueryLength(), sockev.data,
+                      sockev.datalen)) {
+        restartQuery(qid, entry->generation, &response_);
+    }
 }
 
 void
@@ -292,42 +914,451 @@ Dispatcher::DispatcherImpl::responseTCPCallback(
         InputBuffer buffer(sockev.data, sockev.datalen);
         response_.clear(Message::PARSE);
         response_.parseHeader(buffer);
+        if (qev->isTransfer() && sockev.transfer != NULL) {
+            recordTransfer(*qev, *sockev.transfer);
+        }
     } else {
         cout << "[Fail] TCP connection terminated unexpectedly" << endl;
     }
 
-    restartQuery(qev->getQid(), sockev.datalen > 0 ? &response_ : NULL);
+    restartQuery(qev->getQid(), qev->getGeneration(),
+                 sockev.datalen > 0 ? &response_ : NULL);
+}
+
+void
+Dispatcher::DispatcherImpl::recordTransfer(
+    const QueryEvent& qev, const MessageSocket::TransferInfo& info)
+{
+    const ptime now = microsec_clock::universal_time();
+    if (qev.isMeasured()) {
+        transfers_.record(info, qev.getSentTime(), now);
+    }
+
+    const uint64_t duration =
+        (now - qev.getSentTime()).total_microseconds();
+    cout << "[Transfer] msg id: " << qev.getQid() << ", "
+         << info.messages << " messages, " << info.rrs << " RRs, "
+         << info.bytes << " bytes, ";
+    if (!info.first_byte.is_special()) {
+        cout << "first byte in " << (info.first_byte -
+                                     qev.getSentTime()).total_microseconds() /
+            1000.0 << " ms, ";
+    }
+    cout << "done in " << duration / 1000.0 << " ms, "
+         << TransferStatistics::getThroughput(info.bytes, duration)
+         << " MB/s" << endl;
 }
 
 void
-Dispatcher::DispatcherImpl::restartQuery(qid_t qid, const Message* response) {
-    // Identify the matching query from the outstanding queue.
-    const list<boost::shared_ptr<QueryEvent> >::iterator qev_it =
-        find_if(outstanding_.begin(), outstanding_.end(),
-                boost::bind(&QueryEvent::matchResponse, _1, qid));
-    if (qev_it != outstanding_.end()) {
-        if (response != NULL) {
-            // TODO: let the context check the response further
-            ++queries_completed_;
+Dispatcher::DispatcherImpl::streamCallback(const MessageSocket::Event& sockev,
+                                           size_t index)
+{
+    if (sockev.data != NULL) {
+        // Responses can arrive in any order; match them by QID just like
+        // those over UDP.
+        InputBuffer buffer(sockev.data, sockev.datalen);
+        response_.clear(Message::PARSE);
+        response_.parseHeader(buffer);
+        matchResponse(sockev);
+        return;
+    }
+
+    // The connection has been closed.  Queries outstanding on it will
+    // never be responded, so we treat them as lost now rather than waiting
+    // for the timeout.  The next query over the connection will make a new
+    // one.  They are collected first as restarting a query may reuse the
+    // query event.
+    vector<pair<qid_t, uint32_t> > lost;
+    BOOST_FOREACH(QueryEventPtr& qev, qevents_) {
+        const OutstandingEntry& entry = *findOutstanding(qev->getQid());
+        if (entry.qev == qev.get() && qev->getStream() == index) {
+            lost.push_back(make_pair(qev->getQid(), entry.generation));
         }
+    }
+    if (!lost.empty()) {
+        cout << "[Fail] TCP connection closed with " << lost.size()
+             << " outstanding queries" << endl;
+    }
+    for (size_t i = 0; i < lost.size(); ++i) {
+        restartQuery(lost[i].first, lost[i].second, NULL);
+    }
+}
 
-        // If necessary, create a new query and dispatch it.
-        if (keep_sending_) {
-            sendQuery(**qev_it, (*qev_it)->start(qid_, query_timeout_));
+void
+Dispatcher::DispatcherImpl::recordLatency(const QueryEvent& qev,
+                                          const ptime& now, uint64_t latency)
+{
+    ++queries_completed_;
+
+    // In the open-loop mode, measure the corrected latency from the
+    // scheduled time, so any delay in sending the query (due to the
+    // window limit or our own slowness) counts.  In the closed-loop
+    // mode, a long latency delays the next queries of the same query
+    // event, so back-fill the samples they would have produced,
+    // assuming the average latency so far as the sending interval.
+    if (query_rate_ > 0) {
+        corrected_latencies_.record(
+            (now - qev.getIntendedTime()).total_microseconds());
+    } else {
+        corrected_latencies_.recordCorrected(
+            latency, static_cast<uint64_t>(latencies_.getMean()));
+    }
+    latencies_.record(latency);
+}
 
-            // Move this context to the end of the queue.
-            outstanding_.splice(qev_it, outstanding_, outstanding_.end());
+void
+Dispatcher::DispatcherImpl::restartQuery(qid_t qid, uint32_t generation,
+                                         const Message* response)
+{
+    // Identify the matching query from the outstanding table.
+    OutstandingEntry* const found = findOutstanding(qid);
+    if (found == NULL || found->qev == NULL ||
+        found->generation != generation) {
+        // TODO: record the mismatched response
+        return;
+    }
+
+    QueryEvent& qev = *found->qev;
+    found->qev = NULL;
+    --outstanding_count_;
+    if (response != NULL) {
+        // TODO: let the context check the response further
+        const ptime now = microsec_clock::universal_time();
+        const uint64_t latency =
+            (now - qev.getSentTime()).total_microseconds();
+        live_counters_->addCompleted(latency);
+        if (qev.isMeasured()) {
+            recordLatency(qev, now, latency);
+        }
+        ++interval_completed_;
+        interval_latency_sum_ += latency;
+    } else {
+        live_counters_->addLost();
+        ++interval_lost_;
+    }
+
+    // If necessary, create a new query and dispatch it.  In the open-loop
+    // mode, the query event is reused for a query that is already
+    // scheduled, if any; otherwise it will be idle until the next query
+    // is scheduled.  With the adaptive window, the query event will be
+    // idle if the window has shrunk.
+    if (keep_sending_ && query_rate_ == 0) {
+        if (outstanding_count_ < active_window_) {
+            startQuery(qev);
         } else {
-            outstanding_.erase(qev_it);
-            if (outstanding_.empty()) {
-                msg_mgr_->stop();
-            }
+            qev.stop();
+            idle_qevents_.push_back(&qev);
+        }
+    } else if (keep_sending_) {
+        if (queries_pending_ > 0) {
+            startScheduledQuery(qev);
+        } else {
+            qev.stop();
+            idle_qevents_.push_back(&qev);
         }
     } else {
-        // TODO: record the mismatched response
+        qev.stop();
+        if (outstanding_count_ == 0) {
+            msg_mgr_->stop();
+        }
     }
 }
 
+void*
+Dispatcher::DispatcherImpl::Shard::run(void* arg) {
+    Shard* shard = static_cast<Shard*>(arg);
+    ShardGroup& group = *shard->group;
+    try {
+        const vector<unsigned int>& cpus = group.parent.cpus_;
+        if (!cpus.empty()) {
+            setThreadAffinity(cpus[shard->index % cpus.size()]);
+        }
+        const boost::shared_ptr<DispatcherImpl> impl(
+            group.parent.createShard(*shard));
+
+        // Don't start if the others have already been stopped.
+        pthread_mutex_lock(&group.lock);
+        const bool stopped = group.stopped;
+        if (!stopped) {
+            shard->impl = impl;
+        }
+        pthread_mutex_unlock(&group.lock);
+        if (!stopped) {
+            impl->run();
+        }
+    } catch (const std::exception& ex) {
+        shard->error = ex.what();
+        group.stopAll();
+    }
+    return (NULL);
+}
+
+void
+Dispatcher::DispatcherImpl::ShardGroup::stopAll() {
+    // Message managers can be stopped from any thread, even before or
+    // after they run.  Shards built later will see the flag.
+    pthread_mutex_lock(&lock);
+    stopped = true;
+    BOOST_FOREACH(Shard& shard, shards) {
+        if (shard.impl) {
+            shard.impl->msg_mgr_->stop();
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+Dispatcher::DispatcherImpl*
+Dispatcher::DispatcherImpl::createShard(const Shard& shard) const {
+    const size_t i = shard.index;
+    DispatcherImpl* impl =
+        new DispatcherImpl(*shard.repo,
+                           qry_repo_local_->getQueryCount() * i / io_threads_,
+                           io_backend_, standalone_library_);
+    impl->server_address_ = server_address_;
+    impl->server_port_ = server_port_;
+    impl->test_duration_ = test_duration_;
+    impl->warmup_duration_ = warmup_duration_;
+    impl->cooldown_duration_ = cooldown_duration_;
+    impl->query_timeout_ = query_timeout_;
+    impl->tcp_connections_ = tcp_connections_;
+    impl->tcp_keepalive_ = tcp_keepalive_;
+    impl->window_ = getShare(window_, i, io_threads_);
+    impl->query_rate_ = query_rate_ == 0 ? 0 :
+        getShare(query_rate_, i, io_threads_);
+    impl->latency_bound_ = latency_bound_;
+    impl->qid_begin_ = shard.qid_begin;
+    impl->qid_count_ = getShare(QID_SPACE, i, io_threads_);
+    impl->live_counters_ = i == 0 ? live_counters_ :
+        shard_counters_[i - 1].get();
+    return (impl);
+}
+
+void*
+Dispatcher::DispatcherImpl::NodeQueries::run(void* arg) {
+    NodeQueries* queries = static_cast<NodeQueries*>(arg);
+    try {
+        setThreadAffinity(queries->cpu);
+        queries->repo.reset(new QueryRepository(*queries->source, 0, true));
+    } catch (const std::exception& ex) {
+        queries->error = ex.what();
+    }
+    return (NULL);
+}
+
+void
+Dispatcher::DispatcherImpl::runShards() {
+    // All shards share the preloaded queries, each starting at a different
+    // position.
+    if (qry_repo_local_->getQueryCount() == 0) {
+        qry_repo_local_->load();
+    }
+    if (window_ < io_threads_) {
+        throw DispatcherError("window size is smaller than the number of "
+                              "I/O threads");
+    }
+    if (query_rate_ > 0 && query_rate_ < io_threads_) {
+        throw DispatcherError("query rate is smaller than the number of "
+                              "I/O threads");
+    }
+
+    // The queries have been loaded on the node of the first CPU.  Shards
+    // pinned to CPUs of other nodes share a copy made on their node, one
+    // per node.
+    map<unsigned int, const QueryRepository*> node_repos;
+    vector<NodeQueries> node_queries;
+    if (!cpus_.empty()) {
+        node_repos[getCPUNode(cpus_[0])] = qry_repo_local_.get();
+        for (size_t i = 1; i < io_threads_ && i < cpus_.size(); ++i) {
+            const unsigned int node = getCPUNode(cpus_[i]);
+            if (node_repos.count(node) == 0) {
+                node_repos[node] = NULL; // set once copied
+                NodeQueries queries;
+                queries.cpu = cpus_[i];
+                queries.source = qry_repo_local_.get();
+                node_queries.push_back(queries);
+            }
+        }
+    }
+    BOOST_FOREACH(NodeQueries& queries, node_queries) {
+        pthread_t th;
+        const int ret = pthread_create(&th, NULL, NodeQueries::run,
+                                       &queries);
+        if (ret != 0) {
+            throw DispatcherError(string("failed to create a thread to "
+                                         "copy queries: ") + strerror(ret));
+        }
+        pthread_join(th, NULL);
+        if (!queries.error.empty()) {
+            throw DispatcherError("failed to copy queries for CPU " +
+                                  boost::lexical_cast<string>(queries.cpu) +
+                                  ": " + queries.error);
+        }
+        node_repos[getCPUNode(queries.cpu)] = queries.repo.get();
+    }
+
+    // Each shard has its own message manager, and therefore its own
+    // sockets (and source ports).  The QID space is divided among them so
+    // that QIDs are unique throughout the test.
+    ShardGroup group(*this, io_threads_);
+    vector<Shard>& shards = group.shards;
+    qid_t qid_begin = 0;
+    for (size_t i = 0; i < io_threads_; ++i) {
+        shards[i].group = &group;
+        shards[i].index = i;
+        shards[i].repo = cpus_.empty() ? qry_repo_local_.get() :
+            node_repos[getCPUNode(cpus_[i % cpus_.size()])];
+        shards[i].qid_begin = qid_begin;
+        qid_begin += getShare(QID_SPACE, i, io_threads_);
+    }
+
+    // Run the first shard in this thread, and the others in new threads.
+    start_time_ = microsec_clock::local_time();
+    vector<pthread_t> threads;
+    string error;
+    for (size_t i = 1; i < io_threads_; ++i) {
+        pthread_t th;
+        const int ret = pthread_create(&th, NULL, Shard::run, &shards[i]);
+        if (ret != 0) {
+            error = string("failed to create an I/O thread: ") +
+                strerror(ret);
+            group.stopAll();
+            break;
+        }
+        threads.push_back(th);
+    }
+    if (error.empty()) {
+        Shard::run(&shards[0]);
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Merge the results of the shards.
+    for (size_t i = 0; i < io_threads_; ++i) {
+        if (error.empty() && !shards[i].error.empty()) {
+            error = "I/O thread failed: " + shards[i].error;
+        }
+        if (!shards[i].impl) {  // not built or started
+            resource_usages_.push_back(ResourceUsage());
+            continue;
+        }
+        const DispatcherImpl& impl = *shards[i].impl;
+        if (!impl.start_time_.is_special() && impl.start_time_ < start_time_) {
+            start_time_ = impl.start_time_;
+        }
+        if (!impl.measure_start_.is_special() &&
+            (measure_start_.is_special() ||
+             impl.measure_start_ < measure_start_)) {
+            measure_start_ = impl.measure_start_;
+        }
+        if (!impl.measure_end_.is_special() &&
+            (measure_end_.is_special() || impl.measure_end_ > measure_end_)) {
+            measure_end_ = impl.measure_end_;
+        }
+        queries_sent_ += impl.queries_sent_;
+        queries_completed_ += impl.queries_completed_;
+        queries_offered_ += impl.queries_offered_;
+        latencies_.merge(impl.latencies_);
+        corrected_latencies_.merge(impl.corrected_latencies_);
+        transfers_.merge(impl.transfers_);
+        // Each shard adapts its window independently; add up the rates
+        // of the same interval.
+        sustained_rates_.merge(impl.sustained_rates_);
+        resource_usages_.push_back(impl.resource_usages_.empty() ?
+                                   ResourceUsage() :
+                                   impl.resource_usages_[0]);
+    }
+    if (!error.empty()) {
+        throw DispatcherError(error);
+    }
+}
+
+void
+Dispatcher::DispatcherImpl::adaptiveTimerCallback() {
+    if (!keep_sending_) {
+        return;
+    }
+
+    // Nothing to learn if no query completed or was lost in the interval
+    // (e.g., all are waiting for a response); keep the current window.
+    const ptime now = microsec_clock::universal_time();
+    if (interval_completed_ > 0 || interval_lost_ > 0) {
+        // The server is considered to be overloaded if the average
+        // latency inflates beyond the bound or too many queries time out.
+        // Queries dropped by the server are only noticed on timeout, so
+        // the latency is also estimated from the number of outstanding
+        // queries and the throughput (Little's law), which inflates as
+        // soon as responses stop coming back.
+        // Then halve the window; otherwise, record the throughput as a
+        // sustained one and grow the window, doubling it until the first
+        // overload (slow start), and by one after that.
+        const uint64_t elapsed = (now - interval_start_).total_microseconds();
+        const bool overloaded = interval_completed_ == 0 ||
+            interval_latency_sum_ / interval_completed_ > latency_bound_ ||
+            outstanding_count_ * elapsed / interval_completed_ >
+            latency_bound_ ||
+            interval_lost_ * ADAPTIVE_LOSS_DIVISOR > interval_completed_;
+        if (overloaded) {
+            active_window_ = std::max<size_t>(active_window_ / 2, 1);
+            slow_start_ = false;
+        } else {
+            const double rate = interval_completed_ /
+                (static_cast<double>(elapsed) / 1000000);
+            if (measuring_) {
+                sustained_rates_.record(now, rate, active_window_);
+            }
+            active_window_ = std::min(window_, slow_start_ ?
+                                      active_window_ * 2 :
+                                      active_window_ + 1);
+        }
+        interval_completed_ = 0;
+        interval_lost_ = 0;
+        interval_latency_sum_ = 0;
+        interval_start_ = now;
+    }
+
+    // Use idle query events if the window has grown.
+    while (outstanding_count_ < active_window_ && !idle_qevents_.empty()) {
+        QueryEvent* qev = idle_qevents_.back();
+        idle_qevents_.pop_back();
+        startQuery(*qev);
+    }
+    adaptive_timer_->start(milliseconds(ADAPTIVE_INTERVAL));
+}
+
+void
+Dispatcher::DispatcherImpl::pacingTimerCallback() {
+    if (!keep_sending_) {
+        return;
+    }
+
+    // The k-th query (k = 0, 1, ...) is scheduled at k / query_rate_
+    // seconds from the start.  Catch up with all queries scheduled by now;
+    // those that can't be sent due to the window limit will be sent as
+    // soon as an outstanding query completes.
+    const time_duration elapsed =
+        microsec_clock::universal_time() - pacing_start_;
+    const uint64_t elapsed_usec = elapsed.total_microseconds();
+    const uint64_t due = elapsed_usec * query_rate_ / 1000000 + 1;
+    if (due > queries_scheduled_) {
+        if (measuring_) {
+            queries_offered_ += due - queries_scheduled_;
+        }
+        queries_pending_ += due - queries_scheduled_;
+        queries_scheduled_ = due;
+    }
+    sendPendingQueries();
+
+    // Wait until the next query is scheduled, but not too short; if the
+    // rate is high enough, queries are sent in a batch per interval.
+    const uint64_t next_usec =
+        static_cast<uint64_t>(queries_scheduled_) * 1000000 / query_rate_;
+    const uint64_t wait_usec = next_usec > elapsed_usec ?
+        next_usec - elapsed_usec : 0;
+    pacing_timer_->start(microseconds(wait_usec < MIN_PACING_INTERVAL ?
+                                      MIN_PACING_INTERVAL : wait_usec));
+}
+
 Dispatcher::Dispatcher(MessageManager& msg_mgr,
                        QueryContextCreator& ctx_creator) :
     impl_(new DispatcherImpl(msg_mgr, ctx_creator))
@@ -335,6 +1366,7 @@ Dispatcher::Dispatcher(MessageManager& msg_mgr,
 }
 
 const char* const Dispatcher::DEFAULT_SERVER = "::1";
+const char* const Dispatcher::DEFAULT_IO_BACKEND = "asio";
 
 Dispatcher::Dispatcher(const string& data_file) {
     if (data_file == "-") {
@@ -349,6 +1381,19 @@ Dispatcher::Dispatcher(istream& input_stream) :
 {
 }
 
+Dispatcher::Dispatcher(const Dispatcher& source, size_t start_index,
+                       bool copy)
+{
+    // Queries can be shared only if they are preloaded in the internal
+    // repository.
+    if (source.getQueryCount() == 0) {
+        throw DispatcherError("sharing queries of a dispatcher without "
+                              "preload");
+    }
+    impl_ = new DispatcherImpl(*source.impl_->qry_repo_local_, start_index,
+                               copy);
+}
+
 Dispatcher::~Dispatcher() {
     delete impl_;
 }
@@ -365,9 +1410,126 @@ Dispatcher::loadQueries() {
         throw DispatcherError("query load attempt for external repository");
     }
 
+    // If the thread is to be pinned, queries are loaded in run() after
+    // pinning, so they'll be in the memory local to the thread.
+    if (!impl_->cpus_.empty()) {
+        impl_->load_on_run_ = true;
+        return;
+    }
     impl_->qry_repo_local_->load();
 }
 
+size_t
+Dispatcher::getQueryCount() const {
+    if (!impl_->qry_repo_local_) {
+        return (0);
+    }
+    return (impl_->qry_repo_local_->getQueryCount());
+}
+
+void
+Dispatcher::setIOBackend(const std::string& backend) {
+    if (!impl_->start_time_.is_special()) {
+        throw DispatcherError("I/O backend cannot be changed after run()");
+    }
+    // The backend can be changed only for the internal message manager.
+    if (!impl_->msg_mgr_local_) {
+        throw DispatcherError("I/O backend is being set for external "
+                              "message manager");
+    }
+
+    impl_->msg_mgr_local_.reset(createMessageManager(backend, ""));
+    impl_->io_backend_ = backend;
+    impl_->standalone_library_.clear();
+    impl_->msg_mgr_ = impl_->msg_mgr_local_.get();
+}
+
+void
+Dispatcher::setStandaloneLibrary(const std::string& library) {
+    if (!impl_->start_time_.is_special()) {
+        throw DispatcherError("message manager cannot be changed after "
+                              "run()");
+    }
+    if (!impl_->msg_mgr_local_) {
+        throw DispatcherError("query handler library is being set for "
+                              "external message manager");
+    }
+
+    impl_->msg_mgr_local_.reset(createMessageManager(impl_->io_backend_,
+                                                     library));
+    impl_->standalone_library_ = library;
+    impl_->msg_mgr_ = impl_->msg_mgr_local_.get();
+}
+
+size_t
+Dispatcher::getIOThreads() const {
+    return (impl_->io_threads_);
+}
+
+void
+Dispatcher::setIOThreads(size_t threads) {
+    if (!impl_->start_time_.is_special()) {
+        throw DispatcherError("I/O threads cannot be changed after run()");
+    }
+    if (threads == 0) {
+        throw DispatcherError("number of I/O threads must be positive");
+    }
+    // Shards are built from the internal repository and message manager.
+    if (threads > 1 && (!impl_->qry_repo_local_ || !impl_->msg_mgr_local_)) {
+        throw DispatcherError("multiple I/O threads are being set for "
+                              "external repository or message manager");
+    }
+    impl_->io_threads_ = threads;
+    impl_->shard_counters_.clear();
+    for (size_t i = 1; i < threads; ++i) {
+        impl_->shard_counters_.push_back(
+            boost::shared_ptr<LiveCounters>(new LiveCounters));
+    }
+}
+
+void
+Dispatcher::setCPUAffinity(const std::vector<unsigned int>& cpus) {
+    if (!impl_->start_time_.is_special()) {
+        throw DispatcherError("CPU affinity cannot be changed after run()");
+    }
+    if (impl_->load_on_run_) {
+        throw DispatcherError("CPU affinity is being changed after query "
+                              "load");
+    }
+    impl_->cpus_ = cpus;
+}
+
+const std::vector<unsigned int>&
+Dispatcher::getCPUAffinity() const {
+    return (impl_->cpus_);
+}
+
+size_t
+Dispatcher::getTCPConnections() const {
+    return (impl_->tcp_connections_);
+}
+
+void
+Dispatcher::setTCPConnections(size_t connections) {
+    if (!impl_->start_time_.is_special()) {
+        throw DispatcherError("TCP connections cannot be reset after run()");
+    }
+    impl_->tcp_connections_ = connections;
+}
+
+bool
+Dispatcher::getTCPKeepalive() const {
+    return (impl_->tcp_keepalive_);
+}
+
+void
+Dispatcher::setTCPKeepalive(bool on) {
+    if (!impl_->start_time_.is_special()) {
+        throw DispatcherError("TCP keepalive is being set/reset after run");
+    }
+    impl_->tcp_keepalive_ = on;
+}
+
 void
 Dispatcher::setDefaultQueryClass(const std::string& qclass_txt) {
     // default qclass must be set before running tests.
@@ -422,7 +1584,6 @@ void
 Dispatcher::run() {
     assert(impl_->udp_socket_ == NULL);
     impl_->run();
-    impl_->end_time_ = microsec_clock::local_time();
 }
 
 string
@@ -480,6 +1641,96 @@ Dispatcher::setTestDuration(size_t duration) {
     impl_->test_duration_ = duration;
 }
 
+size_t
+Dispatcher::getWarmupDuration() const {
+    return (impl_->warmup_duration_);
+}
+
+void
+Dispatcher::setWarmupDuration(size_t duration) {
+    if (!impl_->start_time_.is_special()) {
+        throw DispatcherError("warm-up duration cannot be reset after run()");
+    }
+    impl_->warmup_duration_ = duration;
+}
+
+size_t
+Dispatcher::getCooldownDuration() const {
+    return (impl_->cooldown_duration_);
+}
+
+void
+Dispatcher::setCooldownDuration(size_t duration) {
+    if (!impl_->start_time_.is_special()) {
+        throw DispatcherError("cool-down duration cannot be reset after "
+                              "run()");
+    }
+    impl_->cooldown_duration_ = duration;
+}
+
+size_t
+Dispatcher::getWindow() const {
+    return (impl_->window_);
+}
+
+void
+Dispatcher::setWindow(size_t window) {
+    if (!impl_->start_time_.is_special()) {
+        throw DispatcherError("window cannot be reset after run()");
+    }
+    if (window == 0 || window > QID_SPACE) {
+        throw DispatcherError("window size out of range: " +
+                              boost::lexical_cast<string>(window));
+    }
+    impl_->window_ = window;
+}
+
+size_t
+Dispatcher::getQueryRate() const {
+    return (impl_->query_rate_);
+}
+
+void
+Dispatcher::setQueryRate(size_t qps) {
+    if (!impl_->start_time_.is_special()) {
+        throw DispatcherError("query rate cannot be reset after run()");
+    }
+    impl_->query_rate_ = qps;
+}
+
+uint64_t
+Dispatcher::getLatencyBound() const {
+    return (impl_->latency_bound_);
+}
+
+void
+Dispatcher::setLatencyBound(uint64_t usec) {
+    if (!impl_->start_time_.is_special()) {
+        throw DispatcherError("latency bound cannot be reset after run()");
+    }
+    impl_->latency_bound_ = usec;
+}
+
+double
+Dispatcher::getMaxSustainedRate() const {
+    return (impl_->sustained_rates_.getMaxRate());
+}
+
+size_t
+Dispatcher::getMaxSustainedWindow() const {
+    return (impl_->sustained_rates_.getMaxWindow());
+}
+
+const SustainedRates&
+Dispatcher::getSustainedRates() const {
+    return (impl_->sustained_rates_);
+}
+
+size_t
+Dispatcher::getQueriesScheduled() const {
+    return (impl_->queries_offered_);
+}
+
 size_t
 Dispatcher::getQueriesSent() const {
     return (impl_->queries_sent_);
@@ -490,14 +1741,49 @@ Dispatcher::getQueriesCompleted() const {
     return (impl_->queries_completed_);
 }
 
+const LatencyHistogram&
+Dispatcher::getLatencyHistogram() const {
+    return (impl_->latencies_);
+}
+
+const LatencyHistogram&
+Dispatcher::getCorrectedLatencyHistogram() const {
+    return (impl_->corrected_latencies_);
+}
+
+const TransferStatistics&
+Dispatcher::getTransferStatistics() const {
+    return (impl_->transfers_);
+}
+
+const LiveCounters&
+Dispatcher::getLiveCounters(size_t thread) const {
+    if (thread >= impl_->io_threads_) {
+        throw DispatcherError("I/O thread index out of range: " +
+                              boost::lexical_cast<string>(thread));
+    }
+    return (thread == 0 ? *impl_->live_counters_ :
+            *impl_->shard_counters_[thread - 1]);
+}
+
+const ResourceUsage&
+Dispatcher::getResourceUsage(size_t thread) const {
+    if (thread >= impl_->resource_usages_.size()) {
+        throw DispatcherError("resource usage is not available for I/O "
+                              "thread " +
+                              boost::lexical_cast<string>(thread));
+    }
+    return (impl_->resource_usages_[thread]);
+}
+
 const ptime&
 Dispatcher::getStartTime() const {
-    return (impl_->start_time_);
+    return (impl_->measure_start_);
 }
 
 const ptime&
 Dispatcher::getEndTime() const {
-    return (impl_->end_time_);
+    return (impl_->measure_end_);
 }
 
 } // end of QueryPerf
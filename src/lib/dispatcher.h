@@ -22,6 +22,7 @@
 
 #include <stdexcept>
 #include <istream>
+#include <vector>
 
 #include <sys/types.h>
 #include <stdint.h>
@@ -54,9 +55,19 @@ public:
     /// \brief Default server port
     static const uint16_t DEFAULT_PORT = 53;
 
+    /// \brief Default I/O backend ("asio")
+    static const char* const DEFAULT_IO_BACKEND;
+
     /// \brief Default timeout for query completion in seconds.
     static const unsigned int DEFAULT_QUERY_TIMEOUT = 5;
 
+    /// \brief Default number of persistent TCP connections (0: a new
+    /// connection for each TCP query).
+    static const size_t DEFAULT_TCP_CONNECTIONS = 0;
+
+    /// \brief Default number of I/O threads.
+    static const size_t DEFAULT_IO_THREADS = 1;
+
     /// \brief Generic constructor.
     ///
     /// \param msg_mgr A message manager object that handles I/O and timeout
@@ -69,14 +80,44 @@ public:
     /// \brief Constructor when using "builtin" classes with input stream.
     Dispatcher(std::istream& input_stream);
 
+    /// \brief Constructor sharing preloaded queries of another dispatcher.
+    ///
+    /// The new dispatcher uses "builtin" classes, and its repository refers
+    /// to the queries preloaded by \c source without parsing or copying
+    /// them.  The dispatchers can then be run in different threads.
+    /// Queries are taken starting at \c start_index of the preloaded ones;
+    /// by giving different indices to each dispatcher, they can send
+    /// different queries at the same time.
+    ///
+    /// Parameters related to queries (such as the query class or the
+    /// protocol) are inherited from \c source and cannot be changed.
+    ///
+    /// If \c copy is true, the queries are copied rather than shared, in
+    /// memory allocated by the calling thread (see \c QueryRepository);
+    /// a thread pinned to a CPU can make a copy local to the CPU's NUMA
+    /// node, which other dispatchers on the node can then share.
+    ///
+    /// \throw DispatcherError \c source doesn't have preloaded queries
+    /// in its builtin repository.
+    Dispatcher(const Dispatcher& source, size_t start_index,
+               bool copy = false);
+
     /// \brief Destructor.
     ~Dispatcher();
 
     /// \brief Preload queries.
     ///
     /// This can be called at most once, and must be called before run().
+    /// If CPU affinity is set (see \c setCPUAffinity()), queries are
+    /// actually loaded at the beginning of run() by the pinned thread.
     void loadQueries();
 
+    /// \brief Return the number of preloaded queries.
+    ///
+    /// It returns 0 if queries haven't been preloaded (or an external
+    /// repository is used).
+    size_t getQueryCount() const;
+
     /// \brief Start the dispatcher.
     void run();
 
@@ -89,11 +130,183 @@ public:
     void setTestDuration(size_t duration);
     size_t getTestDuration() const;
 
+    /// \brief Set the warm-up period in seconds.
+    ///
+    /// During the warm-up period at the beginning of the test, queries are
+    /// sent as usual but are not counted in the statistics, so that, e.g.,
+    /// filling the server's cache doesn't affect the result.  The test
+    /// duration (see \c setTestDuration()) starts after this period.
+    /// It's 0 by default.  This method must be called before run().
+    void setWarmupDuration(size_t duration);
+    size_t getWarmupDuration() const;
+
+    /// \brief Set the cool-down period in seconds.
+    ///
+    /// The statistics cover the queries sent within the test duration;
+    /// the responses to them are counted even if they arrive after the
+    /// end of the test duration.  If a non-0 cool-down period is set,
+    /// queries keep being sent for the period after the test duration, so
+    /// that the last measured queries complete under the same load.
+    /// Otherwise, which is the default, the dispatcher stops sending
+    /// queries at the end of the test duration, and only waits for the
+    /// outstanding ones.  This method must be called before run().
+    void setCooldownDuration(size_t duration);
+    size_t getCooldownDuration() const;
+
+    /// \brief Set the window size: maximum number of queries outstanding.
+    ///
+    /// It must be positive and must not exceed the QID space (65536).
+    /// This method must be called before run().
+    void setWindow(size_t window);
+    size_t getWindow() const;
+
+    /// \brief Set the target query rate in queries per second.
+    ///
+    /// If a non-0 rate is set, the dispatcher runs in the "open-loop" mode:
+    /// it sends queries on a fixed schedule at the given rate regardless of
+    /// how quickly the server responds, while still keeping the number of
+    /// outstanding queries within the window.  Queries that cannot be sent
+    /// on schedule due to the window limit will be sent as soon as an
+    /// outstanding query completes.
+    ///
+    /// If it's 0 (the default), the dispatcher runs in the "closed-loop"
+    /// mode: it sends a new query only when a response to a previous one
+    /// is received or the query times out.
+    ///
+    /// This method must be called before run().
+    void setQueryRate(size_t qps);
+    size_t getQueryRate() const;
+
+    /// \brief Set the latency bound in microseconds for the adaptive
+    /// window.
+    ///
+    /// If a non-0 bound is set, the dispatcher adjusts the number of
+    /// outstanding queries in the closed-loop mode to find the highest
+    /// throughput of the server within the bound.  Starting with one
+    /// query, it periodically grows the window, doubling it at first and
+    /// additively after the server is first found to be overloaded, and
+    /// halves it when the average latency exceeds the bound or too many
+    /// queries time out.  The average latency is also estimated from the
+    /// window and the throughput, so that queries dropped by the server
+    /// count before they time out.  The window set by \c setWindow() is
+    /// the upper limit.  The result is available via
+    /// \c getMaxSustainedRate().
+    ///
+    /// It's 0 (disabled) by default, and cannot be used in the open-loop
+    /// mode.  This method must be called before run().
+    void setLatencyBound(uint64_t usec);
+    uint64_t getLatencyBound() const;
+
     /// \brief Set the default transport protocol used to send queries.
     ///
     /// This method must be called before run().
     void setProtocol(int proto);
 
+    /// \brief Set the number of persistent TCP connections.
+    ///
+    /// If it's non-0, queries over TCP are sent over the given number of
+    /// long-lived connections in the round-robin manner, without waiting
+    /// for responses to previous queries (see RFC 7766), and responses are
+    /// matched by QID regardless of the order.  The connections are made
+    /// on the first query, and made again on the next query if the server
+    /// closes them; queries outstanding on a closed connection are
+    /// considered lost.  The message manager must support
+    /// \c MessageManager::createStreamMessageSocket().
+    ///
+    /// If it's 0 (the default), a new connection is made for each TCP query
+    /// and closed once the response is received.
+    ///
+    /// This method must be called before run().
+    void setTCPConnections(size_t connections);
+    size_t getTCPConnections() const;
+
+    /// \brief Toggle whether to include the EDNS TCP keepalive option.
+    ///
+    /// If set to true, queries sent over persistent TCP connections include
+    /// an empty edns-tcp-keepalive option (RFC 7828), which tells the
+    /// server that we want to keep the connections open even while they're
+    /// idle.  The option is only added to queries with an EDNS0 OPT RR.
+    /// It's false by default.
+    ///
+    /// This method must be called before run().
+    void setTCPKeepalive(bool on);
+    bool getTCPKeepalive() const;
+
+    /// \brief Select the implementation of the builtin message manager.
+    ///
+    /// \c backend is one of "asio" (\c ASIOMessageManager, the default),
+    /// "epoll" (\c EpollMessageManager) and "io_uring"
+    /// (\c IOUringMessageManager).
+    ///
+    /// This method must be called before run().
+    ///
+    /// \throw DispatcherError \c backend is unknown or not supported, or
+    /// an external message manager is used.
+    void setIOBackend(const std::string& backend);
+
+    /// \brief Use the stand alone message manager with a query handler
+    /// loaded from a shared object.
+    ///
+    /// Queries are then handled in process by the handler of \c library
+    /// instead of being sent to the server; see
+    /// \c StandaloneMessageManager.  This replaces any I/O backend set by
+    /// \c setIOBackend().
+    ///
+    /// This method must be called before run().
+    ///
+    /// \throw DispatcherError The library can't be loaded, or an external
+    /// message manager is used.
+    void setStandaloneLibrary(const std::string& library);
+
+    /// \brief Set the number of I/O threads.
+    ///
+    /// If it's more than 1, \c run() splits the test into the given number
+    /// of shards, each of which runs its own event loop in a separate
+    /// thread (the first one in the calling thread), so a single test with
+    /// a large window can use multiple CPU cores.  Each shard has its own
+    /// message manager of the configured type, and hence its own sockets
+    /// and source ports.  The window, the query rate, and the QID space
+    /// are divided among the shards as evenly as possible; each shard only
+    /// uses its own range of QIDs with its own table of outstanding
+    /// queries.  Persistent TCP connections (\c setTCPConnections()) are
+    /// made per shard.
+    ///
+    /// Queries are preloaded on \c run() if they haven't been, and all
+    /// shards share them, each starting at a different position.  When
+    /// \c run() returns, the statistics of all shards have been merged
+    /// into this dispatcher; live counters are kept per shard (see
+    /// \c getLiveCounters()).
+    ///
+    /// This method must be called before run().  Multiple threads can only
+    /// be used with the "builtin" repository and message manager.  The
+    /// window (and the query rate if set) must not be smaller than the
+    /// number of threads on \c run().
+    ///
+    /// \throw DispatcherError \c threads is 0, or an external repository
+    /// or message manager is used for multiple threads.
+    void setIOThreads(size_t threads);
+    size_t getIOThreads() const;
+
+    /// \brief Pin the I/O threads to CPUs.
+    ///
+    /// Each I/O thread (see \c setIOThreads()) pins itself to a CPU at
+    /// the beginning of \c run(): the i-th thread to
+    /// <code>cpus[i % cpus.size()]</code>.  The first thread is the one
+    /// calling \c run().  The builtin message manager, query contexts,
+    /// sockets and buffers are then created by the thread itself, and
+    /// thus on the NUMA node of the CPU.  So are the preloaded queries if
+    /// \c loadQueries() is called after this method: loading is then
+    /// deferred to \c run().  With multiple I/O threads, the queries are
+    /// loaded by the first thread, and the threads on each of the other
+    /// nodes share a copy of them made on their node.  An empty list (the
+    /// default) means the threads are not pinned.
+    ///
+    /// This method must be called before run() and loadQueries().
+    ///
+    /// \throw DispatcherError called after run() or loadQueries().
+    void setCPUAffinity(const std::vector<unsigned int>& cpus);
+    const std::vector<unsigned int>& getCPUAffinity() const;
+
     /// \brief Set the default RR class of queries.
     ///
     /// This must be called before run().
@@ -115,16 +328,100 @@ public:
     /// This method must be called before run().
     void setEDNS(bool on);
 
+    /// \brief Return the number of queries scheduled to be sent in the
+    /// open-loop mode.
+    ///
+    /// This is the "offered" load, which can be larger than the number of
+    /// queries actually sent if the window limit is reached.  It's always 0
+    /// in the closed-loop mode.
+    ///
+    /// As with the other statistics, only queries within the measurement
+    /// window are counted (see \c setWarmupDuration() and
+    /// \c setCooldownDuration()).
+    size_t getQueriesScheduled() const;
+
+    /// \brief Return the highest throughput in queries per second the
+    /// server sustained within the latency bound.
+    ///
+    /// It's only meaningful with the adaptive window (see
+    /// \c setLatencyBound()), and is 0 otherwise.  The rate is measured
+    /// per interval of adjusting the window within the measurement window
+    /// (see \c setWarmupDuration()).  With multiple I/O threads, it's the
+    /// highest sum of the rates of all threads in the same interval.
+    double getMaxSustainedRate() const;
+
+    /// \brief Return the window with which the rate returned by
+    /// \c getMaxSustainedRate() was achieved.
+    size_t getMaxSustainedWindow() const;
+
+    /// \brief Return the sustained rates per interval.
+    ///
+    /// They can be merged with those of other dispatchers running at the
+    /// same time to get the total rate the server sustained.
+    const SustainedRates& getSustainedRates() const;
+
     /// \brief Return the number of queries sent from the dispatcher.
     size_t getQueriesSent() const;
 
     /// \brief Return the number of queries correctly responded.
     size_t getQueriesCompleted() const;
 
-    /// \brief Return the absolute time when the first query was sent.
+    /// \brief Return the histogram of latencies of completed queries.
+    ///
+    /// Each latency is the time in microseconds from sending a query to
+    /// receiving the matching response.  Timed out queries are not counted.
+    const LatencyHistogram& getLatencyHistogram() const;
+
+    /// \brief Return the histogram of latencies corrected for coordinated
+    /// omission.
+    ///
+    /// In the open-loop mode, each latency is measured from the time the
+    /// query was scheduled to be sent rather than the time it was actually
+    /// sent, so delays due to the window limit are included.  In the
+    /// closed-loop mode, where a slow response delays the next queries,
+    /// the latencies those queries would have seen are added to the
+    /// histogram, assuming they would have been sent at intervals of the
+    /// average latency (see \c LatencyHistogram::recordCorrected()).
+    const LatencyHistogram& getCorrectedLatencyHistogram() const;
+
+    /// \brief Return the statistics of completed zone transfers.
+    ///
+    /// AXFR and IXFR queries are measured as transfers only when they are
+    /// sent over a new TCP connection per query (i.e., not over persistent
+    /// TCP connections).
+    const TransferStatistics& getTransferStatistics() const;
+
+    /// \brief Return the live statistics counters of the dispatcher.
+    ///
+    /// Unlike other statistics, the returned counters can be read from
+    /// another thread while the dispatcher is running, e.g., by
+    /// \c LiveStatisticsReporter.  With multiple I/O threads, each thread
+    /// has its own counters, which are identified by \c thread (from 0 to
+    /// \c getIOThreads() - 1).
+    ///
+    /// \throw DispatcherError \c thread is out of range.
+    const LiveCounters& getLiveCounters(size_t thread = 0) const;
+
+    /// \brief Return the resource usage of the given I/O thread during
+    /// the test.
+    ///
+    /// This can be used to tell whether the client was the bottleneck
+    /// rather than the server (see \c ResourceUsage::isSaturated()).
+    ///
+    /// \throw DispatcherError run() hasn't completed or \c thread is not
+    /// smaller than \c getIOThreads().
+    const ResourceUsage& getResourceUsage(size_t thread = 0) const;
+
+    /// \brief Return the absolute time when the measurement started.
+    ///
+    /// This is when the first query was sent, or the end of the warm-up
+    /// period if it's set.
     const boost::posix_time::ptime& getStartTime() const;
 
-    /// \brief Return the absolute time when the dispatcher stops.
+    /// \brief Return the absolute time when the measurement ended.
+    ///
+    /// This is the end of the test duration, or when the dispatcher stops
+    /// if it stops earlier.
     const boost::posix_time::ptime& getEndTime() const;
 
 private:
@@ -0,0 +1,1290 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <config.h>
+
+#include <epoll_message_manager.h>
+#include <resource_usage.h>
+#include <timer_wheel.h>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H) && \
+    defined(HAVE_SYS_TIMERFD_H)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+using boost::lexical_cast;
+
+namespace Queryperf {
+
+#ifdef USE_EPOLL
+
+namespace {
+std::string
+errorText(const char* what) {
+    return (std::string(what) + ": " + std::strerror(errno));
+}
+
+// The base class of objects that receive epoll events.  Events are first
+// recorded in the object and queued in the manager, and processed later
+// by process(); this way processing can be suspended by stop() without
+// losing edge-triggered events.
+//
+// Objects are never deleted directly while the manager may still refer to
+// them; they are "retired" via the manager, which deletes them when it's
+// safe.
+class EventHandler {
+public:
+    EventHandler() : events_(0), queued_(false), dead_(false) {}
+    virtual ~EventHandler() {}
+
+    // Process the recorded events.  Return false if processing is
+    // interrupted by stop(); it will be resumed on the next run.
+    virtual bool process(uint32_t events) = 0;
+
+    uint32_t events_;           // recorded events not processed yet
+    bool queued_;               // whether in the ready queue of the manager
+    bool dead_;                 // retired; never processed again
+};
+}
+
+struct EpollMessageManager::EpollMessageManagerImpl {
+    EpollMessageManagerImpl(EpollMessageManager& mgr);
+    ~EpollMessageManagerImpl();
+
+    // Register a descriptor with the handler of its events.
+    void addDescriptor(int fd, uint32_t events, EventHandler* handler);
+
+    // Release a handler; it's deleted immediately or once it's safe.
+    void retire(EventHandler* handler);
+
+    // Free retired handlers that are no longer referenced.
+    void collectGarbage();
+
+    bool isStopped() const {
+        return (__atomic_load_n(&stopped_, __ATOMIC_ACQUIRE));
+    }
+
+    void run();
+
+    // Process the queued events until the queue becomes empty or stop()
+    // is called.
+    void processReady();
+
+    // Flush messages queued in sockets.
+    void flushSends();
+
+    EpollMessageManager& mgr_;
+    int epoll_fd_;
+    int event_fd_;              // to wake up epoll_wait() on stop()
+    bool stopped_;              // accessed atomically
+    bool dispatching_;          // whether in run()
+    size_t work_count_;         // pending works that keep run() running
+    std::vector<EventHandler*> ready_; // handlers with recorded events
+    std::vector<EventHandler*> graveyard_;
+    std::vector<EventHandler*> flush_list_; // sockets with queued data
+    std::vector<uint8_t> scratch_; // for discarding data (single thread)
+    LoopStatistics loop_stats_;
+    // Destroyed first in the destructor.  Created on the first use.
+    boost::scoped_ptr<TimerWheel> timer_wheel_;
+};
+
+namespace {
+typedef EpollMessageManager::EpollMessageManagerImpl ManagerImpl;
+
+// The base class of socket implementations.  The public socket object
+// (EpollMessageSocket) only holds a reference to it, so the implementation
+// can outlive the public object until the manager releases it.
+class SocketImpl : public EventHandler {
+public:
+    SocketImpl(ManagerImpl& mgr, int fd, MessageSocket::Callback callback) :
+        mgr_(mgr), fd_(fd), callback_(callback), flush_pending_(false)
+    {}
+    virtual ~SocketImpl() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+    virtual void send(const void* data, size_t datalen) = 0;
+
+    // Called on destruction of the public object.
+    virtual void cancel() {
+        close(fd_);             // this also unregisters it from epoll
+        fd_ = -1;
+        mgr_.retire(this);
+    }
+
+    // Send queued messages.  Called by the manager for sockets in its
+    // flush list.  This must not call the callback.
+    virtual void flush() {}
+
+    // Called by the manager when the socket is removed from the flush list.
+    void clearFlushPending() { flush_pending_ = false; }
+
+protected:
+    // Register the socket in the flush list of the manager, if not yet.
+    void requestFlush() {
+        if (!flush_pending_) {
+            mgr_.flush_list_.push_back(this);
+            flush_pending_ = true;
+        }
+    }
+
+    // Remove the socket from the flush list of the manager, if it's there.
+    void cancelFlush() {
+        if (flush_pending_) {
+            mgr_.flush_list_.erase(std::find(mgr_.flush_list_.begin(),
+                                             mgr_.flush_list_.end(), this));
+            flush_pending_ = false;
+        }
+    }
+
+    ManagerImpl& mgr_;
+    int fd_;
+    const MessageSocket::Callback callback_;
+
+private:
+    bool flush_pending_;
+};
+
+class EpollMessageSocket : public MessageSocket {
+public:
+    EpollMessageSocket(SocketImpl* impl) : impl_(impl) {}
+    virtual ~EpollMessageSocket() { impl_->cancel(); }
+    virtual void send(const void* data, size_t datalen) {
+        impl_->send(data, datalen);
+    }
+private:
+    SocketImpl* impl_;
+};
+
+// Convert a textual address and port to a socket address.
+socklen_t
+convertAddress(const std::string& address, uint16_t port,
+               struct sockaddr_storage& ss)
+{
+    std::memset(&ss, 0, sizeof(ss));
+    void* p = &ss;
+    struct sockaddr_in6* sin6 = static_cast<struct sockaddr_in6*>(p);
+    if (inet_pton(AF_INET6, address.c_str(), &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        return (sizeof(*sin6));
+    }
+    struct sockaddr_in* sin = static_cast<struct sockaddr_in*>(p);
+    if (inet_pton(AF_INET, address.c_str(), &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        return (sizeof(*sin));
+    }
+    throw MessageSocketError("Failed to create a socket: invalid address: " +
+                             address);
+}
+
+const struct sockaddr*
+toSockAddr(const struct sockaddr_storage& ss) {
+    const void* p = &ss;
+    return (static_cast<const struct sockaddr*>(p));
+}
+
+class UDPSocketImpl : public SocketImpl {
+public:
+    // Received messages are stored in internal buffers of recvbuf_len
+    // bytes each so a whole batch can be read at once; the caller's buffer
+    // isn't used.
+    UDPSocketImpl(ManagerImpl& mgr, int fd, size_t recvbuf_len,
+                  MessageSocket::Callback callback) :
+        SocketImpl(mgr, fd, callback), recvbuf_len_(recvbuf_len),
+        receiving_(false), send_count_(0),
+        recv_count_(0), recv_next_(0),
+        sendbufs_(BATCH_SIZE * BATCH_SENDBUF_LEN),
+        recvbufs_(BATCH_SIZE * recvbuf_len)
+    {}
+
+    virtual void send(const void* data, size_t datalen);
+    virtual void cancel();
+    virtual bool process(uint32_t events);
+
+    // Send all queued messages.
+    virtual void flush();
+
+private:
+    // Same as those of the ASIO version.
+    static const size_t BATCH_SIZE = 64;
+    static const size_t BATCH_SENDBUF_LEN = 512;
+
+    size_t receiveBatch();
+    void waitWritable();
+
+    const size_t recvbuf_len_;
+    bool receiving_;
+    size_t send_count_;
+    size_t recv_count_;         // number of messages in recvbufs_
+    size_t recv_next_;          // next message in recvbufs_ to be delivered
+    std::vector<uint8_t> sendbufs_; // BATCH_SIZE * BATCH_SENDBUF_LEN
+    size_t sendlens_[BATCH_SIZE];
+    std::vector<uint8_t> recvbufs_; // BATCH_SIZE * recvbuf_len_
+    size_t recvlens_[BATCH_SIZE];
+};
+
+const size_t UDPSocketImpl::BATCH_SIZE;
+const size_t UDPSocketImpl::BATCH_SENDBUF_LEN;
+
+void
+UDPSocketImpl::send(const void* data, size_t datalen) {
+    if (datalen > BATCH_SENDBUF_LEN || send_count_ == BATCH_SIZE) {
+        flush();
+    }
+    if (datalen > BATCH_SENDBUF_LEN) {
+        // Too large for the batch buffer; send it immediately.
+        while (::send(fd_, data, datalen, 0) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                waitWritable();
+            } else if (errno != EINTR) {
+                throw MessageSocketError(
+                    errorText("Unexpected failure on socket send"));
+            }
+        }
+    } else {
+        std::memcpy(&sendbufs_[send_count_ * BATCH_SENDBUF_LEN], data,
+                    datalen);
+        sendlens_[send_count_++] = datalen;
+        requestFlush();
+    }
+    if (!receiving_) {
+        // From now on responses are expected.
+        ++mgr_.work_count_;
+        receiving_ = true;
+    }
+}
+
+void
+UDPSocketImpl::cancel() {
+    // Send the queued messages (as the ASIO version does), if any.
+    flush();
+    cancelFlush();
+    if (receiving_) {
+        --mgr_.work_count_;
+    }
+    SocketImpl::cancel();
+}
+
+void
+UDPSocketImpl::waitWritable() {
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLOUT;
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            throw MessageSocketError(
+                errorText("Unexpected failure on socket poll"));
+        }
+    }
+}
+
+void
+UDPSocketImpl::flush() {
+    const uint64_t io_start = getMonotonicTime();
+    size_t sent = 0;
+    while (sent < send_count_) {
+#ifdef HAVE_SENDMMSG
+        struct mmsghdr msgs[BATCH_SIZE];
+        struct iovec iovs[BATCH_SIZE];
+        const size_t count = send_count_ - sent;
+        std::memset(msgs, 0, sizeof(msgs[0]) * count);
+        for (size_t i = 0; i < count; ++i) {
+            iovs[i].iov_base = &sendbufs_[(sent + i) * BATCH_SENDBUF_LEN];
+            iovs[i].iov_len = sendlens_[sent + i];
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        const int n = sendmmsg(fd_, msgs, count, 0);
+#else
+        const int n = ::send(fd_, &sendbufs_[sent * BATCH_SENDBUF_LEN],
+                             sendlens_[sent], 0) < 0 ? -1 : 1;
+#endif
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                waitWritable();
+                continue;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            throw MessageSocketError(
+                errorText("Unexpected failure on socket send"));
+        }
+        sent += n;
+    }
+    send_count_ = 0;
+    mgr_.loop_stats_.io_usec += getMonotonicTime() - io_start;
+}
+
+size_t
+UDPSocketImpl::receiveBatch() {
+    const uint64_t io_start = getMonotonicTime();
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    std::memset(msgs, 0, sizeof(msgs));
+    for (size_t i = 0; i < BATCH_SIZE; ++i) {
+        iovs[i].iov_base = &recvbufs_[i * recvbuf_len_];
+        iovs[i].iov_len = recvbuf_len_;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n;
+    do {
+        n = recvmmsg(fd_, msgs, BATCH_SIZE, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+    for (int i = 0; i < n; ++i) {
+        recvlens_[i] = msgs[i].msg_len;
+    }
+#else
+    int n = 0;
+    while (n < static_cast<int>(BATCH_SIZE)) {
+        const ssize_t cc = recv(fd_, &recvbufs_[n * recvbuf_len_],
+                                recvbuf_len_, MSG_DONTWAIT);
+        if (cc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (n == 0) {
+                n = -1;
+            }
+            break;
+        }
+        recvlens_[n++] = cc;
+    }
+#endif
+    mgr_.loop_stats_.io_usec += getMonotonicTime() - io_start;
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return (0);
+        }
+        throw MessageSocketError(
+            errorText("unexpected failure on socket read"));
+    }
+    return (n);
+}
+
+bool
+UDPSocketImpl::process(uint32_t) {
+    // As the socket is edge-triggered, it must be drained until it would
+    // block.  Messages of a batch that are received but not delivered due
+    // to stop() are kept for the next run.
+    for (;;) {
+        while (recv_next_ < recv_count_) {
+            const size_t i = recv_next_++;
+            callback_(MessageSocket::Event(&recvbufs_[i * recvbuf_len_],
+                                           recvlens_[i]));
+            if (dead_) {
+                return (true);
+            }
+            if (mgr_.isStopped()) {
+                return (false);
+            }
+        }
+        if (recv_count_ > 0 && recv_count_ < BATCH_SIZE) {
+            // The last batch wasn't full, so the socket should have been
+            // drained (any later arrival triggers a new event).
+            recv_count_ = recv_next_ = 0;
+            return (true);
+        }
+        recv_count_ = receiveBatch();
+        recv_next_ = 0;
+        if (recv_count_ == 0) {
+            return (true);
+        }
+    }
+}
+
+class TCPSocketImpl : public SocketImpl {
+public:
+    TCPSocketImpl(ManagerImpl& mgr, const std::string& address,
+                  uint16_t port, void* recvbuf,
+                  MessageSocket::Callback callback) :
+        SocketImpl(mgr, -1, callback), recvbuf_(static_cast<uint8_t*>(recvbuf)),
+        state_(INIT), sent_len_(0), msglen_(0), read_len_(0),
+        recvdata_len_(0)
+    {
+        dest_len_ = convertAddress(address, port, dest_);
+    }
+
+    virtual void send(const void* data, size_t datalen);
+    virtual void cancel();
+    virtual bool process(uint32_t events);
+
+private:
+    enum State {
+        INIT,                   // not started
+        CONNECTING,
+        WRITING,
+        READ_LENGTH,            // reading the length of the next message
+        READ_DATA,              // reading the data of a message
+        DONE                    // completed, successfully or not
+    };
+
+    void handleConnect(uint32_t events);
+    void handleWrite();
+    void handleRead();
+
+    // Complete the session and call the callback.  The object may be
+    // retired in the callback, so the caller must return immediately.
+    void complete(const void* data, size_t datalen) {
+        state_ = DONE;
+        --mgr_.work_count_;
+        callback_(MessageSocket::Event(data, datalen, &transfer_));
+    }
+
+    struct sockaddr_storage dest_;
+    socklen_t dest_len_;
+    uint8_t* recvbuf_;        // for the first message (must be of > 64KB)
+    MessageSocket::TransferInfo transfer_; // summary of all messages
+    State state_;
+    std::vector<uint8_t> sendbuf_; // length and data of the query
+    size_t sent_len_;
+    uint8_t msglen_buf_[2];
+    size_t msglen_;             // length of the message being read
+    size_t read_len_;           // bytes read for the current field
+    size_t recvdata_len_;       // actual message length of the first message
+};
+
+void
+TCPSocketImpl::send(const void* data, size_t datalen) {
+    if (state_ != INIT) {
+        throw MessageSocketError("duplicate send on a TCP socket");
+    }
+    sendbuf_.resize(datalen + 2);
+    sendbuf_[0] = datalen >> 8;
+    sendbuf_[1] = datalen & 0xff;
+    std::memcpy(&sendbuf_[2], data, datalen);
+
+    fd_ = socket(dest_.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                 IPPROTO_TCP);
+    if (fd_ < 0) {
+        throw MessageSocketError(errorText("Failed to create a socket"));
+    }
+    if (connect(fd_, toSockAddr(dest_), dest_len_) < 0 &&
+        errno != EINPROGRESS) {
+        throw MessageSocketError(errorText("Failed to connect socket"));
+    }
+    // The first event tells the result of the connect.
+    state_ = CONNECTING;
+    ++mgr_.work_count_;
+    mgr_.addDescriptor(fd_, EPOLLIN | EPOLLOUT | EPOLLET, this);
+}
+
+void
+TCPSocketImpl::cancel() {
+    if (state_ != INIT && state_ != DONE) {
+        --mgr_.work_count_;
+    }
+    state_ = DONE;
+    if (fd_ >= 0) {
+        SocketImpl::cancel();
+    } else {
+        mgr_.retire(this);
+    }
+}
+
+bool
+TCPSocketImpl::process(uint32_t events) {
+    switch (state_) {
+    case CONNECTING:
+        handleConnect(events);
+        break;
+    case WRITING:
+        handleWrite();
+        break;
+    case READ_LENGTH:
+    case READ_DATA:
+        handleRead();
+        break;
+    default:
+        break;                  // ignore any events after completion
+    }
+    return (true);
+}
+
+void
+TCPSocketImpl::handleConnect(uint32_t events) {
+    if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) == 0) {
+        return;
+    }
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+        error = errno;
+    }
+    if (error != 0) {
+        std::cerr << "[Warn] TCP connect failed: " << std::strerror(error)
+                  << std::endl;
+        complete(NULL, 0);
+        return;
+    }
+    state_ = WRITING;
+    handleWrite();
+}
+
+void
+TCPSocketImpl::handleWrite() {
+    while (sent_len_ < sendbuf_.size()) {
+        const ssize_t cc = ::send(fd_, &sendbuf_[sent_len_],
+                                  sendbuf_.size() - sent_len_, MSG_NOSIGNAL);
+        if (cc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;         // wait for the next writable event
+            } else if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "[Warn] TCP send failed: " << std::strerror(errno)
+                      << std::endl;
+            complete(NULL, 0);
+            return;
+        }
+        sent_len_ += cc;
+    }
+
+    // Immediately after sending the query, shutdown the outbound direction
+    // of the socket, so the server won't wait for subsequent queries.
+    if (shutdown(fd_, SHUT_WR) < 0) {
+        std::cerr << "[Warn] failed to shut down TCP socket: "
+                  << std::strerror(errno) << std::endl;
+        complete(NULL, 0);
+        return;
+    }
+    state_ = READ_LENGTH;
+    read_len_ = 0;
+    handleRead();
+}
+
+void
+TCPSocketImpl::handleRead() {
+    for (;;) {
+        // We keep the first message in recvbuf_ for callback, and read
+        // subsequent ones (such as those of AXFR) into the shared scratch
+        // buffer, only counting them, until the server closes the
+        // connection.
+        uint8_t* buf;
+        size_t len;
+        if (state_ == READ_LENGTH) {
+            buf = msglen_buf_ + read_len_;
+            len = sizeof(msglen_buf_) - read_len_;
+        } else if (recvdata_len_ == 0) {
+            buf = recvbuf_ + read_len_;
+            len = msglen_ - read_len_;
+        } else {
+            buf = &mgr_.scratch_[0];
+            len = std::min(msglen_ - read_len_, mgr_.scratch_.size());
+        }
+        const ssize_t cc = len > 0 ? recv(fd_, buf, len, 0) : 0;
+        if (cc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;         // wait for the next readable event
+            } else if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "[Warn] failed to read TCP message: "
+                      << std::strerror(errno) << std::endl;
+            complete(NULL, recvdata_len_);
+            return;
+        }
+        if (cc == 0 && len > 0) {
+            // We've received all messages.  Note that this includes the case
+            // where the server closes the connection without sending any
+            // message or with partial message.
+            complete(recvbuf_, recvdata_len_);
+            return;
+        }
+        transfer_.addBytes(cc);
+        if (state_ == READ_DATA) {
+            transfer_.addData(read_len_, buf, cc);
+        }
+        read_len_ += cc;
+        if (state_ == READ_LENGTH && read_len_ == sizeof(msglen_buf_)) {
+            msglen_ = msglen_buf_[0] * 256 + msglen_buf_[1];
+            state_ = READ_DATA;
+            read_len_ = 0;
+        } else if (state_ == READ_DATA && read_len_ == msglen_) {
+            transfer_.addMessage();
+            if (recvdata_len_ == 0) {
+                recvdata_len_ = msglen_;
+            }
+            state_ = READ_LENGTH;
+            read_len_ = 0;
+        }
+    }
+}
+
+// A persistent TCP connection (see
+// MessageManager::createStreamMessageSocket()).  Queued messages are
+// written when the manager flushes sockets; if the socket buffer becomes
+// full, the rest is written on the next writable event.  Write errors are
+// detected on the read side, as the socket then becomes readable with
+// the error, so callbacks are only called from process().
+class StreamSocketImpl : public SocketImpl {
+public:
+    StreamSocketImpl(ManagerImpl& mgr, const std::string& address,
+                     uint16_t port, MessageSocket::Callback callback) :
+        SocketImpl(mgr, -1, callback), state_(CLOSED), sent_len_(0),
+        recvbuf_(RECVBUF_LEN), recvdata_len_(0), recv_next_(0)
+    {
+        dest_len_ = convertAddress(address, port, dest_);
+    }
+
+    virtual void send(const void* data, size_t datalen);
+    virtual void cancel();
+    virtual bool process(uint32_t events);
+    virtual void flush();
+
+private:
+    // Same as that of the ASIO version.
+    static const size_t RECVBUF_LEN = 131072;
+
+    enum State {
+        CLOSED,
+        CONNECTING,
+        CONNECTED
+    };
+
+    void startConnect();
+    bool handleRead();
+
+    // Close the connection and call the callback.  If \c what isn't NULL,
+    // it's an unexpected error and is logged with the error code.  The
+    // object may be retired in the callback, so the caller must return
+    // immediately.
+    void terminate(const char* what, int error);
+
+    struct sockaddr_storage dest_;
+    socklen_t dest_len_;
+    State state_;
+    std::vector<uint8_t> sendbuf_; // queued messages with the length fields
+    size_t sent_len_;              // bytes of sendbuf_ already sent
+    std::vector<uint8_t> recvbuf_; // RECVBUF_LEN bytes
+    size_t recvdata_len_;          // bytes stored in recvbuf_
+    size_t recv_next_;             // next message in recvbuf_ to be delivered
+};
+
+const size_t StreamSocketImpl::RECVBUF_LEN;
+
+void
+StreamSocketImpl::send(const void* data, size_t datalen) {
+    if (state_ == CLOSED) {
+        startConnect();
+    }
+    sendbuf_.push_back(datalen >> 8);
+    sendbuf_.push_back(datalen & 0xff);
+    const uint8_t* const cp = static_cast<const uint8_t*>(data);
+    sendbuf_.insert(sendbuf_.end(), cp, cp + datalen);
+    if (state_ == CONNECTED) {
+        requestFlush();
+    }
+}
+
+void
+StreamSocketImpl::startConnect() {
+    fd_ = socket(dest_.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                 IPPROTO_TCP);
+    if (fd_ < 0) {
+        throw MessageSocketError(errorText("Failed to create a socket"));
+    }
+    if (connect(fd_, toSockAddr(dest_), dest_len_) < 0 &&
+        errno != EINPROGRESS) {
+        const std::string error = errorText("Failed to connect socket");
+        close(fd_);
+        fd_ = -1;
+        throw MessageSocketError(error);
+    }
+    // The first event tells the result of the connect.
+    state_ = CONNECTING;
+    ++mgr_.work_count_;
+    mgr_.addDescriptor(fd_, EPOLLIN | EPOLLOUT | EPOLLET, this);
+}
+
+void
+StreamSocketImpl::cancel() {
+    cancelFlush();
+    if (state_ != CLOSED) {
+        --mgr_.work_count_;
+        state_ = CLOSED;
+    }
+    if (fd_ >= 0) {
+        SocketImpl::cancel();
+    } else {
+        mgr_.retire(this);
+    }
+}
+
+void
+StreamSocketImpl::flush() {
+    if (state_ != CONNECTED) {
+        return;
+    }
+    while (sent_len_ < sendbuf_.size()) {
+        const ssize_t cc = ::send(fd_, &sendbuf_[sent_len_],
+                                  sendbuf_.size() - sent_len_, MSG_NOSIGNAL);
+        if (cc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Wait for the next writable event, or the read side will
+            // see the error.
+            return;
+        }
+        sent_len_ += cc;
+    }
+    sendbuf_.clear();
+    sent_len_ = 0;
+}
+
+bool
+StreamSocketImpl::process(uint32_t events) {
+    if (state_ == CONNECTING) {
+        if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) == 0) {
+            return (true);
+        }
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+            error = errno;
+        }
+        if (error != 0) {
+            terminate("TCP connect failed", error);
+            return (true);
+        }
+        state_ = CONNECTED;
+
+        // Queries are generally small and sent without waiting for
+        // responses to previous ones, so we don't want them to be delayed.
+        const int on = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        flush();
+    } else if (state_ == CONNECTED) {
+        if ((events & EPOLLOUT) != 0) {
+            flush();
+        }
+    } else {
+        return (true);          // ignore events for a closed connection
+    }
+    return (handleRead());
+}
+
+bool
+StreamSocketImpl::handleRead() {
+    for (;;) {
+        // Deliver all complete messages in the buffer.  Those not
+        // delivered due to stop() are kept for the next run.
+        while (recvdata_len_ - recv_next_ >= 2) {
+            const size_t msglen = recvbuf_[recv_next_] * 256 +
+                recvbuf_[recv_next_ + 1];
+            if (recvdata_len_ - recv_next_ < msglen + 2) {
+                break;
+            }
+            const size_t offset = recv_next_ + 2;
+            recv_next_ += msglen + 2;
+            callback_(MessageSocket::Event(&recvbuf_[offset], msglen));
+            if (dead_) {
+                return (true);
+            }
+            if (mgr_.isStopped()) {
+                return (false);
+            }
+        }
+
+        // Move the remaining partial message, if any, to the beginning of
+        // the buffer and read more.
+        if (recv_next_ > 0) {
+            std::memmove(&recvbuf_[0], &recvbuf_[recv_next_],
+                         recvdata_len_ - recv_next_);
+            recvdata_len_ -= recv_next_;
+            recv_next_ = 0;
+        }
+        const ssize_t cc = recv(fd_, &recvbuf_[recvdata_len_],
+                                RECVBUF_LEN - recvdata_len_, 0);
+        if (cc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return (true);  // wait for the next readable event
+            } else if (errno == EINTR) {
+                continue;
+            }
+            terminate("failed to read TCP message", errno);
+            return (true);
+        }
+        if (cc == 0) {
+            // The server closed the connection.  This is a normal event
+            // (e.g., due to idle timeout), so we don't log it.
+            terminate(NULL, 0);
+            return (true);
+        }
+        recvdata_len_ += cc;
+    }
+}
+
+void
+StreamSocketImpl::terminate(const char* what, int error) {
+    if (what != NULL) {
+        std::cerr << "[Warn] " << what << ": " << std::strerror(error)
+                  << std::endl;
+    }
+    close(fd_);                 // this also unregisters it from epoll
+    fd_ = -1;
+    state_ = CLOSED;
+    --mgr_.work_count_;
+    cancelFlush();
+    sendbuf_.clear();
+    sent_len_ = 0;
+    recvdata_len_ = recv_next_ = 0;
+    callback_(MessageSocket::Event(NULL, 0));
+}
+
+class TimerImpl : public EventHandler {
+public:
+    TimerImpl(ManagerImpl& mgr, MessageTimer::Callback callback) :
+        mgr_(mgr), callback_(callback), active_(false)
+    {
+        fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd_ < 0) {
+            throw MessageTimerError(errorText("Failed to create a timer"));
+        }
+        try {
+            mgr_.addDescriptor(fd_, EPOLLIN | EPOLLET, this);
+        } catch (...) {
+            close(fd_);
+            throw;
+        }
+    }
+    virtual ~TimerImpl() {
+        close(fd_);
+    }
+
+    void start(const boost::posix_time::time_duration& duration) {
+        int64_t usec = duration.total_microseconds();
+        if (usec <= 0) {
+            usec = 1;           // 0 would disarm the timer
+        }
+        setTimer(usec);
+        if (!active_) {
+            ++mgr_.work_count_;
+            active_ = true;
+        }
+    }
+
+    void cancel() {
+        if (active_) {
+            setTimer(0);
+            --mgr_.work_count_;
+            active_ = false;
+        }
+    }
+
+    void destroy() {
+        cancel();
+        mgr_.retire(this);
+    }
+
+    virtual bool process(uint32_t) {
+        // The timer may have been cancelled or restarted after the event,
+        // in which case there's nothing to read.
+        uint64_t expirations;
+        if (read(fd_, &expirations, sizeof(expirations)) < 0 || !active_) {
+            return (true);
+        }
+        active_ = false;
+        --mgr_.work_count_;
+        callback_();
+        return (true);
+    }
+
+private:
+    void setTimer(int64_t usec) {
+        struct itimerspec spec;
+        std::memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_sec = usec / 1000000;
+        spec.it_value.tv_nsec = (usec % 1000000) * 1000;
+        if (timerfd_settime(fd_, 0, &spec, NULL) < 0) {
+            throw MessageTimerError(
+                errorText("Unexpected failure on setting timer"));
+        }
+    }
+
+    ManagerImpl& mgr_;
+    const MessageTimer::Callback callback_;
+    int fd_;
+    bool active_;
+};
+
+class EpollMessageTimer : public MessageTimer {
+public:
+    EpollMessageTimer(TimerImpl* impl) : impl_(impl) {}
+    virtual ~EpollMessageTimer() { impl_->destroy(); }
+    virtual void start(const boost::posix_time::time_duration& duration) {
+        impl_->start(duration);
+    }
+    virtual void cancel() { impl_->cancel(); }
+private:
+    TimerImpl* impl_;
+};
+
+// The maximum number of events retrieved in a single epoll_wait().
+const size_t MAX_EVENTS = 64;
+}
+
+EpollMessageManager::EpollMessageManagerImpl::EpollMessageManagerImpl(
+    EpollMessageManager& mgr) :
+    mgr_(mgr), epoll_fd_(-1), event_fd_(-1), stopped_(false),
+    dispatching_(false), work_count_(0),
+    scratch_(std::numeric_limits<uint16_t>::max())
+{
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0) {
+        throw MessageSocketError(errorText("epoll_create1 failed"));
+    }
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd_ < 0) {
+        close(epoll_fd_);
+        throw MessageSocketError(errorText("eventfd failed"));
+    }
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;         // identifies the event descriptor
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev) < 0) {
+        close(event_fd_);
+        close(epoll_fd_);
+        throw MessageSocketError(errorText("epoll_ctl failed"));
+    }
+}
+
+EpollMessageManager::EpollMessageManagerImpl::~EpollMessageManagerImpl() {
+    timer_wheel_.reset();
+    for (size_t i = 0; i < ready_.size(); ++i) {
+        ready_[i]->queued_ = false;
+    }
+    ready_.clear();
+    dispatching_ = false;
+    collectGarbage();
+    close(event_fd_);
+    close(epoll_fd_);
+}
+
+void
+EpollMessageManager::EpollMessageManagerImpl::addDescriptor(
+    int fd, uint32_t events, EventHandler* handler)
+{
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = handler;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        throw MessageSocketError(errorText("epoll_ctl failed"));
+    }
+}
+
+void
+EpollMessageManager::EpollMessageManagerImpl::retire(EventHandler* handler) {
+    handler->dead_ = true;
+    if (!dispatching_ && !handler->queued_) {
+        delete handler;
+    } else {
+        graveyard_.push_back(handler);
+    }
+}
+
+void
+EpollMessageManager::EpollMessageManagerImpl::collectGarbage() {
+    size_t n_kept = 0;
+    for (size_t i = 0; i < graveyard_.size(); ++i) {
+        EventHandler* handler = graveyard_[i];
+        if (handler->queued_) {
+            graveyard_[n_kept++] = handler; // still in the ready queue
+        } else {
+            delete handler;
+        }
+    }
+    graveyard_.resize(n_kept);
+}
+
+void
+EpollMessageManager::EpollMessageManagerImpl::flushSends() {
+    // Sockets remove themselves from the list when retired, so all of them
+    // are alive.
+    for (size_t i = 0; i < flush_list_.size(); ++i) {
+        SocketImpl* sock = static_cast<SocketImpl*>(flush_list_[i]);
+        sock->clearFlushPending();
+        sock->flush();
+    }
+    flush_list_.clear();
+}
+
+void
+EpollMessageManager::EpollMessageManagerImpl::processReady() {
+    size_t i = 0;
+    for (; i < ready_.size() && !isStopped(); ++i) {
+        EventHandler* handler = ready_[i];
+        if (handler->dead_) {
+            handler->queued_ = false;
+            continue;
+        }
+        const uint32_t events = handler->events_;
+        handler->events_ = 0;
+        if (handler->process(events) || handler->dead_) {
+            handler->queued_ = false;
+        } else {
+            // Interrupted by stop(); keep it at the head of the queue.
+            handler->events_ |= events;
+            break;
+        }
+    }
+    ready_.erase(ready_.begin(), ready_.begin() + i);
+}
+
+void
+EpollMessageManager::EpollMessageManagerImpl::run() {
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        // Messages queued in the previous iteration (or before run()) are
+        // sent before waiting for new events.
+        flushSends();
+        collectGarbage();
+        if (isStopped()) {
+            break;
+        }
+        if (!ready_.empty()) {
+            processReady();
+            continue;
+        }
+        if (work_count_ == 0) {
+            break;
+        }
+
+        const uint64_t wait_start = getMonotonicTime();
+        const int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+        loop_stats_.idle_usec += getMonotonicTime() - wait_start;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw MessageSocketError(errorText("epoll_wait failed"));
+        }
+        for (int i = 0; i < n; ++i) {
+            EventHandler* handler =
+                static_cast<EventHandler*>(events[i].data.ptr);
+            if (handler == NULL) {
+                uint64_t count;
+                if (read(event_fd_, &count, sizeof(count)) < 0 &&
+                    errno != EAGAIN) {
+                    throw MessageSocketError(errorText("eventfd read failed"));
+                }
+                continue;
+            }
+            if (handler->dead_) {
+                continue;
+            }
+            handler->events_ |= events[i].events;
+            if (!handler->queued_) {
+                handler->queued_ = true;
+                ready_.push_back(handler);
+            }
+        }
+    }
+    // The manager can be run again.
+    __atomic_store_n(&stopped_, false, __ATOMIC_RELEASE);
+}
+
+#endif  // USE_EPOLL
+
+EpollMessageManager::EpollMessageManager() {
+#ifdef USE_EPOLL
+    impl_ = new EpollMessageManagerImpl(*this);
+#else
+    throw MessageSocketError("epoll is not supported on this system");
+#endif
+}
+
+EpollMessageManager::~EpollMessageManager() {
+#ifdef USE_EPOLL
+    delete impl_;
+#endif
+}
+
+MessageSocket*
+EpollMessageManager::createMessageSocket(int proto, const std::string& address,
+                                         uint16_t port,
+                                         void* recvbuf, size_t recvbuf_len,
+                                         MessageSocket::Callback callback)
+{
+#ifdef USE_EPOLL
+    if (!callback) {
+        throw MessageSocketError("null socket callback specified");
+    }
+    if (proto == IPPROTO_UDP) {
+        struct sockaddr_storage ss;
+        const socklen_t sslen = convertAddress(address, port, ss);
+        const int fd = socket(ss.ss_family,
+                              SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                              IPPROTO_UDP);
+        if (fd < 0) {
+            throw MessageSocketError(errorText("Failed to create a socket"));
+        }
+        // make sure the receive buffer is large enough (32KB, derived from
+        // the original queryperf)
+        const int bufsize = 32768;
+        if (connect(fd, toSockAddr(ss), sslen) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize,
+                       sizeof(bufsize)) < 0) {
+            const std::string error = errorText("Failed to create a socket");
+            close(fd);
+            throw MessageSocketError(error);
+        }
+        UDPSocketImpl* impl = new UDPSocketImpl(*impl_, fd, recvbuf_len,
+                                                callback);
+        try {
+            impl_->addDescriptor(fd, EPOLLIN | EPOLLET, impl);
+            return (new EpollMessageSocket(impl));
+        } catch (...) {
+            delete impl;
+            throw;
+        }
+    } else if (proto == IPPROTO_TCP) {
+        if (recvbuf_len < 65535) { // must be able to hold a full TCP msg
+            throw MessageSocketError("Insufficient TCP receive buffer");
+        }
+        TCPSocketImpl* impl = new TCPSocketImpl(*impl_, address, port,
+                                                recvbuf, callback);
+        try {
+            return (new EpollMessageSocket(impl));
+        } catch (...) {
+            delete impl;
+            throw;
+        }
+    }
+    throw MessageSocketError("unsupported or invalid protocol: " +
+                             lexical_cast<std::string>(proto));
+#else
+    (void)proto; (void)address; (void)port; (void)recvbuf; (void)recvbuf_len;
+    (void)callback;
+    return (NULL);
+#endif
+}
+
+MessageSocket*
+EpollMessageManager::createStreamMessageSocket(
+    const std::string& address, uint16_t port,
+    MessageSocket::Callback callback)
+{
+#ifdef USE_EPOLL
+    if (!callback) {
+        throw MessageSocketError("null socket callback specified");
+    }
+    StreamSocketImpl* impl = new StreamSocketImpl(*impl_, address, port,
+                                                  callback);
+    try {
+        return (new EpollMessageSocket(impl));
+    } catch (...) {
+        delete impl;
+        throw;
+    }
+#else
+    (void)address; (void)port; (void)callback;
+    return (NULL);
+#endif
+}
+
+MessageTimer*
+EpollMessageManager::createMessageTimer(MessageTimer::Callback callback) {
+#ifdef USE_EPOLL
+    TimerImpl* impl = new TimerImpl(*impl_, callback);
+    return (new EpollMessageTimer(impl));
+#else
+    (void)callback;
+    return (NULL);
+#endif
+}
+
+MessageTimer*
+EpollMessageManager::createCoarseMessageTimer(MessageTimer::Callback callback)
+{
+#ifdef USE_EPOLL
+    if (!impl_->timer_wheel_) {
+        impl_->timer_wheel_.reset(new TimerWheel(*this));
+    }
+    return (impl_->timer_wheel_->createTimer(callback));
+#else
+    (void)callback;
+    return (NULL);
+#endif
+}
+
+const LoopStatistics*
+EpollMessageManager::getLoopStatistics() const {
+#ifdef USE_EPOLL
+    return (&impl_->loop_stats_);
+#else
+    return (NULL);
+#endif
+}
+
+void
+EpollMessageManager::run() {
+#ifdef USE_EPOLL
+    impl_->dispatching_ = true;
+    try {
+        impl_->run();
+    } catch (...) {
+        impl_->dispatching_ = false;
+        throw;
+    }
+    impl_->dispatching_ = false;
+#endif
+}
+
+void
+EpollMessageManager::stop() {
+#ifdef USE_EPOLL
+    __atomic_store_n(&impl_->stopped_, true, __ATOMIC_RELEASE);
+    // Wake up epoll_wait() in case it's called from another thread.
+    const uint64_t one = 1;
+    if (write(impl_->event_fd_, &one, sizeof(one)) < 0) {
+        // It can only fail if the counter overflows, in which case the
+        // descriptor is readable anyway.
+    }
+#endif
+}
+
+} // end of QueryPerf
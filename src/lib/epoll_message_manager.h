@@ -0,0 +1,104 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#ifndef __QUERYPERF_EPOLL_MESSAGE_MANAGER_H
+#define __QUERYPERF_EPOLL_MESSAGE_MANAGER_H 1
+
+#include <message_manager.h>
+
+#include <string>
+
+#include <stdint.h>
+
+namespace Queryperf {
+
+/// \brief A \c MessageManager implementation directly using epoll.
+///
+/// This is a lightweight alternative to \c ASIOMessageManager for Linux.
+/// Sockets are non blocking and registered in an epoll instance in the
+/// edge-triggered mode, and each timer is a timerfd.  Events are delivered
+/// to the sockets and timers via virtual calls without intermediate
+/// handler objects.
+///
+/// UDP sockets always work in the batched mode of \c ASIOMessageManager:
+/// messages given to \c send() are queued and sent together (with
+/// \c sendmmsg() if available) before the event loop waits for the next
+/// events, and received messages are read in batches (with \c recvmmsg()
+/// if available).  TCP sockets behave the same as those of
+/// \c ASIOMessageManager.  Persistent TCP connections (see
+/// \c createStreamMessageSocket()) write the queued messages at the same
+/// timing as UDP sockets flush them.
+///
+/// As with \c ASIOMessageManager, \c run() returns when \c stop() is called
+/// or there is no more pending work: no active timer, no UDP socket that
+/// has sent a message, no TCP socket waiting for a response, and no
+/// open persistent TCP connection.
+/// \c stop() can be called from any thread.  The manager can be run again
+/// after \c run() returns; events that arrived but weren't processed due
+/// to \c stop() will then be processed first.
+///
+/// Objects created by the manager must be destroyed before the manager.
+class EpollMessageManager : public MessageManager {
+public:
+    /// \brief Constructor.
+    ///
+    /// \throw MessageSocketError epoll is not supported or an underlying
+    /// system call fails.
+    EpollMessageManager();
+
+    virtual ~EpollMessageManager();
+
+    virtual MessageSocket* createMessageSocket(
+        int proto, const std::string& address, uint16_t port,
+        void* recvbuf, size_t recvbuf_len,
+        MessageSocket::Callback callback);
+
+    virtual MessageSocket* createStreamMessageSocket(
+        const std::string& address, uint16_t port,
+        MessageSocket::Callback callback);
+
+    virtual MessageTimer* createMessageTimer(MessageTimer::Callback callback);
+
+    /// \brief Create a coarse timer.
+    ///
+    /// As with \c ASIOMessageManager, coarse timers are managed in a
+    /// \c TimerWheel with the default tick interval.
+    virtual MessageTimer* createCoarseMessageTimer(
+        MessageTimer::Callback callback);
+
+    /// \brief Return statistics of the event loop.
+    ///
+    /// The idle time is spent in \c epoll_wait(), and the I/O time is
+    /// spent sending and receiving UDP messages.
+    virtual const LoopStatistics* getLoopStatistics() const;
+
+    virtual void run();
+
+    virtual void stop();
+
+    // The implementation is public for the convenience of the
+    // implementation of sockets and timers.
+    struct EpollMessageManagerImpl;
+
+private:
+    EpollMessageManagerImpl* impl_;
+};
+
+} // end of QueryPerf
+
+#endif // __QUERYPERF_EPOLL_MESSAGE_MANAGER_H
+
+// Local Variables:
+// mode: c++
+// End:
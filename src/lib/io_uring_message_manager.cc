@@ -0,0 +1,1675 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <config.h>
+
+#include <io_uring_message_manager.h>
+#include <resource_usage.h>
+#include <timer_wheel.h>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_EVENTFD_H)
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+// Multishot receive is the newest feature we need; its definition also
+// implies provided buffer rings and the other flags used below.
+#if defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT)
+#define USE_IO_URING 1
+#endif
+#endif
+
+using boost::lexical_cast;
+
+namespace Queryperf {
+
+#ifdef USE_IO_URING
+
+namespace {
+std::string
+errorText(const char* what, int error = errno) {
+    return (std::string(what) + ": " + std::strerror(error));
+}
+
+// We use the system calls directly, rather than depending on liburing.
+int
+ioUringSetup(unsigned int entries, struct io_uring_params* params) {
+    return (syscall(__NR_io_uring_setup, entries, params));
+}
+
+int
+ioUringEnter(int fd, unsigned int to_submit, unsigned int min_complete,
+             unsigned int flags)
+{
+    return (syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                    NULL, 0));
+}
+
+int
+ioUringRegister(int fd, unsigned int opcode, void* arg,
+                unsigned int nr_args)
+{
+    return (syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+// The type of a request, stored in its user data.
+enum OpCode {
+    OP_RECV = 1,
+    OP_SEND,
+    OP_CONNECT,
+    OP_SHUTDOWN,
+    OP_TIMEOUT,
+    OP_WAKEUP
+};
+
+// The base class of objects that submit requests.  Each object is
+// identified by an ID registered in the manager, which is encoded in the
+// user data of its requests along with the type of the request and an
+// additional argument (see makeUserData()).
+//
+// Objects are never deleted directly while the manager may still refer to
+// them; they are "retired" via the manager, which deletes them once all
+// of their requests complete.
+class CompletionHandler {
+public:
+    CompletionHandler() : id_(0), inflight_(0), dead_(false) {}
+    virtual ~CompletionHandler() {}
+
+    // Handle a completion of a request.  It's never called once retired.
+    virtual void complete(OpCode op, uint32_t arg, int32_t res,
+                          uint32_t flags) = 0;
+
+    uint32_t id_;
+    size_t inflight_;           // number of requests not completed
+    bool dead_;                 // retired; never called again
+};
+
+// The user data of requests whose completion is ignored.
+const uint64_t IGNORED_USER_DATA = 0;
+
+uint64_t
+makeUserData(const CompletionHandler& handler, OpCode op, uint32_t arg = 0) {
+    return ((static_cast<uint64_t>(handler.id_) << 32) |
+            (static_cast<uint64_t>(arg & 0xffffff) << 8) | op);
+}
+
+// Parameters of the ring.  The completion queue is made large enough so
+// it rarely overflows even with many multishot receives.
+const unsigned int SQ_ENTRIES = 256;
+const unsigned int CQ_ENTRIES = 4096;
+}
+
+struct IOUringMessageManager::IOUringMessageManagerImpl {
+    IOUringMessageManagerImpl(IOUringMessageManager& mgr);
+    ~IOUringMessageManagerImpl();
+
+    // Register a handler so it can submit requests.
+    void addHandler(CompletionHandler* handler);
+
+    // Release a handler; it's deleted immediately or once it's safe.
+    void retire(CompletionHandler* handler);
+
+    // Free retired handlers that no longer have pending requests.
+    void collectGarbage();
+
+    // Get a cleared submission queue entry for a request of the handler.
+    // It's submitted on the next call to submit().
+    struct io_uring_sqe* getSqe(CompletionHandler& handler, OpCode op,
+                                uint32_t arg = 0);
+
+    // Same as the above, for a request whose completion is ignored.
+    struct io_uring_sqe* getSqe();
+
+    // Move the available completions aside to make room in the completion
+    // queue without calling the handlers.  Return false if there's none.
+    bool deferCompletions();
+
+    // Register and unregister a ring of provided buffers.  The former
+    // returns the buffer group ID for the ring.
+    uint16_t registerBufferRing(void* ring, size_t entries);
+    void unregisterBufferRing(uint16_t bgid);
+
+    // Submit prepared requests, and wait for at least one completion if
+    // specified.
+    void submit(bool wait);
+
+    // Process the available completions, starting with the deferred ones,
+    // until there's no more or stop() is called.  Return false in the
+    // latter case.
+    bool processCompletions();
+
+    // Dispatch a single completion to its handler.
+    void completeRequest(const struct io_uring_cqe& cqe);
+
+    // Submit the read of the event descriptor.
+    void armWakeup();
+
+    // Let sockets with queued messages submit the send requests.
+    void flushSends();
+
+    bool isStopped() const {
+        return (__atomic_load_n(&stopped_, __ATOMIC_ACQUIRE));
+    }
+
+    void run();
+
+    IOUringMessageManager& mgr_;
+    int ring_fd_;
+    int event_fd_;              // to wake up io_uring_enter() on stop()
+    bool stopped_;              // accessed atomically
+    bool dispatching_;          // whether in run()
+    size_t work_count_;         // pending works that keep run() running
+
+    // The mapped rings.
+    void* ring_ptr_;
+    size_t ring_size_;
+    struct io_uring_sqe* sqes_;
+    size_t sqes_size_;
+    unsigned int* sq_khead_;
+    unsigned int* sq_ktail_;
+    unsigned int sq_mask_;
+    unsigned int sq_entries_;
+    unsigned int* sq_array_;
+    unsigned int* cq_khead_;
+    unsigned int* cq_ktail_;
+    unsigned int cq_mask_;
+    struct io_uring_cqe* cqes_;
+    std::vector<struct io_uring_cqe> deferred_cqes_;
+    size_t deferred_head_;      // next entry of deferred_cqes_ to process
+    unsigned int sq_tail_;      // local copy of the SQ tail
+    unsigned int unsubmitted_;  // prepared but not submitted entries
+
+    size_t inflight_count_;     // total number of pending requests
+    std::vector<CompletionHandler*> handlers_; // indexed by ID; 0 is unused
+    std::vector<uint32_t> free_ids_;
+    std::vector<CompletionHandler*> graveyard_;
+    std::vector<CompletionHandler*> flush_list_; // sockets with queued data
+    std::vector<uint16_t> free_bgids_;
+    uint16_t next_bgid_;
+    boost::scoped_ptr<CompletionHandler> wakeup_;
+    uint64_t wakeup_buf_;
+    std::vector<uint8_t> scratch_; // for discarding data
+    LoopStatistics loop_stats_;
+    // Destroyed first in the destructor.  Created on the first use.
+    boost::scoped_ptr<TimerWheel> timer_wheel_;
+};
+
+namespace {
+typedef IOUringMessageManager::IOUringMessageManagerImpl ManagerImpl;
+
+class WakeupHandler : public CompletionHandler {
+public:
+    WakeupHandler(ManagerImpl& mgr) : mgr_(mgr) {}
+    virtual void complete(OpCode, uint32_t, int32_t res, uint32_t) {
+        if (res < 0 && res != -EINTR) {
+            throw MessageSocketError(errorText("eventfd read failed", -res));
+        }
+        mgr_.armWakeup();
+    }
+private:
+    ManagerImpl& mgr_;
+};
+
+// The base class of socket implementations.  The public socket object
+// (IOUringMessageSocket) only holds a reference to it, so the
+// implementation can outlive the public object until its requests
+// complete.
+class SocketImpl : public CompletionHandler {
+public:
+    SocketImpl(ManagerImpl& mgr, int fd, MessageSocket::Callback callback) :
+        mgr_(mgr), fd_(fd), callback_(callback), flush_pending_(false)
+    {}
+    virtual ~SocketImpl() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+    virtual void send(const void* data, size_t datalen) = 0;
+
+    // Called on destruction of the public object.
+    virtual void cancel() = 0;
+
+    // Submit requests for queued messages.  Called by the manager for
+    // sockets in its flush list.  This must not call the callback.
+    virtual void flush() {}
+
+    // Called by the manager when the socket is removed from the flush list.
+    void clearFlushPending() { flush_pending_ = false; }
+
+protected:
+    // Register the socket in the flush list of the manager, if not yet.
+    void requestFlush() {
+        if (!flush_pending_) {
+            mgr_.flush_list_.push_back(this);
+            flush_pending_ = true;
+        }
+    }
+
+    // Remove the socket from the flush list of the manager, if it's there.
+    void cancelFlush() {
+        if (flush_pending_) {
+            mgr_.flush_list_.erase(std::find(mgr_.flush_list_.begin(),
+                                             mgr_.flush_list_.end(), this));
+            flush_pending_ = false;
+        }
+    }
+
+    // Cancel all pending requests on the socket.
+    void cancelRequests() {
+        if (inflight_ > 0) {
+            struct io_uring_sqe* sqe = mgr_.getSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = fd_;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD |
+                IORING_ASYNC_CANCEL_ALL;
+        }
+    }
+
+    ManagerImpl& mgr_;
+    int fd_;
+    const MessageSocket::Callback callback_;
+
+private:
+    bool flush_pending_;
+};
+
+class IOUringMessageSocket : public MessageSocket {
+public:
+    IOUringMessageSocket(SocketImpl* impl) : impl_(impl) {}
+    virtual ~IOUringMessageSocket() { impl_->cancel(); }
+    virtual void send(const void* data, size_t datalen) {
+        impl_->send(data, datalen);
+    }
+private:
+    SocketImpl* impl_;
+};
+
+// Convert a textual address and port to a socket address.
+socklen_t
+convertAddress(const std::string& address, uint16_t port,
+               struct sockaddr_storage& ss)
+{
+    std::memset(&ss, 0, sizeof(ss));
+    void* p = &ss;
+    struct sockaddr_in6* sin6 = static_cast<struct sockaddr_in6*>(p);
+    if (inet_pton(AF_INET6, address.c_str(), &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        return (sizeof(*sin6));
+    }
+    struct sockaddr_in* sin = static_cast<struct sockaddr_in*>(p);
+    if (inet_pton(AF_INET, address.c_str(), &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        return (sizeof(*sin));
+    }
+    throw MessageSocketError("Failed to create a socket: invalid address: " +
+                             address);
+}
+
+const struct sockaddr*
+toSockAddr(const struct sockaddr_storage& ss) {
+    const void* p = &ss;
+    return (static_cast<const struct sockaddr*>(p));
+}
+
+class UDPSocketImpl : public SocketImpl {
+public:
+    UDPSocketImpl(ManagerImpl& mgr, int fd, size_t recvbuf_len,
+                  MessageSocket::Callback callback);
+    virtual ~UDPSocketImpl();
+
+    // Set up the provided buffers.  This must be called after the socket
+    // is added to the manager.
+    void setup();
+
+    virtual void send(const void* data, size_t datalen);
+    virtual void cancel();
+    virtual void complete(OpCode op, uint32_t arg, int32_t res,
+                          uint32_t flags);
+
+private:
+    // The number of send buffers and their size.  The size is the same
+    // as that of the batch buffers of the ASIO version.
+    static const size_t SEND_SLOTS = 256;
+    static const size_t SEND_BUF_LEN = 512;
+    // The maximum number of receive buffers and their total size.
+    static const size_t MAX_RECV_BUFFERS = 256;
+    static const size_t MAX_RECV_BUFFER_SPACE = 1024 * 1024;
+
+    void armReceive();
+    void recycleBuffer(uint16_t bid);
+
+    const size_t recvbuf_len_;
+    size_t recvbuf_count_;      // power of 2
+    std::vector<uint8_t> recvbufs_;
+    struct io_uring_buf* buf_ring_; // ring of recvbuf_count_ entries
+    size_t buf_ring_size_;
+    uint16_t bgid_;
+    bool registered_;
+    bool receiving_;            // whether responses are expected
+    bool recv_armed_;           // whether the multishot receive is pending
+    std::vector<uint8_t> sendbufs_; // SEND_SLOTS * SEND_BUF_LEN
+    std::vector<uint16_t> free_slots_;
+};
+
+const size_t UDPSocketImpl::SEND_SLOTS;
+const size_t UDPSocketImpl::SEND_BUF_LEN;
+const size_t UDPSocketImpl::MAX_RECV_BUFFERS;
+const size_t UDPSocketImpl::MAX_RECV_BUFFER_SPACE;
+
+UDPSocketImpl::UDPSocketImpl(ManagerImpl& mgr, int fd, size_t recvbuf_len,
+                             MessageSocket::Callback callback) :
+    SocketImpl(mgr, fd, callback), recvbuf_len_(recvbuf_len),
+    recvbuf_count_(MAX_RECV_BUFFERS), buf_ring_(NULL), buf_ring_size_(0),
+    bgid_(0), registered_(false), receiving_(false), recv_armed_(false),
+    sendbufs_(SEND_SLOTS * SEND_BUF_LEN)
+{
+    while (recvbuf_count_ > 16 &&
+           recvbuf_count_ * recvbuf_len_ > MAX_RECV_BUFFER_SPACE) {
+        recvbuf_count_ /= 2;
+    }
+    recvbufs_.resize(recvbuf_count_ * recvbuf_len_);
+    for (size_t i = 0; i < SEND_SLOTS; ++i) {
+        free_slots_.push_back(SEND_SLOTS - i - 1);
+    }
+}
+
+UDPSocketImpl::~UDPSocketImpl() {
+    if (registered_) {
+        mgr_.unregisterBufferRing(bgid_);
+    }
+    if (buf_ring_ != NULL) {
+        munmap(buf_ring_, buf_ring_size_);
+    }
+}
+
+void
+UDPSocketImpl::setup() {
+    // The ring must be page aligned.
+    buf_ring_size_ = recvbuf_count_ * sizeof(struct io_uring_buf);
+    void* p = mmap(NULL, buf_ring_size_, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        throw MessageSocketError(errorText("Failed to allocate buffer ring"));
+    }
+    buf_ring_ = static_cast<struct io_uring_buf*>(p);
+    bgid_ = mgr_.registerBufferRing(buf_ring_, recvbuf_count_);
+    registered_ = true;
+    for (size_t i = 0; i < recvbuf_count_; ++i) {
+        recycleBuffer(i);
+    }
+}
+
+void
+UDPSocketImpl::recycleBuffer(uint16_t bid) {
+    // The tail of the ring overlays the reserved field of the first entry.
+    uint16_t* const ktail = &buf_ring_[0].resv;
+    const uint16_t tail = *ktail;
+    struct io_uring_buf& buf = buf_ring_[tail & (recvbuf_count_ - 1)];
+    buf.addr = reinterpret_cast<uintptr_t>(&recvbufs_[bid * recvbuf_len_]);
+    buf.len = recvbuf_len_;
+    buf.bid = bid;
+    __atomic_store_n(ktail, static_cast<uint16_t>(tail + 1),
+                     __ATOMIC_RELEASE);
+}
+
+void
+UDPSocketImpl::armReceive() {
+    struct io_uring_sqe* sqe = mgr_.getSqe(*this, OP_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd_;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid_;
+    recv_armed_ = true;
+}
+
+void
+UDPSocketImpl::send(const void* data, size_t datalen) {
+    if (!receiving_) {
+        // From now on responses are expected.
+        ++mgr_.work_count_;
+        receiving_ = true;
+        armReceive();
+    }
+    if (datalen > SEND_BUF_LEN || free_slots_.empty()) {
+        // We can't keep the data until completion; send it immediately.
+        while (::send(fd_, data, datalen, 0) < 0) {
+            if (errno != EINTR) {
+                throw MessageSocketError(
+                    errorText("Unexpected failure on socket send"));
+            }
+        }
+        return;
+    }
+    const uint16_t slot = free_slots_.back();
+    free_slots_.pop_back();
+    uint8_t* buf = &sendbufs_[slot * SEND_BUF_LEN];
+    std::memcpy(buf, data, datalen);
+    struct io_uring_sqe* sqe = mgr_.getSqe(*this, OP_SEND, slot);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd_;
+    sqe->addr = reinterpret_cast<uintptr_t>(buf);
+    sqe->len = datalen;
+}
+
+void
+UDPSocketImpl::cancel() {
+    // Pending sends are completed as the ASIO version does, so only the
+    // receive is cancelled.
+    if (recv_armed_) {
+        struct io_uring_sqe* sqe = mgr_.getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = makeUserData(*this, OP_RECV);
+    }
+    if (receiving_) {
+        --mgr_.work_count_;
+    }
+    mgr_.retire(this);
+}
+
+void
+UDPSocketImpl::complete(OpCode op, uint32_t arg, int32_t res,
+                        uint32_t flags)
+{
+    if (op == OP_SEND) {
+        free_slots_.push_back(arg);
+        if (res < 0) {
+            throw MessageSocketError(
+                errorText("Unexpected failure on socket send", -res));
+        }
+        return;
+    }
+
+    if ((flags & IORING_CQE_F_MORE) == 0) {
+        recv_armed_ = false;
+    }
+    if (res >= 0 && (flags & IORING_CQE_F_BUFFER) != 0) {
+        const uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        callback_(MessageSocket::Event(&recvbufs_[bid * recvbuf_len_], res));
+        if (dead_) {
+            return;
+        }
+        recycleBuffer(bid);
+    } else if (res < 0 && res != -ENOBUFS) {
+        throw MessageSocketError(
+            errorText("unexpected failure on socket read", -res));
+    }
+    // The multishot receive terminates when it runs out of buffers (which
+    // have been recycled by now) or in some other rare cases.
+    if (!recv_armed_) {
+        armReceive();
+    }
+}
+
+class TCPSocketImpl : public SocketImpl {
+public:
+    TCPSocketImpl(ManagerImpl& mgr, const std::string& address,
+                  uint16_t port, void* recvbuf,
+                  MessageSocket::Callback callback) :
+        SocketImpl(mgr, -1, callback), recvbuf_(static_cast<uint8_t*>(recvbuf)),
+        read_buf_(NULL), state_(INIT), sent_len_(0), msglen_(0),
+        read_len_(0), recvdata_len_(0)
+    {
+        dest_len_ = convertAddress(address, port, dest_);
+    }
+
+    virtual void send(const void* data, size_t datalen);
+    virtual void cancel();
+    virtual void complete(OpCode op, uint32_t arg, int32_t res,
+                          uint32_t flags);
+
+private:
+    enum State {
+        INIT,                   // not started
+        READ_LENGTH,            // reading the length of the next message
+        READ_DATA,              // reading the data of a message
+        DONE                    // completed, successfully or not
+    };
+
+    // Submit the rest of the query, followed by the shutdown and the read.
+    void submitWrite(uint8_t flags);
+
+    // Submit the read for the current state.
+    void submitRead(uint8_t flags = 0);
+
+    void handleRead(int32_t res);
+
+    // Complete the session and call the callback.  The object may be
+    // retired in the callback, so the caller must return immediately.
+    void complete(const void* data, size_t datalen) {
+        state_ = DONE;
+        --mgr_.work_count_;
+        callback_(MessageSocket::Event(data, datalen, &transfer_));
+    }
+
+    struct sockaddr_storage dest_;
+    socklen_t dest_len_;
+    uint8_t* recvbuf_;        // for the first message (must be of > 64KB)
+    MessageSocket::TransferInfo transfer_; // summary of all messages
+    const uint8_t* read_buf_;   // buffer of the pending read
+    State state_;
+    std::vector<uint8_t> sendbuf_; // length and data of the query
+    size_t sent_len_;
+    uint8_t msglen_buf_[2];
+    size_t msglen_;             // length of the message being read
+    size_t read_len_;           // bytes read for the current field
+    size_t recvdata_len_;       // actual message length of the first message
+    uint8_t header_buf_[12];    // header of subsequent messages
+};
+
+void
+TCPSocketImpl::send(const void* data, size_t datalen) {
+    if (state_ != INIT) {
+        throw MessageSocketError("duplicate send on a TCP socket");
+    }
+    sendbuf_.resize(datalen + 2);
+    sendbuf_[0] = datalen >> 8;
+    sendbuf_[1] = datalen & 0xff;
+    std::memcpy(&sendbuf_[2], data, datalen);
+
+    fd_ = socket(dest_.ss_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd_ < 0) {
+        throw MessageSocketError(errorText("Failed to create a socket"));
+    }
+    // The whole session is submitted at once.  If any of the requests
+    // fails, the subsequent ones are cancelled.
+    struct io_uring_sqe* sqe = mgr_.getSqe(*this, OP_CONNECT);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd_;
+    sqe->addr = reinterpret_cast<uintptr_t>(&dest_);
+    sqe->off = dest_len_;
+    sqe->flags = IOSQE_IO_LINK;
+    state_ = READ_LENGTH;
+    ++mgr_.work_count_;
+    submitWrite(IOSQE_IO_LINK);
+}
+
+void
+TCPSocketImpl::submitWrite(uint8_t flags) {
+    struct io_uring_sqe* sqe = mgr_.getSqe(*this, OP_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd_;
+    sqe->addr = reinterpret_cast<uintptr_t>(&sendbuf_[sent_len_]);
+    sqe->len = sendbuf_.size() - sent_len_;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->flags = flags;
+
+    // Immediately after sending the query, shutdown the outbound direction
+    // of the socket, so the server won't wait for subsequent queries.
+    sqe = mgr_.getSqe(*this, OP_SHUTDOWN);
+    sqe->opcode = IORING_OP_SHUTDOWN;
+    sqe->fd = fd_;
+    sqe->len = SHUT_WR;
+    sqe->flags = IOSQE_IO_LINK;
+    submitRead(0);
+}
+
+void
+TCPSocketImpl::submitRead(uint8_t flags) {
+    // We keep the first message in recvbuf_ for callback, and read
+    // subsequent ones (such as those of AXFR) into the scratch buffer, only
+    // counting them, until the server closes the connection.  The scratch
+    // buffer is shared by all sockets and can be overwritten before the
+    // completion is handled, so the header of these messages is read into
+    // a separate buffer.
+    for (;;) {
+        uint8_t* buf;
+        size_t len;
+        if (state_ == READ_LENGTH) {
+            buf = msglen_buf_ + read_len_;
+            len = sizeof(msglen_buf_) - read_len_;
+        } else if (recvdata_len_ == 0) {
+            buf = recvbuf_ + read_len_;
+            len = msglen_ - read_len_;
+        } else if (read_len_ < sizeof(header_buf_)) {
+            buf = header_buf_ + read_len_;
+            len = std::min(msglen_, sizeof(header_buf_)) - read_len_;
+        } else {
+            buf = &mgr_.scratch_[0];
+            len = std::min(msglen_ - read_len_, mgr_.scratch_.size());
+        }
+        read_buf_ = buf;
+        if (len == 0) {         // empty message; go to the next one
+            handleRead(0);
+            continue;
+        }
+        struct io_uring_sqe* sqe = mgr_.getSqe(*this, OP_RECV);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd_;
+        sqe->addr = reinterpret_cast<uintptr_t>(buf);
+        sqe->len = len;
+        sqe->msg_flags = MSG_WAITALL;
+        sqe->flags = flags;
+        return;
+    }
+}
+
+void
+TCPSocketImpl::handleRead(int32_t res) {
+    transfer_.addBytes(res);
+    if (state_ == READ_DATA) {
+        transfer_.addData(read_len_, read_buf_, res);
+    }
+    read_len_ += res;
+    if (state_ == READ_LENGTH && read_len_ == sizeof(msglen_buf_)) {
+        msglen_ = msglen_buf_[0] * 256 + msglen_buf_[1];
+        state_ = READ_DATA;
+        read_len_ = 0;
+    } else if (state_ == READ_DATA && read_len_ == msglen_) {
+        transfer_.addMessage();
+        if (recvdata_len_ == 0) {
+            recvdata_len_ = msglen_;
+        }
+        state_ = READ_LENGTH;
+        read_len_ = 0;
+    }
+}
+
+void
+TCPSocketImpl::cancel() {
+    if (state_ != INIT && state_ != DONE) {
+        --mgr_.work_count_;
+    }
+    state_ = DONE;
+    cancelRequests();
+    mgr_.retire(this);
+}
+
+void
+TCPSocketImpl::complete(OpCode op, uint32_t, int32_t res, uint32_t) {
+    // Requests following a failed one in the chain are cancelled; they are
+    // simply ignored.
+    if (state_ == DONE || res == -ECANCELED) {
+        return;
+    }
+    switch (op) {
+    case OP_CONNECT:
+        if (res < 0) {
+            std::cerr << "[Warn] TCP connect failed: " << std::strerror(-res)
+                      << std::endl;
+            complete(NULL, 0);
+        }
+        break;
+    case OP_SEND:
+        if (res < 0) {
+            std::cerr << "[Warn] TCP send failed: " << std::strerror(-res)
+                      << std::endl;
+            complete(NULL, 0);
+            return;
+        }
+        sent_len_ += res;
+        if (sent_len_ < sendbuf_.size()) {
+            // A short write breaks the chain; submit the rest again.
+            submitWrite(IOSQE_IO_LINK);
+        }
+        break;
+    case OP_SHUTDOWN:
+        if (res < 0) {
+            std::cerr << "[Warn] failed to shut down TCP socket: "
+                      << std::strerror(-res) << std::endl;
+            complete(NULL, 0);
+        }
+        break;
+    case OP_RECV:
+        if (res < 0) {
+            std::cerr << "[Warn] failed to read TCP message: "
+                      << std::strerror(-res) << std::endl;
+            complete(NULL, recvdata_len_);
+        } else if (res == 0) {
+            // We've received all messages.  Note that this includes the case
+            // where the server closes the connection without sending any
+            // message or with partial message.
+            complete(recvbuf_, recvdata_len_);
+        } else {
+            handleRead(res);
+            submitRead();
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// A persistent TCP connection (see
+// MessageManager::createStreamMessageSocket()).  Messages queued by send()
+// are written by a single send request when the manager flushes sockets
+// before waiting for completions; those queued while a send request is
+// pending are written on its completion.  A single receive request reads
+// as much data as available into the receive buffer.
+//
+// Requests of a connection carry its generation in their argument, so
+// late completions of a closed connection are ignored.  Since they may
+// still refer to the buffers and the socket, a new connection isn't made
+// until all of them complete.
+class StreamSocketImpl : public SocketImpl {
+public:
+    StreamSocketImpl(ManagerImpl& mgr, const std::string& address,
+                     uint16_t port, MessageSocket::Callback callback) :
+        SocketImpl(mgr, -1, callback), state_(CLOSED), generation_(0),
+        writing_(false), receiving_(false), recvbuf_(RECVBUF_LEN),
+        recvdata_len_(0)
+    {
+        dest_len_ = convertAddress(address, port, dest_);
+    }
+
+    virtual void send(const void* data, size_t datalen);
+    virtual void cancel();
+    virtual void flush();
+    virtual void complete(OpCode op, uint32_t arg, int32_t res,
+                          uint32_t flags);
+
+private:
+    // Same as that of the ASIO version.
+    static const size_t RECVBUF_LEN = 131072;
+
+    enum State {
+        CLOSED,
+        WAITING,                // waiting for the previous connection to
+                                // be cleaned up before reconnecting
+        CONNECTING,
+        CONNECTED
+    };
+
+    uint32_t getArg() const { return (generation_ & 0xffffff); }
+    void startConnect();
+    void submitRead();
+    void handleRead(int32_t res);
+
+    // Cancel the pending requests of the current connection.
+    void cancelPending();
+
+    // Close the socket of the previous connection once all of its requests
+    // complete, and reconnect if necessary.
+    void finishClose();
+
+    // Close the connection and call the callback.  If \c what isn't NULL,
+    // it's an unexpected error and is logged with the error code.  The
+    // object may be retired in the callback, so the caller must return
+    // immediately.
+    void terminate(const char* what, int error);
+
+    struct sockaddr_storage dest_;
+    socklen_t dest_len_;
+    State state_;
+    uint32_t generation_;       // incremented on each connection
+    bool writing_;              // a send request is pending
+    bool receiving_;            // a receive request is pending
+    std::vector<uint8_t> sendbuf_;  // queued messages not yet being written
+    std::vector<uint8_t> writebuf_; // messages being written
+    std::vector<uint8_t> recvbuf_;  // RECVBUF_LEN bytes
+    size_t recvdata_len_;           // bytes stored in recvbuf_
+};
+
+const size_t StreamSocketImpl::RECVBUF_LEN;
+
+void
+StreamSocketImpl::send(const void* data, size_t datalen) {
+    if (state_ == CLOSED) {
+        ++mgr_.work_count_;
+        state_ = WAITING;
+        finishClose();
+    }
+    sendbuf_.push_back(datalen >> 8);
+    sendbuf_.push_back(datalen & 0xff);
+    const uint8_t* const cp = static_cast<const uint8_t*>(data);
+    sendbuf_.insert(sendbuf_.end(), cp, cp + datalen);
+    if (state_ == CONNECTED && !writing_) {
+        requestFlush();
+    }
+}
+
+void
+StreamSocketImpl::startConnect() {
+    fd_ = socket(dest_.ss_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd_ < 0) {
+        throw MessageSocketError(errorText("Failed to create a socket"));
+    }
+    ++generation_;
+    struct io_uring_sqe* sqe = mgr_.getSqe(*this, OP_CONNECT, getArg());
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd_;
+    sqe->addr = reinterpret_cast<uintptr_t>(&dest_);
+    sqe->off = dest_len_;
+    state_ = CONNECTING;
+}
+
+void
+StreamSocketImpl::finishClose() {
+    if (inflight_ > 0) {
+        return;
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+    if (state_ == WAITING) {
+        startConnect();
+    }
+}
+
+void
+StreamSocketImpl::cancelPending() {
+    const OpCode ops[] = { OP_CONNECT, OP_SEND, OP_RECV };
+    const bool pending[] = { state_ == CONNECTING, writing_, receiving_ };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+        if (pending[i]) {
+            struct io_uring_sqe* sqe = mgr_.getSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = makeUserData(*this, ops[i], getArg());
+        }
+    }
+    writing_ = false;
+    receiving_ = false;
+}
+
+void
+StreamSocketImpl::cancel() {
+    cancelFlush();
+    cancelPending();
+    if (state_ != CLOSED) {
+        --mgr_.work_count_;
+        state_ = CLOSED;
+    }
+    mgr_.retire(this);
+}
+
+void
+StreamSocketImpl::flush() {
+    if (state_ != CONNECTED || writing_ || sendbuf_.empty()) {
+        return;
+    }
+    writebuf_.swap(sendbuf_);
+    sendbuf_.clear();
+    struct io_uring_sqe* sqe = mgr_.getSqe(*this, OP_SEND, getArg());
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd_;
+    sqe->addr = reinterpret_cast<uintptr_t>(&writebuf_[0]);
+    sqe->len = writebuf_.size();
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    writing_ = true;
+}
+
+void
+StreamSocketImpl::submitRead() {
+    struct io_uring_sqe* sqe = mgr_.getSqe(*this, OP_RECV, getArg());
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd_;
+    sqe->addr = reinterpret_cast<uintptr_t>(&recvbuf_[recvdata_len_]);
+    sqe->len = RECVBUF_LEN - recvdata_len_;
+    receiving_ = true;
+}
+
+void
+StreamSocketImpl::complete(OpCode op, uint32_t arg, int32_t res, uint32_t) {
+    if ((state_ != CONNECTING && state_ != CONNECTED) || arg != getArg()) {
+        finishClose();          // a request of a closed connection
+        return;
+    }
+    switch (op) {
+    case OP_CONNECT:
+        if (res < 0) {
+            terminate("TCP connect failed", -res);
+            return;
+        }
+        state_ = CONNECTED;
+        {
+            // Queries are generally small and sent without waiting for
+            // responses to previous ones, so we don't want them to be
+            // delayed.
+            const int on = 1;
+            setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        submitRead();
+        flush();
+        break;
+    case OP_SEND:
+        writing_ = false;
+        if (res < 0) {
+            terminate("TCP send failed", -res);
+            return;
+        }
+        if (static_cast<size_t>(res) < writebuf_.size()) {
+            // Shouldn't happen with MSG_WAITALL, but just in case; the rest
+            // is written first.
+            sendbuf_.insert(sendbuf_.begin(), writebuf_.begin() + res,
+                            writebuf_.end());
+        }
+        flush();
+        break;
+    case OP_RECV:
+        receiving_ = false;
+        if (res < 0) {
+            terminate("failed to read TCP message", -res);
+        } else if (res == 0) {
+            // The server closed the connection.  This is a normal event
+            // (e.g., due to idle timeout), so we don't log it.
+            terminate(NULL, 0);
+        } else {
+            handleRead(res);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void
+StreamSocketImpl::handleRead(int32_t res) {
+    // Deliver all complete messages, then move the remaining partial
+    // message, if any, to the beginning of the buffer.
+    recvdata_len_ += res;
+    size_t offset = 0;
+    while (recvdata_len_ - offset >= 2) {
+        const size_t msglen = recvbuf_[offset] * 256 + recvbuf_[offset + 1];
+        if (recvdata_len_ - offset < msglen + 2) {
+            break;
+        }
+        callback_(MessageSocket::Event(&recvbuf_[offset + 2], msglen));
+        if (dead_) {
+            return;
+        }
+        offset += msglen + 2;
+    }
+    if (offset > 0) {
+        std::memmove(&recvbuf_[0], &recvbuf_[offset], recvdata_len_ - offset);
+        recvdata_len_ -= offset;
+    }
+    submitRead();
+}
+
+void
+StreamSocketImpl::terminate(const char* what, int error) {
+    if (what != NULL) {
+        std::cerr << "[Warn] " << what << ": " << std::strerror(error)
+                  << std::endl;
+    }
+    cancelFlush();
+    cancelPending();
+    state_ = CLOSED;
+    --mgr_.work_count_;
+    sendbuf_.clear();
+    recvdata_len_ = 0;
+    callback_(MessageSocket::Event(NULL, 0));
+    if (!dead_) {
+        finishClose();
+    }
+}
+
+// Timers are implemented as absolute timeout requests.  A request is
+// submitted only when the timer is started while no request is pending
+// or the new expiration is earlier than that of the pending one (in which
+// case the pending one is updated).  When a request completes before the
+// current expiration, it's just submitted again.
+class TimerImpl : public CompletionHandler {
+public:
+    TimerImpl(ManagerImpl& mgr, MessageTimer::Callback callback) :
+        mgr_(mgr), callback_(callback), active_(false), armed_(false),
+        expire_(0), armed_expire_(0)
+    {}
+
+    void start(const boost::posix_time::time_duration& duration) {
+        const int64_t usec = duration.total_microseconds();
+        expire_ = getMonotonicTime() + (usec > 0 ? usec : 0);
+        if (!active_) {
+            ++mgr_.work_count_;
+            active_ = true;
+        }
+        if (!armed_) {
+            arm();
+        } else if (expire_ < armed_expire_) {
+            // This fails if the pending request has completed, which is
+            // okay as the completion will check the new expiration.
+            setTimespec(update_ts_, expire_);
+            struct io_uring_sqe* sqe = mgr_.getSqe();
+            sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+            sqe->addr = makeUserData(*this, OP_TIMEOUT);
+            sqe->addr2 = reinterpret_cast<uintptr_t>(&update_ts_);
+            sqe->timeout_flags = IORING_TIMEOUT_UPDATE | IORING_TIMEOUT_ABS;
+            armed_expire_ = expire_;
+        }
+    }
+
+    void cancel() {
+        // The pending request, if any, is kept for later use.
+        if (active_) {
+            --mgr_.work_count_;
+            active_ = false;
+        }
+    }
+
+    void destroy() {
+        cancel();
+        if (armed_) {
+            struct io_uring_sqe* sqe = mgr_.getSqe();
+            sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+            sqe->addr = makeUserData(*this, OP_TIMEOUT);
+        }
+        mgr_.retire(this);
+    }
+
+    virtual void complete(OpCode, uint32_t, int32_t res, uint32_t) {
+        armed_ = false;
+        if (res < 0 && res != -ETIME && res != -ECANCELED) {
+            throw MessageTimerError(
+                errorText("Unexpected failure on timer", -res));
+        }
+        if (!active_) {
+            return;
+        }
+        if (getMonotonicTime() < expire_) {
+            arm();              // restarted with a later expiration
+            return;
+        }
+        active_ = false;
+        --mgr_.work_count_;
+        callback_();
+    }
+
+private:
+    static void setTimespec(struct __kernel_timespec& ts, uint64_t usec) {
+        ts.tv_sec = usec / 1000000;
+        ts.tv_nsec = (usec % 1000000) * 1000;
+    }
+
+    void arm() {
+        setTimespec(ts_, expire_);
+        struct io_uring_sqe* sqe = mgr_.getSqe(*this, OP_TIMEOUT);
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = reinterpret_cast<uintptr_t>(&ts_);
+        sqe->len = 1;
+        sqe->timeout_flags = IORING_TIMEOUT_ABS;
+        armed_ = true;
+        armed_expire_ = expire_;
+    }
+
+    ManagerImpl& mgr_;
+    const MessageTimer::Callback callback_;
+    bool active_;               // started and not expired or cancelled
+    bool armed_;                // a timeout request is pending
+    uint64_t expire_;           // in the monotonic clock, microseconds
+    uint64_t armed_expire_;     // expiration of the pending request
+    // These must be kept until the request is submitted.
+    struct __kernel_timespec ts_;
+    struct __kernel_timespec update_ts_;
+};
+
+class IOUringMessageTimer : public MessageTimer {
+public:
+    IOUringMessageTimer(TimerImpl* impl) : impl_(impl) {}
+    virtual ~IOUringMessageTimer() { impl_->destroy(); }
+    virtual void start(const boost::posix_time::time_duration& duration) {
+        impl_->start(duration);
+    }
+    virtual void cancel() { impl_->cancel(); }
+private:
+    TimerImpl* impl_;
+};
+}
+
+IOUringMessageManager::IOUringMessageManagerImpl::IOUringMessageManagerImpl(
+    IOUringMessageManager& mgr) :
+    mgr_(mgr), ring_fd_(-1), event_fd_(-1), stopped_(false),
+    dispatching_(false), work_count_(0), ring_ptr_(MAP_FAILED),
+    ring_size_(0), sqes_(NULL), sqes_size_(0), deferred_head_(0),
+    sq_tail_(0), unsubmitted_(0),
+    inflight_count_(0), handlers_(1, static_cast<CompletionHandler*>(NULL)),
+    next_bgid_(0), wakeup_buf_(0),
+    scratch_(std::numeric_limits<uint16_t>::max())
+{
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP |
+        IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = CQ_ENTRIES;
+    ring_fd_ = ioUringSetup(SQ_ENTRIES, &params);
+    if (ring_fd_ < 0) {
+        throw MessageSocketError(errorText("io_uring_setup failed"));
+    }
+    const unsigned int required = IORING_FEAT_SINGLE_MMAP |
+        IORING_FEAT_NODROP;
+    if ((params.features & required) != required) {
+        close(ring_fd_);
+        throw MessageSocketError("io_uring of this system is too old");
+    }
+
+    // The submission and completion queue rings share a single mapping.
+    const size_t sq_size = params.sq_off.array +
+        params.sq_entries * sizeof(unsigned int);
+    const size_t cq_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    ring_size_ = sq_size > cq_size ? sq_size : cq_size;
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring_ptr_ = mmap(NULL, ring_size_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    void* sqes = ring_ptr_ == MAP_FAILED ? MAP_FAILED :
+        mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        const std::string error = errorText("failed to map io_uring");
+        if (ring_ptr_ != MAP_FAILED) {
+            munmap(ring_ptr_, ring_size_);
+        }
+        close(ring_fd_);
+        throw MessageSocketError(error);
+    }
+    sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+    uint8_t* const ring = static_cast<uint8_t*>(ring_ptr_);
+    void* p;
+    p = ring + params.sq_off.head;
+    sq_khead_ = static_cast<unsigned int*>(p);
+    p = ring + params.sq_off.tail;
+    sq_ktail_ = static_cast<unsigned int*>(p);
+    p = ring + params.sq_off.ring_mask;
+    sq_mask_ = *static_cast<unsigned int*>(p);
+    sq_entries_ = params.sq_entries;
+    p = ring + params.sq_off.array;
+    sq_array_ = static_cast<unsigned int*>(p);
+    p = ring + params.cq_off.head;
+    cq_khead_ = static_cast<unsigned int*>(p);
+    p = ring + params.cq_off.tail;
+    cq_ktail_ = static_cast<unsigned int*>(p);
+    p = ring + params.cq_off.ring_mask;
+    cq_mask_ = *static_cast<unsigned int*>(p);
+    p = ring + params.cq_off.cqes;
+    cqes_ = static_cast<struct io_uring_cqe*>(p);
+    sq_tail_ = *sq_ktail_;
+
+    event_fd_ = eventfd(0, EFD_CLOEXEC);
+    if (event_fd_ < 0) {
+        const std::string error = errorText("eventfd failed");
+        munmap(sqes_, sqes_size_);
+        munmap(ring_ptr_, ring_size_);
+        close(ring_fd_);
+        throw MessageSocketError(error);
+    }
+    wakeup_.reset(new WakeupHandler(*this));
+    addHandler(wakeup_.get());
+    armWakeup();
+}
+
+IOUringMessageManager::IOUringMessageManagerImpl::~IOUringMessageManagerImpl()
+{
+    timer_wheel_.reset();
+
+    // Cancel all pending requests and wait for their completion, so the
+    // kernel never refers to the memory of the handlers being deleted.
+    wakeup_->dead_ = true;
+    __atomic_store_n(&stopped_, false, __ATOMIC_RELEASE);
+    if (inflight_count_ > 0) {
+        struct io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+    }
+    try {
+        while (inflight_count_ > 0) {
+            submit(deferred_cqes_.empty());
+            processCompletions();
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "[Warn] failed to clean up io_uring: " << ex.what()
+                  << std::endl;
+    }
+    dispatching_ = false;
+    collectGarbage();
+    wakeup_.reset();
+    close(event_fd_);
+    munmap(sqes_, sqes_size_);
+    munmap(ring_ptr_, ring_size_);
+    close(ring_fd_);
+}
+
+void
+IOUringMessageManager::IOUringMessageManagerImpl::addHandler(
+    CompletionHandler* handler)
+{
+    if (free_ids_.empty()) {
+        handler->id_ = handlers_.size();
+        handlers_.push_back(handler);
+    } else {
+        handler->id_ = free_ids_.back();
+        free_ids_.pop_back();
+        handlers_[handler->id_] = handler;
+    }
+}
+
+void
+IOUringMessageManager::IOUringMessageManagerImpl::retire(
+    CompletionHandler* handler)
+{
+    handler->dead_ = true;
+    graveyard_.push_back(handler);
+    if (!dispatching_) {
+        collectGarbage();
+    }
+}
+
+void
+IOUringMessageManager::IOUringMessageManagerImpl::collectGarbage() {
+    size_t n_kept = 0;
+    for (size_t i = 0; i < graveyard_.size(); ++i) {
+        CompletionHandler* handler = graveyard_[i];
+        if (handler->inflight_ > 0) {
+            graveyard_[n_kept++] = handler; // still referred to by requests
+        } else {
+            handlers_[handler->id_] = NULL;
+            free_ids_.push_back(handler->id_);
+            if (handler != wakeup_.get()) {
+                delete handler;
+            }
+        }
+    }
+    graveyard_.resize(n_kept);
+}
+
+struct io_uring_sqe*
+IOUringMessageManager::IOUringMessageManagerImpl::getSqe() {
+    // If the queue is full, submit the entries to make room.  The kernel
+    // may not take them until the completion queue is consumed (EBUSY), or
+    // may be short of resources (EAGAIN); retry until it does, as the last
+    // entry can't be overwritten.  We may be called from a completion
+    // handler, so the completions are only moved aside here.
+    while (sq_tail_ - __atomic_load_n(sq_khead_, __ATOMIC_ACQUIRE) ==
+           sq_entries_) {
+        submit(false);
+        if (sq_tail_ - __atomic_load_n(sq_khead_, __ATOMIC_ACQUIRE) ==
+            sq_entries_ && !deferCompletions()) {
+            sched_yield();
+        }
+    }
+    const unsigned int index = sq_tail_ & sq_mask_;
+    struct io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = IGNORED_USER_DATA;
+    sq_array_[index] = index;
+    ++sq_tail_;
+    ++unsubmitted_;
+    return (sqe);
+}
+
+struct io_uring_sqe*
+IOUringMessageManager::IOUringMessageManagerImpl::getSqe(
+    CompletionHandler& handler, OpCode op, uint32_t arg)
+{
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->user_data = makeUserData(handler, op, arg);
+    ++handler.inflight_;
+    ++inflight_count_;
+    return (sqe);
+}
+
+uint16_t
+IOUringMessageManager::IOUringMessageManagerImpl::registerBufferRing(
+    void* ring, size_t entries)
+{
+    uint16_t bgid;
+    if (free_bgids_.empty()) {
+        if (next_bgid_ == std::numeric_limits<uint16_t>::max()) {
+            throw MessageSocketError("too many UDP sockets");
+        }
+        bgid = next_bgid_++;
+    } else {
+        bgid = free_bgids_.back();
+        free_bgids_.pop_back();
+    }
+    struct io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uintptr_t>(ring);
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (ioUringRegister(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        free_bgids_.push_back(bgid);
+        throw MessageSocketError(
+            errorText("Failed to register provided buffers"));
+    }
+    return (bgid);
+}
+
+void
+IOUringMessageManager::IOUringMessageManagerImpl::unregisterBufferRing(
+    uint16_t bgid)
+{
+    struct io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.bgid = bgid;
+    ioUringRegister(ring_fd_, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    free_bgids_.push_back(bgid);
+}
+
+void
+IOUringMessageManager::IOUringMessageManagerImpl::submit(bool wait) {
+    __atomic_store_n(sq_ktail_, sq_tail_, __ATOMIC_RELEASE);
+    for (;;) {
+        const int n = ioUringEnter(ring_fd_, unsubmitted_, wait ? 1 : 0,
+                                   wait ? IORING_ENTER_GETEVENTS : 0);
+        if (n >= 0) {
+            unsubmitted_ -= n;
+            return;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EBUSY || errno == EAGAIN) {
+            // The completion queue is overflowing, or the kernel is
+            // temporarily short of resources; completions need to be
+            // processed first.
+            return;
+        }
+        throw MessageSocketError(errorText("io_uring_enter failed"));
+    }
+}
+
+bool
+IOUringMessageManager::IOUringMessageManagerImpl::deferCompletions() {
+    const unsigned int head = *cq_khead_;
+    const unsigned int tail = __atomic_load_n(cq_ktail_, __ATOMIC_ACQUIRE);
+    for (unsigned int i = head; i != tail; ++i) {
+        deferred_cqes_.push_back(cqes_[i & cq_mask_]);
+    }
+    __atomic_store_n(cq_khead_, tail, __ATOMIC_RELEASE);
+    return (head != tail);
+}
+
+bool
+IOUringMessageManager::IOUringMessageManagerImpl::processCompletions() {
+    // Handlers may defer more completions while we're processing them, so
+    // the entries are referred to by index and copied.
+    while (deferred_head_ < deferred_cqes_.size()) {
+        if (isStopped()) {
+            return (false);
+        }
+        const struct io_uring_cqe cqe = deferred_cqes_[deferred_head_++];
+        completeRequest(cqe);
+    }
+    deferred_cqes_.clear();
+    deferred_head_ = 0;
+
+    for (;;) {
+        const unsigned int head = *cq_khead_;
+        if (head == __atomic_load_n(cq_ktail_, __ATOMIC_ACQUIRE)) {
+            return (true);
+        }
+        if (isStopped()) {
+            return (false);
+        }
+        // Consume the entry before processing it, so it won't be processed
+        // again even if the handler throws.
+        const struct io_uring_cqe cqe = cqes_[head & cq_mask_];
+        __atomic_store_n(cq_khead_, head + 1, __ATOMIC_RELEASE);
+        completeRequest(cqe);
+    }
+}
+
+void
+IOUringMessageManager::IOUringMessageManagerImpl::completeRequest(
+    const struct io_uring_cqe& cqe)
+{
+    if (cqe.user_data == IGNORED_USER_DATA) {
+        return;
+    }
+    CompletionHandler* handler = handlers_[cqe.user_data >> 32];
+    if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+        --handler->inflight_;
+        --inflight_count_;
+    }
+    if (!handler->dead_) {
+        handler->complete(static_cast<OpCode>(cqe.user_data & 0xff),
+                          (cqe.user_data >> 8) & 0xffffff, cqe.res,
+                          cqe.flags);
+    }
+}
+
+void
+IOUringMessageManager::IOUringMessageManagerImpl::armWakeup() {
+    struct io_uring_sqe* sqe = getSqe(*wakeup_, OP_WAKEUP);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = event_fd_;
+    sqe->addr = reinterpret_cast<uintptr_t>(&wakeup_buf_);
+    sqe->len = sizeof(wakeup_buf_);
+}
+
+void
+IOUringMessageManager::IOUringMessageManagerImpl::flushSends() {
+    // Sockets remove themselves from the list when retired, so all of them
+    // are alive.
+    for (size_t i = 0; i < flush_list_.size(); ++i) {
+        SocketImpl* sock = static_cast<SocketImpl*>(flush_list_[i]);
+        sock->clearFlushPending();
+        sock->flush();
+    }
+    flush_list_.clear();
+}
+
+void
+IOUringMessageManager::IOUringMessageManagerImpl::run() {
+    for (;;) {
+        collectGarbage();
+        if (!processCompletions()) {
+            break;              // stopped
+        }
+        if (work_count_ == 0 || isStopped()) {
+            break;
+        }
+        // Requests prepared so far are submitted along with the wait.
+        flushSends();
+        const uint64_t wait_start = getMonotonicTime();
+        // Don't wait if some completions were deferred in the meantime.
+        submit(deferred_cqes_.empty());
+        loop_stats_.idle_usec += getMonotonicTime() - wait_start;
+    }
+    // Submit the remaining requests, such as queries sent just before
+    // stop(), so they won't be delayed until the next run.
+    flushSends();
+    if (unsubmitted_ > 0) {
+        submit(false);
+    }
+    collectGarbage();
+    // The manager can be run again.
+    __atomic_store_n(&stopped_, false, __ATOMIC_RELEASE);
+}
+
+#endif  // USE_IO_URING
+
+IOUringMessageManager::IOUringMessageManager() {
+#ifdef USE_IO_URING
+    impl_ = new IOUringMessageManagerImpl(*this);
+#else
+    throw MessageSocketError("io_uring is not supported on this system");
+#endif
+}
+
+IOUringMessageManager::~IOUringMessageManager() {
+#ifdef USE_IO_URING
+    delete impl_;
+#endif
+}
+
+MessageSocket*
+IOUringMessageManager::createMessageSocket(int proto,
+                                           const std::string& address,
+                                           uint16_t port,
+                                           void* recvbuf, size_t recvbuf_len,
+                                           MessageSocket::Callback callback)
+{
+#ifdef USE_IO_URING
+    if (!callback) {
+        throw MessageSocketError("null socket callback specified");
+    }
+    SocketImpl* impl = NULL;
+    if (proto == IPPROTO_UDP) {
+        struct sockaddr_storage ss;
+        const socklen_t sslen = convertAddress(address, port, ss);
+        // The socket is blocking; io_uring takes care of the readiness.
+        const int fd = socket(ss.ss_family, SOCK_DGRAM | SOCK_CLOEXEC,
+                              IPPROTO_UDP);
+        if (fd < 0) {
+            throw MessageSocketError(errorText("Failed to create a socket"));
+        }
+        // make sure the receive buffer is large enough (32KB, derived from
+        // the original queryperf)
+        const int bufsize = 32768;
+        if (connect(fd, toSockAddr(ss), sslen) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize,
+                       sizeof(bufsize)) < 0) {
+            const std::string error = errorText("Failed to create a socket");
+            close(fd);
+            throw MessageSocketError(error);
+        }
+        UDPSocketImpl* udp_impl = new UDPSocketImpl(*impl_, fd, recvbuf_len,
+                                                    callback);
+        impl_->addHandler(udp_impl);
+        impl = udp_impl;
+        try {
+            udp_impl->setup();
+        } catch (...) {
+            impl_->retire(impl);
+            throw;
+        }
+    } else if (proto == IPPROTO_TCP) {
+        if (recvbuf_len < 65535) { // must be able to hold a full TCP msg
+            throw MessageSocketError("Insufficient TCP receive buffer");
+        }
+        impl = new TCPSocketImpl(*impl_, address, port, recvbuf, callback);
+        impl_->addHandler(impl);
+    } else {
+        throw MessageSocketError("unsupported or invalid protocol: " +
+                                 lexical_cast<std::string>(proto));
+    }
+    try {
+        return (new IOUringMessageSocket(impl));
+    } catch (...) {
+        impl_->retire(impl);
+        throw;
+    }
+#else
+    (void)proto; (void)address; (void)port; (void)recvbuf; (void)recvbuf_len;
+    (void)callback;
+    return (NULL);
+#endif
+}
+
+MessageSocket*
+IOUringMessageManager::createStreamMessageSocket(
+    const std::string& address, uint16_t port,
+    MessageSocket::Callback callback)
+{
+#ifdef USE_IO_URING
+    if (!callback) {
+        throw MessageSocketError("null socket callback specified");
+    }
+    SocketImpl* impl = new StreamSocketImpl(*impl_, address, port, callback);
+    impl_->addHandler(impl);
+    try {
+        return (new IOUringMessageSocket(impl));
+    } catch (...) {
+        impl_->retire(impl);
+        throw;
+    }
+#else
+    (void)address; (void)port; (void)callback;
+    return (NULL);
+#endif
+}
+
+MessageTimer*
+IOUringMessageManager::createMessageTimer(MessageTimer::Callback callback) {
+#ifdef USE_IO_URING
+    TimerImpl* impl = new TimerImpl(*impl_, callback);
+    impl_->addHandler(impl);
+    try {
+        return (new IOUringMessageTimer(impl));
+    } catch (...) {
+        impl_->retire(impl);
+        throw;
+    }
+#else
+    (void)callback;
+    return (NULL);
+#endif
+}
+
+MessageTimer*
+IOUringMessageManager::createCoarseMessageTimer(
+    MessageTimer::Callback callback)
+{
+#ifdef USE_IO_URING
+    if (!impl_->timer_wheel_) {
+        impl_->timer_wheel_.reset(new TimerWheel(*this));
+    }
+    return (impl_->timer_wheel_->createTimer(callback));
+#else
+    (void)callback;
+    return (NULL);
+#endif
+}
+
+const LoopStatistics*
+IOUringMessageManager::getLoopStatistics() const {
+#ifdef USE_IO_URING
+    return (&impl_->loop_stats_);
+#else
+    return (NULL);
+#endif
+}
+
+void
+IOUringMessageManager::run() {
+#ifdef USE_IO_URING
+    impl_->dispatching_ = true;
+    try {
+        impl_->run();
+    } catch (...) {
+        impl_->dispatching_ = false;
+        throw;
+    }
+    impl_->dispatching_ = false;
+#endif
+}
+
+void
+IOUringMessageManager::stop() {
+#ifdef USE_IO_URING
+    __atomic_store_n(&impl_->stopped_, true, __ATOMIC_RELEASE);
+    // Wake up io_uring_enter() in case it's called from another thread.
+    const uint64_t one = 1;
+    if (write(impl_->event_fd_, &one, sizeof(one)) < 0) {
+        // It can only fail if the counter overflows, in which case the
+        // descriptor is readable anyway.
+    }
+#endif
+}
+
+} // end of QueryPerf
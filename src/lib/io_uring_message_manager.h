@@ -0,0 +1,115 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#ifndef __QUERYPERF_IO_URING_MESSAGE_MANAGER_H
+#define __QUERYPERF_IO_URING_MESSAGE_MANAGER_H 1
+
+#include <message_manager.h>
+
+#include <string>
+
+#include <stdint.h>
+
+namespace Queryperf {
+
+/// \brief A \c MessageManager implementation using Linux io_uring.
+///
+/// All I/O is submitted to a single io_uring instance as requests, and
+/// completions are delivered to the sockets and timers without any
+/// readiness notification.  Requests prepared in callbacks are submitted
+/// together with waiting for the next completions, so in steady state
+/// there's at most one system call per event loop iteration regardless of
+/// the number of queries sent and received in it.
+///
+/// - A UDP socket keeps a multishot receive request with a ring of
+///   provided buffers, so responses are delivered without rearming.
+///   Each message given to \c send() is copied to a send buffer and
+///   submitted as a separate send request; it falls back to a synchronous
+///   send only if all send buffers are in use or the message is too large.
+/// - A TCP socket submits the connect, the write of the query, the
+///   shutdown of the outbound direction and the read of the first response
+///   as a single chain of linked requests.  Otherwise it behaves the same
+///   as that of \c ASIOMessageManager.
+/// - A persistent TCP connection (see \c createStreamMessageSocket())
+///   keeps a single receive request, and writes messages queued in an
+///   event loop iteration with a single send request.
+/// - A timer is an absolute timeout request.  Restarting an active timer
+///   with a later expiration doesn't submit anything; the pending request
+///   is just rearmed when it fires too early.
+///
+/// \c run() and \c stop() have the same semantics as those of
+/// \c EpollMessageManager.  This requires Linux 6.0 or higher at run time.
+///
+/// Objects created by the manager must be destroyed before the manager.
+class IOUringMessageManager : public MessageManager {
+public:
+    /// \brief Constructor.
+    ///
+    /// \throw MessageSocketError io_uring is not supported or an underlying
+    /// system call fails.
+    IOUringMessageManager();
+
+    virtual ~IOUringMessageManager();
+
+    /// \brief Create a message socket.
+    ///
+    /// For UDP, received messages are stored in buffers owned by the socket
+    /// of \c recvbuf_len bytes each, and \c recvbuf isn't used.
+    ///
+    /// \throw MessageSocketError In addition to the cases of the base
+    /// class, the kernel doesn't support provided buffer rings.
+    virtual MessageSocket* createMessageSocket(
+        int proto, const std::string& address, uint16_t port,
+        void* recvbuf, size_t recvbuf_len,
+        MessageSocket::Callback callback);
+
+    virtual MessageSocket* createStreamMessageSocket(
+        const std::string& address, uint16_t port,
+        MessageSocket::Callback callback);
+
+    virtual MessageTimer* createMessageTimer(MessageTimer::Callback callback);
+
+    /// \brief Create a coarse timer.
+    ///
+    /// As with \c ASIOMessageManager, coarse timers are managed in a
+    /// \c TimerWheel with the default tick interval.
+    virtual MessageTimer* createCoarseMessageTimer(
+        MessageTimer::Callback callback);
+
+    /// \brief Return statistics of the event loop.
+    ///
+    /// The idle time is spent in \c io_uring_enter() waiting for
+    /// completions.  Messages are sent and received asynchronously in the
+    /// kernel, so the I/O time is always 0.
+    virtual const LoopStatistics* getLoopStatistics() const;
+
+    virtual void run();
+
+    virtual void stop();
+
+    // The implementation is public for the convenience of the
+    // implementation of sockets and timers.
+    struct IOUringMessageManagerImpl;
+
+private:
+    IOUringMessageManagerImpl* impl_;
+};
+
+} // end of QueryPerf
+
+#endif // __QUERYPERF_IO_URING_MESSAGE_MANAGER_H
+
+// Local Variables:
+// mode: c++
+// End:
@@ -0,0 +1,115 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <latency_histogram.h>
+
+#include <cmath>
+#include <cstring>
+
+namespace Queryperf {
+
+const unsigned int LatencyHistogram::SUB_BUCKET_BITS;
+const uint64_t LatencyHistogram::SUB_BUCKET_COUNT;
+const uint64_t LatencyHistogram::MAX_VALUE;
+
+LatencyHistogram::LatencyHistogram() {
+    clear();
+}
+
+void
+LatencyHistogram::clear() {
+    std::memset(counts_, 0, sizeof(counts_));
+    count_ = 0;
+    sum_ = 0;
+    min_ = 0;
+    max_ = 0;
+}
+
+void
+LatencyHistogram::recordCorrected(uint64_t value, uint64_t expected_interval)
+{
+    record(value);
+    if (expected_interval == 0) {
+        return;
+    }
+    for (uint64_t missing = value; missing >= 2 * expected_interval;) {
+        missing -= expected_interval;
+        record(missing);
+    }
+}
+
+void
+LatencyHistogram::merge(const LatencyHistogram& other) {
+    if (other.count_ == 0) {
+        return;
+    }
+    for (size_t i = 0; i < INDEX_COUNT; ++i) {
+        counts_[i] += other.counts_[i];
+    }
+    if (count_ == 0 || other.min_ < min_) {
+        min_ = other.min_;
+    }
+    if (other.max_ > max_) {
+        max_ = other.max_;
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+}
+
+double
+LatencyHistogram::getMean() const {
+    if (count_ == 0) {
+        return (0);
+    }
+    return (static_cast<double>(sum_) / count_);
+}
+
+uint64_t
+LatencyHistogram::getHighestValue(size_t index) {
+    if (index < SUB_BUCKET_COUNT) {
+        return (index);
+    }
+    const size_t bucket = (index - SUB_BUCKET_COUNT) / HALF_SUB_BUCKET_COUNT;
+    const uint64_t sub_bucket = (index - SUB_BUCKET_COUNT) %
+        HALF_SUB_BUCKET_COUNT + HALF_SUB_BUCKET_COUNT;
+    const unsigned int shift = bucket + 1;
+    return (((sub_bucket + 1) << shift) - 1);
+}
+
+uint64_t
+LatencyHistogram::getValueAtPercentile(double percentile) const {
+    if (count_ == 0) {
+        return (0);
+    }
+    if (percentile > 100) {
+        percentile = 100;
+    }
+    uint64_t target = static_cast<uint64_t>(
+        std::ceil(percentile / 100 * count_));
+    if (target == 0) {
+        target = 1;
+    }
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < INDEX_COUNT; ++i) {
+        total += counts_[i];
+        if (total >= target) {
+            const uint64_t value = getHighestValue(i);
+            return (value < max_ ? value : max_);
+        }
+    }
+    return (max_);              // shouldn't happen, but just in case
+}
+
+} // end of QueryPerf
@@ -0,0 +1,143 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#ifndef __QUERYPERF_LATENCY_HISTOGRAM_H
+#define __QUERYPERF_LATENCY_HISTOGRAM_H 1
+
+#include <sys/types.h>
+#include <stdint.h>
+
+namespace Queryperf {
+
+/// \brief A log-bucketed histogram of latency values in microseconds.
+///
+/// This is a simplified version of the "HDR" histogram: values smaller than
+/// \c SUB_BUCKET_COUNT are counted exactly, and larger ones are counted
+/// in buckets whose width doubles for every power of 2, each divided into
+/// \c SUB_BUCKET_COUNT / 2 sub-buckets.  So the relative error of a recorded
+/// value is bounded by 1 / (\c SUB_BUCKET_COUNT / 2) regardless of its
+/// magnitude.  Values larger than \c MAX_VALUE are counted in the highest
+/// bucket (but the exact maximum is still remembered).
+///
+/// The histogram consists of a fixed size array, and \c record() never
+/// allocates memory, so it can be used in the hot path of the dispatcher.
+class LatencyHistogram {
+public:
+    /// \brief Number of bits to identify a sub-bucket.
+    static const unsigned int SUB_BUCKET_BITS = 7;
+
+    /// \brief Number of the exactly counted values (128).
+    static const uint64_t SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+
+    /// \brief Upper limit of the values that are counted in separate
+    /// buckets (about 19 hours in microseconds).
+    static const uint64_t MAX_VALUE = (1ULL << 36) - 1;
+
+    /// \brief Constructor.  The histogram is initially empty.
+    LatencyHistogram();
+
+    /// \brief Record a single latency value in microseconds.
+    void record(uint64_t value) {
+        ++counts_[getIndex(value)];
+        ++count_;
+        sum_ += value;
+        if (count_ == 1 || value < min_) {
+            min_ = value;
+        }
+        if (value > max_) {
+            max_ = value;
+        }
+    }
+
+    /// \brief Record a latency value, correcting it for coordinated
+    /// omission.
+    ///
+    /// If a sender waits for each response before sending the next query,
+    /// a long latency also delays the queries that would have been sent
+    /// meanwhile, and their (long) latencies are never measured.  Assuming
+    /// a query would have been sent every \c expected_interval
+    /// microseconds, this records the given value along with the values
+    /// those queries would have seen: value - expected_interval,
+    /// value - 2 * expected_interval, and so on, down to
+    /// \c expected_interval.  If \c expected_interval is 0, only the
+    /// given value is recorded.
+    void recordCorrected(uint64_t value, uint64_t expected_interval);
+
+    /// \brief Add all values recorded in another histogram to this one.
+    void merge(const LatencyHistogram& other);
+
+    /// \brief Reset the histogram to the initial empty state.
+    void clear();
+
+    /// \brief Return the total number of recorded values.
+    uint64_t getCount() const { return (count_); }
+
+    /// \brief Return the minimum recorded value (0 if empty).
+    uint64_t getMin() const { return (min_); }
+
+    /// \brief Return the maximum recorded value (0 if empty).
+    uint64_t getMax() const { return (max_); }
+
+    /// \brief Return the mean of the recorded values (0 if empty).
+    double getMean() const;
+
+    /// \brief Return the value at the given percentile.
+    ///
+    /// The returned value is the highest value that is counted in the same
+    /// bucket as the value at the percentile, but it never exceeds the
+    /// actual maximum.  It returns 0 if the histogram is empty.
+    ///
+    /// \param percentile A percentile in the range of [0, 100].
+    uint64_t getValueAtPercentile(double percentile) const;
+
+private:
+    // Number of buckets beyond the exactly counted range: one for every
+    // power of 2 from SUB_BUCKET_BITS to the one of MAX_VALUE.
+    static const size_t BUCKET_COUNT = 36 - SUB_BUCKET_BITS;
+    static const size_t HALF_SUB_BUCKET_COUNT = SUB_BUCKET_COUNT / 2;
+    static const size_t INDEX_COUNT =
+        SUB_BUCKET_COUNT + BUCKET_COUNT * HALF_SUB_BUCKET_COUNT;
+
+    static size_t getIndex(uint64_t value) {
+        if (value < SUB_BUCKET_COUNT) {
+            return (value);
+        }
+        if (value > MAX_VALUE) {
+            value = MAX_VALUE;
+        }
+        // msb >= SUB_BUCKET_BITS; sub-bucket is in [HALF, SUB_BUCKET_COUNT)
+        const unsigned int msb = 63 - __builtin_clzll(value);
+        const unsigned int shift = msb - SUB_BUCKET_BITS + 1;
+        return (SUB_BUCKET_COUNT +
+                (msb - SUB_BUCKET_BITS) * HALF_SUB_BUCKET_COUNT +
+                ((value >> shift) - HALF_SUB_BUCKET_COUNT));
+    }
+
+    // Return the highest value counted in the bucket of the given index.
+    static uint64_t getHighestValue(size_t index);
+
+    uint64_t counts_[INDEX_COUNT];
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t min_;
+    uint64_t max_;
+};
+
+} // end of QueryPerf
+
+#endif // __QUERYPERF_LATENCY_HISTOGRAM_H
+
+// Local Variables:
+// mode: c++
+// End:
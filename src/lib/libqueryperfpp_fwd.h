@@ -25,6 +25,11 @@ class QueryContext;
 class QueryContextCreator;
 class MessageSocket;
 class MessageManager;
+class LatencyHistogram;
+class LiveCounters;
+struct ResourceUsage;
+class TransferStatistics;
+class SustainedRates;
 
 } // end of QueryPerf
 
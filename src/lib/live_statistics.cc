@@ -0,0 +1,231 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <live_statistics.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+
+#include <time.h>
+
+using namespace boost::posix_time;
+
+namespace Queryperf {
+
+const size_t LiveCounters::LATENCY_BUCKET_COUNT;
+const size_t LiveCounters::CACHE_LINE_SIZE;
+
+LiveCounters::Snapshot::Snapshot() : sent(0), completed(0), lost(0) {
+    std::memset(latency_buckets, 0, sizeof(latency_buckets));
+}
+
+void
+LiveCounters::Snapshot::add(const Snapshot& other) {
+    sent += other.sent;
+    completed += other.completed;
+    lost += other.lost;
+    for (size_t i = 0; i < LATENCY_BUCKET_COUNT; ++i) {
+        latency_buckets[i] += other.latency_buckets[i];
+    }
+}
+
+void
+LiveCounters::Snapshot::subtract(const Snapshot& older) {
+    sent -= older.sent;
+    completed -= older.completed;
+    lost -= older.lost;
+    for (size_t i = 0; i < LATENCY_BUCKET_COUNT; ++i) {
+        latency_buckets[i] -= older.latency_buckets[i];
+    }
+}
+
+uint64_t
+LiveCounters::Snapshot::getLatencyAtPercentile(double percentile) const {
+    uint64_t total = 0;
+    for (size_t i = 0; i < LATENCY_BUCKET_COUNT; ++i) {
+        total += latency_buckets[i];
+    }
+    if (total == 0) {
+        return (0);
+    }
+    if (percentile > 100) {
+        percentile = 100;
+    }
+    uint64_t target = static_cast<uint64_t>(std::ceil(percentile / 100 *
+                                                      total));
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t count = 0;
+    for (size_t i = 0; i < LATENCY_BUCKET_COUNT; ++i) {
+        count += latency_buckets[i];
+        if (count >= target) {
+            return (getLatencyBucketBound(i));
+        }
+    }
+    return (getLatencyBucketBound(LATENCY_BUCKET_COUNT - 1)); // can't happen
+}
+
+LiveCounters::LiveCounters() {
+    // Padding is never used, but clear it to make memory checkers happy.
+    std::memset(pad_head_, 0, sizeof(pad_head_));
+    std::memset(pad_tail_, 0, sizeof(pad_tail_));
+}
+
+void
+LiveCounters::read(Snapshot& snapshot) const {
+    snapshot.sent = __atomic_load_n(&counters_.sent, __ATOMIC_RELAXED);
+    snapshot.completed = __atomic_load_n(&counters_.completed,
+                                         __ATOMIC_RELAXED);
+    snapshot.lost = __atomic_load_n(&counters_.lost, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < LATENCY_BUCKET_COUNT; ++i) {
+        snapshot.latency_buckets[i] =
+            __atomic_load_n(&counters_.latency_buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+LiveStatisticsReporter::LiveStatisticsReporter(
+    const std::vector<const LiveCounters*>& counters,
+    const time_duration& interval, std::ostream& os) :
+    counters_(counters), interval_(interval), os_(os), running_(false),
+    stopping_(false), start_time_(microsec_clock::universal_time()),
+    last_time_(start_time_)
+{
+    if (interval.total_microseconds() <= 0) {
+        throw LiveStatisticsError("report interval must be positive");
+    }
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+}
+
+LiveStatisticsReporter::~LiveStatisticsReporter() {
+    stop();
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+void
+LiveStatisticsReporter::start() {
+    if (running_) {
+        throw LiveStatisticsError("duplicate start of statistics reporter");
+    }
+    start_time_ = microsec_clock::universal_time();
+    last_time_ = start_time_;
+    last_ = LiveCounters::Snapshot();
+    stopping_ = false;
+    const int error = pthread_create(&thread_, NULL, threadMain, this);
+    if (error != 0) {
+        throw LiveStatisticsError(
+            std::string("failed to create statistics reporter thread: ") +
+            std::strerror(error));
+    }
+    running_ = true;
+}
+
+void
+LiveStatisticsReporter::stop() {
+    if (!running_) {
+        return;
+    }
+    pthread_mutex_lock(&mutex_);
+    stopping_ = true;
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&mutex_);
+    pthread_join(thread_, NULL);
+    running_ = false;
+}
+
+void*
+LiveStatisticsReporter::threadMain(void* arg) {
+    static_cast<LiveStatisticsReporter*>(arg)->run();
+    return (NULL);
+}
+
+void
+LiveStatisticsReporter::run() {
+    // Reports are scheduled at fixed points from the start so that delays
+    // of a report don't accumulate.
+    struct timespec base;
+    clock_gettime(CLOCK_REALTIME, &base);
+    const int64_t interval_usec = interval_.total_microseconds();
+    uint64_t n_reports = 0;
+
+    pthread_mutex_lock(&mutex_);
+    while (!stopping_) {
+        ++n_reports;
+        const int64_t offset_usec = interval_usec * n_reports;
+        struct timespec deadline;
+        deadline.tv_sec = base.tv_sec + offset_usec / 1000000;
+        deadline.tv_nsec = base.tv_nsec + (offset_usec % 1000000) * 1000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+        int error = 0;
+        while (!stopping_ && error != ETIMEDOUT) {
+            error = pthread_cond_timedwait(&cond_, &mutex_, &deadline);
+        }
+        if (stopping_) {
+            break;
+        }
+        // Don't hold the lock while printing, so stop() won't be blocked.
+        pthread_mutex_unlock(&mutex_);
+        report(microsec_clock::universal_time());
+        pthread_mutex_lock(&mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+void
+LiveStatisticsReporter::report(const ptime& now) {
+    LiveCounters::Snapshot total;
+    for (size_t i = 0; i < counters_.size(); ++i) {
+        LiveCounters::Snapshot snapshot;
+        counters_[i]->read(snapshot);
+        total.add(snapshot);
+    }
+    LiveCounters::Snapshot interval = total;
+    interval.subtract(last_);
+
+    const double interval_sec =
+        static_cast<double>((now - last_time_).total_microseconds()) / 1000000;
+    const double total_sec =
+        static_cast<double>((now - start_time_).total_microseconds()) /
+        1000000;
+    const std::ios::fmtflags flags = os_.flags();
+    const std::streamsize precision = os_.precision();
+    os_ << std::fixed << std::setprecision(3) << "[Stats] " << std::setw(9)
+        << total_sec << "s:" << std::setprecision(1)
+        << " sent " << (interval_sec > 0 ? interval.sent / interval_sec : 0)
+        << " qps, completed "
+        << (interval_sec > 0 ? interval.completed / interval_sec : 0)
+        << " qps, lost " << interval.lost
+        << ", latency p50<=" << interval.getLatencyAtPercentile(50)
+        << "us p99<=" << interval.getLatencyAtPercentile(99) << "us"
+        << " | total: completed " << total.completed
+        << ", lost " << total.lost << ", "
+        << (total_sec > 0 ? total.completed / total_sec : 0) << " qps"
+        << std::endl;
+    os_.flags(flags);
+    os_.precision(precision);
+
+    last_ = total;
+    last_time_ = now;
+}
+
+} // end of QueryPerf
@@ -0,0 +1,201 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#ifndef __QUERYPERF_LIVE_STATISTICS_H
+#define __QUERYPERF_LIVE_STATISTICS_H 1
+
+#include <boost/noncopyable.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <pthread.h>
+
+namespace Queryperf {
+
+/// \brief Exception class thrown on an error of live statistics.
+class LiveStatisticsError : public std::runtime_error {
+public:
+    explicit LiveStatisticsError(const std::string& what_arg) :
+        std::runtime_error(what_arg)
+    {}
+};
+
+/// \brief Statistics counters of a dispatcher that can be read by another
+/// thread while the dispatcher is running.
+///
+/// Each object must be updated by a single thread (i.e., the one running
+/// the dispatcher), so an update is a relaxed atomic load and store without
+/// a lock or a locked instruction.  Other threads can read the counters at
+/// any time via \c read(); each counter is always read as a valid value,
+/// but the snapshot of different counters isn't necessarily consistent
+/// (e.g., a completed query may be counted before its latency).
+///
+/// The counters are surrounded by cache-line sized padding, so updates
+/// don't cause false sharing with data used by other threads regardless
+/// of how the object is allocated.
+///
+/// Latencies are counted in a small number of buckets whose upper bound
+/// doubles for every bucket, which is much coarser than
+/// \c LatencyHistogram but small enough to be sampled frequently.
+class LiveCounters : private boost::noncopyable {
+public:
+    /// \brief Number of latency buckets.
+    ///
+    /// Bucket 0 counts latencies of 0 or 1 microsecond, and bucket i
+    /// (i > 0) counts those in (2^(i-1), 2^i] microseconds.  The last
+    /// bucket counts all larger ones, too.
+    static const size_t LATENCY_BUCKET_COUNT = 32;
+
+    /// \brief A snapshot of the counters.
+    struct Snapshot {
+        Snapshot();
+
+        /// \brief Add the counters of another snapshot to this one.
+        void add(const Snapshot& other);
+
+        /// \brief Subtract the counters of an older snapshot.
+        void subtract(const Snapshot& older);
+
+        /// \brief Return an upper bound of the latency at the given
+        /// percentile in microseconds (0 if no query is completed).
+        uint64_t getLatencyAtPercentile(double percentile) const;
+
+        uint64_t sent;
+        uint64_t completed;
+        uint64_t lost;              // timed out or failed
+        uint64_t latency_buckets[LATENCY_BUCKET_COUNT];
+    };
+
+    /// \brief Constructor.  All counters are initially 0.
+    LiveCounters();
+
+    /// \brief Count a sent query.
+    void addSent() { increment(counters_.sent); }
+
+    /// \brief Count a completed query with its latency in microseconds.
+    void addCompleted(uint64_t latency) {
+        increment(counters_.latency_buckets[getLatencyBucket(latency)]);
+        increment(counters_.completed);
+    }
+
+    /// \brief Count a query that timed out or failed.
+    void addLost() { increment(counters_.lost); }
+
+    /// \brief Read the current counters.
+    ///
+    /// This can be called from any thread.
+    void read(Snapshot& snapshot) const;
+
+    /// \brief Return the index of the latency bucket for the given value.
+    static size_t getLatencyBucket(uint64_t latency) {
+        if (latency <= 1) {
+            return (0);
+        }
+        const size_t bucket = 64 - __builtin_clzll(latency - 1);
+        return (bucket < LATENCY_BUCKET_COUNT ? bucket :
+                LATENCY_BUCKET_COUNT - 1);
+    }
+
+    /// \brief Return the upper bound of the given latency bucket.
+    static uint64_t getLatencyBucketBound(size_t bucket) {
+        return (static_cast<uint64_t>(1) << bucket);
+    }
+
+private:
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    static void increment(uint64_t& counter) {
+        __atomic_store_n(&counter,
+                         __atomic_load_n(&counter, __ATOMIC_RELAXED) + 1,
+                         __ATOMIC_RELAXED);
+    }
+
+    char pad_head_[CACHE_LINE_SIZE];
+    Snapshot counters_;
+    char pad_tail_[CACHE_LINE_SIZE];
+};
+
+/// \brief A reporter thread of live statistics.
+///
+/// It periodically samples a set of \c LiveCounters and prints the rates
+/// and latencies of the last interval and of the whole run so far.
+/// Sampling only reads the counters, so the reporter doesn't affect the
+/// threads that update them except for the cost of the cache line
+/// transfer.
+class LiveStatisticsReporter : private boost::noncopyable {
+public:
+    /// \brief Constructor.
+    ///
+    /// \param counters The counters to be sampled; the sum of them is
+    /// reported.  They must be valid as long as the reporter.
+    /// \param interval The interval of reports.  It must be positive.
+    /// \param os The output stream of the reports.
+    LiveStatisticsReporter(const std::vector<const LiveCounters*>& counters,
+                           const boost::posix_time::time_duration& interval,
+                           std::ostream& os);
+
+    /// \brief Destructor.  It stops the thread if it's still running.
+    ~LiveStatisticsReporter();
+
+    /// \brief Start the reporter thread.
+    ///
+    /// The elapsed time of the reports is measured from this point.
+    ///
+    /// \throw LiveStatisticsError Failed to create the thread, or it has
+    /// already been started.
+    void start();
+
+    /// \brief Stop the reporter thread and wait for it to terminate.
+    ///
+    /// It does nothing if the thread isn't running.
+    void stop();
+
+    /// \brief Sample the counters and print a report for the interval since
+    /// the previous one.
+    ///
+    /// This is called periodically in the reporter thread; exposed mainly
+    /// for tests.
+    ///
+    /// \param now The current time.
+    void report(const boost::posix_time::ptime& now);
+
+private:
+    static void* threadMain(void* arg);
+    void run();
+
+    const std::vector<const LiveCounters*> counters_;
+    const boost::posix_time::time_duration interval_;
+    std::ostream& os_;
+    pthread_t thread_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t cond_;
+    bool running_;
+    bool stopping_;             // protected by mutex_
+    boost::posix_time::ptime start_time_;
+    boost::posix_time::ptime last_time_;
+    LiveCounters::Snapshot last_;
+};
+
+} // end of QueryPerf
+
+#endif // __QUERYPERF_LIVE_STATISTICS_H
+
+// Local Variables:
+// mode: c++
+// End:
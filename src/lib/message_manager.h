@@ -44,12 +44,69 @@ public:
 
 class MessageSocket : private boost::noncopyable {
 public:
+    /// \brief Summary of all messages received for a TCP query.
+    ///
+    /// A response to a TCP query can consist of multiple messages, such as
+    /// those of AXFR or IXFR.  The socket only keeps the first message in
+    /// the receive buffer, and counts the whole stream of messages here
+    /// with a lightweight parse of their headers.
+    struct TransferInfo {
+        TransferInfo() : messages(0), rrs(0), bytes(0) {
+            ancount_[0] = ancount_[1] = 0;
+        }
+
+        /// \brief Count received bytes, including the length fields.
+        /// The time of the first call with a positive length is recorded
+        /// as the time of the first byte.
+        void addBytes(size_t len) {
+            if (bytes == 0 && len > 0) {
+                first_byte = boost::posix_time::microsec_clock::
+                    universal_time();
+            }
+            bytes += len;
+        }
+
+        /// \brief Examine a chunk of a message starting at the given
+        /// offset of the message.  Chunks must be given in order.
+        void addData(size_t offset, const void* data, size_t len) {
+            const uint8_t* const cp = static_cast<const uint8_t*>(data);
+            for (size_t i = 0; i < 2; ++i) {
+                if (offset <= ANCOUNT_OFFSET + i &&
+                    ANCOUNT_OFFSET + i < offset + len) {
+                    ancount_[i] = cp[ANCOUNT_OFFSET + i - offset];
+                }
+            }
+        }
+
+        /// \brief Complete the current message.
+        void addMessage() {
+            ++messages;
+            rrs += ancount_[0] * 256 + ancount_[1];
+            ancount_[0] = ancount_[1] = 0;
+        }
+
+        size_t messages;        ///< Number of complete messages
+        uint64_t rrs;           ///< Total of their answer RR counts
+        uint64_t bytes;         ///< Total bytes including length fields
+        boost::posix_time::ptime first_byte; ///< Time of the first byte
+
+    private:
+        static const size_t ANCOUNT_OFFSET = 6;
+        uint8_t ancount_[2];    // ANCOUNT of the current message
+    };
+
     struct Event {
-        Event(const void* data_param, size_t datalen_param) :
-            data(data_param), datalen(datalen_param)
+        Event(const void* data_param, size_t datalen_param,
+              const TransferInfo* transfer_param = NULL) :
+            data(data_param), datalen(datalen_param),
+            transfer(transfer_param)
         {}
         const void* const data;
         const size_t datalen;
+
+        /// \brief Summary of received messages for a TCP query; NULL for
+        /// other types of sockets.
+        const TransferInfo* const transfer;
     };
     typedef boost::function<void(Event)> Callback;
 
@@ -76,6 +133,16 @@ public:
     virtual void cancel() = 0;
 };
 
+/// \brief Statistics of the event loop of a message manager.
+///
+/// All times are in microseconds, accumulated since the manager was
+/// created.
+struct LoopStatistics {
+    LoopStatistics() : idle_usec(0), io_usec(0) {}
+    uint64_t idle_usec;         ///< waiting for events
+    uint64_t io_usec;           ///< in system calls sending or receiving
+};
+
 class MessageManager : private boost::noncopyable {
 protected:
     MessageManager() {}
@@ -89,7 +156,10 @@ public:
     ///        IPv4) address.
     /// \param port The destination UDP or TCP port.
     /// \param callback The callback function or functor that is to be called
-    ///        when a complete response is received on the socket.
+    ///        when a complete response is received on the socket.  For
+    ///        TCP, it's called when the server closes the connection, with
+    ///        the first message and a summary of all received messages in
+    ///        \c MessageSocket::Event::transfer.
     virtual MessageSocket* createMessageSocket(
         int proto, const std::string& address, uint16_t port,
         void* recvbuf, size_t recvbuf_len,
@@ -99,6 +169,61 @@ public:
     virtual MessageTimer* createMessageTimer(
         MessageTimer::Callback callback) = 0;
 
+    /// \brief Create a timer object that doesn't need precise expiration.
+    ///
+    /// This is intended to be used for a large number of timers that are
+    /// frequently started and cancelled, such as per query timeouts.  The
+    /// returned timer may expire later than the specified duration by some
+    /// implementation dependent granularity, in exchange for lower overhead.
+    ///
+    /// The default implementation simply returns a normal timer created by
+    /// \c createMessageTimer().
+    virtual MessageTimer* createCoarseMessageTimer(
+        MessageTimer::Callback callback)
+    {
+        return (createMessageTimer(callback));
+    }
+
+    /// \brief Create a socket for a persistent TCP connection.
+    ///
+    /// Unlike a TCP socket created by \c createMessageSocket(), which is
+    /// used for a single query, the returned socket can send any number of
+    /// messages over a single long-lived connection (see RFC 7766).
+    /// Each call to \c send() queues the given message with the two-octet
+    /// length field; queued messages may be written in a single batch.
+    /// The callback is called for each received message in the order of
+    /// reception, which can be different from the order of sending.
+    ///
+    /// The connection is established on the first \c send().  If the
+    /// connection is closed by the peer or fails, the callback is called
+    /// with an event of NULL data and 0 length, and messages not sent by
+    /// then are discarded.  The next \c send() then makes a new
+    /// connection.  It's okay to call \c send() or destroy the socket in
+    /// the callback.
+    ///
+    /// The default implementation throws \c MessageSocketError.
+    ///
+    /// \param address Textual representation of the destination (IPv6 or
+    ///        IPv4) address.
+    /// \param port The destination TCP port.
+    /// \param callback The callback function or functor that is to be called
+    ///        on a received message or termination of the connection.
+    virtual MessageSocket* createStreamMessageSocket(
+        const std::string& /*address*/, uint16_t /*port*/,
+        MessageSocket::Callback /*callback*/)
+    {
+        throw MessageSocketError("persistent TCP connection is not "
+                                 "supported");
+    }
+
+    /// \brief Return statistics of the event loop.
+    ///
+    /// They are only available for implementations that run their own
+    /// event loop; the default implementation returns NULL.
+    virtual const LoopStatistics* getLoopStatistics() const {
+        return (NULL);
+    }
+
     /// \brief Start the main event loop.
     virtual void run() = 0;
 
@@ -18,6 +18,8 @@
 #include <dns/message.h>
 #include <dns/messagerenderer.h>
 
+#include <vector>
+
 using namespace bundy::dns;
 
 namespace Queryperf {
@@ -30,6 +32,7 @@ struct QueryContext::QueryContextImpl {
     QueryRepository* repository_;
     Message query_msg_;
     MessageRenderer query_renderer_;
+    std::vector<uint8_t> wire_buf_; // copy of preloaded query with the QID
 };
 
 QueryContext::QueryContext(QueryRepository& repository) :
@@ -43,6 +46,20 @@ QueryContext::~QueryContext() {
 QueryContext::QuerySpec
 QueryContext::start(qid_t qid) {
     int protocol;
+
+    // If queries are preloaded, we only have to copy the rendered data
+    // and set the QID.  The copy is necessary as the same data may be used
+    // for multiple outstanding queries.
+    if (impl_->repository_->getQueryCount() > 0) {
+        size_t len;
+        const uint8_t* const data =
+            impl_->repository_->getNextWireQuery(len, protocol);
+        impl_->wire_buf_.assign(data, data + len);
+        impl_->wire_buf_[0] = qid >> 8;
+        impl_->wire_buf_[1] = qid & 0xff;
+        return (QuerySpec(protocol, &impl_->wire_buf_[0], len));
+    }
+
     impl_->repository_->getNextQuery(impl_->query_msg_, protocol);
     impl_->query_msg_.setQid(qid);
     impl_->query_renderer_.clear();
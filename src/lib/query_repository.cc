@@ -13,10 +13,12 @@
 // PERFORMANCE OF THIS SOFTWARE.
 
 #include <query_repository.h>
+#include <compiled_query_set.h>
 
 #include <dns/name.h>
 #include <dns/edns.h>
 #include <dns/message.h>
+#include <dns/messagerenderer.h>
 #include <dns/opcode.h>
 #include <dns/rcode.h>
 #include <dns/rdata.h>
@@ -28,19 +30,36 @@
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstring>
+#include <cerrno>
 #include <istream>
+#include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
-#include <map>
 #include <vector>
 
 #include <netinet/in.h>
 
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
 using namespace std;
 using boost::lexical_cast;
 using boost::scoped_ptr;
+using boost::shared_ptr;
 using namespace bundy::dns;
+using Queryperf::QueryRepositoryError;
+using Queryperf::CompiledQuerySet;
 
 namespace {
 // an ad hoc threadshold to prevent a busy loop due to an empty input file.
@@ -50,11 +69,12 @@ const size_t MAX_EMPTY_LOOP = 1000;
 // opcode)
 struct RequestParam {
     RequestParam(QuestionPtr question_param, int proto_param) :
-        question(question_param), proto(proto_param)
+        question(question_param), proto(proto_param), wire_offset(0),
+        wire_len(0)
     {}
 
     // Default constructor.  Using some invalid initial values.
-    RequestParam() : proto(IPPROTO_NONE) {}
+    RequestParam() : proto(IPPROTO_NONE), wire_offset(0), wire_len(0) {}
 
     void setEDNSPolicy(bool use_dnssec_param, bool use_edns_param) {
         // For special types of queries, we don't use EDNS by default
@@ -73,6 +93,10 @@ struct RequestParam {
     vector<RRsetPtr> authorities;
     bool use_dnssec;
     bool use_edns;
+
+    // The location of the rendered query (only used in the preload mode).
+    size_t wire_offset;
+    size_t wire_len;
 };
 
 struct QueryOptions {
@@ -84,6 +108,276 @@ struct QueryOptions {
     }
     uint32_t serial;         // querier's serial, only useful for IXFR
 };
+
+// A perfect hash table of commonly used RR type mnemonics, so the query
+// type can be identified without building a string.  It also covers some
+// types that BIND 10 libdns++ doesn't recognize (A6, ANY, AXFR, IXFR).
+// Other mnemonics (and the "TYPEnnn" form) are passed to RRType.
+struct QtypeEntry {
+    const char* mnemonic;
+    uint16_t code;
+};
+
+const QtypeEntry QTYPE_ENTRIES[] = {
+    {"A", 1}, {"NS", 2}, {"CNAME", 5}, {"SOA", 6}, {"PTR", 12},
+    {"HINFO", 13}, {"MINFO", 14}, {"MX", 15}, {"TXT", 16}, {"RP", 17},
+    {"AFSDB", 18}, {"AAAA", 28}, {"SRV", 33}, {"NAPTR", 35}, {"A6", 38},
+    {"DNAME", 39}, {"DS", 43}, {"SSHFP", 44}, {"RRSIG", 46}, {"NSEC", 47},
+    {"DNSKEY", 48}, {"DHCID", 49}, {"NSEC3", 50}, {"NSEC3PARAM", 51},
+    {"SPF", 99}, {"IXFR", 251}, {"AXFR", 252}, {"ANY", 255}
+};
+
+class QtypeTable {
+public:
+    QtypeTable() {
+        for (size_t i = 0; i < TABLE_SIZE; ++i) {
+            table_[i] = NULL;
+            lengths_[i] = 0;
+        }
+        for (size_t i = 0; i < sizeof(QTYPE_ENTRIES) / sizeof(QTYPE_ENTRIES[0]);
+             ++i) {
+            const QtypeEntry& entry = QTYPE_ENTRIES[i];
+            const size_t len = std::strlen(entry.mnemonic);
+            const size_t h = hash(entry.mnemonic, len);
+            assert(table_[h] == NULL); // the hash must be perfect
+            table_[h] = &entry;
+            lengths_[h] = len;
+        }
+    }
+
+    // Return the matching entry of the given text, or NULL if not found.
+    const QtypeEntry* find(const char* text, size_t len) const {
+        const size_t h = hash(text, len);
+        if (table_[h] != NULL && lengths_[h] == len &&
+            std::memcmp(table_[h]->mnemonic, text, len) == 0) {
+            return (table_[h]);
+        }
+        return (NULL);
+    }
+
+private:
+    static const size_t TABLE_SIZE = 64;
+
+    // The parameters are chosen so that there's no collision among the
+    // above entries.
+    static size_t hash(const char* text, size_t len) {
+        const unsigned char first = text[0];
+        const unsigned char last = text[len - 1];
+        return ((first * 2 + last * 13 + len * 5) & (TABLE_SIZE - 1));
+    }
+
+    const QtypeEntry* table_[TABLE_SIZE];
+    size_t lengths_[TABLE_SIZE];
+};
+
+const QtypeTable qtype_table;
+
+// A non allocating tokenizer for a single line of input.  Tokens are
+// separated by white spaces, just like the extraction operator of
+// istream for strings.
+class LineTokenizer {
+public:
+    LineTokenizer(const char* begin, const char* end) :
+        cur_(begin), end_(end)
+    {}
+
+    // Get the next token.  Return false if there's no more token.
+    bool next(const char*& token, size_t& len) {
+        while (cur_ != end_ && isspace(static_cast<unsigned char>(*cur_))) {
+            ++cur_;
+        }
+        if (cur_ == end_) {
+            return (false);
+        }
+        token = cur_;
+        while (cur_ != end_ && !isspace(static_cast<unsigned char>(*cur_))) {
+            ++cur_;
+        }
+        len = cur_ - token;
+        return (true);
+    }
+
+    // Whether the entire line has been consumed.
+    bool atEnd() const { return (cur_ == end_); }
+
+private:
+    const char* cur_;
+    const char* const end_;
+};
+
+// Extract optional attributes of the query.
+void
+parseQueryOptions(LineTokenizer& tokenizer, QueryOptions& options) {
+    // Note: if the line ends with white spaces, it results in an empty
+    // option and is rejected.  It's compatible with the older
+    // implementation.
+    do {
+        const char* option;
+        size_t len;
+        const char* const delim = !tokenizer.next(option, len) ? NULL :
+            static_cast<const char*>(std::memchr(option, '=', len));
+        if (delim == NULL) {
+            throw QueryRepositoryError(
+                "Invalid query option: no '='");
+        }
+        const string optname(option, delim);
+        const string optarg(delim + 1, option + len);
+
+        // Set option: for now just hardcode known options.
+        if (optname == "serial") {
+            options.serial = lexical_cast<uint32_t>(optarg);
+        }
+    } while (!tokenizer.atEnd());
+}
+
+// Parse a single line of input, and build a question (and authority
+// RRsets if necessary) for the request.  It returns a null pointer if
+// the line should be ignored; if it's due to an error, a message is
+// written to err.  The line must not be empty or a comment.
+QuestionPtr
+parseRequest(const char* begin, const char* end, const RRClass& qclass,
+             vector<RRsetPtr>& authorities, ostream& err)
+{
+    LineTokenizer tokenizer(begin, end);
+    const char* qname_text;
+    const char* qtype_text;
+    size_t qname_len, qtype_len;
+    if (!tokenizer.next(qname_text, qname_len) ||
+        !tokenizer.next(qtype_text, qtype_len)) {
+        // Ignore the line is organized in an unexpected way.
+        return (QuestionPtr());
+    }
+
+    QueryOptions options;
+    if (!tokenizer.atEnd()) {
+        try {
+            parseQueryOptions(tokenizer, options);
+        } catch (const std::exception& ex) {
+            err << "Error parsing query option (" << ex.what() << "): "
+                << string(begin, end) << endl;
+            return (QuestionPtr());
+        }
+    }
+
+    authorities.clear();
+    try {
+        const QtypeEntry* const entry = qtype_table.find(qtype_text,
+                                                         qtype_len);
+        const RRType qtype = entry != NULL ? RRType(entry->code) :
+            RRType(string(qtype_text, qtype_len));
+        const Name qname(string(qname_text, qname_len));
+        QuestionPtr question(new Question(qname, qclass, qtype));
+
+        // For IXFR, we need to add an SOA to the authority section.
+        if (qtype == RRType::IXFR()) {
+            RRsetPtr rrset(new RRset(qname, qclass, qtype, RRTTL(0)));
+            rrset->addRdata(rdata::createRdata(
+                                RRType::SOA(), qclass,
+                                ". . " + lexical_cast<string>(options.serial) +
+                                " 0 0 0 0"));
+            authorities.push_back(rrset);
+        }
+        return (question);
+    } catch (const bundy::Exception& ex) {
+        // The input data may contain bad string, which would trigger an
+        // exception.  We ignore them and continue reading until we find
+        // a valid one.
+        err << "Error parsing query (" << ex.what() << "): "
+            << string(begin, end) << endl;
+    }
+    return (QuestionPtr());
+}
+
+// A helper to map the input file in memory and release it in a RAII manner.
+struct MappedFile : private boost::noncopyable {
+    MappedFile(const string& filename) : fd(-1), data(NULL), len(0) {
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw QueryRepositoryError("failed to open input data file: " +
+                                       filename);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw QueryRepositoryError("failed to stat input data file: " +
+                                       filename);
+        }
+        len = st.st_size;
+        if (len > 0) {
+            void* p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                close(fd);
+                throw QueryRepositoryError(
+                    "failed to map input data file: " + filename + ": " +
+                    std::strerror(errno));
+            }
+            data = static_cast<const char*>(p);
+        }
+    }
+    ~MappedFile() {
+        if (data != NULL) {
+            munmap(const_cast<char*>(data), len);
+        }
+        close(fd);
+    }
+    int fd;
+    const char* data;
+    size_t len;
+};
+
+// Queries loaded in the "preload" mode.  Once constructed, it's never
+// modified, so it can be shared by multiple repositories (possibly used in
+// different threads).
+struct PreloadedQueries {
+    vector<RequestParam> params;
+    // All queries in wire format, in a single contiguous buffer.
+    vector<uint8_t> wire_data;
+
+    // Set if the queries are given as a compiled query set; params are
+    // unused in that case, and wire_data holds the image of the set if
+    // it's a copy (see clone()) rather than the mapped file.
+    scoped_ptr<const MappedFile> file;
+    scoped_ptr<const CompiledQuerySet> compiled;
+
+    // Return a copy of the queries in memory allocated by the calling
+    // thread.
+    shared_ptr<PreloadedQueries> clone() const {
+        shared_ptr<PreloadedQueries> copy(new PreloadedQueries);
+        if (compiled) {
+            const uint8_t* const image = file ?
+                reinterpret_cast<const uint8_t*>(file->data) : &wire_data[0];
+            const size_t len = file ? file->len : wire_data.size();
+            copy->wire_data.assign(image, image + len);
+            copy->compiled.reset(new CompiledQuerySet(&copy->wire_data[0],
+                                                      len));
+        } else {
+            copy->params = params;
+            copy->wire_data = wire_data;
+        }
+        return (copy);
+    }
+
+    size_t size() const {
+        return (compiled ? compiled->getCount() : params.size());
+    }
+
+    // Return the query of the given index in wire format.
+    const uint8_t* getWireQuery(size_t index, size_t& len, int& protocol,
+                                uint8_t& flags) const
+    {
+        if (compiled) {
+            flags = compiled->getFlags(index);
+            return (compiled->getQuery(index, len, protocol));
+        }
+        const RequestParam& param = params[index];
+        len = param.wire_len;
+        protocol = param.proto;
+        flags = (param.use_edns ? CompiledQuerySet::FLAG_EDNS : 0) |
+            (param.use_dnssec ? CompiledQuerySet::FLAG_DNSSEC : 0);
+        return (&wire_data[param.wire_offset]);
+    }
+};
+typedef boost::shared_ptr<const PreloadedQueries> ConstPreloadedQueriesPtr;
 }
 
 namespace Queryperf {
@@ -97,12 +391,37 @@ struct QueryRepository::QueryRepositoryImpl {
 
     QueryRepositoryImpl(const string& input_file) :
         qclass_(RRClass::IN()),
-        input_ifs_(new ifstream(input_file.c_str())),
-        input_(*input_ifs_)
+        input_file_(input_file),
+        input_local_(new ifstream(input_file.c_str())),
+        input_(*input_local_)
     {
         initialize();
     }
 
+    // Map a compiled query set and use it as preloaded queries, if the
+    // input file is one.  Return true if it is.
+    bool loadCompiled();
+
+    // Share (or copy) the preloaded queries of another repository.  The
+    // input stream is never used, so we use an empty placeholder.
+    QueryRepositoryImpl(const QueryRepositoryImpl& source,
+                        size_t start_index, bool copy) :
+        qclass_(source.qclass_), input_local_(new stringstream),
+        input_(*input_local_)
+    {
+        initialize();
+        compiled_ = source.compiled_;
+        use_dnssec_ = source.use_dnssec_;
+        use_edns_ = source.use_edns_;
+        proto_ = source.proto_;
+        edns_->setDNSSECAwareness(source.edns_->getDNSSECAwareness());
+        if (copy) {
+            setPreloaded(source.preloaded_->clone(), start_index);
+        } else {
+            setPreloaded(source.preloaded_, start_index);
+        }
+    }
+
     void initialize() {
         use_dnssec_ = true;
         use_edns_ = true;
@@ -111,69 +430,81 @@ struct QueryRepository::QueryRepositoryImpl {
         edns_.reset(new EDNS);
         edns_->setUDPSize(4096);
         edns_->setDNSSECAwareness(true);
-
-        // BIND 10 libdns++ doesn't yet recognize all standardized RR type
-        // menmonics.  To suppress noisy log and avoid ignoring query data
-        // containing such RR types, we use a homebrew mapping table.
-        // We keep the same map for each repository object to avoid inter
-        // thread contention.
-        aux_typemap_["A6"] = "TYPE38";
-        aux_typemap_["ANY"] = "TYPE255";
-        aux_typemap_["AXFR"] = "TYPE252";
-        aux_typemap_["IXFR"] = "TYPE251";
+        load_threads_ = 0;
+        compiled_ = false;
     }
 
     // Extract the next question from the input stream
     QuestionPtr readNextRequest(vector<RRsetPtr>& authorities,
                                 bool rewind);
 
-    // Extract optional attributes of the query.  Used by readNextRequest.
-    void parseQueryOptions(stringstream& ss);
+    // Preload queries from the input stream.
+    void loadStream(vector<RequestParam>& params);
+
+    // Preload queries from the input file, using multiple threads.
+    void loadFile(PreloadedQueries& preloaded) const;
+
+    // A chunk of the input file to be parsed by a loader thread.
+    struct LoadChunk {
+        const QueryRepositoryImpl* impl;
+        const char* begin;
+        const char* end;
+        PreloadedQueries queries;
+        ostringstream errors;   // messages on ignored lines
+        string failure;         // set on an unexpected failure
+    };
+
+    // Parse the lines of a chunk and render the queries.
+    void loadChunk(LoadChunk& chunk) const;
+
+    // Thread entry point for loadChunk().
+    static void* loadChunkThread(void* arg);
+
+    // Render the queries in wire format (with QID of 0).
+    void renderQueries(PreloadedQueries& queries) const;
 
     // Get the parameters of the next request, either from the preloaded
     // vector (if done) or from the input stream.
     const RequestParam& getNextParam();
 
+    // Start using the preloaded queries, beginning at the given index.
+    void setPreloaded(ConstPreloadedQueriesPtr preloaded, size_t start_index) {
+        preloaded_ = preloaded;
+        current_index_ = start_index % preloaded_->size();
+    }
+
+    // Return the index of the next preloaded query and advance the
+    // iteration.
+    size_t nextIndex() {
+        const size_t index = current_index_;
+        if (++current_index_ == preloaded_->size()) {
+            current_index_ = 0;
+        }
+        return (index);
+    }
+
+    // Build a query message for the given parameters.
+    void buildQuery(const RequestParam& param, Message& query_msg) const;
+
     RRClass qclass_;            // Query class
-    scoped_ptr<ifstream> input_ifs_;
+    const string input_file_;   // input file name; empty for a stream
+    scoped_ptr<istream> input_local_;
     istream& input_;
-    map<string, string> aux_typemap_;
-    vector<RequestParam> params_;   // used in the "preload" mode
+    ConstPreloadedQueriesPtr preloaded_; // used in the "preload" mode
     bool use_edns_;                 // whether to include ENDS by default.
     bool use_dnssec_;               // whether to set EDNS DO bit by default.
                                     // EDNS will be included regardless of
                                     // use_edns_.
     EDNSPtr edns_;                  // template of common EDNS OPT RR
     int proto_;                     // Default transport protocol
-    vector<RequestParam>::const_iterator current_param_;
-    vector<RequestParam>::const_iterator end_param_;
-
-    QueryOptions options_;
+    size_t current_index_;          // next index of preloaded queries
+    size_t load_threads_;           // number of loader threads (0: auto)
+    bool compiled_;                 // whether input is a compiled query set
 
 private:
     RequestParam param_placeholder_;
 };
 
-void
-QueryRepository::QueryRepositoryImpl::parseQueryOptions(stringstream& ss) {
-    while (!ss.eof()) {
-        string option;
-        ss >> option;
-
-        const size_t pos_delim = option.find('=');
-        if (pos_delim == string::npos) {
-            throw QueryRepositoryError("Invalid query option: no '='");
-        }
-        const string optname = option.substr(0, pos_delim);
-        const string optarg = option.substr(pos_delim + 1);
-
-        // Set option: for now just hardcode known options.
-        if (optname == "serial") {
-            options_.serial = lexical_cast<uint32_t>(optarg);
-        }
-    }
-}
-
 QuestionPtr
 QueryRepository::QueryRepositoryImpl::readNextRequest(
     vector<RRsetPtr>& authorities, bool rewind)
@@ -209,66 +540,208 @@ QueryRepository::QueryRepositoryImpl::readNextRequest(
             }
         }
 
-        options_.clear();
-        authorities.clear();
-        stringstream ss(line);
-        string qname_text, qtype_text;
-        ss >> qname_text >> qtype_text;
-        if (ss.bad() || ss.fail()) {
-            // Ignore the line is organized in an unexpected way.
-            continue;
+        question = parseRequest(line.data(), line.data() + line.size(),
+                                qclass_, authorities, cerr);
+    }
+
+    return (question);
+}
+
+void
+QueryRepository::QueryRepositoryImpl::loadStream(vector<RequestParam>& params)
+{
+    QuestionPtr question;
+    vector<RRsetPtr> authorities;
+    while ((question = readNextRequest(authorities, false)) != NULL) {
+        params.push_back(RequestParam(question, proto_));
+        params.back().authorities = authorities;
+        params.back().setEDNSPolicy(use_dnssec_, use_edns_);
+    }
+}
+
+void
+QueryRepository::QueryRepositoryImpl::loadChunk(LoadChunk& chunk) const {
+    vector<RequestParam>& params = chunk.queries.params;
+    vector<RRsetPtr> authorities;
+    const char* line = chunk.begin;
+    while (line < chunk.end) {
+        const char* eol = static_cast<const char*>(
+            std::memchr(line, '\n', chunk.end - line));
+        if (eol == NULL) {
+            eol = chunk.end;
         }
-        if (!ss.eof()) {
-            try {
-                parseQueryOptions(ss);
-            } catch (const std::exception& ex) {
-                cerr << "Error parsing query option (" << ex.what() << "): "
-                     << line << endl;
-                continue;
+        // Skip empty lines and comments.
+        if (line != eol && *line != ';') {
+            const QuestionPtr question =
+                parseRequest(line, eol, qclass_, authorities, chunk.errors);
+            if (question) {
+                params.push_back(RequestParam(question, proto_));
+                params.back().authorities = authorities;
+                params.back().setEDNSPolicy(use_dnssec_, use_edns_);
             }
         }
-        // Workaround for some RR types that are not recognized by BIND 10
-        map<string, string>::const_iterator it =
-            aux_typemap_.find(qtype_text);
-        if (it != aux_typemap_.end()) {
-            qtype_text = it->second;
+        line = eol + 1;
+    }
+    renderQueries(chunk.queries);
+}
+
+void*
+QueryRepository::QueryRepositoryImpl::loadChunkThread(void* arg) {
+    LoadChunk* chunk = static_cast<LoadChunk*>(arg);
+    try {
+        chunk->impl->loadChunk(*chunk);
+    } catch (const std::exception& ex) {
+        chunk->failure = ex.what();
+    }
+    return (NULL);
+}
+
+namespace {
+// The minimum size of a chunk of input data for a loader thread when the
+// number of threads is determined automatically.
+const size_t MIN_LOAD_CHUNK_SIZE = 1024 * 1024;
+}
+
+void
+QueryRepository::QueryRepositoryImpl::loadFile(PreloadedQueries& preloaded)
+    const
+{
+    const MappedFile file(input_file_);
+#ifdef MADV_SEQUENTIAL
+    if (file.data != NULL) {
+        madvise(const_cast<char*>(file.data), file.len, MADV_SEQUENTIAL);
+    }
+#endif
+
+    // Determine the number of chunks (and threads).
+    size_t n_chunks = load_threads_;
+    if (n_chunks == 0) {
+        const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_chunks = std::min<size_t>(n_cpus > 0 ? n_cpus : 1,
+                                    file.len / MIN_LOAD_CHUNK_SIZE + 1);
+    }
+
+    // Split the data into chunks at line boundaries.  Some of the chunks
+    // may be empty if the data is small.
+    vector<LoadChunk*> chunks;
+    const char* begin = file.data;
+    const char* const data_end = file.data + file.len;
+    for (size_t i = 0; i < n_chunks; ++i) {
+        const char* end = file.data + file.len * (i + 1) / n_chunks;
+        if (end < begin) {
+            end = begin;
+        }
+        if (end != data_end) {
+            const char* const eol = static_cast<const char*>(
+                std::memchr(end, '\n', data_end - end));
+            end = eol == NULL ? data_end : eol + 1;
         }
-        try {
-            const RRType qtype(qtype_text);
-            const Name qname(qname_text);
-            question.reset(new Question(qname, qclass_, qtype));
-
-            // For IXFR, we need to add an SOA to the authority section.
-            if (qtype == RRType::IXFR()) {
-                RRsetPtr rrset(new RRset(qname, qclass_, qtype, RRTTL(0)));
-                rrset->addRdata(rdata::createRdata(
-                                    RRType::SOA(), qclass_,
-                                    ". . " +
-                                    lexical_cast<string>(options_.serial) +
-                                    " 0 0 0 0"));
-                authorities.push_back(rrset);
+        chunks.push_back(new LoadChunk);
+        chunks.back()->impl = this;
+        chunks.back()->begin = begin;
+        chunks.back()->end = end;
+        begin = end;
+    }
+
+    // Parse the chunks, using the current thread for the first one.
+    vector<pthread_t> threads;
+    int error = 0;
+    for (size_t i = 1; i < n_chunks && error == 0; ++i) {
+        pthread_t th;
+        error = pthread_create(&th, NULL, loadChunkThread, chunks[i]);
+        if (error == 0) {
+            threads.push_back(th);
+        }
+    }
+    if (error == 0) {
+        loadChunkThread(chunks[0]);
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Concatenate the results in the original order.
+    string failure;
+    if (error != 0) {
+        failure = string("failed to create a loader thread: ") +
+            std::strerror(error);
+    }
+    for (size_t i = 0; i < n_chunks; ++i) {
+        LoadChunk& chunk = *chunks[i];
+        if (failure.empty() && !chunk.failure.empty()) {
+            failure = chunk.failure;
+        }
+        if (failure.empty()) {
+            cerr << chunk.errors.str();
+            const size_t wire_base = preloaded.wire_data.size();
+            BOOST_FOREACH(RequestParam& param, chunk.queries.params) {
+                param.wire_offset += wire_base;
+                preloaded.params.push_back(param);
             }
-        } catch (const bundy::Exception& ex) {
-            // The input data may contain bad string, which would trigger an
-            // exception.  We ignore them and continue reading until we find
-            // a valid one.
-            cerr << "Error parsing query (" << ex.what() << "): "
-                 << line << endl;
+            preloaded.wire_data.insert(preloaded.wire_data.end(),
+                                       chunk.queries.wire_data.begin(),
+                                       chunk.queries.wire_data.end());
         }
+        delete &chunk;
+    }
+    if (!failure.empty()) {
+        throw QueryRepositoryError("failed to preload queries: " + failure);
     }
+}
 
-    return (question);
+bool
+QueryRepository::QueryRepositoryImpl::loadCompiled() {
+    char magic[CompiledQuerySet::HEADER_SIZE];
+    input_.read(magic, sizeof(magic));
+    if (!CompiledQuerySet::isCompiled(magic, input_.gcount())) {
+        input_.clear();
+        input_.seekg(0);
+        return (false);
+    }
+
+    // The data is used directly from the mapped image; nothing is parsed
+    // except the header.
+    shared_ptr<PreloadedQueries> preloaded(new PreloadedQueries);
+    preloaded->file.reset(new MappedFile(input_file_));
+    preloaded->compiled.reset(new CompiledQuerySet(preloaded->file->data,
+                                                   preloaded->file->len));
+    if (preloaded->compiled->getCount() == 0) {
+        throw QueryRepositoryError("failed to preload queries: empty input");
+    }
+    compiled_ = true;
+    setPreloaded(preloaded, 0);
+    return (true);
+}
+
+void
+QueryRepository::QueryRepositoryImpl::renderQueries(
+    PreloadedQueries& queries) const
+{
+    Message query_msg(Message::RENDER);
+    MessageRenderer renderer;
+    BOOST_FOREACH(RequestParam& param, queries.params) {
+        buildQuery(param, query_msg);
+        query_msg.setQid(0);
+        renderer.clear();
+        query_msg.toWire(renderer);
+        const uint8_t* const data =
+            static_cast<const uint8_t*>(renderer.getData());
+        param.wire_offset = queries.wire_data.size();
+        param.wire_len = renderer.getLength();
+        queries.wire_data.insert(queries.wire_data.end(), data,
+                                 data + param.wire_len);
+    }
 }
 
 const RequestParam&
 QueryRepository::QueryRepositoryImpl::getNextParam() {
-    if (!params_.empty()) {
+    if (compiled_) {
+        throw QueryRepositoryError("queries of a compiled query set are only "
+                                   "available in wire format");
+    }
+    if (preloaded_) {
         // queries have been preloaded.  get the next one from the vector.
-        const RequestParam& param = *current_param_;
-        if (++current_param_ == end_param_) {
-            current_param_ = params_.begin();
-        }
-        return (param);
+        return (preloaded_->params[nextIndex()]);
     }
 
     param_placeholder_.question =
@@ -278,6 +751,23 @@ QueryRepository::QueryRepositoryImpl::getNextParam() {
     return (param_placeholder_);
 }
 
+void
+QueryRepository::QueryRepositoryImpl::buildQuery(const RequestParam& param,
+                                                 Message& query_msg) const
+{
+    query_msg.clear(Message::RENDER);
+    query_msg.setOpcode(Opcode::QUERY());
+    query_msg.setRcode(Rcode::NOERROR());
+    query_msg.setHeaderFlag(Message::HEADERFLAG_RD);
+    query_msg.addQuestion(param.question);
+    BOOST_FOREACH(const RRsetPtr rrset, param.authorities) {
+        query_msg.addRRset(Message::SECTION_AUTHORITY, rrset);
+    }
+    if (param.use_edns || param.use_dnssec) {
+        query_msg.setEDNS(edns_);
+    }
+}
+
 QueryRepository::QueryRepository(istream& input) :
     impl_(new QueryRepositoryImpl(input))
 {
@@ -291,6 +781,21 @@ QueryRepository::QueryRepository(const string& input_file) :
         throw QueryRepositoryError("failed to open input data file: " +
                                    input_file);
     }
+    try {
+        impl_->loadCompiled();
+    } catch (...) {
+        delete impl_;
+        throw;
+    }
+}
+
+QueryRepository::QueryRepository(const QueryRepository& source,
+                                 size_t start_index, bool copy)
+{
+    if (!source.impl_->preloaded_) {
+        throw QueryRepositoryError("queries are shared before preload");
+    }
+    impl_ = new QueryRepositoryImpl(*source.impl_, start_index, copy);
 }
 
 QueryRepository::~QueryRepository() {
@@ -299,53 +804,96 @@ QueryRepository::~QueryRepository() {
 
 void
 QueryRepository::load() {
+    // A compiled query set has been mapped on construction.
+    if (impl_->compiled_) {
+        return;
+    }
+
     // duplicate load check
-    if (!impl_->params_.empty()) {
+    if (impl_->preloaded_) {
         throw QueryRepositoryError("duplicate preload attempt");
     }
 
-    QuestionPtr question;
-    vector<RRsetPtr> authorities;
-    while ((question = impl_->readNextRequest(authorities, false))
-           != NULL) {
-        impl_->params_.push_back(RequestParam(question, impl_->proto_));
-        impl_->params_.back().authorities = authorities;
-        impl_->params_.back().setEDNSPolicy(impl_->use_dnssec_,
-                                            impl_->use_edns_);
-    }
-    if (impl_->params_.empty()) {
+    shared_ptr<PreloadedQueries> preloaded(new PreloadedQueries);
+    if (impl_->input_file_.empty()) {
+        impl_->loadStream(preloaded->params);
+        // Render all queries in wire format (with QID of 0), so that
+        // queries can be sent without building and rendering a message
+        // each time.
+        impl_->renderQueries(*preloaded);
+    } else {
+        // For a file, parsing and rendering are done in parallel.
+        impl_->loadFile(*preloaded);
+    }
+    if (preloaded->params.empty()) {
         throw QueryRepositoryError("failed to preload queries: empty input");
     }
-    impl_->current_param_ = impl_->params_.begin();
-    impl_->end_param_ = impl_->params_.end();
+
+    impl_->setPreloaded(preloaded, 0);
 }
 
 size_t
 QueryRepository::getQueryCount() const {
-    return (impl_->params_.size());
+    return (impl_->preloaded_ ? impl_->preloaded_->size() : 0);
 }
 
 void
 QueryRepository::getNextQuery(Message& query_msg, int& protocol) {
     const RequestParam& param = impl_->getNextParam();
+    impl_->buildQuery(param, query_msg);
+    protocol = param.proto;
+}
 
-    query_msg.clear(Message::RENDER);
-    query_msg.setOpcode(Opcode::QUERY());
-    query_msg.setRcode(Rcode::NOERROR());
-    query_msg.setHeaderFlag(Message::HEADERFLAG_RD);
-    query_msg.addQuestion(param.question);
-    BOOST_FOREACH(const RRsetPtr rrset, param.authorities) {
-        query_msg.addRRset(Message::SECTION_AUTHORITY, rrset);
+const uint8_t*
+QueryRepository::getNextWireQuery(size_t& len, int& protocol) {
+    if (!impl_->preloaded_) {
+        throw QueryRepositoryError("wire format queries are only available "
+                                   "after preload");
     }
-    protocol = param.proto;
-    if (param.use_edns || param.use_dnssec) {
-        query_msg.setEDNS(impl_->edns_);
+    uint8_t flags;
+    return (impl_->preloaded_->getWireQuery(impl_->nextIndex(), len, protocol,
+                                            flags));
+}
+
+void
+QueryRepository::writeCompiled(ostream& os) const {
+    if (!impl_->preloaded_) {
+        throw QueryRepositoryError("queries are compiled before preload");
+    }
+    const PreloadedQueries& queries = *impl_->preloaded_;
+    const size_t count = queries.size();
+    size_t len;
+    int protocol;
+    uint8_t flags;
+
+    // Index entries precede the data, so the offsets are calculated first.
+    uint64_t data_size = 0;
+    for (size_t i = 0; i < count; ++i) {
+        queries.getWireQuery(i, len, protocol, flags);
+        data_size += len;
+    }
+    CompiledQuerySet::writeHeader(os, count, data_size);
+    uint64_t offset = 0;
+    for (size_t i = 0; i < count; ++i) {
+        queries.getWireQuery(i, len, protocol, flags);
+        CompiledQuerySet::writeIndexEntry(os, offset, len, protocol, flags);
+        offset += len;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* data = queries.getWireQuery(i, len, protocol, flags);
+        os.write(reinterpret_cast<const char*>(data), len);
+    }
+    if (!os) {
+        throw QueryRepositoryError("failed to write compiled query set");
     }
 }
 
 void
 QueryRepository::setQueryClass(RRClass qclass) {
-    if (!impl_->params_.empty()) {
+    if (impl_->compiled_) {
+        return;                 // fixed in the compiled query set
+    }
+    if (impl_->preloaded_) {
         throw QueryRepositoryError("query class is being set after preload");
     }
 
@@ -354,7 +902,10 @@ QueryRepository::setQueryClass(RRClass qclass) {
 
 void
 QueryRepository::setDNSSEC(bool on) {
-    if (!impl_->params_.empty()) {
+    if (impl_->compiled_) {
+        return;                 // fixed in the compiled query set
+    }
+    if (impl_->preloaded_) {
         throw QueryRepositoryError(
             "DNSSEC DO bit is being changed after preload");
     }
@@ -365,16 +916,35 @@ QueryRepository::setDNSSEC(bool on) {
 
 void
 QueryRepository::setEDNS(bool on) {
-    if (!impl_->params_.empty()) {
+    if (impl_->compiled_) {
+        return;                 // fixed in the compiled query set
+    }
+    if (impl_->preloaded_) {
         throw QueryRepositoryError("EDNS flag is being changed after preload");
     }
 
     impl_->use_edns_ = on;
 }
 
+void
+QueryRepository::setLoadThreads(size_t count) {
+    if (impl_->compiled_) {
+        return;                 // fixed in the compiled query set
+    }
+    if (impl_->preloaded_) {
+        throw QueryRepositoryError(
+            "number of loader threads is being set after preload");
+    }
+
+    impl_->load_threads_ = count;
+}
+
 void
 QueryRepository::setProtocol(int proto) {
-    if (!impl_->params_.empty()) {
+    if (impl_->compiled_) {
+        return;                 // fixed in the compiled query set
+    }
+    if (impl_->preloaded_) {
         throw QueryRepositoryError("Protocol is being changed after preload");
     }
     if (proto != IPPROTO_UDP && proto != IPPROTO_TCP) {
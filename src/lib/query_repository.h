@@ -21,9 +21,12 @@
 #include <boost/noncopyable.hpp>
 
 #include <istream>
+#include <ostream>
 #include <string>
 #include <stdexcept>
 
+#include <stdint.h>
+
 namespace Queryperf {
 
 class QueryRepositoryError : public std::runtime_error {
@@ -36,12 +39,65 @@ public:
 class QueryRepository : private boost::noncopyable {
 public:
     explicit QueryRepository(std::istream& input);
+
+    /// \brief Constructor from an input file.
+    ///
+    /// The file is either a text file of queries or a compiled query set
+    /// (see \c CompiledQuerySet and \c writeCompiled()).  A compiled query
+    /// set is mapped in memory and is ready for use on construction, as if
+    /// it were preloaded; \c load() does nothing, and the query class,
+    /// EDNS, DNSSEC, and protocol settings are ignored as they are stored
+    /// in the file per query.  Queries of a compiled query set are only
+    /// available via \c getNextWireQuery().
+    ///
+    /// \throw QueryRepositoryError The file can't be opened, or it's a
+    /// broken or empty compiled query set.
     explicit QueryRepository(const std::string& input_file);
+
+    /// \brief Constructor sharing preloaded queries of another repository.
+    ///
+    /// The new repository refers to the same preloaded queries as
+    /// \c source without copying them, while keeping its own position of
+    /// iteration, starting at \c start_index (modulo the number of
+    /// queries).  Since preloaded queries are never modified, the
+    /// repositories sharing them can be used in different threads
+    /// simultaneously.  Other parameters such as the query class are copied
+    /// from \c source, and cannot be changed (as in the case of preload).
+    ///
+    /// If \c copy is true, the preloaded queries are copied into memory
+    /// allocated by the calling thread instead of being shared (a compiled
+    /// query set is copied from the mapped file).  A thread pinned to a CPU
+    /// can use it to get a copy local to the NUMA node of the CPU, which
+    /// can then be shared by other threads on the node.
+    ///
+    /// \throw QueryRepositoryError \c source hasn't been preloaded.
+    ///
+    /// \param source The repository that has preloaded queries.
+    /// \param start_index The index of the query to be used first.
+    /// \param copy Whether to copy the preloaded queries.
+    QueryRepository(const QueryRepository& source, size_t start_index,
+                    bool copy = false);
     ~QueryRepository();
 
     /// \brief Preload all data and hold it internally.
+    ///
+    /// If the repository was constructed with a file name, the file is
+    /// mapped in memory and split into chunks at line boundaries, which
+    /// are parsed and rendered by multiple threads (see
+    /// \c setLoadThreads()).  The resulting sequence of queries is the
+    /// same as the one loaded from an input stream.
     void load();
 
+    /// \brief Set the number of threads used to preload an input file.
+    ///
+    /// If it's 0 (the default), the number of available CPUs is used,
+    /// while files smaller than 1MB per thread use fewer threads.
+    /// This is ignored if the repository was constructed with an input
+    /// stream.  This must be called before load().
+    ///
+    /// \param count The number of threads.
+    void setLoadThreads(size_t count);
+
     /// \brief Return preloaded query count if preload took place.
     ///
     /// It returns 0 if preload hasn't been initiated.
@@ -49,6 +105,32 @@ public:
 
     void getNextQuery(bundy::dns::Message& message, int& protocol);
 
+    /// \brief Return the next query in wire format.
+    ///
+    /// This is available only in the preload mode; all queries are rendered
+    /// in a single buffer on \c load(), so this method simply returns the
+    /// location of the next one.  The QID of the returned data is 0, and
+    /// the caller is expected to copy the data and set the QID.  It shares
+    /// the iteration with \c getNextQuery().
+    ///
+    /// \throw QueryRepositoryError preload hasn't taken place.
+    ///
+    /// \param len Set to the length of the returned data.
+    /// \param protocol Set to the transport protocol of the query.
+    /// \return A pointer to the query data, valid as long as the repository.
+    const uint8_t* getNextWireQuery(size_t& len, int& protocol);
+
+    /// \brief Write the preloaded queries as a compiled query set.
+    ///
+    /// The written data can be given to the constructor as an input file
+    /// later, so the queries can be used without parsing them again.
+    ///
+    /// \throw QueryRepositoryError preload hasn't taken place, or writing
+    /// to the stream failed.
+    ///
+    /// \param os The output stream.
+    void writeCompiled(std::ostream& os) const;
+
     /// \brief Set the default RR class of the queries.
     ///
     /// When preload is used, this must be called before load().
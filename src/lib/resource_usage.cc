@@ -0,0 +1,117 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <resource_usage.h>
+
+#include <cstring>
+
+#include <time.h>
+
+namespace Queryperf {
+
+const double ResourceUsage::SATURATION_THRESHOLD = 0.9;
+
+namespace {
+uint64_t
+toMicroseconds(const struct timeval& tv) {
+    return (static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec);
+}
+
+// Get the usage of the calling thread; all 0 if it's not supported.
+void
+getThreadUsage(struct rusage& ru) {
+    std::memset(&ru, 0, sizeof(ru));
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &ru);
+#endif
+}
+}
+
+uint64_t
+getMonotonicTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000);
+}
+
+ResourceUsage::ResourceUsage() :
+    wall_usec(0), user_usec(0), system_usec(0), voluntary_switches(0),
+    involuntary_switches(0), has_loop_stats(false), idle_usec(0), io_usec(0)
+{}
+
+void
+ResourceUsage::merge(const ResourceUsage& other) {
+    // Loop statistics are only meaningful if all threads have them.
+    has_loop_stats = (wall_usec == 0 || has_loop_stats) &&
+        other.has_loop_stats;
+    wall_usec += other.wall_usec;
+    user_usec += other.user_usec;
+    system_usec += other.system_usec;
+    voluntary_switches += other.voluntary_switches;
+    involuntary_switches += other.involuntary_switches;
+    idle_usec += other.idle_usec;
+    io_usec += other.io_usec;
+}
+
+double
+ResourceUsage::getCPUUtilization() const {
+    if (wall_usec == 0) {
+        return (0);
+    }
+    return (static_cast<double>(user_usec + system_usec) / wall_usec);
+}
+
+double
+ResourceUsage::getBusyRatio() const {
+    if (!has_loop_stats) {
+        return (getCPUUtilization());
+    }
+    if (wall_usec == 0) {
+        return (0);
+    }
+    return (idle_usec >= wall_usec ? 0 :
+            static_cast<double>(wall_usec - idle_usec) / wall_usec);
+}
+
+bool
+ResourceUsage::isSaturated() const {
+    return (getCPUUtilization() >= SATURATION_THRESHOLD ||
+            getBusyRatio() >= SATURATION_THRESHOLD);
+}
+
+ThreadUsageMeter::ThreadUsageMeter() : start_time_(0) {
+    std::memset(&start_rusage_, 0, sizeof(start_rusage_));
+}
+
+void
+ThreadUsageMeter::start() {
+    start_time_ = getMonotonicTime();
+    getThreadUsage(start_rusage_);
+}
+
+void
+ThreadUsageMeter::stop(ResourceUsage& usage) const {
+    struct rusage ru;
+    getThreadUsage(ru);
+    usage.wall_usec += getMonotonicTime() - start_time_;
+    usage.user_usec += toMicroseconds(ru.ru_utime) -
+        toMicroseconds(start_rusage_.ru_utime);
+    usage.system_usec += toMicroseconds(ru.ru_stime) -
+        toMicroseconds(start_rusage_.ru_stime);
+    usage.voluntary_switches += ru.ru_nvcsw - start_rusage_.ru_nvcsw;
+    usage.involuntary_switches += ru.ru_nivcsw - start_rusage_.ru_nivcsw;
+}
+
+} // end of QueryPerf
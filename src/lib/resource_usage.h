@@ -0,0 +1,100 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#ifndef __QUERYPERF_RESOURCE_USAGE_H
+#define __QUERYPERF_RESOURCE_USAGE_H 1
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <stdint.h>
+
+namespace Queryperf {
+
+/// \brief Return the current time of a monotonic clock in microseconds.
+///
+/// This is intended to measure short intervals in hot paths cheaply.
+uint64_t getMonotonicTime();
+
+/// \brief Resource usage of a thread running a dispatcher.
+///
+/// It's used to tell whether the client itself (rather than the server)
+/// was the bottleneck of a test.  All times are in microseconds.
+///
+/// The CPU times and context switches are per thread where the system
+/// supports it (\c RUSAGE_THREAD); otherwise they are 0.  The idle and I/O
+/// times are only available if the message manager measures its event
+/// loop (see \c MessageManager::getLoopStatistics()).
+struct ResourceUsage {
+    /// \brief The ratio of busy time above which the thread is considered
+    /// to be saturated.
+    static const double SATURATION_THRESHOLD;
+
+    ResourceUsage();
+
+    /// \brief Add the usage of another thread to this one.
+    void merge(const ResourceUsage& other);
+
+    /// \brief Return the ratio of CPU time (user and system) to wall time.
+    double getCPUUtilization() const;
+
+    /// \brief Return the ratio of time the event loop was busy, i.e.,
+    /// not waiting for events.
+    ///
+    /// If the idle time isn't available, it's the same as the CPU
+    /// utilization.
+    double getBusyRatio() const;
+
+    /// \brief Return true if the thread was busy most of the time, i.e.,
+    /// either the CPU utilization or the busy ratio reaches
+    /// \c SATURATION_THRESHOLD.
+    bool isSaturated() const;
+
+    uint64_t wall_usec;         ///< elapsed time
+    uint64_t user_usec;         ///< CPU time in the user mode
+    uint64_t system_usec;       ///< CPU time in the kernel
+    uint64_t voluntary_switches; ///< e.g., waiting for events
+    uint64_t involuntary_switches; ///< preempted; a sign of CPU contention
+    bool has_loop_stats;        ///< whether idle_usec and io_usec are valid
+    uint64_t idle_usec;         ///< waiting for events in the event loop
+    uint64_t io_usec;           ///< in system calls sending or receiving
+};
+
+/// \brief Measure the resource usage of the calling thread.
+///
+/// \c start() and \c stop() must be called by the same thread.
+class ThreadUsageMeter {
+public:
+    ThreadUsageMeter();
+
+    /// \brief Start measuring.
+    void start();
+
+    /// \brief Add the usage since \c start() to the given object.
+    ///
+    /// The loop statistics of \c usage are not touched.
+    void stop(ResourceUsage& usage) const;
+
+private:
+    uint64_t start_time_;
+    struct rusage start_rusage_;
+};
+
+} // end of QueryPerf
+
+#endif // __QUERYPERF_RESOURCE_USAGE_H
+
+// Local Variables:
+// mode: c++
+// End:
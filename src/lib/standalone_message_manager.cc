@@ -0,0 +1,467 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <config.h>
+
+#include <standalone_message_manager.h>
+#include <resource_usage.h>
+#include <timer_wheel.h>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef HAVE_DLOPEN
+#include <dlfcn.h>
+#endif
+
+using boost::lexical_cast;
+
+namespace Queryperf {
+
+namespace {
+class SocketImpl;
+class TimerImpl;
+
+// The type of the handler function of a shared object.
+typedef size_t (*HandlerFunction)(const void*, size_t, void*, size_t);
+}
+
+struct StandaloneMessageManager::StandaloneMessageManagerImpl {
+    StandaloneMessageManagerImpl(const QueryHandler& handler) :
+        handler_(handler), library_(NULL), stopped_(false),
+        response_buf_(std::numeric_limits<uint16_t>::max())
+    {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&cond_, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_init(&mutex_, NULL);
+    }
+
+    ~StandaloneMessageManagerImpl() {
+        pthread_cond_destroy(&cond_);
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    // A message queued by send().  The data are stored in a separate
+    // buffer, from the given offset.
+    struct Query {
+        Query(SocketImpl* sock_param, size_t offset_param, size_t len_param) :
+            sock(sock_param), offset(offset_param), len(len_param)
+        {}
+        SocketImpl* sock;       // NULL if the socket has been destroyed
+        size_t offset;
+        size_t len;
+    };
+
+    bool isStopped() const {
+        return (__atomic_load_n(&stopped_, __ATOMIC_ACQUIRE));
+    }
+
+    void enqueue(SocketImpl* sock, const void* data, size_t len) {
+        const uint8_t* const cp = static_cast<const uint8_t*>(data);
+        queries_.push_back(Query(sock, query_data_.size(), len));
+        query_data_.insert(query_data_.end(), cp, cp + len);
+    }
+
+    // Invalidate messages of a destroyed socket.
+    void forget(const SocketImpl* sock);
+
+    // Call the callbacks of expired timers, and return the expiration time
+    // of the earliest active timer, or 0 if there's none.
+    uint64_t fireTimers();
+
+    // Handle all messages queued so far, until stop() is called.
+    void handleQueries();
+
+    // Wait until the given time or stop().
+    void wait(uint64_t until);
+
+    void run();
+
+    QueryHandler handler_;
+    void* library_;             // shared object of the handler, if loaded
+    bool stopped_;              // accessed atomically
+    pthread_mutex_t mutex_;     // protects cond_ for stop()
+    pthread_cond_t cond_;
+    std::vector<Query> queries_; // queued, not being handled yet
+    std::vector<uint8_t> query_data_;
+    std::vector<Query> processing_; // being handled
+    std::vector<uint8_t> processing_data_;
+    std::vector<TimerImpl*> timers_; // active timers
+    std::vector<uint8_t> response_buf_; // for persistent connections
+    // Destroyed first in the destructor.  Created on the first use.
+    boost::scoped_ptr<TimerWheel> timer_wheel_;
+};
+
+namespace {
+typedef StandaloneMessageManager::StandaloneMessageManagerImpl ManagerImpl;
+
+class SocketImpl : public MessageSocket {
+public:
+    // UDP and persistent TCP sockets can send any number of messages,
+    // while a TCP socket sends a single query and gets a single response.
+    enum Type {
+        DATAGRAM,
+        TCP,
+        STREAM
+    };
+
+    SocketImpl(ManagerImpl& mgr, Type type, void* recvbuf,
+               size_t recvbuf_len, Callback callback) :
+        mgr_(mgr), type_(type), recvbuf_(recvbuf), recvbuf_len_(recvbuf_len),
+        callback_(callback), sent_(false), pending_(0)
+    {}
+
+    virtual ~SocketImpl() {
+        if (pending_ > 0) {
+            mgr_.forget(this);
+        }
+    }
+
+    virtual void send(const void* data, size_t datalen) {
+        if (type_ == TCP && sent_) {
+            throw MessageSocketError("duplicate send on a TCP socket");
+        }
+        sent_ = true;
+        mgr_.enqueue(this, data, datalen);
+        ++pending_;
+    }
+
+    // Handle a queued message.  The object may be destroyed in the
+    // callback, so the caller must not refer to it after that.
+    void handle(const void* data, size_t datalen) {
+        --pending_;
+        const size_t len = mgr_.handler_(data, datalen, recvbuf_,
+                                         recvbuf_len_);
+        if (len > recvbuf_len_) {
+            throw MessageSocketError("query handler returned too large "
+                                     "response: " +
+                                     lexical_cast<std::string>(len));
+        }
+        if (type_ != TCP) {
+            if (len > 0) {
+                callback_(Event(recvbuf_, len));
+            }
+        } else if (len == 0) {
+            callback_(Event(NULL, 0));
+        } else {
+            // The response is considered a single message over TCP.
+            MessageSocket::TransferInfo transfer;
+            transfer.addBytes(len + 2);
+            transfer.addData(0, recvbuf_, len);
+            transfer.addMessage();
+            callback_(Event(recvbuf_, len, &transfer));
+        }
+    }
+
+private:
+    ManagerImpl& mgr_;
+    const Type type_;
+    void* const recvbuf_;
+    const size_t recvbuf_len_;
+    const Callback callback_;
+    bool sent_;
+    size_t pending_;            // number of queued messages
+};
+
+class TimerImpl : public MessageTimer {
+public:
+    TimerImpl(ManagerImpl& mgr, Callback callback) :
+        mgr_(mgr), callback_(callback), expire_(0), active_(false)
+    {}
+
+    virtual ~TimerImpl() {
+        cancel();
+    }
+
+    virtual void start(const boost::posix_time::time_duration& duration) {
+        cancel();
+        const int64_t usec = duration.total_microseconds();
+        expire_ = getMonotonicTime() + (usec > 0 ? usec : 0);
+        mgr_.timers_.push_back(this);
+        active_ = true;
+    }
+
+    virtual void cancel() {
+        if (active_) {
+            std::vector<TimerImpl*>& timers = mgr_.timers_;
+            *std::find(timers.begin(), timers.end(), this) = timers.back();
+            timers.pop_back();
+            active_ = false;
+        }
+    }
+
+    uint64_t getExpiration() const { return (expire_); }
+
+    // Deactivate the timer and call the callback.
+    void fire() {
+        cancel();
+        callback_();
+    }
+
+private:
+    ManagerImpl& mgr_;
+    const Callback callback_;
+    uint64_t expire_;
+    bool active_;
+};
+
+}
+
+void
+ManagerImpl::forget(const SocketImpl* sock) {
+    for (size_t i = 0; i < queries_.size(); ++i) {
+        if (queries_[i].sock == sock) {
+            queries_[i].sock = NULL;
+        }
+    }
+    for (size_t i = 0; i < processing_.size(); ++i) {
+        if (processing_[i].sock == sock) {
+            processing_[i].sock = NULL;
+        }
+    }
+}
+
+uint64_t
+ManagerImpl::fireTimers() {
+    // There are only a few timers (most are managed in the timer wheel), so
+    // we simply scan all of them.  Callbacks can start or cancel any
+    // timers, so we rescan after every callback.
+    for (;;) {
+        const uint64_t now = getMonotonicTime();
+        TimerImpl* expired = NULL;
+        uint64_t next = 0;
+        for (size_t i = 0; i < timers_.size(); ++i) {
+            const uint64_t expire = timers_[i]->getExpiration();
+            if (expire <= now) {
+                expired = timers_[i];
+                break;
+            }
+            if (next == 0 || expire < next) {
+                next = expire;
+            }
+        }
+        if (expired == NULL) {
+            return (next);
+        }
+        expired->fire();
+        if (isStopped()) {
+            return (0);
+        }
+    }
+}
+
+void
+ManagerImpl::handleQueries() {
+    // Messages queued in the callbacks are handled in the next batch.
+    processing_.swap(queries_);
+    processing_data_.swap(query_data_);
+    queries_.clear();
+    query_data_.clear();
+
+    size_t i = 0;
+    for (; i < processing_.size() && !isStopped(); ++i) {
+        const Query& query = processing_[i];
+        if (query.sock != NULL) {
+            query.sock->handle(&processing_data_[query.offset], query.len);
+        }
+    }
+    if (i < processing_.size()) {
+        // Interrupted by stop().  Keep the rest so they will be handled
+        // first on the next run, followed by those queued in the meantime.
+        std::vector<Query> rest;
+        std::vector<uint8_t> rest_data;
+        for (; i < processing_.size(); ++i) {
+            const Query& query = processing_[i];
+            rest.push_back(Query(query.sock, rest_data.size(), query.len));
+            rest_data.insert(rest_data.end(),
+                             processing_data_.begin() + query.offset,
+                             processing_data_.begin() + query.offset +
+                             query.len);
+        }
+        for (size_t j = 0; j < queries_.size(); ++j) {
+            const Query& query = queries_[j];
+            rest.push_back(Query(query.sock, rest_data.size(), query.len));
+            rest_data.insert(rest_data.end(),
+                             query_data_.begin() + query.offset,
+                             query_data_.begin() + query.offset + query.len);
+        }
+        queries_.swap(rest);
+        query_data_.swap(rest_data);
+    }
+    processing_.clear();
+}
+
+void
+ManagerImpl::wait(uint64_t until) {
+    struct timespec ts;
+    ts.tv_sec = until / 1000000;
+    ts.tv_nsec = (until % 1000000) * 1000;
+    pthread_mutex_lock(&mutex_);
+    while (!isStopped() && getMonotonicTime() < until) {
+        pthread_cond_timedwait(&cond_, &mutex_, &ts);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+void
+ManagerImpl::run() {
+    while (!isStopped()) {
+        const uint64_t next_timer = fireTimers();
+        if (isStopped()) {
+            break;
+        }
+        if (!queries_.empty()) {
+            handleQueries();
+        } else if (next_timer != 0) {
+            wait(next_timer);
+        } else {
+            break;              // no more work
+        }
+    }
+    // The manager can be run again.
+    __atomic_store_n(&stopped_, false, __ATOMIC_RELEASE);
+}
+
+const char* const StandaloneMessageManager::HANDLER_SYMBOL =
+    "queryperf_handle_query";
+
+StandaloneMessageManager::StandaloneMessageManager(QueryHandler handler) {
+    if (!handler) {
+        throw MessageSocketError("null query handler specified");
+    }
+    impl_ = new StandaloneMessageManagerImpl(handler);
+}
+
+StandaloneMessageManager::StandaloneMessageManager(
+    const std::string& library)
+{
+#ifdef HAVE_DLOPEN
+    void* handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        throw MessageSocketError(std::string("failed to load query handler "
+                                             "library: ") + dlerror());
+    }
+    // Converting an object pointer to a function pointer isn't allowed in
+    // C++; this is the workaround recommended by POSIX.
+    HandlerFunction handler;
+    *reinterpret_cast<void**>(&handler) = dlsym(handle, HANDLER_SYMBOL);
+    if (handler == NULL) {
+        const std::string error = std::string("no query handler in ") +
+            library + ": " + HANDLER_SYMBOL;
+        dlclose(handle);
+        throw MessageSocketError(error);
+    }
+    impl_ = new StandaloneMessageManagerImpl(handler);
+    impl_->library_ = handle;
+#else
+    throw MessageSocketError("loading a query handler library is not "
+                             "supported on this system: " + library);
+#endif
+}
+
+StandaloneMessageManager::~StandaloneMessageManager() {
+    impl_->timer_wheel_.reset();
+#ifdef HAVE_DLOPEN
+    void* const library = impl_->library_;
+    delete impl_;
+    if (library != NULL) {
+        dlclose(library);
+    }
+#else
+    delete impl_;
+#endif
+}
+
+MessageSocket*
+StandaloneMessageManager::createMessageSocket(int proto, const std::string&,
+                                              uint16_t, void* recvbuf,
+                                              size_t recvbuf_len,
+                                              MessageSocket::Callback callback)
+{
+    if (!callback) {
+        throw MessageSocketError("null socket callback specified");
+    }
+    if (proto == IPPROTO_UDP) {
+        return (new SocketImpl(*impl_, SocketImpl::DATAGRAM, recvbuf,
+                               recvbuf_len, callback));
+    } else if (proto == IPPROTO_TCP) {
+        return (new SocketImpl(*impl_, SocketImpl::TCP, recvbuf,
+                               recvbuf_len, callback));
+    }
+    throw MessageSocketError("unsupported or invalid protocol: " +
+                             lexical_cast<std::string>(proto));
+}
+
+MessageSocket*
+StandaloneMessageManager::createStreamMessageSocket(
+    const std::string&, uint16_t, MessageSocket::Callback callback)
+{
+    if (!callback) {
+        throw MessageSocketError("null socket callback specified");
+    }
+    return (new SocketImpl(*impl_, SocketImpl::STREAM,
+                           &impl_->response_buf_[0],
+                           impl_->response_buf_.size(), callback));
+}
+
+MessageTimer*
+StandaloneMessageManager::createMessageTimer(MessageTimer::Callback callback)
+{
+    if (!callback) {
+        throw MessageTimerError("null timer callback specified");
+    }
+    return (new TimerImpl(*impl_, callback));
+}
+
+MessageTimer*
+StandaloneMessageManager::createCoarseMessageTimer(
+    MessageTimer::Callback callback)
+{
+    if (!impl_->timer_wheel_) {
+        impl_->timer_wheel_.reset(new TimerWheel(*this));
+    }
+    return (impl_->timer_wheel_->createTimer(callback));
+}
+
+void
+StandaloneMessageManager::run() {
+    impl_->run();
+}
+
+void
+StandaloneMessageManager::stop() {
+    __atomic_store_n(&impl_->stopped_, true, __ATOMIC_RELEASE);
+    // Wake up the loop in case it's waiting for a timer in another thread.
+    pthread_mutex_lock(&impl_->mutex_);
+    pthread_cond_signal(&impl_->cond_);
+    pthread_mutex_unlock(&impl_->mutex_);
+}
+
+} // end of QueryPerf
@@ -0,0 +1,136 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#ifndef __QUERYPERF_STANDALONE_MESSAGE_MANAGER_H
+#define __QUERYPERF_STANDALONE_MESSAGE_MANAGER_H 1
+
+#include <message_manager.h>
+
+#include <boost/function.hpp>
+
+#include <string>
+
+#include <stdint.h>
+
+namespace Queryperf {
+
+/// \brief A \c MessageManager implementation that handles queries in
+/// process, without network I/O (the "stand alone" mode).
+///
+/// Instead of sending queries to a server, the manager passes each query
+/// to a query handler, typically a thin wrapper of the query processing
+/// code of a server implementation, and delivers the response rendered by
+/// the handler to the socket as if it were received from the network.
+/// This way the gross maximum performance of the server code can be
+/// measured, and profiled, with the same queries as network tests.
+///
+/// The handler is given the query data and a buffer for the response, and
+/// returns the length of the response rendered in the buffer.  It can
+/// return 0 to indicate there's no response; for a UDP socket or a
+/// persistent TCP connection the query is then simply left unanswered,
+/// and for a TCP socket the callback is called as if the connection
+/// failed.  The handler is called from \c run() of the manager; if
+/// multiple managers share a handler in different threads, it must be
+/// thread safe.
+///
+/// The handler can also be loaded from a shared object, which must export
+/// a function of the following name and signature:
+/// \code extern "C" size_t
+/// queryperf_handle_query(const void* query, size_t query_len,
+///                        void* response, size_t response_len);
+/// \endcode
+/// If the library needs initialization, it can be done in its constructor
+/// (e.g., a function with \c __attribute__((constructor))).
+///
+/// Messages given to \c send() are queued, and handled in the order of
+/// sending in the event loop, so the callbacks are never called from
+/// \c send().  The destination addresses and ports of sockets are ignored.
+/// Timers are checked between batches of queries handled in the loop,
+/// and coarse timers are managed in a \c TimerWheel as with other
+/// managers.
+///
+/// \c run() returns when \c stop() is called or there is no more pending
+/// work: no queued message and no active timer.  \c stop() can be called
+/// from any thread.  The manager can be run again after \c run() returns;
+/// queued messages that weren't handled due to \c stop() will then be
+/// handled first.
+///
+/// Objects created by the manager must be destroyed before the manager.
+class StandaloneMessageManager : public MessageManager {
+public:
+    /// \brief The query handler.
+    ///
+    /// The parameters are the query data and its length, and the buffer
+    /// for the response and its size.  It returns the length of the
+    /// response, or 0 if there's no response.
+    typedef boost::function<size_t(const void*, size_t, void*, size_t)>
+    QueryHandler;
+
+    /// \brief The name of the handler function of a shared object.
+    static const char* const HANDLER_SYMBOL;
+
+    /// \brief Constructor with a handler linked in the program.
+    ///
+    /// \throw MessageSocketError The handler is empty.
+    explicit StandaloneMessageManager(QueryHandler handler);
+
+    /// \brief Constructor with a handler loaded from a shared object.
+    ///
+    /// The shared object is unloaded when the manager is destroyed.
+    ///
+    /// \throw MessageSocketError The shared object can't be loaded, it
+    /// doesn't have the handler function, or dynamic loading isn't
+    /// supported on the system.
+    explicit StandaloneMessageManager(const std::string& library);
+
+    virtual ~StandaloneMessageManager();
+
+    virtual MessageSocket* createMessageSocket(
+        int proto, const std::string& address, uint16_t port,
+        void* recvbuf, size_t recvbuf_len,
+        MessageSocket::Callback callback);
+
+    virtual MessageSocket* createStreamMessageSocket(
+        const std::string& address, uint16_t port,
+        MessageSocket::Callback callback);
+
+    virtual MessageTimer* createMessageTimer(MessageTimer::Callback callback);
+
+    /// \brief Create a coarse timer.
+    ///
+    /// As with other managers, coarse timers are managed in a
+    /// \c TimerWheel with the default tick interval.
+    virtual MessageTimer* createCoarseMessageTimer(
+        MessageTimer::Callback callback);
+
+    virtual void run();
+
+    virtual void stop();
+
+    // The implementation is public for the convenience of the
+    // implementation of sockets and timers.
+    struct StandaloneMessageManagerImpl;
+
+private:
+    StandaloneMessageManagerImpl* impl_;
+};
+
+} // end of QueryPerf
+
+#endif // __QUERYPERF_STANDALONE_MESSAGE_MANAGER_H
+
+// Local Variables:
+// mode: c++
+// End:
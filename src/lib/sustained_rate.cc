@@ -0,0 +1,87 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <sustained_rate.h>
+
+#include <boost/date_time/gregorian/gregorian_types.hpp>
+
+using namespace boost::posix_time;
+
+namespace Queryperf {
+
+namespace {
+const ptime EPOCH(boost::gregorian::date(1970, 1, 1));
+}
+
+SustainedRates::SustainedRates(const time_duration& interval) :
+    interval_(interval.total_microseconds()), sources_(0)
+{}
+
+void
+SustainedRates::record(const ptime& end_time, double rate, size_t window) {
+    // Round to the nearest slot so small jitters of the timer don't move
+    // the rate to a neighbor slot.
+    const int64_t slot_id =
+        ((end_time - EPOCH).total_microseconds() + interval_ / 2) /
+        interval_;
+    Slot& slot = slots_[slot_id];
+    if (slot.sources == 0 || rate > slot.rate) {
+        slot.rate = rate;
+        slot.window = window;
+        slot.sources = 1;
+    }
+    sources_ = 1;
+}
+
+void
+SustainedRates::merge(const SustainedRates& other) {
+    for (SlotMap::const_iterator it = other.slots_.begin();
+         it != other.slots_.end();
+         ++it) {
+        Slot& slot = slots_[it->first];
+        slot.rate += it->second.rate;
+        slot.window += it->second.window;
+        slot.sources += it->second.sources;
+    }
+    sources_ += other.sources_;
+}
+
+SustainedRates::SlotMap::const_iterator
+SustainedRates::findMax() const {
+    SlotMap::const_iterator max_it = slots_.end();
+    for (SlotMap::const_iterator it = slots_.begin();
+         it != slots_.end();
+         ++it) {
+        if (it->second.sources == sources_ &&
+            (max_it == slots_.end() || it->second.rate > max_it->second.rate)) {
+            max_it = it;
+        }
+    }
+    return (max_it);
+}
+
+double
+SustainedRates::getMaxRate() const {
+    const SlotMap::const_iterator it = findMax();
+    return (it == slots_.end() ? 0 : it->second.rate);
+}
+
+size_t
+SustainedRates::getMaxWindow() const {
+    const SlotMap::const_iterator it = findMax();
+    return (it == slots_.end() ? 0 : it->second.window);
+}
+
+} // end of QueryPerf
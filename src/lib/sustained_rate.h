@@ -0,0 +1,94 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#ifndef __QUERYPERF_SUSTAINED_RATE_H
+#define __QUERYPERF_SUSTAINED_RATE_H 1
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <map>
+
+#include <stdint.h>
+
+namespace Queryperf {
+
+/// \brief Throughput sustained by the server per interval of adjusting
+/// the adaptive window.
+///
+/// Each recorded rate is put in a time slot of the given interval,
+/// counted from a fixed epoch, so rates recorded by dispatchers running
+/// at the same time land in the same slot without a common start time.
+/// \c merge() adds up the rates and windows per slot, and the maximum is
+/// taken only over the slots every merged dispatcher recorded a rate in.
+/// So the result is what the server sustained in a single interval,
+/// rather than the sum of maximums reached at different times.
+class SustainedRates {
+public:
+    /// \brief Constructor.  The rates are initially empty.
+    ///
+    /// \param interval The length of a slot; it should be the interval of
+    /// adjusting the window of the dispatchers.
+    explicit SustainedRates(const boost::posix_time::time_duration&
+                            interval = boost::posix_time::milliseconds(100));
+
+    /// \brief Record the rate sustained in the interval ending at the
+    /// given time.
+    ///
+    /// If a rate has already been recorded in the same slot, the higher
+    /// one is kept.
+    ///
+    /// \param end_time The end of the interval.
+    /// \param rate The throughput in queries per second.
+    /// \param window The window used in the interval.
+    void record(const boost::posix_time::ptime& end_time, double rate,
+                size_t window);
+
+    /// \brief Add the rates recorded by another dispatcher to this one.
+    ///
+    /// Both objects must have the same interval.  Merging an empty object
+    /// has no effect.
+    void merge(const SustainedRates& other);
+
+    /// \brief Return the highest total rate in queries per second over
+    /// the slots covered by all merged dispatchers, or 0 if there's none.
+    double getMaxRate() const;
+
+    /// \brief Return the total window with which the rate returned by
+    /// \c getMaxRate() was achieved.
+    size_t getMaxWindow() const;
+
+private:
+    struct Slot {
+        Slot() : rate(0), window(0), sources(0) {}
+        double rate;
+        size_t window;
+        size_t sources;         // number of dispatchers recorded in it
+    };
+    typedef std::map<int64_t, Slot> SlotMap;
+
+    SlotMap::const_iterator findMax() const;
+
+    int64_t interval_;          // in microseconds
+    size_t sources_;            // number of merged dispatchers
+    SlotMap slots_;
+};
+
+} // end of QueryPerf
+
+#endif // __QUERYPERF_SUSTAINED_RATE_H
+
+// Local Variables:
+// mode: c++
+// End:
@@ -199,6 +199,9 @@ public:
     // Common callback for the message socket.
     void sendCallback(const MessageSocket::Event& ev) {
         ++sendcallback_called_;
+        if (ev.transfer != NULL) {
+            last_transfer_ = *ev.transfer;
+        }
         // In the TCP test, a complete response message hasn't be sent
         // until callbackForTCPTest is called at least 4 times.  See that
         // function.
@@ -260,6 +263,7 @@ public:
     size_t timercallback_called_;
     size_t helpercallback_called_; // # of times callbackForTCPTest is called
     size_t send_done_;
+    MessageSocket::TransferInfo last_transfer_;
     ASIOMessageManager asio_manager_;
     scoped_ptr<MessageSocket> test_sock_;
     scoped_ptr<MessageSocket> udp_sock_; // auxiliary socket used in TCP test
@@ -582,6 +586,10 @@ TEST_F(ASIOMessageManagerTest, sendTCPIPv6Multi) {
     // will result in two response messages.
     sendTCPCheck(listen_s.fd, AF_INET6, "::1", "5306", 5);
     EXPECT_EQ(1, sendcallback_called_);
+    // Both messages are counted: 2 + 15 bytes and 2 + 8 bytes.
+    EXPECT_EQ(2, last_transfer_.messages);
+    EXPECT_EQ(27, last_transfer_.bytes);
+    EXPECT_FALSE(last_transfer_.first_byte.is_special());
 }
 
 TEST_F(ASIOMessageManagerTest, sendTCPIPv4) {
@@ -610,6 +618,10 @@ TEST_F(ASIOMessageManagerTest, sendTCPIPv4Multi) {
                                        getSockAddr("127.0.0.1", "5304")));
     sendTCPCheck(listen_s.fd, AF_INET, "127.0.0.1", "5304", 5);
     EXPECT_EQ(1, sendcallback_called_);
+    // Both messages are counted: 2 + 15 bytes and 2 + 8 bytes.
+    EXPECT_EQ(2, last_transfer_.messages);
+    EXPECT_EQ(27, last_transfer_.bytes);
+    EXPECT_FALSE(last_transfer_.first_byte.is_special());
 }
 
 TEST_F(ASIOMessageManagerTest, multipleUDPSends) {
@@ -626,6 +638,95 @@ TEST_F(ASIOMessageManagerTest, multipleUDPSends) {
     EXPECT_EQ(2, sendcallback_called_);
 }
 
+// Receive the given number of messages on the socket, and echo back some
+// of them.
+void
+echoMessages(int recv_fd, size_t count, size_t echo_count) {
+    for (size_t i = 0; i < count; ++i) {
+        char recvbuf[sizeof(TEST_DATA)];
+        sockaddr_storage ss;
+        socklen_t sa_len = sizeof(ss);
+        EXPECT_EQ(sizeof(TEST_DATA),
+                  recvfrom(recv_fd, recvbuf, sizeof(recvbuf),
+                           setRecvDelay(recv_fd), convertSockAddr(&ss),
+                           &sa_len));
+        if (i < echo_count) {
+            EXPECT_EQ(sizeof(TEST_DATA),
+                      sendto(recv_fd, recvbuf, sizeof(recvbuf), 0,
+                             convertSockAddr(&ss), sa_len));
+        }
+    }
+}
+
+void
+countingSocketCallback(const MessageSocket::Event& ev, size_t* count,
+                       size_t limit, MessageManager* mgr)
+{
+    EXPECT_EQ(sizeof(TEST_DATA), ev.datalen);
+    EXPECT_STREQ(TEST_DATA, static_cast<const char*>(ev.data));
+    if (++*count == limit) {
+        mgr->stop();
+    }
+}
+
+TEST_F(ASIOMessageManagerTest, batchedUDPSends) {
+    const size_t send_count = 100; // more than a single batch
+    // Echoing back everything could overflow the receive buffer.
+    const size_t echo_count = 20;
+    ASIOMessageManager batch_manager(true);
+    ScopedSocket recv_s(createSocket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP,
+                                     getSockAddr("::1", "5306")));
+    size_t received = 0;
+    scoped_ptr<MessageSocket> sock(
+        batch_manager.createMessageSocket(
+            IPPROTO_UDP, "::1", 5306, recvbuf_, sizeof(recvbuf_),
+            boost::bind(countingSocketCallback, _1, &received, echo_count,
+                        &batch_manager)));
+    // Nothing should have been sent until the manager runs (unless the
+    // batch becomes full).
+    sock->send(TEST_DATA, sizeof(TEST_DATA));
+    char recvbuf[sizeof(TEST_DATA)];
+    EXPECT_EQ(-1, recv(recv_s.fd, recvbuf, sizeof(recvbuf), MSG_DONTWAIT));
+    for (size_t i = 1; i < send_count; ++i) {
+        sock->send(TEST_DATA, sizeof(TEST_DATA));
+    }
+
+    // Once the queued messages are flushed, the timer callback receives them
+    // and echoes some back, and these should be passed to the socket
+    // callback.
+    scoped_ptr<MessageTimer> timer(
+        batch_manager.createMessageTimer(
+            boost::bind(echoMessages, recv_s.fd, send_count, echo_count)));
+    timer->start(milliseconds(10));
+    batch_manager.run();
+    EXPECT_EQ(echo_count, received);
+}
+
+TEST_F(ASIOMessageManagerTest, batchedUDPCancel) {
+    ASIOMessageManager batch_manager(true);
+    ScopedSocket recv_s(createSocket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP,
+                                     getSockAddr("::1", "5306")));
+    scoped_ptr<MessageSocket> sock(
+        batch_manager.createMessageSocket(
+            IPPROTO_UDP, "::1", 5306, recvbuf_, sizeof(recvbuf_),
+            boost::bind(&ASIOMessageManagerTest::sendCallback, this, _1)));
+    sock->send(TEST_DATA, sizeof(TEST_DATA));
+
+    // Destroying the socket flushes the queued message immediately,
+    // without running the manager.
+    sock.reset();
+    char recvbuf[sizeof(TEST_DATA)];
+    EXPECT_EQ(sizeof(TEST_DATA),
+              recv(recv_s.fd, recvbuf, sizeof(recvbuf), MSG_DONTWAIT));
+
+    // The flush handler posted before that is now harmless.
+    test_timer_.reset(batch_manager.createMessageTimer(noopTimerCallback));
+    test_timer_->start(milliseconds(10));
+    batch_manager.run();
+    EXPECT_EQ(-1, recv(recv_s.fd, recvbuf, sizeof(recvbuf), MSG_DONTWAIT));
+    test_timer_.reset();
+}
+
 TEST_F(ASIOMessageManagerTest, createMessageTimer) {
     test_timer_.reset(asio_manager_.createMessageTimer(noopTimerCallback));
     EXPECT_TRUE(test_timer_);
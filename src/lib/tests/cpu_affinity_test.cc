@@ -0,0 +1,95 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <config.h>
+
+#include <cpu_affinity.h>
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include <sched.h>
+
+using namespace Queryperf;
+using std::vector;
+
+namespace {
+TEST(CPUAffinityTest, parseCPUList) {
+    vector<unsigned int> cpus = parseCPUList("3");
+    ASSERT_EQ(1, cpus.size());
+    EXPECT_EQ(3, cpus[0]);
+
+    cpus = parseCPUList("0-3,8,10-11");
+    ASSERT_EQ(7, cpus.size());
+    EXPECT_EQ(0, cpus[0]);
+    EXPECT_EQ(3, cpus[3]);
+    EXPECT_EQ(8, cpus[4]);
+    EXPECT_EQ(10, cpus[5]);
+    EXPECT_EQ(11, cpus[6]);
+
+    // The order is kept.
+    cpus = parseCPUList("5,1-2");
+    ASSERT_EQ(3, cpus.size());
+    EXPECT_EQ(5, cpus[0]);
+    EXPECT_EQ(1, cpus[1]);
+    EXPECT_EQ(2, cpus[2]);
+}
+
+TEST(CPUAffinityTest, parseBadCPUList) {
+    EXPECT_THROW(parseCPUList(""), CPUAffinityError);
+    EXPECT_THROW(parseCPUList(","), CPUAffinityError);
+    EXPECT_THROW(parseCPUList("1,"), CPUAffinityError);
+    EXPECT_THROW(parseCPUList("a"), CPUAffinityError);
+    EXPECT_THROW(parseCPUList("-1"), CPUAffinityError);
+    EXPECT_THROW(parseCPUList("1-"), CPUAffinityError);
+    EXPECT_THROW(parseCPUList("3-1"), CPUAffinityError);
+    EXPECT_THROW(parseCPUList("1-2-3"), CPUAffinityError);
+    EXPECT_THROW(parseCPUList("99999999999"), CPUAffinityError);
+}
+
+TEST(CPUAffinityTest, getInterfaceCPUs) {
+    // The loopback interface has no device.
+    EXPECT_THROW(getInterfaceCPUs("lo"), CPUAffinityError);
+    EXPECT_THROW(getInterfaceCPUs("no-such-interface"), CPUAffinityError);
+}
+
+TEST(CPUAffinityTest, getCPUNode) {
+    // An unknown CPU is considered to be on node 0.
+    EXPECT_EQ(0, getCPUNode(99999999));
+    EXPECT_NO_THROW(getCPUNode(0));
+}
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+TEST(CPUAffinityTest, setThreadAffinity) {
+    cpu_set_t saved;
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(saved), &saved));
+    unsigned int cpu = 0;
+    while (!CPU_ISSET(cpu, &saved)) {
+        ++cpu;
+    }
+
+    setThreadAffinity(cpu);
+    cpu_set_t cpuset;
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(cpuset), &cpuset));
+    EXPECT_EQ(1, CPU_COUNT(&cpuset));
+    EXPECT_TRUE(CPU_ISSET(cpu, &cpuset));
+
+    EXPECT_THROW(setThreadAffinity(CPU_SETSIZE), CPUAffinityError);
+
+    sched_setaffinity(0, sizeof(saved), &saved);
+}
+#endif
+}
@@ -12,12 +12,18 @@
 // OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
 // PERFORMANCE OF THIS SOFTWARE.
 
+#include <config.h>
+
 #include <test_message_manager.h>
 #include <common_test.h>
 
 #include <query_repository.h>
 #include <query_context.h>
 #include <dispatcher.h>
+#include <latency_histogram.h>
+#include <live_statistics.h>
+#include <resource_usage.h>
+#include <transfer_statistics.h>
 #include <common_test.h>
 
 #include <dns/message.h>
@@ -30,10 +36,16 @@
 #include <boost/bind.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include <cstring>
 #include <sstream>
+#include <stdexcept>
 #include <vector>
 
+#include <sys/socket.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace bundy::dns;
@@ -231,6 +243,177 @@ TEST_F(DispatcherTest, nextQueryTCP) {
     }
 }
 
+void
+respondOverStream(TestMessageManager* mgr, size_t stream, size_t index) {
+    Message& query = *mgr->stream_sockets_.at(stream)->queries_.at(index);
+    query.makeResponse();
+    MessageRenderer renderer;
+    query.toWire(renderer);
+    mgr->stream_sockets_.at(stream)->callback_(
+        MessageSocket::Event(renderer.getData(), renderer.getLength()));
+}
+
+void
+persistentTCPCheck(DispatcherTest* test) {
+    TestMessageManager& mgr = test->msg_mgr;
+
+    // Queries are sent over the two persistent connections in the
+    // round-robin manner; no per query TCP socket is created.
+    EXPECT_TRUE(mgr.tcp_sockets_.empty());
+    ASSERT_EQ(2, mgr.stream_sockets_.size());
+    for (size_t i = 0; i < 2; ++i) {
+        ASSERT_EQ(10, mgr.stream_sockets_[i]->queries_.size());
+        for (size_t j = 0; j < 10; ++j) {
+            EXPECT_EQ(j * 2 + i,
+                      mgr.stream_sockets_[i]->queries_[j]->getQid());
+        }
+    }
+
+    // Responses can arrive in any order.  Each of them completes the query
+    // of the same QID, and the next query is sent over the next connection.
+    respondOverStream(&mgr, 1, 4); // QID 9
+    respondOverStream(&mgr, 0, 7); // QID 14
+    ASSERT_EQ(11, mgr.stream_sockets_[0]->queries_.size());
+    ASSERT_EQ(11, mgr.stream_sockets_[1]->queries_.size());
+    EXPECT_EQ(20, mgr.stream_sockets_[0]->queries_[10]->getQid());
+    EXPECT_EQ(21, mgr.stream_sockets_[1]->queries_[10]->getQid());
+
+    // A duplicate response doesn't match any outstanding query.
+    respondOverStream(&mgr, 1, 4);
+    EXPECT_EQ(11, mgr.stream_sockets_[0]->queries_.size());
+    EXPECT_EQ(11, mgr.stream_sockets_[1]->queries_.size());
+
+    // The server closes the first connection.  The 10 queries outstanding
+    // on it are considered lost, and new ones are sent over both
+    // connections (the first one will be reconnected).
+    mgr.stream_sockets_[0]->callback_(MessageSocket::Event(NULL, 0));
+    EXPECT_EQ(16, mgr.stream_sockets_[0]->queries_.size());
+    EXPECT_EQ(16, mgr.stream_sockets_[1]->queries_.size());
+
+    mgr.stop();
+}
+
+TEST_F(DispatcherTest, persistentTCP) {
+    msg_mgr.setRunHandler(boost::bind(persistentTCPCheck, this));
+    repo.setProtocol(IPPROTO_TCP);
+    disp.setTCPConnections(2);
+    disp.run();
+    EXPECT_EQ(32, disp.getQueriesSent());
+    EXPECT_EQ(2, disp.getQueriesCompleted());
+    LiveCounters::Snapshot snapshot;
+    disp.getLiveCounters().read(snapshot);
+    EXPECT_EQ(10, snapshot.lost);
+}
+
+void
+tcpKeepaliveCheck(DispatcherTest* test, bool keepalive) {
+    // The OPT RR (at the end of the query) should have an empty keepalive
+    // option (code 11) only if it's enabled.
+    const vector<uint8_t>& data =
+        test->msg_mgr.stream_sockets_.at(0)->query_data_.at(0);
+    ASSERT_LT(10, data.size());
+    const uint8_t* const end = &data[0] + data.size();
+    if (keepalive) {
+        EXPECT_EQ(0, end[-6]);  // RDLENGTH
+        EXPECT_EQ(4, end[-5]);
+        EXPECT_EQ(0, end[-4]);  // OPTION-CODE
+        EXPECT_EQ(11, end[-3]);
+        EXPECT_EQ(0, end[-2]);  // OPTION-LENGTH
+        EXPECT_EQ(0, end[-1]);
+    } else {
+        EXPECT_EQ(0, end[-2]);  // RDLENGTH
+        EXPECT_EQ(0, end[-1]);
+    }
+    // The query is still valid with the option.
+    EXPECT_TRUE(test->msg_mgr.stream_sockets_[0]->queries_[0]->getEDNS());
+    test->msg_mgr.stop();
+}
+
+TEST_F(DispatcherTest, tcpKeepalive) {
+    msg_mgr.setRunHandler(boost::bind(tcpKeepaliveCheck, this, true));
+    repo.setProtocol(IPPROTO_TCP);
+    disp.setTCPConnections(1);
+    disp.setTCPKeepalive(true);
+    disp.run();
+}
+
+TEST_F(DispatcherTest, noTCPKeepalive) {
+    msg_mgr.setRunHandler(boost::bind(tcpKeepaliveCheck, this, false));
+    repo.setProtocol(IPPROTO_TCP);
+    disp.setTCPConnections(1);
+    disp.run();
+}
+
+void
+respondToTransfer(TestMessageManager* mgr, size_t index,
+                  const MessageSocket::TransferInfo& info)
+{
+    Message& query = *mgr->tcp_sockets_.at(index)->queries_.at(0);
+    query.makeResponse();
+    MessageRenderer renderer;
+    query.toWire(renderer);
+    mgr->tcp_sockets_.at(index)->callback_(
+        MessageSocket::Event(renderer.getData(), renderer.getLength(),
+                             &info));
+}
+
+void
+transferCheck(TestMessageManager* mgr) {
+    // Queries alternate between AXFR and SOA.  Only the former is counted
+    // as a transfer even if the response to the latter has multiple
+    // messages.
+    MessageSocket::TransferInfo info;
+    info.messages = 3;
+    info.rrs = 100;
+    info.bytes = 5000;
+    info.first_byte = boost::posix_time::microsec_clock::universal_time();
+    respondToTransfer(mgr, 0, info);
+    respondToTransfer(mgr, 1, info);
+    respondToTransfer(mgr, 2, info);
+    mgr->stop();
+}
+
+TEST(DispatcherTransferTest, transfer) {
+    TestMessageManager msg_mgr;
+    stringstream ss("example.com. AXFR\n"
+                    "example.com. SOA");
+    QueryRepository repo(ss);
+    repo.setProtocol(IPPROTO_TCP);
+    QueryContextCreator ctx_creator(repo);
+    Dispatcher disp(msg_mgr, ctx_creator);
+    msg_mgr.setRunHandler(boost::bind(transferCheck, &msg_mgr));
+    disp.run();
+
+    EXPECT_EQ(3, disp.getQueriesCompleted());
+    const TransferStatistics& transfers = disp.getTransferStatistics();
+    EXPECT_EQ(2, transfers.getCount());
+    EXPECT_EQ(6, transfers.getMessages());
+    EXPECT_EQ(200, transfers.getRRs());
+    EXPECT_EQ(10000, transfers.getBytes());
+    EXPECT_EQ(2, transfers.getFirstByteTimes().getCount());
+}
+
+void
+streamTransferCheck(TestMessageManager* mgr) {
+    respondOverStream(mgr, 0, 0);
+    mgr->stop();
+}
+
+TEST(DispatcherTransferTest, noTransferOverStream) {
+    // Over persistent connections, zone transfers aren't measured.
+    TestMessageManager msg_mgr;
+    stringstream ss("example.com. AXFR");
+    QueryRepository repo(ss);
+    repo.setProtocol(IPPROTO_TCP);
+    QueryContextCreator ctx_creator(repo);
+    Dispatcher disp(msg_mgr, ctx_creator);
+    disp.setTCPConnections(1);
+    msg_mgr.setRunHandler(boost::bind(streamTransferCheck, &msg_mgr));
+    disp.run();
+    EXPECT_EQ(1, disp.getQueriesCompleted());
+    EXPECT_EQ(0, disp.getTransferStatistics().getCount());
+}
+
 void
 sendBadResponse(TestMessageManager* mgr) {
     // Respond to the specified position of query
@@ -254,6 +437,94 @@ TEST_F(DispatcherTest, queryMismatch) {
     EXPECT_EQ(20, msg_mgr.socket_->queries_.size());
 }
 
+void
+sendDuplicateResponse(TestMessageManager* mgr) {
+    // Respond to the first query twice.
+    Message& query = *mgr->socket_->queries_.at(0);
+    query.makeResponse();
+    MessageRenderer renderer;
+    query.toWire(renderer);
+    mgr->socket_->callback_(MessageSocket::Event(renderer.getData(),
+                                                 renderer.getLength()));
+    EXPECT_EQ(21, mgr->socket_->queries_.size());
+
+    // The QID of the first query has been released, so the duplicate
+    // response should be rejected and shouldn't trigger another query.
+    mgr->socket_->callback_(MessageSocket::Event(renderer.getData(),
+                                                 renderer.getLength()));
+    EXPECT_EQ(21, mgr->socket_->queries_.size());
+    mgr->stop();
+}
+
+TEST_F(DispatcherTest, duplicateResponse) {
+    msg_mgr.setRunHandler(boost::bind(sendDuplicateResponse, &msg_mgr));
+    disp.run();
+    EXPECT_EQ(21, disp.getQueriesSent());
+    EXPECT_EQ(1, disp.getQueriesCompleted());
+}
+
+void
+sendStaleResponse(TestMessageManager* mgr) {
+    // Let the first query time out.  Its QID is released and a next query
+    // is sent with a new QID.
+    mgr->timers_.at(1)->callback_();
+    EXPECT_EQ(21, mgr->socket_->queries_.size());
+
+    // A late response to the timed out query is now stale and should be
+    // ignored.
+    Message& query = *mgr->socket_->queries_.at(0);
+    query.makeResponse();
+    MessageRenderer renderer;
+    query.toWire(renderer);
+    mgr->socket_->callback_(MessageSocket::Event(renderer.getData(),
+                                                 renderer.getLength()));
+    EXPECT_EQ(21, mgr->socket_->queries_.size());
+    mgr->stop();
+}
+
+TEST_F(DispatcherTest, staleResponse) {
+    msg_mgr.setRunHandler(boost::bind(sendStaleResponse, &msg_mgr));
+    disp.run();
+    EXPECT_EQ(21, disp.getQueriesSent());
+    EXPECT_EQ(0, disp.getQueriesCompleted());
+}
+
+void
+sendReusedQidResponse(TestMessageManager* mgr) {
+    // A late response to a previous user of a QID now used by another
+    // query: emulate it by a response to the first query (example.com/SOA)
+    // with the QID of the second one (www.example.com/A).  Its question
+    // doesn't match, so it should be ignored.
+    Message& query = *mgr->socket_->queries_.at(0);
+    query.makeResponse();
+    query.setQid(mgr->socket_->queries_.at(1)->getQid());
+    MessageRenderer renderer;
+    query.toWire(renderer);
+    mgr->socket_->callback_(MessageSocket::Event(renderer.getData(),
+                                                 renderer.getLength()));
+    EXPECT_EQ(20, mgr->socket_->queries_.size());
+
+    // The real response to the second query is accepted, even if the
+    // case of the name differs.
+    Message& query2 = *mgr->socket_->queries_.at(1);
+    query2.makeResponse();
+    renderer.clear();
+    query2.toWire(renderer);
+    vector<uint8_t> data(static_cast<const uint8_t*>(renderer.getData()),
+                         static_cast<const uint8_t*>(renderer.getData()) +
+                         renderer.getLength());
+    data[13] = 'W';             // the first letter of "www"
+    mgr->socket_->callback_(MessageSocket::Event(&data[0], data.size()));
+    EXPECT_EQ(21, mgr->socket_->queries_.size());
+    mgr->stop();
+}
+
+TEST_F(DispatcherTest, reusedQidResponse) {
+    msg_mgr.setRunHandler(boost::bind(sendReusedQidResponse, &msg_mgr));
+    disp.run();
+    EXPECT_EQ(1, disp.getQueriesCompleted());
+}
+
 void
 queryTimeoutCallback(TestMessageManager* mgr, int proto) {
     // Do timeout callcack for the first query.
@@ -279,6 +550,13 @@ TEST_F(DispatcherTest, queryTimeout) {
 
     // No queries should have been considered completed.
     EXPECT_EQ(0, disp.getQueriesCompleted());
+
+    // The timed out query is counted as lost in the live counters.
+    LiveCounters::Snapshot snapshot;
+    disp.getLiveCounters().read(snapshot);
+    EXPECT_EQ(21, snapshot.sent);
+    EXPECT_EQ(0, snapshot.completed);
+    EXPECT_EQ(1, snapshot.lost);
 }
 
 TEST_F(DispatcherTest, queryTimeoutTCP) {
@@ -334,11 +612,280 @@ TEST_F(DispatcherTest, sessionTimer) {
 
     EXPECT_EQ(50, disp.getQueriesSent());
     EXPECT_EQ(50, disp.getQueriesCompleted());
+    // Latency should have been recorded for every completed query.
+    EXPECT_EQ(50, disp.getLatencyHistogram().getCount());
+    // The corrected histogram may contain back-filled samples in addition.
+    EXPECT_LE(50, disp.getCorrectedLatencyHistogram().getCount());
+    EXPECT_LE(disp.getLatencyHistogram().getMax(),
+              disp.getCorrectedLatencyHistogram().getMax());
+    // Live counters should be consistent with the final statistics.
+    LiveCounters::Snapshot snapshot;
+    disp.getLiveCounters().read(snapshot);
+    EXPECT_EQ(50, snapshot.sent);
+    EXPECT_EQ(50, snapshot.completed);
+    EXPECT_EQ(0, snapshot.lost);
     EXPECT_FALSE(disp.getStartTime().is_special());
     EXPECT_FALSE(disp.getEndTime().is_special());
     EXPECT_TRUE(disp.getStartTime() < disp.getEndTime());
 }
 
+void
+respondUDP(TestMessageManager* mgr, size_t pos) {
+    Message& query = *mgr->socket_->queries_.at(pos);
+    query.makeResponse();
+    MessageRenderer renderer;
+    query.toWire(renderer);
+    mgr->socket_->callback_(MessageSocket::Event(renderer.getData(),
+                                                 renderer.getLength()));
+}
+
+void
+openLoopWindowCheck(TestMessageManager* mgr) {
+    // In the open-loop mode, timers are: session, pacing, then per query.
+    ASSERT_EQ(7, mgr->timers_.size());
+    EXPECT_EQ(1, mgr->timers_[1]->n_started_);
+
+    // Let some time pass so many queries are scheduled at the very high
+    // rate, and fire the pacing timer.  Only the window (5) of queries
+    // can be sent.
+    usleep(1000);
+    mgr->timers_[1]->callback_();
+    EXPECT_EQ(2, mgr->timers_[1]->n_started_);
+    EXPECT_EQ(5, mgr->socket_->queries_.size());
+
+    // A response allows one of the pending queries to be sent immediately.
+    respondUDP(mgr, 0);
+    EXPECT_EQ(6, mgr->socket_->queries_.size());
+
+    // Once the session ends, no more queries will be sent; the dispatcher
+    // will stop when all outstanding queries complete.
+    mgr->timers_[0]->callback_();
+    for (size_t i = 1; i < 6; ++i) {
+        respondUDP(mgr, i);
+    }
+    EXPECT_EQ(6, mgr->socket_->queries_.size());
+}
+
+TEST_F(DispatcherTest, openLoopWindow) {
+    disp.setWindow(5);
+    disp.setQueryRate(1000000);
+    msg_mgr.setRunHandler(boost::bind(openLoopWindowCheck, &msg_mgr));
+    disp.run();
+    EXPECT_EQ(6, disp.getQueriesSent());
+    EXPECT_EQ(6, disp.getQueriesCompleted());
+    // Many more queries than sent should have been scheduled.
+    EXPECT_LT(6, disp.getQueriesScheduled());
+
+    // In the open-loop mode there's one corrected sample per response.
+    // The last query was sent well after its scheduled time due to the
+    // window limit, which is included in the corrected latency.
+    const LatencyHistogram& corrected = disp.getCorrectedLatencyHistogram();
+    EXPECT_EQ(6, corrected.getCount());
+    EXPECT_LE(1000, corrected.getMax());
+    EXPECT_LE(disp.getLatencyHistogram().getMax(), corrected.getMax());
+}
+
+void
+openLoopSlowCheck(TestMessageManager* mgr) {
+    // At the rate of 1 qps, only the first query is sent at the start.
+    EXPECT_EQ(1, mgr->socket_->queries_.size());
+    EXPECT_EQ(1, mgr->timers_[1]->n_started_);
+
+    // Responding to it doesn't trigger a new query in this mode.
+    respondUDP(mgr, 0);
+    EXPECT_EQ(1, mgr->socket_->queries_.size());
+
+    // There's no outstanding query, so the dispatcher stops on the
+    // expiration of the session timer.
+    mgr->timers_[0]->callback_();
+}
+
+TEST_F(DispatcherTest, openLoopSlow) {
+    disp.setQueryRate(1);
+    msg_mgr.setRunHandler(boost::bind(openLoopSlowCheck, &msg_mgr));
+    disp.run();
+    EXPECT_EQ(1, disp.getQueriesScheduled());
+    EXPECT_EQ(1, disp.getQueriesSent());
+    EXPECT_EQ(1, disp.getQueriesCompleted());
+}
+
+// The time right after the end of the test duration in the warm-up and
+// cool-down tests.
+boost::posix_time::ptime window_closed_time;
+
+void
+warmupCheck(TestMessageManager* mgr) {
+    // The session timer first runs for the warm-up period.
+    ASSERT_EQ(2, mgr->socket_->queries_.size());
+    EXPECT_EQ(1, mgr->timers_[0]->n_started_);
+    EXPECT_EQ(10, mgr->timers_[0]->duration_seconds_);
+
+    // Queries are sent as usual during warm-up.
+    respondUDP(mgr, 0);
+    EXPECT_EQ(3, mgr->socket_->queries_.size());
+
+    // At the end of warm-up the timer restarts for the test duration.
+    mgr->timers_[0]->callback_();
+    EXPECT_EQ(2, mgr->timers_[0]->n_started_);
+    EXPECT_EQ(30, mgr->timers_[0]->duration_seconds_);
+    respondUDP(mgr, 1);
+    EXPECT_EQ(4, mgr->socket_->queries_.size());
+
+    // Then the test ends as usual.  Of the outstanding queries, only the
+    // one sent after warm-up will be counted.
+    mgr->timers_[0]->callback_();
+    window_closed_time = boost::posix_time::microsec_clock::local_time();
+    respondUDP(mgr, 2);
+    respondUDP(mgr, 3);
+    EXPECT_EQ(4, mgr->socket_->queries_.size());
+}
+
+TEST_F(DispatcherTest, warmup) {
+    disp.setWindow(2);
+    disp.setWarmupDuration(10);
+    msg_mgr.setRunHandler(boost::bind(warmupCheck, &msg_mgr));
+    disp.run();
+
+    // Only the query sent after warm-up is counted, both as sent and as
+    // completed, while the responses to the queries sent during warm-up
+    // are ignored.
+    EXPECT_EQ(1, disp.getQueriesSent());
+    EXPECT_EQ(1, disp.getQueriesCompleted());
+    EXPECT_EQ(1, disp.getLatencyHistogram().getCount());
+    // The live counters count everything.
+    LiveCounters::Snapshot snapshot;
+    disp.getLiveCounters().read(snapshot);
+    EXPECT_EQ(4, snapshot.sent);
+    EXPECT_EQ(4, snapshot.completed);
+    EXPECT_FALSE(disp.getStartTime().is_special());
+    EXPECT_LE(disp.getStartTime(), disp.getEndTime());
+    // The measurement ends at the end of the test duration, not when the
+    // last outstanding query completes.
+    EXPECT_LE(disp.getEndTime(), window_closed_time);
+}
+
+void
+cooldownCheck(TestMessageManager* mgr) {
+    ASSERT_EQ(2, mgr->socket_->queries_.size());
+    EXPECT_EQ(30, mgr->timers_[0]->duration_seconds_);
+    respondUDP(mgr, 0);
+    EXPECT_EQ(3, mgr->socket_->queries_.size());
+
+    // At the end of the test duration the timer restarts for the
+    // cool-down period, while queries are still sent.
+    mgr->timers_[0]->callback_();
+    window_closed_time = boost::posix_time::microsec_clock::local_time();
+    EXPECT_EQ(2, mgr->timers_[0]->n_started_);
+    EXPECT_EQ(5, mgr->timers_[0]->duration_seconds_);
+    respondUDP(mgr, 1);
+    EXPECT_EQ(4, mgr->socket_->queries_.size());
+
+    // Then it stops sending queries.
+    mgr->timers_[0]->callback_();
+    respondUDP(mgr, 2);
+    respondUDP(mgr, 3);
+    EXPECT_EQ(4, mgr->socket_->queries_.size());
+}
+
+TEST_F(DispatcherTest, cooldown) {
+    disp.setWindow(2);
+    disp.setCooldownDuration(5);
+    msg_mgr.setRunHandler(boost::bind(cooldownCheck, &msg_mgr));
+    disp.run();
+
+    // Only the queries sent within the test duration are counted,
+    // including the responses to them received during cool-down.
+    EXPECT_EQ(3, disp.getQueriesSent());
+    EXPECT_EQ(3, disp.getQueriesCompleted());
+    EXPECT_EQ(3, disp.getLatencyHistogram().getCount());
+    EXPECT_EQ(3, disp.getCorrectedLatencyHistogram().getCount());
+    EXPECT_FALSE(disp.getEndTime().is_special());
+    EXPECT_LE(disp.getStartTime(), disp.getEndTime());
+    EXPECT_LE(disp.getEndTime(), window_closed_time);
+}
+
+void
+adaptiveWindowCheck(TestMessageManager* mgr) {
+    // Timers are: session, adaptive window, then per query.  Only one
+    // query is sent at the start.
+    ASSERT_EQ(10, mgr->timers_.size());
+    EXPECT_EQ(1, mgr->timers_[1]->n_started_);
+    EXPECT_EQ(1, mgr->socket_->queries_.size());
+
+    // A quick response keeps the window at 1 until the timer fires.
+    respondUDP(mgr, 0);
+    EXPECT_EQ(2, mgr->socket_->queries_.size());
+
+    // The window is doubled (slow start) on each interval within the
+    // latency bound; nothing changes in an interval without a response.
+    mgr->timers_[1]->callback_();
+    EXPECT_EQ(2, mgr->timers_[1]->n_started_);
+    EXPECT_EQ(3, mgr->socket_->queries_.size());
+    mgr->timers_[1]->callback_();
+    EXPECT_EQ(3, mgr->socket_->queries_.size());
+    respondUDP(mgr, 1);
+    mgr->timers_[1]->callback_();
+    EXPECT_EQ(6, mgr->socket_->queries_.size()); // 3 + 1 + 2 (window 4)
+
+    // A response exceeding the latency bound halves the window (4 -> 2).
+    // Queries 3-5 were also sent before the sleep, so they will be late
+    // too; query 6 will be quick.
+    usleep(60000);
+    respondUDP(mgr, 2);
+    EXPECT_EQ(7, mgr->socket_->queries_.size());
+    mgr->timers_[1]->callback_();
+    respondUDP(mgr, 6);
+    EXPECT_EQ(7, mgr->socket_->queries_.size()); // 3 outstanding > window
+
+    // The window now grows additively (2 -> 3), so the next response
+    // triggers a new query.  It exceeds the bound, shrinking the window.
+    mgr->timers_[1]->callback_();
+    respondUDP(mgr, 3);
+    EXPECT_EQ(8, mgr->socket_->queries_.size());
+    mgr->timers_[1]->callback_();
+
+    // End of the test.
+    mgr->timers_[0]->callback_();
+    respondUDP(mgr, 4);
+    respondUDP(mgr, 5);
+    respondUDP(mgr, 7);
+    EXPECT_EQ(8, mgr->socket_->queries_.size());
+}
+
+TEST_F(DispatcherTest, adaptiveWindow) {
+    disp.setWindow(8);
+    disp.setLatencyBound(50000);
+    msg_mgr.setRunHandler(boost::bind(adaptiveWindowCheck, &msg_mgr));
+    disp.run();
+    EXPECT_EQ(8, disp.getQueriesSent());
+    EXPECT_EQ(8, disp.getQueriesCompleted());
+
+    // The highest rate was achieved in one of the intervals without
+    // overload, with the window of 1 or 2.
+    EXPECT_LT(0, disp.getMaxSustainedRate());
+    EXPECT_LE(1, disp.getMaxSustainedWindow());
+    EXPECT_GE(2, disp.getMaxSustainedWindow());
+}
+
+void
+resourceUsageCheck(TestMessageManager* mgr) {
+    usleep(10000);
+    mgr->stop();
+}
+
+TEST_F(DispatcherTest, resourceUsage) {
+    // It's only available after run().
+    EXPECT_THROW(disp.getResourceUsage(), DispatcherError);
+
+    msg_mgr.setRunHandler(boost::bind(resourceUsageCheck, &msg_mgr));
+    disp.run();
+    const ResourceUsage& usage = disp.getResourceUsage();
+    EXPECT_LE(10000, usage.wall_usec);
+    // The test manager doesn't measure its event loop.
+    EXPECT_FALSE(usage.has_loop_stats);
+    EXPECT_THROW(disp.getResourceUsage(1), DispatcherError);
+}
+
 TEST_F(DispatcherTest, builtins) {
     // creating dispatcher with "builtin" support classes.  No disruption
     // should happen.
@@ -351,6 +898,33 @@ TEST_F(DispatcherTest, builtins) {
     EXPECT_THROW(disp.loadQueries(), QueryRepositoryError);
 }
 
+TEST_F(DispatcherTest, shareQueries) {
+    Dispatcher disp("test-input.txt");
+    EXPECT_EQ(0, disp.getQueryCount());
+
+    // Queries can be shared only after preload.
+    EXPECT_THROW(Dispatcher(disp, 0), DispatcherError);
+    disp.loadQueries();
+    EXPECT_LT(0, disp.getQueryCount());
+
+    Dispatcher disp2(disp, 1);
+    EXPECT_EQ(disp.getQueryCount(), disp2.getQueryCount());
+
+    // A copy can be made, and shared as well.
+    Dispatcher disp3(disp, 0, true);
+    EXPECT_EQ(disp.getQueryCount(), disp3.getQueryCount());
+    Dispatcher disp4(disp3, 1);
+    EXPECT_EQ(disp.getQueryCount(), disp4.getQueryCount());
+
+    // Query related parameters can't be changed for the sharing dispatcher.
+    EXPECT_THROW(disp2.setProtocol(IPPROTO_TCP), QueryRepositoryError);
+    EXPECT_THROW(disp2.loadQueries(), QueryRepositoryError);
+
+    // External repository can't be shared.
+    EXPECT_EQ(0, this->disp.getQueryCount());
+    EXPECT_THROW(Dispatcher(this->disp, 0), DispatcherError);
+}
+
 TEST_F(DispatcherTest, preloadAfterRun) {
     Dispatcher disp("test-input.txt");
     // There's no server to be tested, so the send attempt should fail
@@ -360,6 +934,43 @@ TEST_F(DispatcherTest, preloadAfterRun) {
     EXPECT_THROW(disp.loadQueries(), DispatcherError);
 }
 
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+TEST_F(DispatcherTest, cpuAffinity) {
+    cpu_set_t saved;
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(saved), &saved));
+    unsigned int cpu = 0;
+    while (!CPU_ISSET(cpu, &saved)) {
+        ++cpu;
+    }
+
+    Dispatcher disp("test-input.txt");
+    EXPECT_TRUE(disp.getCPUAffinity().empty());
+    disp.setCPUAffinity(vector<unsigned int>(1, cpu));
+    ASSERT_EQ(1, disp.getCPUAffinity().size());
+    EXPECT_EQ(cpu, disp.getCPUAffinity()[0]);
+
+    // Preloading is deferred to run(), and the affinity cannot be changed
+    // after that.
+    disp.loadQueries();
+    EXPECT_EQ(0, disp.getQueryCount());
+    EXPECT_THROW(disp.setCPUAffinity(vector<unsigned int>()),
+                 DispatcherError);
+
+    // The thread is pinned and queries are loaded before sending queries
+    // (which fails as there's no server).
+    EXPECT_THROW(disp.run(), MessageSocketError);
+    EXPECT_LT(0, disp.getQueryCount());
+    cpu_set_t cpuset;
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(cpuset), &cpuset));
+    EXPECT_EQ(1, CPU_COUNT(&cpuset));
+    EXPECT_TRUE(CPU_ISSET(cpu, &cpuset));
+    EXPECT_THROW(disp.setCPUAffinity(vector<unsigned int>()),
+                 DispatcherError);
+
+    sched_setaffinity(0, sizeof(saved), &saved);
+}
+#endif
+
 TEST_F(DispatcherTest, preloadForExternalRepository) {
     // preload for external query repository is prohibited
     EXPECT_THROW(disp.loadQueries(), DispatcherError);
@@ -422,6 +1033,177 @@ TEST_F(DispatcherTest, setProtocolRepository) {
     EXPECT_THROW(disp.setProtocol(IPPROTO_TCP), DispatcherError);
 }
 
+TEST_F(DispatcherTest, setIOBackend) {
+    Dispatcher disp("test-input.txt");
+    EXPECT_THROW(disp.setIOBackend("no_such_backend"), DispatcherError);
+    disp.setIOBackend("epoll");
+    disp.setIOBackend(Dispatcher::DEFAULT_IO_BACKEND);
+    EXPECT_THROW(disp.run(), MessageSocketError);
+    EXPECT_THROW(disp.setIOBackend("epoll"), DispatcherError);
+}
+
+TEST_F(DispatcherTest, setIOBackendForExternalManager) {
+    EXPECT_THROW(disp.setIOBackend("asio"), DispatcherError);
+}
+
+TEST_F(DispatcherTest, ioThreads) {
+    EXPECT_EQ(1, disp.getIOThreads());
+    EXPECT_THROW(disp.setIOThreads(0), DispatcherError);
+    EXPECT_THROW(disp.getLiveCounters(1), DispatcherError);
+
+    // Multiple threads can only be used with the builtin classes.
+    disp.setIOThreads(1);
+    EXPECT_THROW(disp.setIOThreads(2), DispatcherError);
+
+    Dispatcher disp2("test-input.txt");
+    disp2.setIOThreads(3);
+    EXPECT_EQ(3, disp2.getIOThreads());
+    EXPECT_NO_THROW(disp2.getLiveCounters(2));
+    EXPECT_THROW(disp2.getLiveCounters(3), DispatcherError);
+
+    // Each thread needs at least one query in the window.
+    disp2.setWindow(2);
+    EXPECT_THROW(disp2.run(), DispatcherError);
+}
+
+// A UDP server running in a separate thread, which returns queries as
+// responses and records their QIDs.
+class UDPEchoServer {
+public:
+    explicit UDPEchoServer(uint16_t port) : stopped_(false) {
+        fd_ = socket(AF_INET6, SOCK_DGRAM, 0);
+        struct sockaddr_in6 sin6;
+        memset(&sin6, 0, sizeof(sin6));
+        sin6.sin6_family = AF_INET6;
+        sin6.sin6_port = htons(port);
+        sin6.sin6_addr = in6addr_loopback;
+        void* p = &sin6;
+        if (fd_ < 0 ||
+            bind(fd_, static_cast<struct sockaddr*>(p), sizeof(sin6)) < 0) {
+            throw std::runtime_error("failed to open echo server socket");
+        }
+        const struct timeval timeo = { 0, 100000 };
+        setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeo, sizeof(timeo));
+        pthread_create(&thread_, NULL, run, this);
+    }
+
+    ~UDPEchoServer() {
+        stop();
+        close(fd_);
+    }
+
+    // Stop the server thread; qids_ can be examined after this.
+    void stop() {
+        if (!__atomic_exchange_n(&stopped_, true, __ATOMIC_ACQ_REL)) {
+            pthread_join(thread_, NULL);
+        }
+    }
+
+    vector<qid_t> qids_;
+
+private:
+    static void* run(void* arg) {
+        UDPEchoServer* server = static_cast<UDPEchoServer*>(arg);
+        uint8_t buf[512];
+        while (!__atomic_load_n(&server->stopped_, __ATOMIC_ACQUIRE)) {
+            struct sockaddr_in6 from;
+            socklen_t fromlen = sizeof(from);
+            void* p = &from;
+            const ssize_t n = recvfrom(server->fd_, buf, sizeof(buf), 0,
+                                       static_cast<struct sockaddr*>(p),
+                                       &fromlen);
+            if (n < 12) {
+                continue;       // timeout or broken query
+            }
+            server->qids_.push_back(buf[0] * 256 + buf[1]);
+            buf[2] |= 0x80;
+            sendto(server->fd_, buf, n, 0, static_cast<struct sockaddr*>(p),
+                   fromlen);
+        }
+        return (NULL);
+    }
+
+    int fd_;
+    pthread_t thread_;
+    bool stopped_;
+};
+
+TEST(DispatcherIOThreadsTest, run) {
+    const uint16_t TEST_PORT = 5307;
+    UDPEchoServer server(TEST_PORT);
+    stringstream ss("example.com. SOA\n"
+                    "www.example.com. A");
+    Dispatcher disp(ss);
+    disp.setServerPort(TEST_PORT);
+    disp.setTestDuration(1);
+    disp.setWindow(10);
+    disp.setIOThreads(2);
+    disp.run();
+    server.stop();
+
+    // Statistics of both threads are merged.
+    EXPECT_LT(0, disp.getQueriesCompleted());
+    EXPECT_EQ(disp.getQueriesSent(), disp.getQueriesCompleted());
+    EXPECT_EQ(disp.getQueriesCompleted(),
+              disp.getLatencyHistogram().getCount());
+    EXPECT_EQ(disp.getQueriesSent(), server.qids_.size());
+    EXPECT_FALSE(disp.getStartTime().is_special());
+    EXPECT_LE(disp.getStartTime(), disp.getEndTime());
+
+    // Live counters are kept per thread.
+    LiveCounters::Snapshot snapshot0, snapshot1;
+    disp.getLiveCounters(0).read(snapshot0);
+    disp.getLiveCounters(1).read(snapshot1);
+    EXPECT_LT(0, snapshot0.sent);
+    EXPECT_LT(0, snapshot1.sent);
+    EXPECT_EQ(disp.getQueriesSent(), snapshot0.sent + snapshot1.sent);
+
+    // Each thread uses its own half of the QID space.
+    size_t lower = 0;
+    for (size_t i = 0; i < server.qids_.size(); ++i) {
+        if (server.qids_[i] < 32768) {
+            ++lower;
+        }
+    }
+    EXPECT_EQ(snapshot0.sent, lower);
+    EXPECT_EQ(snapshot1.sent, server.qids_.size() - lower);
+
+    // Resource usage is recorded per thread, too.
+    EXPECT_LT(0, disp.getResourceUsage(0).wall_usec);
+    EXPECT_LT(0, disp.getResourceUsage(1).wall_usec);
+    EXPECT_THROW(disp.getResourceUsage(2), DispatcherError);
+}
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+TEST(DispatcherIOThreadsTest, failedShard) {
+    cpu_set_t saved;
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(saved), &saved));
+    unsigned int cpu = 0;
+    while (!CPU_ISSET(cpu, &saved)) {
+        ++cpu;
+    }
+
+    // The second thread fails to pin itself to a bogus CPU.  The first one
+    // should then be stopped rather than running for the test duration.
+    const uint16_t TEST_PORT = 5307;
+    UDPEchoServer server(TEST_PORT);
+    Dispatcher disp("test-input.txt");
+    disp.setServerPort(TEST_PORT);
+    disp.setTestDuration(30);
+    disp.setIOThreads(2);
+    vector<unsigned int> cpus;
+    cpus.push_back(cpu);
+    cpus.push_back(CPU_SETSIZE);
+    disp.setCPUAffinity(cpus);
+    using namespace boost::posix_time;
+    const ptime start = microsec_clock::local_time();
+    EXPECT_THROW(disp.run(), DispatcherError);
+    EXPECT_GT(seconds(10), microsec_clock::local_time() - start);
+
+    sched_setaffinity(0, sizeof(saved), &saved);
+}
+#endif
+
 TEST_F(DispatcherTest, serverAddress) {
     // Default server address
     EXPECT_EQ("::1", disp.getServerAddress());
@@ -461,4 +1243,91 @@ TEST_F(DispatcherTest, testDuration) {
     EXPECT_THROW(disp.setTestDuration(120), DispatcherError);
 }
 
+TEST_F(DispatcherTest, warmupDuration) {
+    EXPECT_EQ(0, disp.getWarmupDuration());
+    disp.setWarmupDuration(10);
+    EXPECT_EQ(10, disp.getWarmupDuration());
+    disp.run();
+    EXPECT_THROW(disp.setWarmupDuration(20), DispatcherError);
+}
+
+TEST_F(DispatcherTest, cooldownDuration) {
+    EXPECT_EQ(0, disp.getCooldownDuration());
+    disp.setCooldownDuration(10);
+    EXPECT_EQ(10, disp.getCooldownDuration());
+    disp.run();
+    EXPECT_THROW(disp.setCooldownDuration(20), DispatcherError);
+}
+
+TEST_F(DispatcherTest, window) {
+    // Default window
+    EXPECT_EQ(20, disp.getWindow());
+
+    // Reset it.
+    disp.setWindow(100);
+    EXPECT_EQ(100, disp.getWindow());
+
+    // Out of range values are rejected.
+    EXPECT_THROW(disp.setWindow(0), DispatcherError);
+    EXPECT_THROW(disp.setWindow(65537), DispatcherError);
+
+    // Once started it cannot be changed.
+    disp.run();
+    EXPECT_THROW(disp.setWindow(10), DispatcherError);
+}
+
+TEST_F(DispatcherTest, queryRate) {
+    // Closed-loop by default
+    EXPECT_EQ(0, disp.getQueryRate());
+
+    disp.setQueryRate(10000);
+    EXPECT_EQ(10000, disp.getQueryRate());
+
+    // Once started it cannot be changed.
+    disp.run();
+    EXPECT_THROW(disp.setQueryRate(0), DispatcherError);
+}
+
+TEST_F(DispatcherTest, latencyBound) {
+    // Disabled by default
+    EXPECT_EQ(0, disp.getLatencyBound());
+    EXPECT_EQ(0, disp.getMaxSustainedRate());
+    EXPECT_EQ(0, disp.getMaxSustainedWindow());
+
+    disp.setLatencyBound(10000);
+    EXPECT_EQ(10000, disp.getLatencyBound());
+
+    // It cannot be used in the open-loop mode.
+    disp.setQueryRate(100);
+    EXPECT_THROW(disp.run(), DispatcherError);
+}
+
+TEST_F(DispatcherTest, latencyBoundAfterRun) {
+    disp.run();
+    EXPECT_THROW(disp.setLatencyBound(10000), DispatcherError);
+}
+
+TEST_F(DispatcherTest, tcpConnections) {
+    // Connection per query by default
+    EXPECT_EQ(0, disp.getTCPConnections());
+
+    disp.setTCPConnections(4);
+    EXPECT_EQ(4, disp.getTCPConnections());
+
+    // Once started it cannot be changed.
+    disp.run();
+    EXPECT_THROW(disp.setTCPConnections(1), DispatcherError);
+}
+
+TEST_F(DispatcherTest, tcpKeepaliveParam) {
+    EXPECT_FALSE(disp.getTCPKeepalive());
+
+    disp.setTCPKeepalive(true);
+    EXPECT_TRUE(disp.getTCPKeepalive());
+
+    // Once started it cannot be changed.
+    disp.run();
+    EXPECT_THROW(disp.setTCPKeepalive(false), DispatcherError);
+}
+
 } // unnamed namespace
@@ -0,0 +1,125 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <latency_histogram.h>
+
+#include <gtest/gtest.h>
+
+using namespace Queryperf;
+
+namespace {
+TEST(LatencyHistogramTest, empty) {
+    const LatencyHistogram hist;
+    EXPECT_EQ(0, hist.getCount());
+    EXPECT_EQ(0, hist.getMin());
+    EXPECT_EQ(0, hist.getMax());
+    EXPECT_EQ(0, hist.getMean());
+    EXPECT_EQ(0, hist.getValueAtPercentile(50));
+}
+
+TEST(LatencyHistogramTest, exactValues) {
+    // Small values are counted exactly.
+    LatencyHistogram hist;
+    for (uint64_t i = 1; i <= 100; ++i) {
+        hist.record(i);
+    }
+    EXPECT_EQ(100, hist.getCount());
+    EXPECT_EQ(1, hist.getMin());
+    EXPECT_EQ(100, hist.getMax());
+    EXPECT_DOUBLE_EQ(50.5, hist.getMean());
+    EXPECT_EQ(1, hist.getValueAtPercentile(0));
+    EXPECT_EQ(50, hist.getValueAtPercentile(50));
+    EXPECT_EQ(90, hist.getValueAtPercentile(90));
+    EXPECT_EQ(99, hist.getValueAtPercentile(99));
+    EXPECT_EQ(100, hist.getValueAtPercentile(99.9));
+    EXPECT_EQ(100, hist.getValueAtPercentile(100));
+}
+
+TEST(LatencyHistogramTest, largeValues) {
+    // Large values are bucketed, but the error should be bounded by 1/64.
+    LatencyHistogram hist;
+    const uint64_t values[] = { 1000, 12345, 500000, 5000000, 123456789 };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        LatencyHistogram single;
+        single.record(values[i]);
+        single.record(values[i] * 2); // make sure max isn't the same
+        const uint64_t value = single.getValueAtPercentile(50);
+        EXPECT_LE(values[i], value);
+        EXPECT_GE(values[i] + values[i] / 64, value);
+        hist.record(values[i]);
+    }
+    EXPECT_EQ(1000, hist.getMin());
+    EXPECT_EQ(123456789, hist.getMax());
+    // The highest percentile never exceeds the actual maximum.
+    EXPECT_EQ(123456789, hist.getValueAtPercentile(100));
+}
+
+TEST(LatencyHistogramTest, overflow) {
+    // Too large values are counted in the highest bucket, but the max is
+    // kept exactly.
+    LatencyHistogram hist;
+    hist.record(LatencyHistogram::MAX_VALUE * 2);
+    EXPECT_EQ(LatencyHistogram::MAX_VALUE * 2, hist.getMax());
+    EXPECT_EQ(LatencyHistogram::MAX_VALUE, hist.getValueAtPercentile(100));
+}
+
+TEST(LatencyHistogramTest, merge) {
+    LatencyHistogram hist1, hist2;
+    hist1.record(10);
+    hist1.record(20);
+    hist2.record(5);
+    hist2.record(30);
+
+    hist1.merge(hist2);
+    EXPECT_EQ(4, hist1.getCount());
+    EXPECT_EQ(5, hist1.getMin());
+    EXPECT_EQ(30, hist1.getMax());
+    EXPECT_DOUBLE_EQ(16.25, hist1.getMean());
+    EXPECT_EQ(10, hist1.getValueAtPercentile(50));
+
+    // Merging an empty histogram doesn't change anything; merging into an
+    // empty one makes a copy.
+    hist1.merge(LatencyHistogram());
+    EXPECT_EQ(5, hist1.getMin());
+    LatencyHistogram hist3;
+    hist3.merge(hist1);
+    EXPECT_EQ(4, hist3.getCount());
+    EXPECT_EQ(5, hist3.getMin());
+
+    hist3.clear();
+    EXPECT_EQ(0, hist3.getCount());
+}
+
+TEST(LatencyHistogramTest, recordCorrected) {
+    // A 100us latency with an expected interval of 30us hides queries
+    // that would have waited 70, 40 (but not 10) microseconds.
+    LatencyHistogram hist;
+    hist.recordCorrected(100, 30);
+    EXPECT_EQ(3, hist.getCount());
+    EXPECT_EQ(40, hist.getMin());
+    EXPECT_EQ(100, hist.getMax());
+    EXPECT_EQ(70, hist.getValueAtPercentile(50));
+
+    // Latencies shorter than twice the interval hide nothing.
+    hist.clear();
+    hist.recordCorrected(50, 30);
+    EXPECT_EQ(1, hist.getCount());
+    EXPECT_EQ(50, hist.getMax());
+
+    // Without an interval this is the same as record().
+    hist.clear();
+    hist.recordCorrected(100, 0);
+    EXPECT_EQ(1, hist.getCount());
+}
+}
@@ -0,0 +1,148 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <live_statistics.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace Queryperf;
+using namespace boost::posix_time;
+
+namespace {
+TEST(LiveCountersTest, latencyBucket) {
+    EXPECT_EQ(0, LiveCounters::getLatencyBucket(0));
+    EXPECT_EQ(0, LiveCounters::getLatencyBucket(1));
+    EXPECT_EQ(1, LiveCounters::getLatencyBucket(2));
+    EXPECT_EQ(2, LiveCounters::getLatencyBucket(3));
+    EXPECT_EQ(2, LiveCounters::getLatencyBucket(4));
+    EXPECT_EQ(10, LiveCounters::getLatencyBucket(1000));
+    EXPECT_EQ(10, LiveCounters::getLatencyBucket(1024));
+    EXPECT_EQ(11, LiveCounters::getLatencyBucket(1025));
+    // Too large values are counted in the last bucket.
+    EXPECT_EQ(LiveCounters::LATENCY_BUCKET_COUNT - 1,
+              LiveCounters::getLatencyBucket(1ULL << 40));
+
+    // Every value is within the bound of its bucket.
+    for (uint64_t latency = 0; latency < 5000; ++latency) {
+        const size_t bucket = LiveCounters::getLatencyBucket(latency);
+        EXPECT_LE(latency, LiveCounters::getLatencyBucketBound(bucket));
+        if (bucket > 0) {
+            EXPECT_GT(latency, LiveCounters::getLatencyBucketBound(bucket - 1));
+        }
+    }
+}
+
+TEST(LiveCountersTest, read) {
+    LiveCounters counters;
+    LiveCounters::Snapshot snapshot;
+    counters.read(snapshot);
+    EXPECT_EQ(0, snapshot.sent);
+    EXPECT_EQ(0, snapshot.completed);
+    EXPECT_EQ(0, snapshot.lost);
+    EXPECT_EQ(0, snapshot.getLatencyAtPercentile(50));
+
+    for (int i = 0; i < 10; ++i) {
+        counters.addSent();
+    }
+    for (uint64_t i = 1; i <= 8; ++i) {
+        counters.addCompleted(i * 100);
+    }
+    counters.addLost();
+    counters.read(snapshot);
+    EXPECT_EQ(10, snapshot.sent);
+    EXPECT_EQ(8, snapshot.completed);
+    EXPECT_EQ(1, snapshot.lost);
+    EXPECT_EQ(512, snapshot.getLatencyAtPercentile(50)); // 400
+    EXPECT_EQ(1024, snapshot.getLatencyAtPercentile(100)); // 800
+
+    // Difference from an older snapshot.
+    const LiveCounters::Snapshot older = snapshot;
+    counters.addSent();
+    counters.addCompleted(5000);
+    counters.read(snapshot);
+    snapshot.subtract(older);
+    EXPECT_EQ(1, snapshot.sent);
+    EXPECT_EQ(1, snapshot.completed);
+    EXPECT_EQ(0, snapshot.lost);
+    EXPECT_EQ(8192, snapshot.getLatencyAtPercentile(0));
+
+    snapshot.add(older);
+    EXPECT_EQ(11, snapshot.sent);
+    EXPECT_EQ(9, snapshot.completed);
+}
+
+TEST(LiveStatisticsReporterTest, badInterval) {
+    std::vector<const LiveCounters*> counters;
+    std::ostringstream os;
+    EXPECT_THROW(LiveStatisticsReporter(counters, seconds(0), os),
+                 LiveStatisticsError);
+}
+
+TEST(LiveStatisticsReporterTest, report) {
+    LiveCounters counters1, counters2;
+    std::vector<const LiveCounters*> counters;
+    counters.push_back(&counters1);
+    counters.push_back(&counters2);
+    std::ostringstream os;
+    LiveStatisticsReporter reporter(counters, seconds(1), os);
+
+    // The sum of all counters is reported, both for the interval and
+    // in total.
+    const ptime start = microsec_clock::universal_time();
+    counters1.addSent();
+    counters1.addCompleted(10);
+    counters2.addSent();
+    counters2.addLost();
+    reporter.report(start + seconds(1));
+    EXPECT_NE(std::string::npos, os.str().find("lost 1,"));
+    EXPECT_NE(std::string::npos, os.str().find("p50<=16us"));
+    EXPECT_NE(std::string::npos,
+              os.str().find("total: completed 1, lost 1,"));
+
+    os.str("");
+    counters1.addSent();
+    counters1.addCompleted(10);
+    reporter.report(start + seconds(2));
+    EXPECT_NE(std::string::npos, os.str().find("lost 0,"));
+    EXPECT_NE(std::string::npos,
+              os.str().find("total: completed 2, lost 1,"));
+}
+
+TEST(LiveStatisticsReporterTest, startStop) {
+    LiveCounters counters1;
+    std::vector<const LiveCounters*> counters(1, &counters1);
+    std::ostringstream os;
+    LiveStatisticsReporter reporter(counters, milliseconds(10), os);
+    reporter.stop();            // no-op before start
+
+    reporter.start();
+    EXPECT_THROW(reporter.start(), LiveStatisticsError);
+    usleep(55000);
+    reporter.stop();
+    // The exact number of reports depends on scheduling; we only check
+    // some reports have been made and the thread stops on request.
+    const std::string reports = os.str();
+    EXPECT_NE(std::string::npos, reports.find("[Stats]"));
+    usleep(30000);
+    EXPECT_EQ(reports, os.str());
+}
+}
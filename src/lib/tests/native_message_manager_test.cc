@@ -0,0 +1,533 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <epoll_message_manager.h>
+#include <io_uring_message_manager.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace Queryperf;
+using boost::scoped_ptr;
+using namespace boost::posix_time;
+
+// Tests common to the message managers running their own event loop on
+// the native interfaces of the system.  They're run for each manager, so
+// all of them are checked against the same behavior.
+
+namespace {
+const char TEST_DATA[] = "queryperf test";
+const uint16_t TEST_PORT = 5302;
+
+// Parameters of each manager that differ in the tests.
+template <typename T>
+struct ManagerTraits;
+
+template <>
+struct ManagerTraits<EpollMessageManager> {
+    static const char* const NAME;
+    // UDP messages are queued until this many are sent, and then sent
+    // in a batch.
+    static const size_t UDP_BATCH = 100;
+    static const bool FLUSH_ON_BATCH = true;
+};
+const char* const ManagerTraits<EpollMessageManager>::NAME = "epoll";
+
+template <>
+struct ManagerTraits<IOUringMessageManager> {
+    static const char* const NAME;
+    // UDP messages are submitted when the event loop runs or the
+    // submission queue fills up, which doesn't happen with this many.
+    static const size_t UDP_BATCH = 200;
+    static const bool FLUSH_ON_BATCH = false;
+};
+const char* const ManagerTraits<IOUringMessageManager>::NAME = "io_uring";
+
+void
+noopSocketCallback(const MessageSocket::Event&) {
+}
+
+// Create a server side socket bound to [::1]:TEST_PORT.
+int
+createServerSocket(int type) {
+    const int s = socket(AF_INET6, type, 0);
+    if (s < 0) {
+        throw runtime_error(string("socket(2) failed: ") + strerror(errno));
+    }
+    const int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in6 sin6;
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(TEST_PORT);
+    sin6.sin6_addr = in6addr_loopback;
+    void* p = &sin6;
+    if (bind(s, static_cast<struct sockaddr*>(p), sizeof(sin6)) < 0 ||
+        (type == SOCK_STREAM && listen(s, 1) < 0)) {
+        close(s);
+        throw runtime_error(string("bind/listen failed: ") + strerror(errno));
+    }
+    const struct timeval timeo = { 10, 0 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeo, sizeof(timeo));
+    return (s);
+}
+
+template <typename T>
+class NativeMessageManagerTest : public ::testing::Test {
+protected:
+    NativeMessageManagerTest() : server_fd_(-1), received_(0), stop_at_(0),
+                                 timer_called_(0)
+    {
+        try {
+            manager_.reset(new T);
+        } catch (const MessageSocketError& ex) {
+            // The manager may not be supported by the running system.
+            std::cerr << ManagerTraits<T>::NAME << " tests are skipped: "
+                      << ex.what() << std::endl;
+        }
+    }
+    ~NativeMessageManagerTest() {
+        if (server_fd_ >= 0) {
+            close(server_fd_);
+        }
+    }
+
+    MessageSocket* createSocket(int proto) {
+        return (manager_->createMessageSocket(
+                    proto, "::1", TEST_PORT, recvbuf_, sizeof(recvbuf_),
+                    boost::bind(&NativeMessageManagerTest::socketCallback,
+                                this, _1)));
+    }
+
+    MessageSocket* createStreamSocket() {
+        return (manager_->createStreamMessageSocket(
+                    "::1", TEST_PORT,
+                    boost::bind(&NativeMessageManagerTest::socketCallback,
+                                this, _1)));
+    }
+
+public:
+    void socketCallback(const MessageSocket::Event& ev) {
+        ++received_;
+        last_len_ = ev.datalen;
+        if (ev.data != NULL) {
+            last_data_.assign(static_cast<const char*>(ev.data), ev.datalen);
+        } else {
+            last_data_ = "(null)";
+        }
+        if (ev.transfer != NULL) {
+            last_transfer_ = *ev.transfer;
+        }
+        if (received_ == stop_at_) {
+            manager_->stop();
+        }
+    }
+
+    void timerCallback() {
+        ++timer_called_;
+    }
+
+    // Receive the given number of messages on the UDP server socket and
+    // echo back some of them.
+    void echoUDP(size_t count, size_t echo_count) {
+        for (size_t i = 0; i < count; ++i) {
+            char buf[512];
+            struct sockaddr_storage ss;
+            socklen_t sslen = sizeof(ss);
+            void* p = &ss;
+            const ssize_t cc = recvfrom(server_fd_, buf, sizeof(buf), 0,
+                                        static_cast<struct sockaddr*>(p),
+                                        &sslen);
+            ASSERT_EQ(sizeof(TEST_DATA), cc);
+            if (i < echo_count) {
+                sendto(server_fd_, buf, cc, 0,
+                       static_cast<struct sockaddr*>(p), sslen);
+            }
+        }
+    }
+
+    // Accept a TCP connection, read a query, and respond with the given
+    // number of messages.
+    void respondTCP(size_t response_count) {
+        const int s = accept(server_fd_, NULL, NULL);
+        ASSERT_LE(0, s);
+        uint8_t buf[2 + sizeof(TEST_DATA)];
+        size_t len = 0;
+        while (len < sizeof(buf)) {
+            const ssize_t cc = recv(s, buf + len, sizeof(buf) - len, 0);
+            ASSERT_LT(0, cc);
+            len += cc;
+        }
+        EXPECT_EQ(sizeof(TEST_DATA), buf[0] * 256 + buf[1]);
+        EXPECT_STREQ(TEST_DATA, reinterpret_cast<const char*>(buf + 2));
+        for (size_t i = 0; i < response_count; ++i) {
+            // Send the length and the data separately to test partial reads.
+            EXPECT_EQ(2, send(s, buf, 2, 0));
+            usleep(1000);
+            EXPECT_EQ(sizeof(TEST_DATA), send(s, buf + 2, sizeof(TEST_DATA),
+                                              0));
+        }
+        close(s);
+    }
+
+    // Accept a TCP connection, read the given number of queries, and
+    // respond to all of them in a single batch (split in the middle of a
+    // message to test partial reads).  Then close the connection.
+    void respondStream(size_t count) {
+        const int s = accept(server_fd_, NULL, NULL);
+        ASSERT_LE(0, s);
+        vector<uint8_t> buf(count * (2 + sizeof(TEST_DATA)));
+        size_t len = 0;
+        while (len < buf.size()) {
+            const ssize_t cc = recv(s, &buf[len], buf.size() - len, 0);
+            ASSERT_LT(0, cc);
+            len += cc;
+        }
+        EXPECT_EQ(sizeof(TEST_DATA), buf[0] * 256 + buf[1]);
+        EXPECT_STREQ(TEST_DATA, reinterpret_cast<const char*>(&buf[2]));
+        const size_t first_len = buf.size() - sizeof(TEST_DATA) / 2;
+        EXPECT_EQ(first_len, send(s, &buf[0], first_len, 0));
+        usleep(1000);
+        EXPECT_EQ(buf.size() - first_len,
+                  send(s, &buf[first_len], buf.size() - first_len, 0));
+        close(s);
+    }
+
+protected:
+    scoped_ptr<T> manager_;
+    int server_fd_;
+    uint8_t recvbuf_[65535];
+    size_t received_;
+    size_t stop_at_;
+    size_t last_len_;
+    string last_data_;
+    MessageSocket::TransferInfo last_transfer_;
+    size_t timer_called_;
+};
+
+typedef ::testing::Types<EpollMessageManager, IOUringMessageManager>
+ManagerTypes;
+#ifdef TYPED_TEST_SUITE
+TYPED_TEST_SUITE(NativeMessageManagerTest, ManagerTypes);
+#else
+TYPED_TEST_CASE(NativeMessageManagerTest, ManagerTypes);
+#endif
+
+// Skip the test if the manager isn't available.
+#define CHECK_SUPPORTED() if (!this->manager_) { return; }
+
+TYPED_TEST(NativeMessageManagerTest, createMessageSocketBadParam) {
+    CHECK_SUPPORTED();
+    EXPECT_THROW(this->manager_->createMessageSocket(
+                     IPPROTO_UDP, "bad", TEST_PORT, this->recvbuf_,
+                     sizeof(this->recvbuf_), noopSocketCallback),
+                 MessageSocketError);
+    EXPECT_THROW(this->manager_->createMessageSocket(
+                     IPPROTO_TCP, "bad", TEST_PORT, this->recvbuf_,
+                     sizeof(this->recvbuf_), noopSocketCallback),
+                 MessageSocketError);
+    EXPECT_THROW(this->manager_->createMessageSocket(
+                     IPPROTO_ICMP, "::1", TEST_PORT, this->recvbuf_,
+                     sizeof(this->recvbuf_), noopSocketCallback),
+                 MessageSocketError);
+    EXPECT_THROW(this->manager_->createMessageSocket(
+                     IPPROTO_TCP, "::1", TEST_PORT, this->recvbuf_, 65534,
+                     noopSocketCallback),
+                 MessageSocketError);
+    EXPECT_THROW(this->manager_->createMessageSocket(
+                     IPPROTO_UDP, "::1", TEST_PORT, this->recvbuf_,
+                     sizeof(this->recvbuf_), MessageSocket::Callback()),
+                 MessageSocketError);
+}
+
+TYPED_TEST(NativeMessageManagerTest, runWithoutWork) {
+    CHECK_SUPPORTED();
+    // Nothing to do; run() immediately returns.
+    this->manager_->run();
+    scoped_ptr<MessageSocket> sock(this->createSocket(IPPROTO_UDP));
+    this->manager_->run();
+}
+
+TYPED_TEST(NativeMessageManagerTest, sendUDP) {
+    CHECK_SUPPORTED();
+    this->server_fd_ = createServerSocket(SOCK_DGRAM);
+    scoped_ptr<MessageSocket> sock(this->createSocket(IPPROTO_UDP));
+
+    // Messages are queued until the event loop runs or a batch fills up.
+    const size_t batch = ManagerTraits<TypeParam>::UDP_BATCH;
+    for (size_t i = 0; i < 10; ++i) {
+        sock->send(TEST_DATA, sizeof(TEST_DATA));
+    }
+    char buf[512];
+    EXPECT_EQ(-1, recv(this->server_fd_, buf, sizeof(buf),
+                       MSG_PEEK | MSG_DONTWAIT));
+    for (size_t i = 10; i < batch; ++i) {
+        sock->send(TEST_DATA, sizeof(TEST_DATA));
+    }
+    if (ManagerTraits<TypeParam>::FLUSH_ON_BATCH) {
+        EXPECT_EQ(sizeof(TEST_DATA), recv(this->server_fd_, buf, sizeof(buf),
+                                          MSG_PEEK | MSG_DONTWAIT));
+    }
+
+    // The timer callback is called after the queued messages are sent.
+    scoped_ptr<MessageTimer> timer(this->manager_->createMessageTimer(
+                                       boost::bind(
+                                           &TestFixture::echoUDP, this,
+                                           batch, 20)));
+    timer->start(milliseconds(10));
+    this->stop_at_ = 20;
+    this->manager_->run();
+    EXPECT_EQ(20, this->received_);
+    EXPECT_EQ(sizeof(TEST_DATA), this->last_len_);
+    EXPECT_STREQ(TEST_DATA, this->last_data_.c_str());
+}
+
+TYPED_TEST(NativeMessageManagerTest, sendUDPManySockets) {
+    CHECK_SUPPORTED();
+    this->server_fd_ = createServerSocket(SOCK_DGRAM);
+
+    // More requests than the io_uring submission queue can hold are
+    // prepared before the event loop runs.  All of them must be submitted,
+    // and the manager must be destroyed cleanly afterwards.
+    const size_t batch = ManagerTraits<TypeParam>::UDP_BATCH;
+    vector<boost::shared_ptr<MessageSocket> > socks;
+    for (size_t i = 0; i < 4; ++i) {
+        socks.push_back(boost::shared_ptr<MessageSocket>(
+                            this->createSocket(IPPROTO_UDP)));
+        for (size_t j = 0; j < batch; ++j) {
+            socks.back()->send(TEST_DATA, sizeof(TEST_DATA));
+        }
+    }
+    scoped_ptr<MessageTimer> timer(this->manager_->createMessageTimer(
+                                       boost::bind(
+                                           &TestFixture::echoUDP, this,
+                                           20, 20)));
+    timer->start(milliseconds(10));
+    this->stop_at_ = 20;
+    this->manager_->run();
+    EXPECT_EQ(20, this->received_);
+    socks.clear();
+    timer.reset();
+    this->manager_.reset();
+}
+
+TYPED_TEST(NativeMessageManagerTest, loopStatistics) {
+    CHECK_SUPPORTED();
+    const LoopStatistics* stats = this->manager_->getLoopStatistics();
+    ASSERT_TRUE(stats != NULL);
+    EXPECT_EQ(0, stats->idle_usec);
+    EXPECT_EQ(0, stats->io_usec);
+
+    // Waiting for the timer is counted as idle time.
+    scoped_ptr<MessageTimer> timer(this->manager_->createMessageTimer(
+                                       boost::bind(
+                                           &TypeParam::stop,
+                                           this->manager_.get())));
+    timer->start(milliseconds(20));
+    this->manager_->run();
+    EXPECT_LE(10000, stats->idle_usec);
+}
+
+TYPED_TEST(NativeMessageManagerTest, resumeAfterStop) {
+    CHECK_SUPPORTED();
+    this->server_fd_ = createServerSocket(SOCK_DGRAM);
+    scoped_ptr<MessageSocket> sock(this->createSocket(IPPROTO_UDP));
+    for (size_t i = 0; i < 3; ++i) {
+        sock->send(TEST_DATA, sizeof(TEST_DATA));
+    }
+    scoped_ptr<MessageTimer> timer(this->manager_->createMessageTimer(
+                                       boost::bind(
+                                           &TestFixture::echoUDP, this,
+                                           3, 3)));
+    timer->start(milliseconds(10));
+
+    // Stop on the first response.  The others have been received with the
+    // same (edge-triggered) event, and they'll be delivered on the next run.
+    this->stop_at_ = 1;
+    this->manager_->run();
+    EXPECT_EQ(1, this->received_);
+    this->stop_at_ = 3;
+    this->manager_->run();
+    EXPECT_EQ(3, this->received_);
+}
+
+template <typename T>
+void*
+stopThread(void* arg) {
+    usleep(20000);
+    static_cast<T*>(arg)->stop();
+    return (NULL);
+}
+
+TYPED_TEST(NativeMessageManagerTest, stopFromOtherThread) {
+    CHECK_SUPPORTED();
+    scoped_ptr<MessageTimer> timer(this->manager_->createMessageTimer(
+                                       boost::bind(
+                                           &TestFixture::timerCallback,
+                                           this)));
+    timer->start(seconds(10));
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, stopThread<TypeParam>,
+                                this->manager_.get()));
+    const ptime start = microsec_clock::universal_time();
+    this->manager_->run();
+    pthread_join(th, NULL);
+    EXPECT_GT(seconds(5), microsec_clock::universal_time() - start);
+    EXPECT_EQ(0, this->timer_called_);
+
+    // stop() before run() makes the next run() return immediately.
+    this->manager_->stop();
+    this->manager_->run();
+    EXPECT_EQ(0, this->timer_called_);
+}
+
+TYPED_TEST(NativeMessageManagerTest, timer) {
+    CHECK_SUPPORTED();
+    scoped_ptr<MessageTimer> timer(this->manager_->createMessageTimer(
+                                       boost::bind(
+                                           &TestFixture::timerCallback,
+                                           this)));
+    scoped_ptr<MessageTimer> cancelled(this->manager_->createMessageTimer(
+                                           boost::bind(
+                                               &TestFixture::timerCallback,
+                                               this)));
+    scoped_ptr<MessageTimer> coarse(this->manager_->createCoarseMessageTimer(
+                                        boost::bind(
+                                            &TestFixture::timerCallback,
+                                            this)));
+    cancelled->start(milliseconds(10));
+    cancelled->cancel();
+    timer->start(milliseconds(10));
+    timer->start(milliseconds(20)); // restart
+    coarse->start(milliseconds(10));
+
+    // run() returns once all timers expire.
+    const ptime start = microsec_clock::universal_time();
+    this->manager_->run();
+    EXPECT_EQ(2, this->timer_called_);
+    EXPECT_LE(milliseconds(20), microsec_clock::universal_time() - start);
+}
+
+TYPED_TEST(NativeMessageManagerTest, sendTCP) {
+    CHECK_SUPPORTED();
+    this->server_fd_ = createServerSocket(SOCK_STREAM);
+    scoped_ptr<MessageSocket> sock(this->createSocket(IPPROTO_TCP));
+    sock->send(TEST_DATA, sizeof(TEST_DATA));
+    scoped_ptr<MessageTimer> timer(this->manager_->createMessageTimer(
+                                       boost::bind(
+                                           &TestFixture::respondTCP, this,
+                                           2)));
+    timer->start(milliseconds(10));
+
+    // The callback is called with the first message once the server closes
+    // the connection.
+    this->manager_->run();
+    EXPECT_EQ(1, this->received_);
+    EXPECT_EQ(sizeof(TEST_DATA), this->last_len_);
+    EXPECT_STREQ(TEST_DATA, this->last_data_.c_str());
+
+    // Both messages are counted.  The test data are counted as answer
+    // RRs, as they are in place of the ANCOUNT field.
+    EXPECT_EQ(2, this->last_transfer_.messages);
+    EXPECT_EQ(2 * (2 + sizeof(TEST_DATA)), this->last_transfer_.bytes);
+    EXPECT_EQ(2 * (TEST_DATA[6] * 256 + TEST_DATA[7]),
+              this->last_transfer_.rrs);
+    EXPECT_FALSE(this->last_transfer_.first_byte.is_special());
+}
+
+TYPED_TEST(NativeMessageManagerTest, sendTCPFail) {
+    CHECK_SUPPORTED();
+    // There's no server, so the connection fails.
+    scoped_ptr<MessageSocket> sock(this->createSocket(IPPROTO_TCP));
+    sock->send(TEST_DATA, sizeof(TEST_DATA));
+    this->manager_->run();
+    EXPECT_EQ(1, this->received_);
+    EXPECT_EQ(0, this->last_len_);
+    EXPECT_EQ("(null)", this->last_data_);
+}
+
+TYPED_TEST(NativeMessageManagerTest, cancelTCP) {
+    CHECK_SUPPORTED();
+    // A socket can be destroyed while it's waiting for a response, after
+    // which run() has nothing to do.
+    this->server_fd_ = createServerSocket(SOCK_STREAM);
+    scoped_ptr<MessageSocket> sock(this->createSocket(IPPROTO_TCP));
+    sock->send(TEST_DATA, sizeof(TEST_DATA));
+    sock.reset();
+    this->manager_->run();
+    EXPECT_EQ(0, this->received_);
+}
+
+TYPED_TEST(NativeMessageManagerTest, sendStream) {
+    CHECK_SUPPORTED();
+    this->server_fd_ = createServerSocket(SOCK_STREAM);
+    scoped_ptr<MessageSocket> sock(this->createStreamSocket());
+    for (size_t i = 0; i < 3; ++i) {
+        sock->send(TEST_DATA, sizeof(TEST_DATA));
+    }
+    scoped_ptr<MessageTimer> timer(this->manager_->createMessageTimer(
+                                       boost::bind(
+                                           &TestFixture::respondStream, this,
+                                           3)));
+    timer->start(milliseconds(10));
+
+    // The callback is called for each response, and then for the closed
+    // connection.
+    this->manager_->run();
+    EXPECT_EQ(4, this->received_);
+    EXPECT_EQ(0, this->last_len_);
+    EXPECT_EQ("(null)", this->last_data_);
+
+    // The next send reconnects.
+    sock->send(TEST_DATA, sizeof(TEST_DATA));
+    timer.reset(this->manager_->createMessageTimer(
+                    boost::bind(&TestFixture::respondStream, this, 1)));
+    timer->start(milliseconds(10));
+    this->stop_at_ = 5;
+    this->manager_->run();
+    EXPECT_EQ(5, this->received_);
+    EXPECT_EQ(sizeof(TEST_DATA), this->last_len_);
+    EXPECT_STREQ(TEST_DATA, this->last_data_.c_str());
+}
+
+TYPED_TEST(NativeMessageManagerTest, sendStreamFail) {
+    CHECK_SUPPORTED();
+    // There's no server, so the connection fails.
+    scoped_ptr<MessageSocket> sock(this->createStreamSocket());
+    sock->send(TEST_DATA, sizeof(TEST_DATA));
+    sock->send(TEST_DATA, sizeof(TEST_DATA));
+    this->manager_->run();
+    EXPECT_EQ(1, this->received_);
+    EXPECT_EQ("(null)", this->last_data_);
+}
+}
@@ -84,4 +84,25 @@ TEST_F(QueryContextTest, setProtocol) {
                  RRType::SOA(), IPPROTO_TCP);
 }
 
+TEST_F(QueryContextTest, startWithPreload) {
+    // With preload, queries are copied from the pre-rendered data.  Their
+    // content should be the same as in the non-preload mode.
+    const qid_t TEST_QID = 0x1234;
+
+    repo.setProtocol(IPPROTO_TCP);
+    repo.load();
+    QueryContext ctx(repo);
+    messageCheck(ctx.start(TEST_QID), TEST_QID, Name("example.com"),
+                 RRType::SOA(), IPPROTO_TCP);
+    messageCheck(ctx.start(TEST_QID + 1), TEST_QID + 1,
+                 Name("www.example.com"), RRType::A(), IPPROTO_TCP);
+
+    // Multiple contexts can use the same query data with different QIDs.
+    QueryContext ctx2(repo);
+    const QueryContext::QuerySpec spec1 = ctx.start(1);
+    const QueryContext::QuerySpec spec2 = ctx2.start(2);
+    messageCheck(spec1, 1, Name("example.com"), RRType::SOA(), IPPROTO_TCP);
+    messageCheck(spec2, 2, Name("www.example.com"), RRType::A(), IPPROTO_TCP);
+}
+
 }
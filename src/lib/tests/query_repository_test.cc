@@ -13,6 +13,7 @@
 // PERFORMANCE OF THIS SOFTWARE.
 
 #include <query_repository.h>
+#include <compiled_query_set.h>
 #include <common_test.h>
 
 #include <dns/name.h>
@@ -25,12 +26,16 @@
 
 #include <gtest/gtest.h>
 
+#include <fstream>
 #include <sstream>
 #include <string>
 #include <iostream>
+#include <vector>
 
 #include <netinet/in.h>
 
+#include <unistd.h>
+
 using namespace std;
 using namespace bundy::dns;
 using namespace Queryperf;
@@ -92,6 +97,258 @@ TEST_F(QueryRepositoryTest, createFromStringWithPreload) {
     initialCheck(repo, msg);
 }
 
+TEST_F(QueryRepositoryTest, getNextWireQuery) {
+    stringstream ss("example.com. SOA\nwww.example.com. A");
+    QueryRepository repo(ss);
+    size_t len;
+
+    // Not available without preload.
+    EXPECT_THROW(repo.getNextWireQuery(len, protocol), QueryRepositoryError);
+
+    repo.setProtocol(IPPROTO_TCP);
+    repo.load();
+    const uint8_t* data = repo.getNextWireQuery(len, protocol);
+    EXPECT_EQ(IPPROTO_TCP, protocol);
+    queryMessageCheck(data, len, 0, Name("example.com"), RRType::SOA());
+    data = repo.getNextWireQuery(len, protocol);
+    queryMessageCheck(data, len, 0, Name("www.example.com"), RRType::A());
+
+    // It shares the iteration with getNextQuery().
+    repo.getNextQuery(msg, protocol);
+    queryMessageCheck(msg, 0, Name("example.com"), RRType::SOA(),
+                      default_expected_rr_counts);
+    data = repo.getNextWireQuery(len, protocol);
+    queryMessageCheck(data, len, 0, Name("www.example.com"), RRType::A());
+}
+
+TEST_F(QueryRepositoryTest, sharePreloaded) {
+    stringstream ss("example.com. SOA\nwww.example.com. A\n"
+                    "example.com. NS");
+    QueryRepository repo(ss);
+
+    // Sharing queries requires preload.
+    EXPECT_THROW(QueryRepository(repo, 0), QueryRepositoryError);
+
+    repo.setDNSSEC(false);
+    repo.setProtocol(IPPROTO_TCP);
+    repo.load();
+    QueryRepository repo2(repo, 4); // start from the second query
+    EXPECT_EQ(3, repo2.getQueryCount());
+
+    // The shared repository has its own iteration, and inherits the
+    // parameters of the original one.
+    repo2.getNextQuery(msg, protocol);
+    EXPECT_EQ(IPPROTO_TCP, protocol);
+    queryMessageCheck(msg, 0, Name("www.example.com"), RRType::A(),
+                      default_expected_rr_counts, true, false);
+    size_t len;
+    const uint8_t* data = repo2.getNextWireQuery(len, protocol);
+    queryMessageCheck(data, len, 0, Name("example.com"), RRType::NS(),
+                      true, false);
+    repo.getNextQuery(msg, protocol);
+    queryMessageCheck(msg, 0, Name("example.com"), RRType::SOA(),
+                      default_expected_rr_counts, true, false);
+    repo2.getNextQuery(msg, protocol);
+    queryMessageCheck(msg, 0, Name("example.com"), RRType::SOA(),
+                      default_expected_rr_counts, true, false);
+
+    // The shared one can't be reconfigured or loaded again.
+    EXPECT_THROW(repo2.setProtocol(IPPROTO_UDP), QueryRepositoryError);
+    EXPECT_THROW(repo2.load(), QueryRepositoryError);
+
+    // The shared queries remain valid even after the original is gone.
+    QueryRepository* repo3 = new QueryRepository(repo2, 0);
+    QueryRepository repo4(*repo3, 0);
+    delete repo3;
+    data = repo4.getNextWireQuery(len, protocol);
+    queryMessageCheck(data, len, 0, Name("example.com"), RRType::SOA(),
+                      true, false);
+
+    // A copy has the same queries in a different place.
+    QueryRepository repo5(repo4, 0, true);
+    const uint8_t* copied_data = repo5.getNextWireQuery(len, protocol);
+    EXPECT_EQ(IPPROTO_TCP, protocol);
+    queryMessageCheck(copied_data, len, 0, Name("example.com"),
+                      RRType::SOA(), true, false);
+    EXPECT_NE(data, copied_data);
+    repo5.getNextQuery(msg, protocol);
+    queryMessageCheck(msg, 0, Name("www.example.com"), RRType::A(),
+                      default_expected_rr_counts, true, false);
+}
+
+// Input data containing various cases of valid and invalid lines.
+const char* const LOAD_TEST_DATA =
+    "example.com. SOA\n"
+    "; comment\n"
+    "\n"
+    "   \n"
+    "www.example.com. A\n"
+    "example.com.\n"            // missing type, ignored
+    "example.org. NOSUCHTYPE\n" // unknown type, ignored
+    "example.org. TYPE65000\n"
+    "example.org. ANY\n"
+    "example.org. AAAA \n"      // trailing space, ignored
+    "example.com. IXFR serial=42\n"
+    "example.com. IXFR serial=bad\n"
+    "example.com. NS foo=bar\n"
+    "example.com. NS foo\n"
+    "example.net. AXFR";         // no trailing newline
+
+// Return all preloaded queries in wire format in the repository.
+vector<vector<uint8_t> >
+getWireQueries(QueryRepository& repo) {
+    vector<vector<uint8_t> > queries;
+    for (size_t i = 0; i < repo.getQueryCount(); ++i) {
+        size_t len;
+        int protocol;
+        const uint8_t* data = repo.getNextWireQuery(len, protocol);
+        queries.push_back(vector<uint8_t>(data, data + len));
+    }
+    return (queries);
+}
+
+TEST_F(QueryRepositoryTest, loadFile) {
+    // Loading from a file, possibly in parallel, should result in the same
+    // sequence of queries as from a stream.
+    stringstream ss(LOAD_TEST_DATA);
+    QueryRepository repo(ss);
+    repo.load();
+    const vector<vector<uint8_t> > expected = getWireQueries(repo);
+    EXPECT_EQ(7, expected.size());
+
+    const char* const filename = "query_repository_test.tmp";
+    {
+        ofstream ofs(filename);
+        ofs << LOAD_TEST_DATA;
+    }
+    // Using up to more threads than lines, including automatic adjustment.
+    for (size_t n_threads = 0; n_threads <= 20; ++n_threads) {
+        QueryRepository file_repo(filename);
+        file_repo.setLoadThreads(n_threads);
+        file_repo.load();
+        EXPECT_EQ(expected, getWireQueries(file_repo));
+    }
+    unlink(filename);
+}
+
+TEST_F(QueryRepositoryTest, loadEmptyFile) {
+    const char* const filename = "query_repository_test.tmp";
+    {
+        ofstream ofs(filename);
+        ofs << "; comment only\n";
+    }
+    QueryRepository repo(filename);
+    repo.setLoadThreads(2);
+    EXPECT_THROW(repo.load(), QueryRepositoryError);
+    unlink(filename);
+}
+
+TEST_F(QueryRepositoryTest, compiledQuerySet) {
+    stringstream ss(LOAD_TEST_DATA);
+    QueryRepository repo(ss);
+    repo.setProtocol(IPPROTO_TCP);
+    repo.setDNSSEC(false);
+    repo.load();
+    const char* const filename = "query_repository_test.tmp";
+    {
+        ofstream ofs(filename, ios::binary);
+        repo.writeCompiled(ofs);
+    }
+
+    // The compiled set is ready for use on construction.  Other settings
+    // are ignored, and the same sequence of queries (including protocols)
+    // should be returned.
+    QueryRepository compiled_repo(filename);
+    EXPECT_EQ(repo.getQueryCount(), compiled_repo.getQueryCount());
+    compiled_repo.setProtocol(IPPROTO_UDP);
+    compiled_repo.setQueryClass(RRClass::CH());
+    compiled_repo.load();
+    for (size_t i = 0; i < repo.getQueryCount(); ++i) {
+        size_t len, compiled_len;
+        int protocol, compiled_protocol;
+        const uint8_t* data = repo.getNextWireQuery(len, protocol);
+        const uint8_t* compiled_data =
+            compiled_repo.getNextWireQuery(compiled_len, compiled_protocol);
+        EXPECT_EQ(vector<uint8_t>(data, data + len),
+                  vector<uint8_t>(compiled_data, compiled_data + compiled_len));
+        EXPECT_EQ(protocol, compiled_protocol);
+    }
+
+    // Compiled queries can be shared, and compiled again.
+    QueryRepository shared_repo(compiled_repo, 1);
+    size_t len;
+    const uint8_t* data = shared_repo.getNextWireQuery(len, protocol);
+    queryMessageCheck(data, len, 0, Name("www.example.com"), RRType::A(),
+                      true, false);
+    EXPECT_EQ(IPPROTO_TCP, protocol);
+    stringstream compiled1, compiled2;
+    repo.writeCompiled(compiled1);
+    compiled_repo.writeCompiled(compiled2);
+    EXPECT_EQ(compiled1.str(), compiled2.str());
+
+    // So can a copy of them, and a copy of the copy.
+    QueryRepository copied_repo(compiled_repo, 0, true);
+    QueryRepository copied_repo2(copied_repo, 0, true);
+    stringstream compiled3, compiled4;
+    copied_repo.writeCompiled(compiled3);
+    copied_repo2.writeCompiled(compiled4);
+    EXPECT_EQ(compiled1.str(), compiled3.str());
+    EXPECT_EQ(compiled1.str(), compiled4.str());
+
+    // Message objects aren't available for a compiled set.
+    EXPECT_THROW(compiled_repo.getNextQuery(msg, protocol),
+                 QueryRepositoryError);
+    unlink(filename);
+}
+
+TEST_F(QueryRepositoryTest, brokenCompiledQuerySet) {
+    stringstream ss("example.com. SOA\n");
+    QueryRepository repo(ss);
+    EXPECT_THROW(repo.writeCompiled(ss), QueryRepositoryError);
+    repo.load();
+    stringstream compiled;
+    repo.writeCompiled(compiled);
+    const string data = compiled.str();
+    const char* const filename = "query_repository_test.tmp";
+
+    // Truncated data.
+    {
+        ofstream ofs(filename, ios::binary);
+        ofs << data.substr(0, data.size() - 1);
+    }
+    EXPECT_THROW(QueryRepository r(filename), QueryRepositoryError);
+
+    // Unknown version.
+    {
+        ofstream ofs(filename, ios::binary);
+        string broken = data;
+        broken[11] = 2;
+        ofs << broken;
+    }
+    EXPECT_THROW(QueryRepository r(filename), QueryRepositoryError);
+
+    // Broken index entry (query length exceeding the data) is detected on
+    // use.
+    {
+        ofstream ofs(filename, ios::binary);
+        string broken = data;
+        broken[CompiledQuerySet::HEADER_SIZE + 8] = 0x7f;
+        ofs << broken;
+    }
+    QueryRepository broken_repo(filename);
+    size_t len;
+    EXPECT_THROW(broken_repo.getNextWireQuery(len, protocol),
+                 QueryRepositoryError);
+    unlink(filename);
+}
+
+TEST_F(QueryRepositoryTest, setLoadThreadsAfterPreload) {
+    stringstream ss("example.com. SOA\n");
+    QueryRepository repo(ss);
+    repo.load();
+    EXPECT_THROW(repo.setLoadThreads(1), QueryRepositoryError);
+}
+
 TEST_F(QueryRepositoryTest, duplicatePreload) {
     stringstream ss("example.com. SOA\nwww.example.com. A");
     QueryRepository repo(ss);
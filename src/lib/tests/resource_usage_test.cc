@@ -0,0 +1,131 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <resource_usage.h>
+
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+
+using namespace Queryperf;
+
+namespace {
+TEST(ResourceUsageTest, construct) {
+    const ResourceUsage usage;
+    EXPECT_EQ(0, usage.wall_usec);
+    EXPECT_EQ(0, usage.user_usec);
+    EXPECT_EQ(0, usage.system_usec);
+    EXPECT_EQ(0, usage.voluntary_switches);
+    EXPECT_EQ(0, usage.involuntary_switches);
+    EXPECT_FALSE(usage.has_loop_stats);
+    EXPECT_EQ(0, usage.idle_usec);
+    EXPECT_EQ(0, usage.io_usec);
+    EXPECT_EQ(0, usage.getCPUUtilization());
+    EXPECT_EQ(0, usage.getBusyRatio());
+    EXPECT_FALSE(usage.isSaturated());
+}
+
+TEST(ResourceUsageTest, ratios) {
+    ResourceUsage usage;
+    usage.wall_usec = 1000;
+    usage.user_usec = 300;
+    usage.system_usec = 200;
+    EXPECT_DOUBLE_EQ(0.5, usage.getCPUUtilization());
+    // Without loop statistics, the busy ratio is the CPU utilization.
+    EXPECT_DOUBLE_EQ(0.5, usage.getBusyRatio());
+    EXPECT_FALSE(usage.isSaturated());
+
+    usage.has_loop_stats = true;
+    usage.idle_usec = 50;
+    EXPECT_DOUBLE_EQ(0.95, usage.getBusyRatio());
+    EXPECT_TRUE(usage.isSaturated());
+
+    // Saturated in terms of CPU while the loop seems mostly idle.
+    usage.idle_usec = 900;
+    EXPECT_FALSE(usage.isSaturated());
+    usage.user_usec = 900;
+    EXPECT_TRUE(usage.isSaturated());
+}
+
+TEST(ResourceUsageTest, merge) {
+    ResourceUsage usage1;
+    usage1.wall_usec = 1000;
+    usage1.user_usec = 100;
+    usage1.system_usec = 200;
+    usage1.voluntary_switches = 10;
+    usage1.involuntary_switches = 1;
+    usage1.has_loop_stats = true;
+    usage1.idle_usec = 500;
+    usage1.io_usec = 150;
+
+    // Merging into an empty object makes a copy.
+    ResourceUsage total;
+    total.merge(usage1);
+    EXPECT_EQ(1000, total.wall_usec);
+    EXPECT_TRUE(total.has_loop_stats);
+    EXPECT_EQ(500, total.idle_usec);
+
+    total.merge(usage1);
+    EXPECT_EQ(2000, total.wall_usec);
+    EXPECT_EQ(200, total.user_usec);
+    EXPECT_EQ(400, total.system_usec);
+    EXPECT_EQ(20, total.voluntary_switches);
+    EXPECT_EQ(2, total.involuntary_switches);
+    EXPECT_TRUE(total.has_loop_stats);
+    EXPECT_EQ(1000, total.idle_usec);
+    EXPECT_EQ(300, total.io_usec);
+
+    // Loop statistics are invalid once a thread without them is merged.
+    ResourceUsage no_loop_stats;
+    no_loop_stats.wall_usec = 1000;
+    total.merge(no_loop_stats);
+    EXPECT_EQ(3000, total.wall_usec);
+    EXPECT_FALSE(total.has_loop_stats);
+}
+
+TEST(ResourceUsageTest, monotonicTime) {
+    const uint64_t start = getMonotonicTime();
+    usleep(10000);
+    const uint64_t elapsed = getMonotonicTime() - start;
+    EXPECT_LE(10000, elapsed);
+    EXPECT_GT(1000000, elapsed);
+}
+
+TEST(ThreadUsageMeterTest, measure) {
+    ThreadUsageMeter meter;
+    meter.start();
+    // Spin for a while so some CPU time is consumed.
+    const uint64_t start = getMonotonicTime();
+    while (getMonotonicTime() - start < 20000) {
+        ;
+    }
+    ResourceUsage usage;
+    usage.has_loop_stats = true;
+    usage.idle_usec = 10;
+    meter.stop(usage);
+    EXPECT_LE(20000, usage.wall_usec);
+#ifdef RUSAGE_THREAD
+    EXPECT_LT(0, usage.user_usec + usage.system_usec);
+#endif
+    // Loop statistics are intact.
+    EXPECT_TRUE(usage.has_loop_stats);
+    EXPECT_EQ(10, usage.idle_usec);
+
+    // The usage is accumulated.
+    const uint64_t wall_usec = usage.wall_usec;
+    meter.stop(usage);
+    EXPECT_LE(wall_usec * 2, usage.wall_usec);
+}
+}
@@ -0,0 +1,265 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+// Microbenchmarks of the hot paths of the library.  Each benchmark runs
+// a fixed number of iterations, repeated several times, and the results
+// are printed in CSV so that they can be compared between builds:
+//
+//   benchmark,iterations,min_ns_per_op,median_ns_per_op
+//
+// Only the measured operations are timed; setup such as building the
+// input queries is excluded.  An optional argument restricts the
+// benchmarks to those whose names contain it.
+
+#include <test_message_manager.h>
+
+#include <query_repository.h>
+#include <query_context.h>
+#include <dispatcher.h>
+#include <message_manager.h>
+
+#include <util/buffer.h>
+#include <dns/message.h>
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+using namespace std;
+using namespace bundy::dns;
+using namespace bundy::util;
+using namespace Queryperf;
+using namespace Queryperf::unittest;
+using namespace boost::posix_time;
+using boost::lexical_cast;
+
+namespace {
+// Number of times each benchmark is repeated.
+const size_t REPEAT_COUNT = 5;
+
+// Number of distinct queries in the input used by the benchmarks.
+const size_t QUERY_COUNT = 1000;
+
+// Results of measured operations are stored here so that the compiler
+// can't optimize the operations out.
+volatile size_t result_sink;
+
+// A benchmark body runs the given number of iterations and returns the
+// time spent for them in nanoseconds.
+typedef boost::function<uint64_t(size_t)> BenchmarkBody;
+
+// Time of the measured part of a benchmark.
+class Stopwatch {
+public:
+    Stopwatch() : start_(microsec_clock::universal_time()) {}
+    uint64_t getElapsed() const {
+        return ((microsec_clock::universal_time() -
+                 start_).total_microseconds() * 1000);
+    }
+
+private:
+    const ptime start_;
+};
+
+// Return QUERY_COUNT lines of query input of various types.
+string
+getQueryText(size_t count = QUERY_COUNT) {
+    static const char* const types[] = { "A", "AAAA", "MX", "NS", "TXT" };
+    ostringstream oss;
+    for (size_t i = 0; i < count; ++i) {
+        oss << "host" << i << ".example.com. "
+            << types[i % (sizeof(types) / sizeof(types[0]))] << "\n";
+    }
+    return (oss.str());
+}
+
+uint64_t
+benchContextStart(size_t iterations) {
+    stringstream ss(getQueryText());
+    QueryRepository repo(ss);
+    repo.load();
+    QueryContext ctx(repo);
+
+    size_t total_len = 0;
+    const Stopwatch watch;
+    for (size_t i = 0; i < iterations; ++i) {
+        total_len += ctx.start(i & 0xffff).len;
+    }
+    const uint64_t elapsed = watch.getElapsed();
+    result_sink = total_len;
+    return (elapsed);
+}
+
+uint64_t
+benchGetNextQuery(bool preload, size_t iterations) {
+    stringstream ss(getQueryText());
+    QueryRepository repo(ss);
+    if (preload) {
+        repo.load();
+    }
+    Message msg(Message::RENDER);
+    int protocol;
+
+    const Stopwatch watch;
+    for (size_t i = 0; i < iterations; ++i) {
+        repo.getNextQuery(msg, protocol);
+    }
+    return (watch.getElapsed());
+}
+
+// readNextRequest() is internal to the repository; we measure it as the
+// cost of preloading the given number of lines from a stream.
+uint64_t
+benchReadRequest(size_t iterations) {
+    stringstream ss(getQueryText(iterations));
+    QueryRepository repo(ss);
+
+    const Stopwatch watch;
+    repo.load();
+    return (watch.getElapsed());
+}
+
+// Respond to queries sent by the dispatcher in order, so that each
+// response restarts a query in DispatcherImpl::responseCallback().
+class RestartQueryBenchmark {
+public:
+    RestartQueryBenchmark(TestMessageManager& mgr, size_t iterations) :
+        mgr_(mgr), iterations_(iterations), elapsed_(0)
+    {}
+
+    void run() {
+        TestMessageSocket& sock = *mgr_.socket_;
+        vector<vector<uint8_t> > queries;
+        size_t count = 0;
+
+        const Stopwatch watch;
+        while (count < iterations_) {
+            // Responding to all currently outstanding queries refills the
+            // socket with the same number of new ones.
+            queries.clear();
+            queries.swap(sock.query_data_);
+            for (size_t i = 0; i < queries.size() && count < iterations_;
+                 ++i, ++count) {
+                vector<uint8_t>& data = queries[i];
+                data[2] |= 0x80; // make it a response by setting QR
+                sock.callback_(MessageSocket::Event(&data[0], data.size()));
+            }
+        }
+        elapsed_ = watch.getElapsed();
+        mgr_.stop();
+    }
+
+    uint64_t getElapsed() const { return (elapsed_); }
+
+private:
+    TestMessageManager& mgr_;
+    const size_t iterations_;
+    uint64_t elapsed_;
+};
+
+uint64_t
+benchRestartQuery(size_t window, size_t iterations) {
+    stringstream ss(getQueryText());
+    QueryRepository repo(ss);
+    repo.load();
+    QueryContextCreator ctx_creator(repo);
+    TestMessageManager mgr;
+    mgr.parse_queries_ = false;
+    Dispatcher disp(mgr, ctx_creator);
+    disp.setWindow(window);
+
+    RestartQueryBenchmark bench(mgr, iterations);
+    mgr.setRunHandler(boost::bind(&RestartQueryBenchmark::run, &bench));
+    disp.run();
+    return (bench.getElapsed());
+}
+
+// The response parsing part of DispatcherImpl::responseCallback().
+uint64_t
+benchParseHeader(size_t iterations) {
+    stringstream ss(getQueryText());
+    QueryRepository repo(ss);
+    repo.load();
+    size_t len;
+    int protocol;
+    const uint8_t* const query = repo.getNextWireQuery(len, protocol);
+    vector<uint8_t> response(query, query + len);
+    response[2] |= 0x80;
+    Message msg(Message::PARSE);
+
+    size_t total_qid = 0;
+    const Stopwatch watch;
+    for (size_t i = 0; i < iterations; ++i) {
+        InputBuffer buffer(&response[0], response.size());
+        msg.clear(Message::PARSE);
+        msg.parseHeader(buffer);
+        total_qid += msg.getQid();
+    }
+    const uint64_t elapsed = watch.getElapsed();
+    result_sink = total_qid;
+    return (elapsed);
+}
+
+void
+runBenchmark(const string& filter, const string& name, size_t iterations,
+             BenchmarkBody body)
+{
+    if (name.find(filter) == string::npos) {
+        return;
+    }
+    vector<double> results;
+    for (size_t i = 0; i < REPEAT_COUNT; ++i) {
+        results.push_back(static_cast<double>(body(iterations)) /
+                          iterations);
+    }
+    sort(results.begin(), results.end());
+    cout << name << "," << iterations << "," << results[0] << ","
+         << results[REPEAT_COUNT / 2] << endl;
+}
+}
+
+int
+main(int argc, char* argv[]) {
+    const string filter = argc > 1 ? argv[1] : "";
+
+    cout << "benchmark,iterations,min_ns_per_op,median_ns_per_op" << endl;
+    runBenchmark(filter, "QueryContext::start", 1000000, benchContextStart);
+    runBenchmark(filter, "QueryRepository::getNextQuery/preload", 200000,
+                 boost::bind(benchGetNextQuery, true, _1));
+    runBenchmark(filter, "QueryRepository::getNextQuery/stream", 100000,
+                 boost::bind(benchGetNextQuery, false, _1));
+    runBenchmark(filter, "QueryRepository::readNextRequest", 100000,
+                 benchReadRequest);
+    // The window can't exceed the QID space (65536).
+    const size_t windows[] = { 10, 100, 1000, 10000, 65536 };
+    for (size_t i = 0; i < sizeof(windows) / sizeof(windows[0]); ++i) {
+        runBenchmark(filter, "Dispatcher::restartQuery/window=" +
+                     lexical_cast<string>(windows[i]), 200000,
+                     boost::bind(benchRestartQuery, windows[i], _1));
+    }
+    runBenchmark(filter, "Dispatcher::responseCallback/parseHeader", 1000000,
+                 benchParseHeader);
+
+    return (0);
+}
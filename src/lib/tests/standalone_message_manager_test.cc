@@ -0,0 +1,246 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <standalone_message_manager.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+
+using namespace std;
+using namespace Queryperf;
+using boost::scoped_ptr;
+using namespace boost::posix_time;
+
+namespace {
+const char TEST_DATA[] = "queryperf test";
+
+// A handler that returns the query as the response, unless the query
+// starts with "drop".
+size_t
+echoHandler(const void* query, size_t query_len, void* response,
+            size_t response_len)
+{
+    if (query_len >= 4 && memcmp(query, "drop", 4) == 0) {
+        return (0);
+    }
+    const size_t len = query_len < response_len ? query_len : response_len;
+    memcpy(response, query, len);
+    return (len);
+}
+
+// A handler that returns a response larger than the buffer.
+size_t
+badHandler(const void*, size_t, void*, size_t response_len) {
+    return (response_len + 1);
+}
+
+class StandaloneMessageManagerTest : public ::testing::Test {
+protected:
+    StandaloneMessageManagerTest() :
+        manager_(echoHandler), received_(0), stop_at_(0), timer_called_(0)
+    {}
+
+    void socketCallback(const MessageSocket::Event& ev) {
+        ++received_;
+        events_.push_back(ev.data == NULL ? string() :
+                          string(static_cast<const char*>(ev.data),
+                                 ev.datalen));
+        had_transfer_.push_back(ev.transfer != NULL);
+        if (ev.transfer != NULL) {
+            transfer_ = *ev.transfer;
+        }
+        if (received_ == stop_at_) {
+            manager_.stop();
+        }
+    }
+
+    void timerCallback() {
+        ++timer_called_;
+    }
+
+    MessageSocket::Callback getSocketCallback() {
+        return (boost::bind(&StandaloneMessageManagerTest::socketCallback,
+                            this, _1));
+    }
+
+    MessageTimer::Callback getTimerCallback() {
+        return (boost::bind(&StandaloneMessageManagerTest::timerCallback,
+                            this));
+    }
+
+    StandaloneMessageManager manager_;
+    size_t received_;
+    size_t stop_at_;
+    size_t timer_called_;
+    vector<string> events_;
+    vector<bool> had_transfer_;
+    MessageSocket::TransferInfo transfer_;
+    char recvbuf_[512];
+};
+
+TEST_F(StandaloneMessageManagerTest, badConstruct) {
+    EXPECT_THROW(StandaloneMessageManager(
+                     StandaloneMessageManager::QueryHandler()),
+                 MessageSocketError);
+    EXPECT_THROW(StandaloneMessageManager(
+                     string("/nonexistent/libhandler.so")),
+                 MessageSocketError);
+}
+
+TEST_F(StandaloneMessageManagerTest, badSocket) {
+    EXPECT_THROW(manager_.createMessageSocket(IPPROTO_ICMP, "::1", 53,
+                                              recvbuf_, sizeof(recvbuf_),
+                                              getSocketCallback()),
+                 MessageSocketError);
+    EXPECT_THROW(manager_.createMessageSocket(IPPROTO_UDP, "::1", 53,
+                                              recvbuf_, sizeof(recvbuf_),
+                                              MessageSocket::Callback()),
+                 MessageSocketError);
+    EXPECT_THROW(manager_.createMessageTimer(MessageTimer::Callback()),
+                 MessageTimerError);
+}
+
+TEST_F(StandaloneMessageManagerTest, udp) {
+    // The address is ignored.
+    scoped_ptr<MessageSocket> sock(
+        manager_.createMessageSocket(IPPROTO_UDP, "192.0.2.1", 53, recvbuf_,
+                                     sizeof(recvbuf_), getSocketCallback()));
+    sock->send(TEST_DATA, sizeof(TEST_DATA));
+    sock->send("drop", 4);
+    sock->send(TEST_DATA, 5);
+    // Queries are handled in the event loop, not in send().
+    EXPECT_EQ(0, received_);
+
+    // run() returns when there's no more work.
+    manager_.run();
+    ASSERT_EQ(2, received_);
+    EXPECT_EQ(string(TEST_DATA, sizeof(TEST_DATA)), events_[0]);
+    EXPECT_EQ(string(TEST_DATA, 5), events_[1]);
+    EXPECT_FALSE(had_transfer_[0]);
+}
+
+TEST_F(StandaloneMessageManagerTest, tcp) {
+    scoped_ptr<MessageSocket> sock(
+        manager_.createMessageSocket(IPPROTO_TCP, "::1", 53, recvbuf_,
+                                     sizeof(recvbuf_), getSocketCallback()));
+    sock->send(TEST_DATA, sizeof(TEST_DATA));
+    EXPECT_THROW(sock->send(TEST_DATA, sizeof(TEST_DATA)),
+                 MessageSocketError);
+    manager_.run();
+    ASSERT_EQ(1, received_);
+    EXPECT_EQ(string(TEST_DATA, sizeof(TEST_DATA)), events_[0]);
+    ASSERT_TRUE(had_transfer_[0]);
+    EXPECT_EQ(1, transfer_.messages);
+    EXPECT_EQ(sizeof(TEST_DATA) + 2, transfer_.bytes);
+    // ANCOUNT of the "response" is "er" (0x65, 0x72).
+    EXPECT_EQ(0x65 * 256 + 0x72, transfer_.rrs);
+
+    // No response over TCP is considered a failure.
+    scoped_ptr<MessageSocket> sock2(
+        manager_.createMessageSocket(IPPROTO_TCP, "::1", 53, recvbuf_,
+                                     sizeof(recvbuf_), getSocketCallback()));
+    sock2->send("drop", 4);
+    manager_.run();
+    ASSERT_EQ(2, received_);
+    EXPECT_EQ(string(), events_[1]);
+    EXPECT_FALSE(had_transfer_[1]);
+}
+
+TEST_F(StandaloneMessageManagerTest, stream) {
+    scoped_ptr<MessageSocket> sock(
+        manager_.createStreamMessageSocket("::1", 53, getSocketCallback()));
+    sock->send(TEST_DATA, sizeof(TEST_DATA));
+    sock->send("drop", 4);
+    sock->send(TEST_DATA, 3);
+    manager_.run();
+    ASSERT_EQ(2, received_);
+    EXPECT_EQ(string(TEST_DATA, sizeof(TEST_DATA)), events_[0]);
+    EXPECT_EQ(string(TEST_DATA, 3), events_[1]);
+    EXPECT_FALSE(had_transfer_[0]);
+}
+
+TEST_F(StandaloneMessageManagerTest, tooLargeResponse) {
+    StandaloneMessageManager manager(badHandler);
+    scoped_ptr<MessageSocket> sock(
+        manager.createMessageSocket(IPPROTO_UDP, "::1", 53, recvbuf_,
+                                    sizeof(recvbuf_), getSocketCallback()));
+    sock->send(TEST_DATA, sizeof(TEST_DATA));
+    EXPECT_THROW(manager.run(), MessageSocketError);
+}
+
+TEST_F(StandaloneMessageManagerTest, stopAndResume) {
+    scoped_ptr<MessageSocket> sock(
+        manager_.createMessageSocket(IPPROTO_UDP, "::1", 53, recvbuf_,
+                                     sizeof(recvbuf_), getSocketCallback()));
+    for (size_t i = 0; i < 5; ++i) {
+        sock->send(TEST_DATA, i + 1);
+    }
+    stop_at_ = 2;
+    manager_.run();
+    EXPECT_EQ(2, received_);
+
+    // Remaining queries are handled first on the next run, followed by
+    // new ones.
+    sock->send(TEST_DATA, 10);
+    manager_.run();
+    ASSERT_EQ(6, received_);
+    for (size_t i = 0; i < 5; ++i) {
+        EXPECT_EQ(string(TEST_DATA, i + 1), events_[i]);
+    }
+    EXPECT_EQ(string(TEST_DATA, 10), events_[5]);
+}
+
+TEST_F(StandaloneMessageManagerTest, destroyPendingSocket) {
+    // Queued queries of a destroyed socket are silently discarded.
+    scoped_ptr<MessageSocket> sock(
+        manager_.createMessageSocket(IPPROTO_UDP, "::1", 53, recvbuf_,
+                                     sizeof(recvbuf_), getSocketCallback()));
+    sock->send(TEST_DATA, sizeof(TEST_DATA));
+    sock.reset();
+    manager_.run();
+    EXPECT_EQ(0, received_);
+}
+
+TEST_F(StandaloneMessageManagerTest, timers) {
+    scoped_ptr<MessageTimer> timer(
+        manager_.createMessageTimer(getTimerCallback()));
+    scoped_ptr<MessageTimer> timer2(
+        manager_.createMessageTimer(getTimerCallback()));
+    timer->start(milliseconds(10));
+    timer2->start(milliseconds(10));
+    timer2->cancel();
+    const ptime start = microsec_clock::universal_time();
+    manager_.run();
+    EXPECT_EQ(1, timer_called_);
+    EXPECT_LE(10000, (microsec_clock::universal_time() -
+                      start).total_microseconds());
+
+    // Coarse timers also work.
+    scoped_ptr<MessageTimer> coarse(
+        manager_.createCoarseMessageTimer(getTimerCallback()));
+    coarse->start(milliseconds(1));
+    manager_.run();
+    EXPECT_EQ(2, timer_called_);
+}
+}
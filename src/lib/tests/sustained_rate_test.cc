@@ -0,0 +1,91 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <sustained_rate.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace Queryperf;
+using namespace boost::posix_time;
+
+namespace {
+const ptime BASE_TIME(time_from_string("2012-06-01 00:00:00"));
+
+TEST(SustainedRatesTest, empty) {
+    const SustainedRates rates;
+    EXPECT_EQ(0, rates.getMaxRate());
+    EXPECT_EQ(0, rates.getMaxWindow());
+}
+
+TEST(SustainedRatesTest, record) {
+    SustainedRates rates;
+    rates.record(BASE_TIME, 1000, 10);
+    rates.record(BASE_TIME + milliseconds(100), 3000, 20);
+    rates.record(BASE_TIME + milliseconds(200), 2000, 21);
+    EXPECT_EQ(3000, rates.getMaxRate());
+    EXPECT_EQ(20, rates.getMaxWindow());
+
+    // A small jitter stays in the same slot, where the higher rate is
+    // kept.
+    rates.record(BASE_TIME + milliseconds(210), 4000, 22);
+    rates.record(BASE_TIME + milliseconds(190), 1500, 23);
+    EXPECT_EQ(4000, rates.getMaxRate());
+    EXPECT_EQ(22, rates.getMaxWindow());
+}
+
+TEST(SustainedRatesTest, merge) {
+    // Each has its maximum in a different slot; the total is the
+    // highest sum in a single slot, not the sum of the maximums.
+    SustainedRates rates1;
+    rates1.record(BASE_TIME, 3000, 30);
+    rates1.record(BASE_TIME + milliseconds(100), 1000, 10);
+    SustainedRates rates2;
+    rates2.record(BASE_TIME + milliseconds(5), 1000, 10);
+    rates2.record(BASE_TIME + milliseconds(105), 2500, 25);
+
+    SustainedRates total;
+    total.merge(rates1);
+    total.merge(rates2);
+    EXPECT_EQ(4000, total.getMaxRate());
+    EXPECT_EQ(40, total.getMaxWindow());
+
+    // Merging an empty one doesn't change anything.
+    total.merge(SustainedRates());
+    EXPECT_EQ(4000, total.getMaxRate());
+}
+
+TEST(SustainedRatesTest, mergePartialSlots) {
+    // Slots not covered by all merged ones are ignored.
+    SustainedRates rates1;
+    rates1.record(BASE_TIME, 1000, 10);
+    rates1.record(BASE_TIME + milliseconds(100), 5000, 50);
+    SustainedRates rates2;
+    rates2.record(BASE_TIME, 2000, 20);
+
+    SustainedRates total;
+    total.merge(rates1);
+    total.merge(rates2);
+    EXPECT_EQ(3000, total.getMaxRate());
+    EXPECT_EQ(30, total.getMaxWindow());
+
+    SustainedRates rates3;
+    rates3.record(BASE_TIME + milliseconds(200), 2000, 20);
+    total.merge(rates3);
+    EXPECT_EQ(0, total.getMaxRate());
+    EXPECT_EQ(0, total.getMaxWindow());
+}
+}
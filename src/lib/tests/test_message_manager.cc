@@ -47,10 +47,14 @@ TestMessageSocket::~TestMessageSocket() {
 
 void
 TestMessageSocket::send(const void* data, size_t datalen) {
-    InputBuffer buffer(data, datalen);
-    shared_ptr<Message> query_msg(new Message(Message::PARSE));
-    query_msg->fromWire(buffer);
-    queries_.push_back(query_msg);
+    if (manager_->parse_queries_) {
+        InputBuffer buffer(data, datalen);
+        shared_ptr<Message> query_msg(new Message(Message::PARSE));
+        query_msg->fromWire(buffer);
+        queries_.push_back(query_msg);
+    }
+    const uint8_t* const cp = static_cast<const uint8_t*>(data);
+    query_data_.push_back(std::vector<uint8_t>(cp, cp + datalen));
 }
 
 void
@@ -88,6 +92,16 @@ TestMessageManager::createMessageSocket(int proto,
     return (ret);
 }
 
+MessageSocket*
+TestMessageManager::createStreamMessageSocket(const std::string&, uint16_t,
+                                              MessageSocket::Callback callback)
+{
+    std::auto_ptr<TestMessageSocket> p(new TestMessageSocket(callback));
+    p->manager_ = this;
+    stream_sockets_.push_back(p.get());
+    return (p.release());   // give the ownership
+}
+
 MessageTimer*
 TestMessageManager::createMessageTimer(MessageTimer::Callback callback) {
     std::auto_ptr<TestMessageTimer> p(new TestMessageTimer(callback));
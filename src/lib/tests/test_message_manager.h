@@ -47,6 +47,7 @@ public:
     virtual void send(const void* data, size_t datalen);
 
     std::vector<boost::shared_ptr<bundy::dns::Message> > queries_;
+    std::vector<std::vector<uint8_t> > query_data_; // queries in wire format
     Callback callback_;
 
 private:
@@ -71,14 +72,18 @@ class TestMessageManager : public MessageManager {
 public:
     typedef boost::function<void()> Handler;
 
-    TestMessageManager() : socket_(NULL),
-                           n_deleted_sockets_(0), running_(false) {}
+    TestMessageManager() : socket_(NULL), n_deleted_sockets_(0),
+                           parse_queries_(true), running_(false) {}
 
     virtual MessageSocket* createMessageSocket(
         int proto, const std::string& address, uint16_t port,
         void* recvbuf, size_t recvbuf_len,
         MessageSocket::Callback callback);
 
+    virtual MessageSocket* createStreamMessageSocket(
+        const std::string& address, uint16_t port,
+        MessageSocket::Callback callback);
+
     virtual MessageTimer* createMessageTimer(MessageTimer::Callback callback);
 
     virtual void run();
@@ -94,9 +99,16 @@ public:
     std::vector<TestMessageSocket*> tcp_sockets_;
     size_t n_deleted_sockets_;
 
+    // Sockets for persistent TCP connections
+    std::vector<TestMessageSocket*> stream_sockets_;
+
     // Timers created in this manager.
     std::vector<TestMessageTimer*> timers_;
 
+    // If false, sockets only keep the query data without parsing them
+    // (used by benchmarks to exclude the cost of parsing).
+    bool parse_queries_;
+
 private:
     // run() Callback.  It delegates the control to the corresponding test.
     Handler run_handler_;
@@ -0,0 +1,211 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <timer_wheel.h>
+#include <test_message_manager.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <vector>
+
+using namespace Queryperf;
+using namespace Queryperf::unittest;
+using boost::scoped_ptr;
+using boost::posix_time::seconds;
+
+namespace {
+// We use a long tick so that the wheel never tries to catch up with
+// the real time; each tick callback advances the wheel by exactly one tick.
+const long TICK_SECONDS = 30;
+
+class TimerWheelTest : public ::testing::Test {
+protected:
+    TimerWheelTest() : wheel(mgr, seconds(TICK_SECONDS)) {}
+
+    // Fire the underlying timer the given number of times.
+    void tick(size_t count = 1) {
+        for (size_t i = 0; i < count; ++i) {
+            mgr.timers_.at(0)->callback_();
+        }
+    }
+
+    void timerCallback(size_t id) {
+        fired.push_back(std::make_pair(id, wheel.getCurrentTick()));
+    }
+
+    MessageTimer* createTimer(size_t id) {
+        return (wheel.createTimer(boost::bind(&TimerWheelTest::timerCallback,
+                                              this, id)));
+    }
+
+    TestMessageManager mgr;
+    TimerWheel wheel;
+    std::vector<std::pair<size_t, uint64_t> > fired;
+};
+
+TEST_F(TimerWheelTest, badTick) {
+    EXPECT_THROW(TimerWheel(mgr, seconds(0)), MessageTimerError);
+}
+
+TEST_F(TimerWheelTest, expire) {
+    scoped_ptr<MessageTimer> timer(createTimer(0));
+
+    // The underlying timer starts only when a timer is started.
+    ASSERT_EQ(1, mgr.timers_.size());
+    EXPECT_EQ(0, mgr.timers_[0]->n_started_);
+    timer->start(seconds(3 * TICK_SECONDS));
+    EXPECT_EQ(1, mgr.timers_[0]->n_started_);
+    EXPECT_EQ(TICK_SECONDS, mgr.timers_[0]->duration_seconds_);
+    EXPECT_EQ(1, wheel.getActiveCount());
+
+    tick(2);
+    EXPECT_TRUE(fired.empty());
+    tick();
+    ASSERT_EQ(1, fired.size());
+    EXPECT_EQ(3, fired[0].second);
+    EXPECT_EQ(0, wheel.getActiveCount());
+
+    // There's no active timer, so the underlying timer should have stopped.
+    EXPECT_EQ(3, mgr.timers_[0]->n_started_);
+}
+
+TEST_F(TimerWheelTest, shortDuration) {
+    // Any duration shorter than a tick expires at the next tick.
+    scoped_ptr<MessageTimer> timer(createTimer(0));
+    timer->start(seconds(0));
+    tick();
+    ASSERT_EQ(1, fired.size());
+    EXPECT_EQ(1, fired[0].second);
+}
+
+TEST_F(TimerWheelTest, cancel) {
+    scoped_ptr<MessageTimer> timer1(createTimer(1));
+    scoped_ptr<MessageTimer> timer2(createTimer(2));
+    timer1->start(seconds(2 * TICK_SECONDS));
+    timer2->start(seconds(2 * TICK_SECONDS));
+    EXPECT_EQ(2, wheel.getActiveCount());
+
+    timer1->cancel();
+    EXPECT_EQ(1, wheel.getActiveCount());
+    timer1->cancel();           // duplicate cancel is okay
+    EXPECT_EQ(1, wheel.getActiveCount());
+
+    tick(2);
+    ASSERT_EQ(1, fired.size());
+    EXPECT_EQ(2, fired[0].first);
+
+    // Destroying an active timer implicitly cancels it.
+    timer2->start(seconds(TICK_SECONDS));
+    timer2.reset();
+    EXPECT_EQ(0, wheel.getActiveCount());
+}
+
+TEST_F(TimerWheelTest, restart) {
+    // Restarting an active timer resets the expiration.
+    scoped_ptr<MessageTimer> timer(createTimer(0));
+    timer->start(seconds(5 * TICK_SECONDS));
+    tick(2);
+    timer->start(seconds(5 * TICK_SECONDS));
+    EXPECT_EQ(1, wheel.getActiveCount());
+    tick(4);
+    EXPECT_TRUE(fired.empty());
+    tick();
+    ASSERT_EQ(1, fired.size());
+    EXPECT_EQ(7, fired[0].second);
+}
+
+TEST_F(TimerWheelTest, cascade) {
+    // Timers of long durations are kept in higher levels and moved down
+    // as the wheel turns.  They should still expire at the exact tick.
+    const uint64_t durations[] = { 255, 256, 257, 511, 65535, 65536, 70000 };
+    const size_t count = sizeof(durations) / sizeof(durations[0]);
+    std::vector<MessageTimer*> timers;
+    tick(0);
+    for (size_t i = 0; i < count; ++i) {
+        timers.push_back(createTimer(i));
+        timers.back()->start(seconds(durations[i] * TICK_SECONDS));
+    }
+    tick(70000);
+    ASSERT_EQ(count, fired.size());
+    for (size_t i = 0; i < count; ++i) {
+        EXPECT_EQ(i, fired[i].first);
+        EXPECT_EQ(durations[i], fired[i].second);
+        delete timers[i];
+    }
+}
+
+TEST_F(TimerWheelTest, cascadeFromMiddle) {
+    // Same as the previous test, but start timers when the wheel isn't at
+    // a slot boundary.
+    scoped_ptr<MessageTimer> dummy(createTimer(100));
+    dummy->start(seconds(1000 * TICK_SECONDS));
+    tick(300);
+    scoped_ptr<MessageTimer> timer1(createTimer(1));
+    scoped_ptr<MessageTimer> timer2(createTimer(2));
+    timer1->start(seconds(300 * TICK_SECONDS));
+    timer2->start(seconds(65600 * TICK_SECONDS));
+    tick(65600);
+    ASSERT_EQ(3, fired.size());
+    EXPECT_EQ(1, fired[0].first);
+    EXPECT_EQ(600, fired[0].second);
+    EXPECT_EQ(100, fired[1].first);
+    EXPECT_EQ(1000, fired[1].second);
+    EXPECT_EQ(2, fired[2].first);
+    EXPECT_EQ(65900, fired[2].second);
+}
+
+class RestartingTimer {
+public:
+    RestartingTimer(TimerWheel& wheel) :
+        timer_(wheel.createTimer(boost::bind(&RestartingTimer::callback,
+                                             this))),
+        other_(NULL), count_(0)
+    {}
+
+    void callback() {
+        ++count_;
+        if (other_ != NULL) {
+            other_->cancel();
+        }
+        if (count_ < 3) {
+            timer_->start(seconds(TICK_SECONDS));
+        }
+    }
+
+    scoped_ptr<MessageTimer> timer_;
+    MessageTimer* other_;
+    size_t count_;
+};
+
+TEST_F(TimerWheelTest, updateInCallback) {
+    // Timers can be restarted or cancelled in a callback, even if they
+    // expire at the same tick.
+    RestartingTimer timer(wheel);
+    scoped_ptr<MessageTimer> other(createTimer(0));
+    timer.other_ = other.get();
+    timer.timer_->start(seconds(TICK_SECONDS));
+    other->start(seconds(TICK_SECONDS));
+
+    tick();
+    EXPECT_EQ(1, timer.count_);
+    EXPECT_TRUE(fired.empty());
+    tick(5);
+    EXPECT_EQ(3, timer.count_);
+    EXPECT_EQ(0, wheel.getActiveCount());
+}
+}
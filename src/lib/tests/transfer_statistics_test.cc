@@ -0,0 +1,98 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <transfer_statistics.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace Queryperf;
+using namespace boost::posix_time;
+
+namespace {
+TEST(TransferStatisticsTest, empty) {
+    const TransferStatistics stats;
+    EXPECT_EQ(0, stats.getCount());
+    EXPECT_EQ(0, stats.getMessages());
+    EXPECT_EQ(0, stats.getRRs());
+    EXPECT_EQ(0, stats.getBytes());
+    EXPECT_EQ(0, stats.getThroughput());
+}
+
+TEST(TransferStatisticsTest, record) {
+    const ptime start(time_from_string("2012-01-01 00:00:00"));
+    MessageSocket::TransferInfo info;
+    info.messages = 10;
+    info.rrs = 1000;
+    info.bytes = 500000;
+    info.first_byte = start + milliseconds(2);
+
+    TransferStatistics stats;
+    stats.record(info, start, start + milliseconds(100));
+    EXPECT_EQ(1, stats.getCount());
+    EXPECT_EQ(10, stats.getMessages());
+    EXPECT_EQ(1000, stats.getRRs());
+    EXPECT_EQ(500000, stats.getBytes());
+    EXPECT_EQ(2000, stats.getFirstByteTimes().getMax());
+    EXPECT_EQ(100000, stats.getDurations().getMax());
+    EXPECT_DOUBLE_EQ(5, stats.getThroughput()); // 0.5MB in 0.1s
+
+    // If no byte is received, the time to the first byte isn't recorded.
+    MessageSocket::TransferInfo empty_info;
+    stats.record(empty_info, start, start + milliseconds(100));
+    EXPECT_EQ(2, stats.getCount());
+    EXPECT_EQ(1, stats.getFirstByteTimes().getCount());
+    EXPECT_DOUBLE_EQ(2.5, stats.getThroughput());
+}
+
+TEST(TransferStatisticsTest, merge) {
+    const ptime start(time_from_string("2012-01-01 00:00:00"));
+    MessageSocket::TransferInfo info;
+    info.messages = 2;
+    info.rrs = 20;
+    info.bytes = 1000;
+    info.first_byte = start + milliseconds(1);
+
+    TransferStatistics stats1, stats2;
+    stats1.record(info, start, start + milliseconds(1));
+    stats2.record(info, start, start + milliseconds(3));
+    stats1.merge(stats2);
+    EXPECT_EQ(2, stats1.getCount());
+    EXPECT_EQ(4, stats1.getMessages());
+    EXPECT_EQ(40, stats1.getRRs());
+    EXPECT_EQ(2000, stats1.getBytes());
+    EXPECT_EQ(3000, stats1.getDurations().getMax());
+    EXPECT_DOUBLE_EQ(0.5, stats1.getThroughput());
+}
+
+TEST(TransferStatisticsTest, transferInfo) {
+    // Chunks of messages are examined to count the answer RRs.
+    const uint8_t header[] = { 0, 1, 0x84, 0, 0, 1, 0x01, 0x02, 0, 0, 0, 0 };
+    MessageSocket::TransferInfo info;
+    EXPECT_TRUE(info.first_byte.is_special());
+    info.addBytes(2);
+    EXPECT_FALSE(info.first_byte.is_special());
+    info.addBytes(sizeof(header));
+    info.addData(0, header, 7); // ANCOUNT is split into two chunks
+    info.addData(7, header + 7, sizeof(header) - 7);
+    info.addMessage();
+    info.addData(0, header, sizeof(header));
+    info.addMessage();
+    EXPECT_EQ(2, info.messages);
+    EXPECT_EQ(2 * 0x0102, info.rrs);
+    EXPECT_EQ(2 + sizeof(header), info.bytes);
+}
+}
@@ -0,0 +1,204 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <timer_wheel.h>
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <cassert>
+
+using namespace boost::posix_time;
+
+namespace Queryperf {
+
+class TimerWheel::WheelTimer : public MessageTimer, public TimerWheel::Link {
+public:
+    WheelTimer(TimerWheel& wheel, Callback callback) :
+        wheel_(wheel), callback_(callback), expire_tick_(0)
+    {}
+
+    virtual ~WheelTimer() {
+        wheel_.cancel(*this);
+    }
+
+    virtual void start(const time_duration& duration) {
+        wheel_.start(*this, duration);
+    }
+
+    virtual void cancel() {
+        wheel_.cancel(*this);
+    }
+
+    TimerWheel& wheel_;
+    const Callback callback_;
+    uint64_t expire_tick_;
+};
+
+const long TimerWheel::DEFAULT_TICK_MSEC;
+
+TimerWheel::TimerWheel(MessageManager& mgr, const time_duration& tick) :
+    tick_(tick), tick_usec_(tick.total_microseconds()),
+    tick_timer_(mgr.createMessageTimer(
+                    boost::bind(&TimerWheel::tickCallback, this))),
+    current_tick_(0), active_count_(0), ticking_(false), base_tick_(0)
+{
+    if (tick_usec_ <= 0) {
+        throw MessageTimerError("timer wheel tick must be positive");
+    }
+}
+
+TimerWheel::~TimerWheel() {
+    assert(active_count_ == 0);
+}
+
+MessageTimer*
+TimerWheel::createTimer(MessageTimer::Callback callback) {
+    return (new WheelTimer(*this, callback));
+}
+
+void
+TimerWheel::start(WheelTimer& timer, const time_duration& duration) {
+    cancel(timer);
+
+    // Expire at the first tick at or after the duration, but at least one
+    // tick later (the current one may have been processed already).
+    const int64_t usec = duration.total_microseconds();
+    uint64_t ticks = usec > 0 ? (usec + tick_usec_ - 1) / tick_usec_ : 1;
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    const uint64_t max_ticks = (1ULL << (SLOT_BITS * LEVEL_COUNT)) - 1;
+    if (ticks > max_ticks) {
+        ticks = max_ticks;
+    }
+    timer.expire_tick_ = current_tick_ + ticks;
+    insert(timer);
+    ++active_count_;
+
+    if (!ticking_) {
+        ticking_ = true;
+        base_time_ = microsec_clock::universal_time();
+        base_tick_ = current_tick_;
+        scheduleTick();
+    }
+}
+
+void
+TimerWheel::cancel(WheelTimer& timer) {
+    if (timer.isLinked()) {
+        timer.unlink();
+        --active_count_;
+    }
+}
+
+void
+TimerWheel::insert(WheelTimer& timer) {
+    const uint64_t expire = timer.expire_tick_;
+    const uint64_t delta = expire - current_tick_;
+    size_t level = 0;
+    while (level + 1 < LEVEL_COUNT &&
+           delta >= (static_cast<uint64_t>(1) << (SLOT_BITS * (level + 1)))) {
+        ++level;
+    }
+    const size_t slot = (expire >> (SLOT_BITS * level)) & SLOT_MASK;
+    timer.insertBefore(slots_[level][slot]);
+}
+
+void
+TimerWheel::cascade(size_t level) {
+    Link& head = slots_[level][(current_tick_ >> (SLOT_BITS * level)) &
+                               SLOT_MASK];
+    Link pending;
+    if (!head.isLinked()) {
+        return;
+    }
+    // Move the whole list to a temporary head, then re-insert each.
+    pending.next = head.next;
+    pending.prev = head.prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    head.prev = head.next = &head;
+    while (pending.isLinked()) {
+        WheelTimer& timer = static_cast<WheelTimer&>(*pending.next);
+        timer.unlink();
+        insert(timer);
+    }
+}
+
+void
+TimerWheel::advance() {
+    ++current_tick_;
+
+    // Cascade timers from higher levels when the lower level wraps around.
+    // The highest level should be cascaded first so its timers can be moved
+    // down to the lowest level if necessary.
+    if ((current_tick_ & SLOT_MASK) == 0) {
+        size_t level = 1;
+        while (level + 1 < LEVEL_COUNT &&
+               (current_tick_ & ((static_cast<uint64_t>(1) <<
+                                  (SLOT_BITS * (level + 1))) - 1)) == 0) {
+            ++level;
+        }
+        for (; level > 0; --level) {
+            cascade(level);
+        }
+    }
+
+    // Expire the timers of the current slot.  They are moved to a temporary
+    // list first, so the callbacks can safely start or cancel any timers.
+    Link& head = slots_[0][current_tick_ & SLOT_MASK];
+    if (!head.isLinked()) {
+        return;
+    }
+    Link expired;
+    expired.next = head.next;
+    expired.prev = head.prev;
+    expired.next->prev = &expired;
+    expired.prev->next = &expired;
+    head.prev = head.next = &head;
+    while (expired.isLinked()) {
+        WheelTimer& timer = static_cast<WheelTimer&>(*expired.next);
+        assert(timer.expire_tick_ == current_tick_);
+        timer.unlink();
+        --active_count_;
+        timer.callback_();
+    }
+}
+
+void
+TimerWheel::tickCallback() {
+    // Process at least one tick, and more if the underlying timer is
+    // delayed so the wheel keeps up with the real time.
+    const int64_t elapsed =
+        (microsec_clock::universal_time() - base_time_).total_microseconds();
+    const uint64_t target = base_tick_ +
+        (elapsed > 0 ? elapsed / tick_usec_ : 0);
+    do {
+        advance();
+    } while (current_tick_ < target && active_count_ > 0);
+
+    if (active_count_ > 0) {
+        scheduleTick();
+    } else {
+        ticking_ = false;
+    }
+}
+
+void
+TimerWheel::scheduleTick() {
+    tick_timer_->start(tick_);
+}
+
+} // end of QueryPerf
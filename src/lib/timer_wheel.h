@@ -0,0 +1,143 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#ifndef __QUERYPERF_TIMER_WHEEL_H
+#define __QUERYPERF_TIMER_WHEEL_H 1
+
+#include <message_manager.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <sys/types.h>
+#include <stdint.h>
+
+namespace Queryperf {
+
+/// \brief A hierarchical timing wheel for a large number of coarse timers.
+///
+/// This class manages timers that don't need precise expiration, such as
+/// per query timeouts, using a single underlying \c MessageTimer that ticks
+/// at a fixed interval.  Each timer expires at the first tick after the
+/// specified duration, so it can be delayed by up to one tick.
+///
+/// Timers are kept in three levels of 256 slots each (so the maximum
+/// duration is 2^24 ticks; longer ones are capped), and timers in a higher
+/// level are moved to a lower one as the wheel turns.  Starting and
+/// cancelling a timer is O(1) and doesn't involve memory allocation or
+/// the underlying timer, since each timer object embeds the link to its
+/// slot.
+///
+/// The underlying timer only runs while any timer of the wheel is active.
+class TimerWheel : private boost::noncopyable {
+public:
+    /// \brief Default tick interval in milliseconds.
+    static const long DEFAULT_TICK_MSEC = 10;
+
+    /// \brief Constructor.
+    ///
+    /// \param mgr The message manager that provides the underlying timer.
+    /// \param tick The tick interval.  It must be positive.
+    TimerWheel(MessageManager& mgr,
+               const boost::posix_time::time_duration& tick =
+               boost::posix_time::milliseconds(DEFAULT_TICK_MSEC));
+
+    /// \brief Destructor.
+    ///
+    /// All timers created by the wheel must have been destroyed by the
+    /// time of this destructor.
+    ~TimerWheel();
+
+    /// \brief Create a timer managed in the wheel.
+    ///
+    /// The caller is responsible for destroying the returned object.
+    MessageTimer* createTimer(MessageTimer::Callback callback);
+
+    /// \brief Return the number of currently active timers.
+    size_t getActiveCount() const { return (active_count_); }
+
+    /// \brief Return the number of ticks processed so far.
+    uint64_t getCurrentTick() const { return (current_tick_); }
+
+    // A link of a timer in a doubly linked list of a slot.  The timer class
+    // is derived from this, so the link is embedded in the timer object.
+    // Exposed only for the convenience of the implementation.
+    struct Link {
+        Link() : prev(this), next(this) {}
+        void unlink() {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = this;
+        }
+        void insertBefore(Link& head) {
+            prev = head.prev;
+            next = &head;
+            head.prev->next = this;
+            head.prev = this;
+        }
+        bool isLinked() const { return (next != this); }
+        Link* prev;
+        Link* next;
+    };
+
+    class WheelTimer;
+
+private:
+    static const unsigned int SLOT_BITS = 8;
+    static const size_t SLOT_COUNT = 1 << SLOT_BITS;
+    static const size_t SLOT_MASK = SLOT_COUNT - 1;
+    static const size_t LEVEL_COUNT = 3;
+
+    friend class WheelTimer;
+    void start(WheelTimer& timer,
+               const boost::posix_time::time_duration& duration);
+    void cancel(WheelTimer& timer);
+
+    // Link a timer to the appropriate slot for its expiration tick.
+    void insert(WheelTimer& timer);
+
+    // The handler of the underlying timer.
+    void tickCallback();
+
+    // Process a single tick: cascade timers from higher levels if necessary
+    // and expire the timers of the lowest level slot.
+    void advance();
+
+    // Move all timers in the given slot to lower levels.
+    void cascade(size_t level);
+
+    // Start the underlying timer for the next tick.
+    void scheduleTick();
+
+    const boost::posix_time::time_duration tick_;
+    const int64_t tick_usec_;
+    boost::scoped_ptr<MessageTimer> tick_timer_;
+    Link slots_[LEVEL_COUNT][SLOT_COUNT];
+    uint64_t current_tick_;
+    size_t active_count_;
+    bool ticking_;
+    // The base of the tick count in the absolute time; used to catch up
+    // with the real time in case the underlying timer is delayed.
+    boost::posix_time::ptime base_time_;
+    uint64_t base_tick_;
+};
+
+} // end of QueryPerf
+
+#endif // __QUERYPERF_TIMER_WHEEL_H
+
+// Local Variables:
+// mode: c++
+// End:
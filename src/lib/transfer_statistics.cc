@@ -0,0 +1,70 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <transfer_statistics.h>
+
+using namespace boost::posix_time;
+
+namespace Queryperf {
+
+TransferStatistics::TransferStatistics() :
+    messages_(0), rrs_(0), bytes_(0), total_duration_(0)
+{}
+
+void
+TransferStatistics::record(const MessageSocket::TransferInfo& info,
+                           const ptime& start_time, const ptime& end_time)
+{
+    messages_ += info.messages;
+    rrs_ += info.rrs;
+    bytes_ += info.bytes;
+
+    // Clocks can be adjusted during the test; treat negative values as 0.
+    const int64_t duration = (end_time - start_time).total_microseconds();
+    const uint64_t duration_usec = duration > 0 ? duration : 0;
+    total_duration_ += duration_usec;
+    durations_.record(duration_usec);
+    if (!info.first_byte.is_special()) {
+        const int64_t first_byte =
+            (info.first_byte - start_time).total_microseconds();
+        first_byte_times_.record(first_byte > 0 ? first_byte : 0);
+    }
+}
+
+void
+TransferStatistics::merge(const TransferStatistics& other) {
+    messages_ += other.messages_;
+    rrs_ += other.rrs_;
+    bytes_ += other.bytes_;
+    total_duration_ += other.total_duration_;
+    first_byte_times_.merge(other.first_byte_times_);
+    durations_.merge(other.durations_);
+}
+
+double
+TransferStatistics::getThroughput() const {
+    return (getThroughput(bytes_, total_duration_));
+}
+
+double
+TransferStatistics::getThroughput(uint64_t bytes, uint64_t duration_usec) {
+    if (duration_usec == 0) {
+        return (0);
+    }
+    // bytes per microsecond is the same as megabytes per second.
+    return (static_cast<double>(bytes) / duration_usec);
+}
+
+} // end of QueryPerf
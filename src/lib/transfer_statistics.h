@@ -0,0 +1,98 @@
+// Copyright (C) 2012  JINMEI Tatuya
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+// OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#ifndef __QUERYPERF_TRANSFER_STATISTICS_H
+#define __QUERYPERF_TRANSFER_STATISTICS_H 1
+
+#include <latency_histogram.h>
+#include <message_manager.h>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <stdint.h>
+
+namespace Queryperf {
+
+/// \brief Statistics of zone transfers (AXFR and IXFR).
+///
+/// For each completed transfer, it counts the messages, answer RRs and
+/// bytes, and records the time to the first byte of the response and the
+/// total duration of the transfer in microseconds.  The recorded values
+/// are kept in fixed size histograms, so \c record() never allocates
+/// memory.
+class TransferStatistics {
+public:
+    /// \brief Constructor.  The statistics are initially empty.
+    TransferStatistics();
+
+    /// \brief Record a single completed transfer.
+    ///
+    /// \param info Summary of the received messages of the transfer.
+    /// \param start_time The time when the query was sent.
+    /// \param end_time The time when the transfer completed.
+    void record(const MessageSocket::TransferInfo& info,
+                const boost::posix_time::ptime& start_time,
+                const boost::posix_time::ptime& end_time);
+
+    /// \brief Add all transfers recorded in another object to this one.
+    void merge(const TransferStatistics& other);
+
+    /// \brief Return the number of recorded transfers.
+    uint64_t getCount() const { return (durations_.getCount()); }
+
+    /// \brief Return the total number of messages of the transfers.
+    uint64_t getMessages() const { return (messages_); }
+
+    /// \brief Return the total number of answer RRs of the transfers.
+    uint64_t getRRs() const { return (rrs_); }
+
+    /// \brief Return the total bytes of the transfers, including the
+    /// TCP length fields.
+    uint64_t getBytes() const { return (bytes_); }
+
+    /// \brief Return the times to the first byte in microseconds.
+    const LatencyHistogram& getFirstByteTimes() const {
+        return (first_byte_times_);
+    }
+
+    /// \brief Return the durations of the transfers in microseconds.
+    const LatencyHistogram& getDurations() const { return (durations_); }
+
+    /// \brief Return the average throughput of a single transfer in
+    /// megabytes (10^6 bytes) per second, i.e., the total bytes divided by
+    /// the total duration of the transfers.  It returns 0 if no transfer
+    /// has been recorded.
+    double getThroughput() const;
+
+    /// \brief Return the throughput of a single transfer in megabytes per
+    /// second, given its size in bytes and duration in microseconds.
+    static double getThroughput(uint64_t bytes, uint64_t duration_usec);
+
+private:
+    uint64_t messages_;
+    uint64_t rrs_;
+    uint64_t bytes_;
+    uint64_t total_duration_;   // in microseconds
+    LatencyHistogram first_byte_times_;
+    LatencyHistogram durations_;
+};
+
+} // end of QueryPerf
+
+#endif // __QUERYPERF_TRANSFER_STATISTICS_H
+
+// Local Variables:
+// mode: c++
+// End: